@@ -0,0 +1,580 @@
+/* For O_DIRECT */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <zlib.h>
+
+#include "flowtree.h"
+#include "export.h"
+#include "sink.h"
+#include "ftbin.h"
+#include "ftcol.h"
+
+
+/* ===
+ * The on-disk archive sink
+ *
+ * Export datagrams are written back to back into a segment file that
+ * covers rotate= seconds (default ARCHIVE_ROTATE), lined up on the
+ * clock so a 60 second segment always starts on the minute.  While a
+ * segment is being written it is a dot file in the archive directory;
+ * once it is finished it is synced and published as
+ *
+ *   flowtree-YYYYMMDD-HHMMSS.<bin|json>[.gz]
+ *
+ * (UTC, the segment start) so anything picking files up never sees a
+ * partial one.  Publishing is a link() and unlink() rather than a
+ * rename() so a segment that is already there (a restart inside the
+ * same period, or another archive on the same directory) is never
+ * replaced; the new one gets -<pid>-<n> added to its name instead.
+ *
+ * Output is collected in an ARCHIVE_BUFF sized buffer and written in
+ * whole buffers.  With compress=gzip (the default) the sink thread runs
+ * the data through deflate on the way into the buffer, level= sets the
+ * level.  direct=1 opens segments with O_DIRECT, only the tail of a
+ * segment is written without it.
+ *
+ * columnar=1 writes ftcol segments (flowtree-...ftc, see ftcol.h)
+ * instead of the export stream.  The sink takes binary datagrams, turns
+ * them back into flows and adds them to the open block; blocks are
+ * written as they fill and the index goes at the end of the segment.
+ * Columns are already compressed so gzip is off for these.
+ * ===
+ */
+#define ARCHIVE_ROTATE 60 /* seconds */
+#define ARCHIVE_BUFF (4 * 1024 * 1024) /* 4 MB */
+#define ARCHIVE_ALIGN 4096 /* O_DIRECT wants aligned memory and sizes */
+#define ARCHIVE_LEVEL 1
+#define ARCHIVE_NAME_TRIES 100 /* suffixes to try when a name is taken */
+
+struct archive {
+  int rotate;
+  int compress;
+  int level;
+  int direct;
+  int columnar;
+  int id; /* keeps the temp names of archives in one process apart */
+
+  /* === The open segment, seg_fh is -1 between segments === */
+  int seg_fh;
+  time_t seg_start;
+  char seg_tmp[PATH_MAX + 64];
+  uint8_t *buff;
+  size_t buff_len;
+  z_stream zs;
+
+  /* === Columnar segments === */
+  struct ftcol_writer *col;
+  uint8_t *col_buff;
+  struct ftbin_flow flow;
+
+  /* === Stats === */
+  uint64_t stat_segments;
+};
+
+int archive_next_id = 0; /* only the command line parsing hands them out */
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+struct archive *archive_state(struct sink *);
+int archive_segment_open(struct sink *, struct archive *, const time_t);
+void archive_segment_close(struct sink *, struct archive *);
+int archive_write(struct sink *, struct archive *, const int);
+int archive_append(struct sink *, struct archive *, const uint8_t *,
+		   const size_t);
+int archive_columnar(struct sink *, struct archive *, const struct sink_msg *);
+int archive_columnar_block(struct sink *, struct archive *);
+void archive_segment_name(const struct sink *, const struct archive *,
+			  char *, const size_t, const int);
+
+
+struct archive *archive_state(struct sink *s) {
+
+  struct archive *ar;
+
+  if (s->priv != NULL) {
+    return (struct archive *)s->priv;
+  }
+
+  if ((ar = calloc(1, sizeof(struct archive))) == NULL) {
+    return NULL;
+  }
+
+  ar->rotate = ARCHIVE_ROTATE;
+  ar->compress = 1;
+  ar->level = ARCHIVE_LEVEL;
+  ar->seg_fh = -1;
+  ar->id = archive_next_id++;
+
+  s->priv = ar;
+
+  return ar;
+}
+
+
+int archive_option(struct sink *s, const char *opt, const char *val) {
+
+  struct archive *ar;
+
+  if ((ar = archive_state(s)) == NULL) {
+    return -1;
+  }
+
+  if ((strcmp(opt, "rotate") == 0) && (atoi(val) > 0)) {
+    ar->rotate = atoi(val);
+  }
+  else if ((strcmp(opt, "compress") == 0) && (strcmp(val, "gzip") == 0)) {
+    ar->compress = 1;
+  }
+  else if ((strcmp(opt, "compress") == 0) && (strcmp(val, "none") == 0)) {
+    ar->compress = 0;
+  }
+  else if ((strcmp(opt, "level") == 0) &&
+	   (atoi(val) >= 1) && (atoi(val) <= 9)) {
+    ar->level = atoi(val);
+  }
+  else if (strcmp(opt, "direct") == 0) {
+    ar->direct = (atoi(val) != 0);
+  }
+  else if (strcmp(opt, "columnar") == 0) {
+    ar->columnar = (atoi(val) != 0);
+
+    /* Columnar segments are built from binary records.  This has to be
+     * settled before export_init() asks the sinks what to encode, an
+     * archive whose directory isn't there yet still wants binary. */
+    if (ar->columnar != 0) {
+      s->format = EXPORT_BINARY;
+    }
+  }
+  else {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int archive_open(struct sink *s) {
+
+  struct archive *ar;
+  struct stat st;
+
+  if ((ar = archive_state(s)) == NULL) {
+    return -1;
+  }
+
+  if ((ar->columnar != 0) && (s->format != EXPORT_BINARY)) {
+    fprintf(stderr, "Columnar archive %s needs format=binary\n", s->path);
+    return -1;
+  }
+
+  if ((stat(s->path, &st) != 0) || (!S_ISDIR(st.st_mode))) {
+    fprintf(stderr, "Archive directory %s does not exist\n", s->path);
+    return -1;
+  }
+
+  if ((ar->buff == NULL) &&
+      (posix_memalign((void **)&(ar->buff), ARCHIVE_ALIGN,
+		      ARCHIVE_BUFF) != 0)) {
+    ar->buff = NULL;
+    return -1;
+  }
+
+  /* The segment does its own block compression */
+  if (ar->columnar != 0) {
+    ar->compress = 0;
+
+    if ((ar->col == NULL) &&
+	((ar->col = calloc(1, sizeof(struct ftcol_writer))) == NULL)) {
+      return -1;
+    }
+    if ((ar->col_buff == NULL) &&
+	((ar->col_buff = malloc(FTCOL_BLOCK_MAX)) == NULL)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+/* try is 0 for the plain name, after that it gets a suffix */
+void archive_segment_name(const struct sink *s, const struct archive *ar,
+			  char *name, const size_t len, const int try) {
+
+  struct tm tm;
+  char suffix[32];
+
+  suffix[0] = '\0';
+  if (try > 0) {
+    snprintf(suffix, sizeof(suffix), "-%d-%d", getpid(), try);
+  }
+
+  gmtime_r(&(ar->seg_start), &tm);
+  snprintf(name, len, "%s/flowtree-%04d%02d%02d-%02d%02d%02d%s.%s%s", s->path,
+	   tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+	   tm.tm_hour, tm.tm_min, tm.tm_sec, suffix,
+	   (ar->columnar != 0) ? "ftc" :
+	   ((s->format == EXPORT_BINARY) ? "bin" :
+	    ((s->format == EXPORT_IPFIX) ? "ipfix" : "json")),
+	   (ar->compress != 0) ? ".gz" : "");
+}
+
+
+int archive_segment_open(struct sink *s, struct archive *ar,
+			 const time_t now) {
+
+  int flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+  ar->seg_start = now - (now % ar->rotate);
+  snprintf(ar->seg_tmp, sizeof(ar->seg_tmp), "%s/.flowtree-%ld.%d.%d.tmp",
+	   s->path, (long)ar->seg_start, getpid(), ar->id);
+
+  if (ar->direct != 0) {
+    ar->seg_fh = open(ar->seg_tmp, flags | O_DIRECT, 0644);
+
+    /* Not every filesystem does O_DIRECT (tmpfs doesn't) */
+    if ((ar->seg_fh == -1) && (errno == EINVAL)) {
+      fprintf(stderr, "Archive %s can't use O_DIRECT, turning it off\n",
+	      s->path);
+      ar->direct = 0;
+    }
+  }
+  if (ar->direct == 0) {
+    ar->seg_fh = open(ar->seg_tmp, flags, 0644);
+  }
+
+  if (ar->seg_fh == -1) {
+    fprintf(stderr, "Unable to open archive segment %s\n", ar->seg_tmp);
+    perror("open");
+    return -1;
+  }
+
+  ar->buff_len = 0;
+
+  /* windowBits + 16 gets a gzip wrapper so zcat can read segments */
+  if (ar->compress != 0) {
+    memset(&(ar->zs), 0, sizeof(ar->zs));
+    if (deflateInit2(&(ar->zs), ar->level, Z_DEFLATED, 15 + 16, 8,
+		     Z_DEFAULT_STRATEGY) != Z_OK) {
+      fprintf(stderr, "Unable to start compressing %s\n", ar->seg_tmp);
+      close(ar->seg_fh);
+      unlink(ar->seg_tmp);
+      ar->seg_fh = -1;
+      return -1;
+    }
+  }
+
+  if (ar->columnar != 0) {
+    if (ftcol_writer_init(ar->col) != 0) {
+      close(ar->seg_fh);
+      unlink(ar->seg_tmp);
+      ar->seg_fh = -1;
+      return -1;
+    }
+    archive_append(s, ar, ar->col_buff, ftcol_encode_header(ar->col,
+							   ar->col_buff));
+  }
+
+  return 0;
+}
+
+
+int archive_write(struct sink *s, struct archive *ar, const int last) {
+
+  size_t len, done = 0;
+  ssize_t ret;
+  int flags;
+
+  /* O_DIRECT only gets whole aligned blocks, the tail goes without */
+  len = ar->buff_len;
+  if (ar->direct != 0) {
+    len -= len % ARCHIVE_ALIGN;
+  }
+
+  while (done < ar->buff_len) {
+    if ((done == len) && (last != 0) && (ar->direct != 0)) {
+      flags = fcntl(ar->seg_fh, F_GETFL);
+      fcntl(ar->seg_fh, F_SETFL, flags & ~O_DIRECT);
+      len = ar->buff_len;
+    }
+    if (done == len) {
+      break;
+    }
+
+    if ((ret = write(ar->seg_fh, ar->buff + done, len - done)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      s->stat_errors++;
+      return -1;
+    }
+    done += ret;
+  }
+
+  /* Keep whatever didn't go out (only ever less than a block) */
+  if (done < ar->buff_len) {
+    memmove(ar->buff, ar->buff + done, ar->buff_len - done);
+  }
+  ar->buff_len -= done;
+
+  return 0;
+}
+
+
+int archive_append(struct sink *s, struct archive *ar, const uint8_t *data,
+		   const size_t len) {
+
+  size_t copy, done = 0;
+
+  if (ar->compress != 0) {
+    ar->zs.next_in = (Bytef *)data;
+    ar->zs.avail_in = len;
+
+    while (ar->zs.avail_in > 0) {
+      ar->zs.next_out = ar->buff + ar->buff_len;
+      ar->zs.avail_out = ARCHIVE_BUFF - ar->buff_len;
+
+      deflate(&(ar->zs), Z_NO_FLUSH);
+      ar->buff_len = ARCHIVE_BUFF - ar->zs.avail_out;
+
+      if ((ar->buff_len == ARCHIVE_BUFF) && (archive_write(s, ar, 0) != 0)) {
+	return -1;
+      }
+    }
+
+    return 0;
+  }
+
+  while (done < len) {
+    copy = len - done;
+    if (copy > ARCHIVE_BUFF - ar->buff_len) {
+      copy = ARCHIVE_BUFF - ar->buff_len;
+    }
+
+    memcpy(ar->buff + ar->buff_len, data + done, copy);
+    ar->buff_len += copy;
+    done += copy;
+
+    if ((ar->buff_len == ARCHIVE_BUFF) && (archive_write(s, ar, 0) != 0)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+void archive_segment_close(struct sink *s, struct archive *ar) {
+
+  char name[PATH_MAX + 64];
+  const uint8_t *index;
+  int ret = Z_OK;
+  int failed = 0;
+  int try;
+
+  if (ar->seg_fh == -1) {
+    return;
+  }
+
+  /* Whatever is left of the last block, then the index */
+  if (ar->columnar != 0) {
+    if ((archive_columnar_block(s, ar) != 0) ||
+	(archive_append(s, ar, index, ftcol_encode_index(ar->col, &index)) !=
+	 0)) {
+      failed = 1;
+    }
+  }
+
+  /* Finish the gzip stream */
+  if (ar->compress != 0) {
+    ar->zs.avail_in = 0;
+    while (ret != Z_STREAM_END) {
+      ar->zs.next_out = ar->buff + ar->buff_len;
+      ar->zs.avail_out = ARCHIVE_BUFF - ar->buff_len;
+
+      ret = deflate(&(ar->zs), Z_FINISH);
+      ar->buff_len = ARCHIVE_BUFF - ar->zs.avail_out;
+
+      if ((ret == Z_STREAM_ERROR) ||
+	  ((ar->buff_len == ARCHIVE_BUFF) && (archive_write(s, ar, 0) != 0))) {
+	failed = 1;
+	break;
+      }
+    }
+    deflateEnd(&(ar->zs));
+  }
+
+  if ((archive_write(s, ar, 1) != 0) || (fdatasync(ar->seg_fh) != 0)) {
+    failed = 1;
+  }
+  close(ar->seg_fh);
+  ar->seg_fh = -1;
+
+  /* Leave a broken segment where it is rather than publish it */
+  if (failed != 0) {
+    fprintf(stderr, "Archive segment %s was not finished\n", ar->seg_tmp);
+    s->stat_errors++;
+    return;
+  }
+
+  /* link() won't replace a segment that's already been published */
+  for (try = 0; try < ARCHIVE_NAME_TRIES; try++) {
+    archive_segment_name(s, ar, name, sizeof(name), try);
+    if (link(ar->seg_tmp, name) == 0) {
+      break;
+    }
+    if (errno != EEXIST) {
+      try = ARCHIVE_NAME_TRIES;
+    }
+  }
+
+  if (try == ARCHIVE_NAME_TRIES) {
+    fprintf(stderr, "Unable to publish %s as %s\n", ar->seg_tmp, name);
+    s->stat_errors++;
+    return;
+  }
+  unlink(ar->seg_tmp);
+
+  ar->stat_segments++;
+}
+
+
+int archive_send(struct sink *s, struct sink_msg **msgs, const int count) {
+
+  struct archive *ar;
+  time_t now;
+  int i;
+
+  if ((ar = archive_state(s)) == NULL) {
+    return 0;
+  }
+  if ((ar->buff == NULL) && (archive_open(s) != 0)) {
+    return 0;
+  }
+
+  /* A new segment starts with the first message after rotation */
+  now = time(NULL);
+  if ((ar->seg_fh == -1) && (archive_segment_open(s, ar, now) != 0)) {
+    return 0;
+  }
+
+  for (i = 0; i < count; i++) {
+    if (ar->columnar != 0) {
+      if (archive_columnar(s, ar, msgs[i]) != 0) {
+	return i;
+      }
+    }
+    else if (archive_append(s, ar, msgs[i]->data, msgs[i]->len) != 0) {
+      return i;
+    }
+  }
+
+  return count;
+}
+
+
+int archive_columnar(struct sink *s, struct archive *ar,
+		     const struct sink_msg *msg) {
+
+  struct ftbin_header header;
+  int offset, ret;
+  int r, i;
+
+  if ((offset = ftbin_decode_header(msg->data, msg->len, &header)) < 0) {
+    s->stat_errors++;
+    return 0;
+  }
+
+  for (r = 0; r < header.count; r++) {
+    if ((ret = ftbin_decode_flow(msg->data + offset, msg->len - offset,
+				 &(ar->flow))) < 0) {
+      s->stat_errors++;
+      return 0;
+    }
+    offset += ret;
+
+    /* A row per source, or just the one if there are none */
+    i = 0;
+    do {
+      if ((ftcol_add_row(ar->col, &(ar->flow), i) != 0) &&
+	  (archive_columnar_block(s, ar) != 0)) {
+	return -1;
+      }
+      i++;
+    } while (i < ar->flow.source_count);
+  }
+
+  return 0;
+}
+
+
+int archive_columnar_block(struct sink *s, struct archive *ar) {
+
+  size_t len;
+
+  if (ar->col->rows == 0) {
+    return 0;
+  }
+
+  len = ftcol_encode_block(ar->col, ar->col_buff);
+  if (len == 0) {
+    s->stat_errors++;
+    return -1;
+  }
+
+  return archive_append(s, ar, ar->col_buff, len);
+}
+
+
+void archive_tick(struct sink *s) {
+
+  struct archive *ar = (struct archive *)s->priv;
+
+  /* Rotate even when nothing is coming in so segments don't sit open */
+  if ((ar != NULL) && (ar->seg_fh != -1) &&
+      (time(NULL) >= ar->seg_start + ar->rotate)) {
+    archive_segment_close(s, ar);
+  }
+}
+
+
+void archive_close(struct sink *s) {
+
+  struct archive *ar = (struct archive *)s->priv;
+
+  if (ar == NULL) {
+    return;
+  }
+
+  archive_segment_close(s, ar);
+
+  fprintf(stderr, "Archive %s: %lu segments written\n", s->path,
+	  ar->stat_segments);
+
+  if (ar->col != NULL) {
+    ftcol_writer_free(ar->col);
+    free(ar->col);
+  }
+  free(ar->col_buff);
+  free(ar->buff);
+  free(ar);
+  s->priv = NULL;
+}
@@ -0,0 +1,601 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <stdint.h>
+
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "filter.h"
+#include "export.h"
+#include "topk.h"
+#include "hll.h"
+#include "rollup.h"
+#include "matrix.h"
+
+
+/* ===
+ * Micro benchmarks for the per-record hot paths, run with -B <name>
+ * ===
+ */
+#define BENCH_FLOWS 4096
+#define BENCH_RECORDS 10000000
+#define BENCH_JSON_FLOWS 1000000
+#define BENCH_JSON_BUFF 65536
+#define BENCH_TOPK_HOT 64 /* talkers in the skewed run */
+#define BENCH_HLL_SCANNERS 16
+#define BENCH_ROLLUPS 4
+
+/* Something representative to run when no filter was given */
+#define BENCH_FILTER "not (proto 17 and dst port 53) and " \
+  "exporter in 10.0.0.0/8 and not tcpflags R"
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+uint32_t bench_rand(void);
+void bench_filter(const struct filter_prog *);
+struct flow_summary *bench_random_summaries(const int);
+void bench_free_summaries(struct flow_summary *, const int);
+int bench_json_snprintf(char *, const struct flow_summary *);
+void bench_json(void);
+void bench_topk_run(const char *, struct unified_flow *);
+void bench_topk(void);
+void bench_hll_run(const char *, struct unified_flow *);
+void bench_hll(void);
+void bench_rollup(void);
+void bench_matrix(void);
+
+
+uint32_t bench_state = 0x2545F491;
+
+
+uint32_t bench_rand(void) {
+
+  /* xorshift32, we only want repeatable junk */
+  bench_state ^= bench_state << 13;
+  bench_state ^= bench_state >> 17;
+  bench_state ^= bench_state << 5;
+
+  return bench_state;
+}
+
+
+void bench_random_flows(struct unified_flow *flows, const int count) {
+
+  const uint8_t protos[] = {6, 6, 6, 17, 17, 1, 47, 50};
+  int i;
+
+  memset(flows, 0, count * sizeof(struct unified_flow));
+
+  for (i = 0; i < count; i++) {
+    flows[i].flow_src = 0x0A000000 | (bench_rand() & 0x1F);
+    flows[i].recv_time = 1000000000 + i;
+    flows[i].src_int = bench_rand() & 0x1F;
+    flows[i].dst_int = bench_rand() & 0x1F;
+    flows[i].src_addr.s_addr = bench_rand();
+    flows[i].dst_addr.s_addr = bench_rand();
+    flows[i].protocol = protos[bench_rand() & 0x7];
+    flows[i].src_port = bench_rand() & 0xFFFF;
+    flows[i].dst_port = ((bench_rand() & 0x3) == 0) ? 53 :
+      (bench_rand() & 0xFFFF);
+    flows[i].tcp_flags = bench_rand() & 0x3F;
+    flows[i].num_packets = 1 + (bench_rand() & 0xFF);
+    flows[i].num_bytes = flows[i].num_packets * (40 + (bench_rand() & 0x3FF));
+    flows[i].start_time = flows[i].recv_time - (bench_rand() & 0x3F);
+    flows[i].end_time = flows[i].recv_time;
+  }
+}
+
+
+void bench_filter(const struct filter_prog *prog) {
+
+  struct unified_flow *flows;
+  uint64_t start_ns, end_ns;
+  uint64_t kept = 0;
+  int i;
+
+  flows = malloc(BENCH_FLOWS * sizeof(struct unified_flow));
+  if (flows == NULL) {
+    return;
+  }
+  bench_random_flows(flows, BENCH_FLOWS);
+
+  fprintf(stderr, "filter: %s\n", prog->source);
+  fprintf(stderr, "compiled to %d instructions\n", prog->len);
+
+  start_ns = monotonic_ns();
+  for (i = 0; i < BENCH_RECORDS; i++) {
+    kept += filter_match(prog, &(flows[i & (BENCH_FLOWS - 1)]));
+  }
+  end_ns = monotonic_ns();
+
+  fprintf(stderr, "%d records in %.03f ms; %.02f ns/record; "
+	  "%.02f M records/s; kept %.02f%%\n", BENCH_RECORDS,
+	  (double)(end_ns - start_ns) / 1000000.0,
+	  (double)(end_ns - start_ns) / (double)BENCH_RECORDS,
+	  (double)BENCH_RECORDS * 1000.0 / (double)(end_ns - start_ns),
+	  ((double)kept / (double)BENCH_RECORDS) * 100);
+
+  free(flows);
+}
+
+
+struct flow_summary *bench_random_summaries(const int count) {
+
+  struct unified_flow *flows;
+  struct flow_summary *summaries;
+  struct flow_source_summary *flow_source;
+  int i, j;
+
+  flows = malloc(count * sizeof(struct unified_flow));
+  summaries = calloc(count, sizeof(struct flow_summary));
+  if ((flows == NULL) || (summaries == NULL)) {
+    free(flows);
+    free(summaries);
+    return NULL;
+  }
+  bench_random_flows(flows, count);
+
+  /* One to three exporters saw each flow */
+  for (i = 0; i < count; i++) {
+    summaries[i].time_added = flows[i].recv_time;
+    summaries[i].time_updated = flows[i].recv_time;
+    summaries[i].src_addr = flows[i].src_addr;
+    summaries[i].dst_addr = flows[i].dst_addr;
+    summaries[i].protocol = flows[i].protocol;
+    summaries[i].src_port = flows[i].src_port;
+    summaries[i].dst_port = flows[i].dst_port;
+    summaries[i].tcp_flags = flows[i].tcp_flags;
+    summaries[i].start_time = flows[i].start_time;
+    summaries[i].end_time = flows[i].end_time;
+    summaries[i].source_count = 1 + (bench_rand() % 3);
+
+    for (j = 0; j < summaries[i].source_count; j++) {
+      flow_source = malloc(sizeof(struct flow_source_summary));
+      flow_source->flow_src = flows[i].flow_src + j;
+      flow_source->src_int = flows[i].src_int;
+      flow_source->dst_int = flows[i].dst_int;
+      flow_source->num_packets = flows[i].num_packets;
+      flow_source->num_bytes = flows[i].num_bytes;
+      flow_source->num_flows = 1 + j;
+      flow_source->rev_packets = 0;
+      flow_source->rev_bytes = 0;
+      flow_source->rev_flows = 0;
+      flow_source->bins = NULL;
+      flow_source->next = summaries[i].sources;
+      summaries[i].sources = flow_source;
+    }
+  }
+
+  free(flows);
+
+  return summaries;
+}
+
+
+void bench_free_summaries(struct flow_summary *summaries, const int count) {
+
+  int i;
+
+  for (i = 0; i < count; i++) {
+    free_source_list(summaries[i].sources);
+  }
+  free(summaries);
+}
+
+
+int bench_json_snprintf(char *outbuff, const struct flow_summary *flow) {
+
+  /* === Misc vars === */
+  struct flow_source_summary *flow_source;
+  struct in_addr temp_inaddr_src, temp_inaddr_dst, temp_inaddr_flow;
+  int outindex;
+
+  temp_inaddr_src.s_addr = htonl(flow->src_addr.s_addr);
+  temp_inaddr_dst.s_addr = htonl(flow->dst_addr.s_addr);
+
+
+  /* This is the old print_flow_json() minus the sendto(), kept around
+   * as the baseline for the JSON writer
+   */
+
+  outindex = 0;
+
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "{\n");
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"src_addr\": \"%s\",\n", inet_ntoa(temp_inaddr_src));
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"dst_addr\": \"%s\",\n", inet_ntoa(temp_inaddr_dst));
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"protocol\": %d,\n", flow->protocol);
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"src_port\": %d,\n", flow->src_port);
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"dst_port\": %d,\n", flow->dst_port);
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"tcp_flags\": %d,\n", flow->tcp_flags);
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"start_time\": %d,\n", (int)(flow->start_time));
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"end_time\": %d,\n", (int)(flow->end_time));
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"source_count\": %d,\n", flow->source_count);
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t\"source_stats\": [\n");
+
+  flow_source = flow->sources;
+  while (flow_source != NULL) {
+
+    temp_inaddr_flow.s_addr = htonl(flow_source->flow_src);
+
+    outindex +=
+      snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	       "\t\t{\n");
+    outindex +=
+      snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	       "\t\t\"flow_source\": \"%s\",\n", inet_ntoa(temp_inaddr_flow));
+    outindex +=
+      snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	       "\t\t\"src_int\": %d,\n", flow_source->src_int);
+    outindex +=
+      snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	       "\t\t\"dst_int\": %d,\n", flow_source->dst_int);
+    outindex +=
+      snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	       "\t\t\"num_packets\": %lu,\n", flow_source->num_packets);
+    outindex +=
+      snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	       "\t\t\"num_bytes\": %lu,\n", flow_source->num_bytes);
+    outindex +=
+      snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	       "\t\t\"num_flows\": %lu\n", flow_source->num_flows);
+
+    flow_source = flow_source->next;
+
+    if (flow_source == NULL) {
+      outindex +=
+	snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+		 "\t\t}\n");
+    }
+    else {
+      outindex +=
+	snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+		 "\t\t},\n");
+    }
+  }
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "\t]\n");
+  outindex +=
+    snprintf(outbuff + outindex, BENCH_JSON_BUFF - outindex - 1,
+	     "}\n");
+  
+  /* Terminate the string */
+  outbuff[outindex] = '\0';
+
+
+  return outindex;
+}
+
+
+void bench_json(void) {
+
+  struct flow_summary *summaries;
+  char *buff;
+  uint64_t start_ns, end_ns;
+  uint64_t total_len;
+  int i;
+
+  summaries = bench_random_summaries(BENCH_FLOWS);
+  buff = malloc(BENCH_JSON_BUFF);
+  if ((summaries == NULL) || (buff == NULL)) {
+    free(buff);
+    return;
+  }
+
+  /* The old pretty printed snprintf() + inet_ntoa() version */
+  total_len = 0;
+  start_ns = monotonic_ns();
+  for (i = 0; i < BENCH_JSON_FLOWS; i++) {
+    total_len += bench_json_snprintf(buff,
+				     &(summaries[i & (BENCH_FLOWS - 1)]));
+  }
+  end_ns = monotonic_ns();
+
+  fprintf(stderr, "snprintf json: %d flows in %.03f ms; %.02f ns/flow; "
+	  "%.0f flows/s; %.0f bytes/flow\n", BENCH_JSON_FLOWS,
+	  (double)(end_ns - start_ns) / 1000000.0,
+	  (double)(end_ns - start_ns) / (double)BENCH_JSON_FLOWS,
+	  (double)BENCH_JSON_FLOWS * 1000000000.0 / (double)(end_ns - start_ns),
+	  (double)total_len / (double)BENCH_JSON_FLOWS);
+
+  /* The NDJSON writer */
+  total_len = 0;
+  start_ns = monotonic_ns();
+  for (i = 0; i < BENCH_JSON_FLOWS; i++) {
+    total_len += encode_flow_json(buff, BENCH_JSON_BUFF,
+				  &(summaries[i & (BENCH_FLOWS - 1)]));
+  }
+  end_ns = monotonic_ns();
+
+  fprintf(stderr, "ndjson writer: %d flows in %.03f ms; %.02f ns/flow; "
+	  "%.0f flows/s; %.0f bytes/flow\n", BENCH_JSON_FLOWS,
+	  (double)(end_ns - start_ns) / 1000000.0,
+	  (double)(end_ns - start_ns) / (double)BENCH_JSON_FLOWS,
+	  (double)BENCH_JSON_FLOWS * 1000000000.0 / (double)(end_ns - start_ns),
+	  (double)total_len / (double)BENCH_JSON_FLOWS);
+
+  free(buff);
+  bench_free_summaries(summaries, BENCH_FLOWS);
+}
+
+
+void bench_topk_run(const char *name, struct unified_flow *flows) {
+
+  struct topk_interval *ti;
+  uint64_t start_ns, end_ns;
+  int i;
+
+  if ((ti = malloc(sizeof(struct topk_interval))) == NULL) {
+    return;
+  }
+  topk_reset(ti, 0);
+
+  start_ns = monotonic_ns();
+  for (i = 0; i < BENCH_RECORDS; i++) {
+    topk_add(ti, &(flows[i & (BENCH_FLOWS - 1)]));
+  }
+  end_ns = monotonic_ns();
+
+  fprintf(stderr, "topk %s: %d records in %.03f ms; %.02f ns/record; "
+	  "%.02f M records/s\n", name, BENCH_RECORDS,
+	  (double)(end_ns - start_ns) / 1000000.0,
+	  (double)(end_ns - start_ns) / (double)BENCH_RECORDS,
+	  (double)BENCH_RECORDS * 1000.0 / (double)(end_ns - start_ns));
+
+  free(ti);
+}
+
+
+void bench_topk(void) {
+
+  struct unified_flow *flows;
+  int i;
+
+  flows = malloc(BENCH_FLOWS * sizeof(struct unified_flow));
+  if (flows == NULL) {
+    return;
+  }
+
+  /* Every key new, so nearly every update evicts */
+  bench_random_flows(flows, BENCH_FLOWS);
+  bench_topk_run("uniform", flows);
+
+  /* Most records from a few talkers, closer to real traffic */
+  for (i = 0; i < BENCH_FLOWS; i++) {
+    if ((bench_rand() & 0x3) != 0) {
+      flows[i].src_addr.s_addr = 0x0A000000 | (bench_rand() % BENCH_TOPK_HOT);
+      flows[i].dst_addr.s_addr = 0xC0A80000 | (bench_rand() % BENCH_TOPK_HOT);
+      flows[i].dst_port = 443;
+    }
+  }
+  bench_topk_run("skewed", flows);
+
+  free(flows);
+}
+
+
+void bench_hll_run(const char *name, struct unified_flow *flows) {
+
+  uint64_t start_ns, end_ns;
+  int i;
+
+  if (hll_init() != 0) {
+    return;
+  }
+
+  start_ns = monotonic_ns();
+  for (i = 0; i < BENCH_RECORDS; i++) {
+    hll_add(&(flows[i & (BENCH_FLOWS - 1)]));
+  }
+  end_ns = monotonic_ns();
+
+  fprintf(stderr, "hll %s: %d records in %.03f ms; %.02f ns/record; "
+	  "%.02f M records/s\n", name, BENCH_RECORDS,
+	  (double)(end_ns - start_ns) / 1000000.0,
+	  (double)(end_ns - start_ns) / (double)BENCH_RECORDS,
+	  (double)BENCH_RECORDS * 1000.0 / (double)(end_ns - start_ns));
+
+  hll_shutdown();
+}
+
+
+void bench_hll(void) {
+
+  struct unified_flow *flows;
+  int i;
+
+  flows = malloc(BENCH_FLOWS * sizeof(struct unified_flow));
+  if (flows == NULL) {
+    return;
+  }
+
+  /* High enough that nothing alerts, only the update is timed */
+  if (hll_threshold == 0) {
+    hll_threshold = UINT32_MAX;
+  }
+
+  /* Every key new, so the probe windows fill and evict */
+  bench_random_flows(flows, BENCH_FLOWS);
+  for (i = 0; i < BENCH_FLOWS; i++) {
+    flows[i].recv_time = 0;
+  }
+  bench_hll_run("uniform", flows);
+
+  /* A few sources sweeping addresses and ports, the rest random */
+  for (i = 0; i < BENCH_FLOWS; i++) {
+    if ((bench_rand() & 0x3) != 0) {
+      flows[i].src_addr.s_addr = 0x0A000000 | (bench_rand() %
+					       BENCH_HLL_SCANNERS);
+    }
+  }
+  bench_hll_run("scan", flows);
+
+  free(flows);
+}
+
+
+void bench_rollup(void) {
+
+  const char *specs[BENCH_ROLLUPS] = {
+    "subnets=src/24,dst/24",
+    "ifaces=exporter,src_int,dst_int",
+    "as=src_as,dst_as",
+    "ports=proto,dst_port"
+  };
+  struct unified_flow *flows;
+  uint64_t start_ns, end_ns;
+  int i;
+
+  flows = malloc(BENCH_FLOWS * sizeof(struct unified_flow));
+  if (flows == NULL) {
+    return;
+  }
+
+  /* Whatever -R gave, or a few like the ones we run */
+  if (rollup_count == 0) {
+    for (i = 0; i < BENCH_ROLLUPS; i++) {
+      if (rollup_parse(specs[i]) != 0) {
+	free(flows);
+	return;
+      }
+    }
+  }
+
+  /* All in one interval, only the update is timed */
+  bench_random_flows(flows, BENCH_FLOWS);
+  for (i = 0; i < BENCH_FLOWS; i++) {
+    flows[i].recv_time = 1000000000;
+    flows[i].src_as = bench_rand() & 0x3FF;
+    flows[i].dst_as = bench_rand() & 0x3FF;
+  }
+
+  start_ns = monotonic_ns();
+  for (i = 0; i < BENCH_RECORDS; i++) {
+    rollup_record(&(flows[i & (BENCH_FLOWS - 1)]));
+  }
+  end_ns = monotonic_ns();
+
+  fprintf(stderr, "rollup x%d: %d records in %.03f ms; %.02f ns/record; "
+	  "%.02f M records/s\n", rollup_count, BENCH_RECORDS,
+	  (double)(end_ns - start_ns) / 1000000.0,
+	  (double)(end_ns - start_ns) / (double)BENCH_RECORDS,
+	  (double)BENCH_RECORDS * 1000.0 / (double)(end_ns - start_ns));
+
+  rollup_shutdown();
+  free(flows);
+}
+
+
+void bench_matrix(void) {
+
+  struct unified_flow *flows;
+  uint64_t start_ns, end_ns;
+  int i;
+
+  flows = malloc(BENCH_FLOWS * sizeof(struct unified_flow));
+  if (flows == NULL) {
+    return;
+  }
+
+  /* 32 exporters with 32 interfaces each, switching every few records */
+  bench_random_flows(flows, BENCH_FLOWS);
+  for (i = 0; i < BENCH_FLOWS; i++) {
+    flows[i].flow_src = 0x0A000000 | ((i >> 3) & 0x1F);
+  }
+
+  start_ns = monotonic_ns();
+  for (i = 0; i < BENCH_RECORDS; i++) {
+    matrix_add(&(flows[i & (BENCH_FLOWS - 1)]));
+  }
+  end_ns = monotonic_ns();
+
+  fprintf(stderr, "matrix: %d records in %.03f ms; %.02f ns/record; "
+	  "%.02f M records/s\n", BENCH_RECORDS,
+	  (double)(end_ns - start_ns) / 1000000.0,
+	  (double)(end_ns - start_ns) / (double)BENCH_RECORDS,
+	  (double)BENCH_RECORDS * 1000.0 / (double)(end_ns - start_ns));
+
+  matrix_shutdown();
+  free(flows);
+}
+
+
+int run_benchmark(const char *name, const struct filter_prog *filter) {
+
+  struct filter_prog *default_filter;
+  char err[256];
+
+  if (strcmp(name, "filter") == 0) {
+    if (filter != NULL) {
+      bench_filter(filter);
+      return 0;
+    }
+
+    if ((default_filter = filter_compile(BENCH_FILTER, err,
+					 sizeof(err))) == NULL) {
+      fprintf(stderr, "Compiling the benchmark filter failed: %s\n", err);
+      return 1;
+    }
+    bench_filter(default_filter);
+    filter_free(default_filter);
+
+    return 0;
+  }
+
+  if (strcmp(name, "json") == 0) {
+    bench_json();
+    return 0;
+  }
+
+  if (strcmp(name, "topk") == 0) {
+    bench_topk();
+    return 0;
+  }
+
+  if (strcmp(name, "hll") == 0) {
+    bench_hll();
+    return 0;
+  }
+
+  if (strcmp(name, "rollup") == 0) {
+    bench_rollup();
+    return 0;
+  }
+
+  if (strcmp(name, "matrix") == 0) {
+    bench_matrix();
+    return 0;
+  }
+
+  fprintf(stderr, "Unknown benchmark %s, try: filter json topk hll rollup "
+	  "matrix\n", name);
+
+  return 1;
+}
@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "flowtree.h"
+#include "bins.h"
+
+
+/* ===
+ * Bins settings
+ * ===
+ */
+int flow_bin_secs = 0;
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+int bins_slot(struct flow_bins *, uint32_t);
+
+
+/* NULL when -T is off, which is what the sources expect then */
+struct flow_bins *bins_new(void) {
+
+  struct flow_bins *bins;
+
+  if ((flow_bin_secs == 0) ||
+      ((bins = malloc(sizeof(struct flow_bins))) == NULL)) {
+    return NULL;
+  }
+
+  bins->first = 0;
+  bins->head = 0;
+  bins->count = 0;
+
+  return bins;
+}
+
+
+/* Where bin number n lives in the ring, moving the ring along and
+ * zeroing bins as they come into use */
+int bins_slot(struct flow_bins *bins, uint32_t n) {
+
+  uint32_t drop;
+  int slot;
+
+  if (bins->count == 0) {
+    bins->first = n;
+    bins->head = 0;
+  }
+
+  /* Older than anything we still have */
+  if (n < bins->first) {
+    n = bins->first;
+  }
+
+  if (n >= bins->first + bins->count) {
+
+    /* Past the end of the ring, drop the oldest to make room */
+    if (n - bins->first >= FLOW_BINS) {
+      drop = n - bins->first - FLOW_BINS + 1;
+      if (drop >= bins->count) {
+	bins->first = n;
+	bins->head = 0;
+	bins->count = 0;
+      }
+      else {
+	bins->head = (bins->head + drop) % FLOW_BINS;
+	bins->first += drop;
+	bins->count -= drop;
+      }
+    }
+
+    while (bins->first + bins->count <= n) {
+      slot = (bins->head + bins->count) % FLOW_BINS;
+      bins->bytes[slot] = 0;
+      bins->packets[slot] = 0;
+      bins->count++;
+    }
+  }
+
+  return (bins->head + (n - bins->first)) % FLOW_BINS;
+}
+
+
+void bins_add(struct flow_bins *bins, const struct unified_flow *flow) {
+
+  uint32_t first, last, n, span;
+  int slot;
+
+  /* Spread the record over the bins it covers */
+  last = (uint32_t)(flow->end_time / flow_bin_secs);
+  first = (uint32_t)(flow->start_time / flow_bin_secs);
+  if ((flow->start_time <= 0) || (first > last)) {
+    first = last;
+  }
+  if (last - first >= FLOW_BINS) {
+    first = last - FLOW_BINS + 1;
+  }
+  span = last - first + 1;
+
+  for (n = first; n <= last; n++) {
+    slot = bins_slot(bins, n);
+    bins->bytes[slot] += flow->num_bytes / span;
+    bins->packets[slot] += flow->num_packets / span;
+  }
+
+  /* Whatever didn't divide evenly goes in the last one */
+  slot = bins_slot(bins, last);
+  bins->bytes[slot] += flow->num_bytes % span;
+  bins->packets[slot] += flow->num_packets % span;
+}
@@ -0,0 +1,49 @@
+#ifndef BINS_H
+#define BINS_H 1
+
+#include <stdint.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Per-flow time bins
+ *
+ * With -T <secs> every flow source also keeps its bytes and packets in
+ * <secs> wide bins, so the export can tell a steady stream from a burst.
+ * A record is spread evenly over the bins its start_time to end_time
+ * covers, since that is when the exporter says the traffic happened.
+ *
+ * The bins are a ring of FLOW_BINS, so each source costs exactly
+ * sizeof(struct flow_bins) more (392 bytes) however long it lives.
+ * Once a flow runs past FLOW_BINS bins the oldest ones are dropped, and
+ * records older than the oldest bin kept land in it.
+ *
+ * Bins are kept per source rather than per flow so a flow two exporters
+ * saw isn't counted twice.  With -b they only cover the forward
+ * direction, like num_bytes and num_packets; the rev_ counters have no
+ * bins of their own.  Only the JSON export has room for them: each
+ * source gets its bins plus the peak and average bps and pps over them.
+ * ===
+ */
+#define FLOW_BINS 32
+
+struct flow_bins {
+  uint32_t first; /* bin number (time / width) of the oldest bin */
+  uint16_t head;  /* where the oldest bin is in the ring */
+  uint16_t count; /* bins in use */
+  uint64_t bytes[FLOW_BINS];
+  uint32_t packets[FLOW_BINS];
+};
+
+extern int flow_bin_secs; /* -T, 0 is off */
+
+
+/* ===
+ * Bins function prototypes
+ * ===
+ */
+struct flow_bins *bins_new(void);
+void bins_add(struct flow_bins *, const struct unified_flow *);
+
+#endif /* bins.h */
@@ -0,0 +1,520 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "filter.h"
+#include "control.h"
+#include "metrics.h"
+
+
+/* ===
+ * Control settings and state
+ * ===
+ */
+const char *control_path = NULL; /* -C, off unless given */
+
+int control_fh = -1;
+int control_stopping = 0;
+pthread_t control_thread;
+
+/* Only the control thread writes these */
+uint64_t control_queries = 0;
+uint64_t control_scanned = 0;
+uint64_t control_last_ns = 0;      /* how long the last query took */
+uint64_t control_max_hold_ns = 0;  /* longest tree lock hold, any query */
+
+
+/* ===
+ * A query and what it found
+ * ===
+ */
+struct control_hit {
+  struct flow_summary flow; /* sources left out */
+  uint64_t num_packets;
+  uint64_t num_bytes;
+  uint64_t num_flows;
+  uint64_t rev_packets; /* -b only */
+  uint64_t rev_bytes;
+  uint64_t rev_flows;
+  uint64_t bytes;       /* both ways, what top and minbytes go by */
+};
+
+struct control_query {
+  struct filter_prog *filter;
+  uint64_t min_bytes;
+  int top;   /* 0 for every match up to limit */
+  int limit;
+  struct control_hit *hits;
+  int hit_count;
+  uint64_t scanned;
+  uint64_t matched;
+};
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+void *thread_control(void *);
+void control_serve(const int);
+int control_parse(struct control_query *, const char *, char *, const size_t);
+int control_match(const struct flow_summary *, void *);
+void control_heap_down(struct control_hit *, const int, int);
+int compare_hits(const void *, const void *);
+void control_print_hit(FILE *, const struct control_hit *);
+void control_print_error(FILE *, const char *);
+
+
+int control_start(void) {
+
+  struct sockaddr_un addrun;
+
+  if (control_path == NULL) {
+    return 0;
+  }
+
+  if (strlen(control_path) >= sizeof(addrun.sun_path)) {
+    fprintf(stderr, "Control socket path %s is too long\n", control_path);
+    return -1;
+  }
+
+  if ((control_fh = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    return -1;
+  }
+
+  memset(&addrun, 0, sizeof(addrun));
+  addrun.sun_family = AF_UNIX;
+  strcpy(addrun.sun_path, control_path);
+
+  /* A stale socket from the last run would make the bind fail */
+  unlink(control_path);
+
+  if ((bind(control_fh, (const struct sockaddr *)&addrun,
+	    sizeof(addrun)) == -1) ||
+      (listen(control_fh, 4) == -1)) {
+    fprintf(stderr, "Unable to listen for queries on %s\n", control_path);
+    perror("bind");
+    close(control_fh);
+    control_fh = -1;
+    return -1;
+  }
+  chmod(control_path, 0600);
+
+  if (pthread_create(&control_thread, NULL, thread_control, NULL) != 0) {
+    fprintf(stderr, "Unable to start the control thread\n");
+    close(control_fh);
+    control_fh = -1;
+    unlink(control_path);
+    return -1;
+  }
+
+  fprintf(stderr, "Answering queries on %s\n", control_path);
+
+  return 0;
+}
+
+
+void control_shutdown(void) {
+
+  if (control_fh == -1) {
+    return;
+  }
+
+  __atomic_store_n(&control_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(control_thread, NULL);
+
+  close(control_fh);
+  control_fh = -1;
+  unlink(control_path);
+}
+
+
+/* ===
+ * The control thread, one query at a time
+ * ===
+ */
+void *thread_control(void *arg) {
+
+  struct pollfd pfd;
+  int client_fh;
+
+  pfd.fd = control_fh;
+  pfd.events = POLLIN;
+
+  while (__atomic_load_n(&control_stopping, __ATOMIC_ACQUIRE) == 0) {
+    /* Wake up now and then to see if we're done */
+    if (poll(&pfd, 1, 500) <= 0) {
+      continue;
+    }
+
+    if ((client_fh = accept(control_fh, NULL, NULL)) == -1) {
+      continue;
+    }
+
+    control_serve(client_fh);
+    close(client_fh);
+  }
+
+  return NULL;
+}
+
+
+void control_serve(const int client_fh) {
+
+  struct control_query query;
+  struct timeval timeout;
+  char line[CONTROL_QUERY_MAX + 1];
+  char err[256];
+  uint64_t start_ns, hold_ns;
+  ssize_t got;
+  size_t len = 0;
+  FILE *out;
+  int i;
+
+  /* Nobody gets to hold the thread for long */
+  timeout.tv_sec = CONTROL_TIMEOUT;
+  timeout.tv_usec = 0;
+  setsockopt(client_fh, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  setsockopt(client_fh, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+  /* One line, the query */
+  while (len < CONTROL_QUERY_MAX) {
+    if ((got = read(client_fh, line + len, CONTROL_QUERY_MAX - len)) <= 0) {
+      break;
+    }
+    len += got;
+    line[len] = '\0';
+
+    if (strchr(line, '\n') != NULL) {
+      break;
+    }
+  }
+  line[len] = '\0';
+  line[strcspn(line, "\r\n")] = '\0';
+
+  if ((out = fdopen(dup(client_fh), "w")) == NULL) {
+    return;
+  }
+
+  if (control_parse(&query, line, err, sizeof(err)) != 0) {
+    control_print_error(out, err);
+    fclose(out);
+    return;
+  }
+
+  start_ns = monotonic_ns();
+  hold_ns = flowtree_walk(control_match, &query);
+
+  /* Biggest first for top, tree order otherwise */
+  if (query.top > 0) {
+    qsort(query.hits, query.hit_count, sizeof(struct control_hit),
+	  compare_hits);
+  }
+  for (i = 0; i < query.hit_count; i++) {
+    control_print_hit(out, &(query.hits[i]));
+  }
+
+  __atomic_store_n(&control_last_ns, monotonic_ns() - start_ns,
+		   __ATOMIC_RELAXED);
+  __atomic_store_n(&control_scanned, control_scanned + query.scanned,
+		   __ATOMIC_RELAXED);
+  if (hold_ns > control_max_hold_ns) {
+    __atomic_store_n(&control_max_hold_ns, hold_ns, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&control_queries, control_queries + 1, __ATOMIC_RELAXED);
+
+  fprintf(out, "{\"scanned\":%lu,\"matched\":%lu,\"sent\":%d,"
+	  "\"elapsed_us\":%.03f,\"max_lock_hold_us\":%.03f}\n",
+	  query.scanned, query.matched, query.hit_count,
+	  (double)control_last_ns / 1000.0, (double)hold_ns / 1000.0);
+  fclose(out);
+
+  free(query.hits);
+  if (query.filter != NULL) {
+    filter_free(query.filter);
+  }
+}
+
+
+int control_parse(struct control_query *query, const char *line, char *err,
+		  const size_t errlen) {
+
+  const char *pos = line;
+  char word[16];
+  unsigned long val;
+  int used;
+
+  memset(query, 0, sizeof(struct control_query));
+  query->limit = CONTROL_LIMIT;
+
+  /* The options come first, whatever is left is the filter */
+  while (sscanf(pos, " %15s %lu%n", word, &val, &used) == 2) {
+    if (strcmp(word, "top") == 0) {
+      if ((val < 1) || (val > CONTROL_TOP_MAX)) {
+	snprintf(err, errlen, "top must be 1 to %d", CONTROL_TOP_MAX);
+	return -1;
+      }
+      query->top = val;
+    }
+    else if (strcmp(word, "limit") == 0) {
+      if (val > CONTROL_TOP_MAX) {
+	snprintf(err, errlen, "limit must be 0 to %d", CONTROL_TOP_MAX);
+	return -1;
+      }
+      query->limit = val;
+    }
+    else if (strcmp(word, "minbytes") == 0) {
+      query->min_bytes = val;
+    }
+    else {
+      break;
+    }
+    pos += used;
+  }
+
+  pos += strspn(pos, " \t");
+  if (*pos != '\0') {
+    if ((query->filter = filter_compile(pos, err, errlen)) == NULL) {
+      return -1;
+    }
+  }
+
+  if (query->top > 0) {
+    query->limit = query->top;
+  }
+
+  if ((query->limit > 0) &&
+      ((query->hits = malloc(query->limit *
+			     sizeof(struct control_hit))) == NULL)) {
+    snprintf(err, errlen, "out of memory");
+    if (query->filter != NULL) {
+      filter_free(query->filter);
+    }
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* Called with the flow's tree locked, so keep it short */
+int control_match(const struct flow_summary *flow, void *arg) {
+
+  struct control_query *query = arg;
+  struct flow_source_summary *flow_source;
+  struct unified_flow match_flow;
+  struct control_hit *hit;
+  uint64_t packets = 0, bytes = 0, flows = 0;
+  uint64_t rev_packets = 0, rev_bytes = 0, rev_flows = 0;
+  int matched = (query->filter == NULL);
+  int i;
+
+  query->scanned++;
+
+  memset(&match_flow, 0, sizeof(match_flow));
+  match_flow.src_addr = flow->src_addr;
+  match_flow.dst_addr = flow->dst_addr;
+  match_flow.protocol = flow->protocol;
+  match_flow.src_port = flow->src_port;
+  match_flow.dst_port = flow->dst_port;
+  match_flow.tcp_flags = flow->tcp_flags;
+
+  for (flow_source = flow->sources; flow_source != NULL;
+       flow_source = flow_source->next) {
+    packets += flow_source->num_packets;
+    bytes += flow_source->num_bytes;
+    flows += flow_source->num_flows;
+    rev_packets += flow_source->rev_packets;
+    rev_bytes += flow_source->rev_bytes;
+    rev_flows += flow_source->rev_flows;
+
+    if (matched == 0) {
+      match_flow.flow_src = flow_source->flow_src;
+      match_flow.src_int = flow_source->src_int;
+      match_flow.dst_int = flow_source->dst_int;
+      matched = filter_match(query->filter, &match_flow);
+    }
+  }
+
+  if ((matched == 0) || (bytes + rev_bytes < query->min_bytes)) {
+    return 0;
+  }
+  query->matched++;
+
+  if (query->limit == 0) {
+    return 0;
+  }
+
+  /* A full top list only takes something bigger than its smallest */
+  if ((query->top > 0) && (query->hit_count == query->top)) {
+    if (bytes + rev_bytes <= query->hits[0].bytes) {
+      return 0;
+    }
+    hit = &(query->hits[0]);
+  }
+  else {
+    hit = &(query->hits[query->hit_count++]);
+  }
+
+  memcpy(&(hit->flow), flow, sizeof(struct flow_summary));
+  hit->flow.sources = NULL;
+  hit->num_packets = packets;
+  hit->num_bytes = bytes;
+  hit->num_flows = flows;
+  hit->rev_packets = rev_packets;
+  hit->rev_bytes = rev_bytes;
+  hit->rev_flows = rev_flows;
+  hit->bytes = bytes + rev_bytes;
+
+  if (query->top > 0) {
+    /* Keep the smallest at the root */
+    if (hit == &(query->hits[0])) {
+      control_heap_down(query->hits, query->hit_count, 0);
+    }
+    else if (query->hit_count == query->top) {
+      for (i = (query->hit_count / 2) - 1; i >= 0; i--) {
+	control_heap_down(query->hits, query->hit_count, i);
+      }
+    }
+    return 0;
+  }
+
+  /* Plain listing stops once the limit is reached */
+  return (query->hit_count == query->limit);
+}
+
+
+void control_heap_down(struct control_hit *hits, const int count, int i) {
+
+  struct control_hit tmp;
+  int child;
+
+  while ((child = (i * 2) + 1) < count) {
+    if ((child + 1 < count) &&
+	(hits[child + 1].bytes < hits[child].bytes)) {
+      child++;
+    }
+    if (hits[i].bytes <= hits[child].bytes) {
+      return;
+    }
+    tmp = hits[i];
+    hits[i] = hits[child];
+    hits[child] = tmp;
+    i = child;
+  }
+}
+
+
+int compare_hits(const void *a, const void *b) {
+
+  const struct control_hit *ha = a;
+  const struct control_hit *hb = b;
+
+  if (ha->bytes != hb->bytes) {
+    return (ha->bytes < hb->bytes) ? 1 : -1;
+  }
+
+  return 0;
+}
+
+
+void control_print_hit(FILE *out, const struct control_hit *hit) {
+
+  struct in_addr addr;
+
+  addr.s_addr = htonl(hit->flow.src_addr.s_addr);
+  fprintf(out, "{\"src_addr\":\"%s\",", inet_ntoa(addr));
+  addr.s_addr = htonl(hit->flow.dst_addr.s_addr);
+  fprintf(out, "\"dst_addr\":\"%s\",\"protocol\":%u,\"src_port\":%u,"
+	  "\"dst_port\":%u,\"tcp_flags\":%u,\"start_time\":%lu,"
+	  "\"end_time\":%lu,\"time_added\":%lu,\"time_updated\":%lu,"
+	  "\"source_count\":%u,\"num_packets\":%lu,\"num_bytes\":%lu,"
+	  "\"num_flows\":%lu", inet_ntoa(addr),
+	  (unsigned int)hit->flow.protocol, (unsigned int)hit->flow.src_port,
+	  (unsigned int)hit->flow.dst_port, (unsigned int)hit->flow.tcp_flags,
+	  (uint64_t)hit->flow.start_time, (uint64_t)hit->flow.end_time,
+	  (uint64_t)hit->flow.time_added, (uint64_t)hit->flow.time_updated,
+	  (unsigned int)hit->flow.source_count, hit->num_packets,
+	  hit->num_bytes, hit->num_flows);
+  if (biflow_enabled != 0) {
+    fprintf(out, ",\"rev_tcp_flags\":%u,\"rev_packets\":%lu,"
+	    "\"rev_bytes\":%lu,\"rev_flows\":%lu",
+	    (unsigned int)hit->flow.rev_tcp_flags, hit->rev_packets,
+	    hit->rev_bytes, hit->rev_flows);
+  }
+  fprintf(out, "}\n");
+}
+
+
+void control_print_error(FILE *out, const char *err) {
+
+  fputs("{\"error\":\"", out);
+  for (; *err != '\0'; err++) {
+    if ((*err == '"') || (*err == '\\')) {
+      fputc('\\', out);
+    }
+    if ((unsigned char)*err >= ' ') {
+      fputc(*err, out);
+    }
+  }
+  fputs("\"}\n", out);
+}
+
+
+/* ===
+ * Reporting
+ * ===
+ */
+void control_report(void) {
+
+  if (control_path == NULL) {
+    return;
+  }
+
+  fprintf(stderr, "control queries: %lu; flows scanned: %lu; last took "
+	  "%.03f ms; longest tree lock hold: %.03f us\n",
+	  __atomic_load_n(&control_queries, __ATOMIC_RELAXED),
+	  __atomic_load_n(&control_scanned, __ATOMIC_RELAXED),
+	  (double)__atomic_load_n(&control_last_ns, __ATOMIC_RELAXED) / 1e6,
+	  (double)__atomic_load_n(&control_max_hold_ns, __ATOMIC_RELAXED) /
+	  1e3);
+}
+
+
+void control_metrics(FILE *out) {
+
+  if (control_path == NULL) {
+    return;
+  }
+
+  metrics_header(out, "flowtree_control_queries_total", "counter",
+		 "Queries answered on the control socket");
+  fprintf(out, "flowtree_control_queries_total %lu\n",
+	  __atomic_load_n(&control_queries, __ATOMIC_RELAXED));
+
+  metrics_header(out, "flowtree_control_flows_scanned_total", "counter",
+		 "Live flows looked at by control socket queries");
+  fprintf(out, "flowtree_control_flows_scanned_total %lu\n",
+	  __atomic_load_n(&control_scanned, __ATOMIC_RELAXED));
+
+  metrics_header(out, "flowtree_control_lock_hold_max_seconds", "gauge",
+		 "Longest any query held a single tree lock");
+  fprintf(out, "flowtree_control_lock_hold_max_seconds %.9f\n",
+	  (double)__atomic_load_n(&control_max_hold_ns, __ATOMIC_RELAXED) /
+	  1e9);
+}
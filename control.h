@@ -0,0 +1,54 @@
+#ifndef CONTROL_H
+#define CONTROL_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * The control socket
+ *
+ * With -C <path> a thread of its own listens on a unix stream socket
+ * for queries against the flows still in the trees.  A query is one
+ * line:
+ *
+ *   [top <n>] [limit <n>] [minbytes <n>] [<filter expression>]
+ *
+ * where the filter is the same language as -f (see filter.c) and a flow
+ * matches if any of its sources does.  "top <n>" answers with the n
+ * flows with the most bytes, otherwise every match is sent, up to the
+ * limit.  With -b top and minbytes count the bytes both ways.  The
+ * answer is a JSON object per flow and a last one with what the query
+ * cost.
+ *
+ * The walk takes one tree mutex at a time and only for as long as it
+ * takes to look at that tree's flows, so the receive path waits at most
+ * one short tree's worth.  The longest single hold is reported with
+ * every answer and in the stats, and with -L the waits it causes show
+ * up in the tree lock profile.
+ * ===
+ */
+#define CONTROL_LIMIT 1000      /* flows sent without a limit or top */
+#define CONTROL_TOP_MAX 100000
+#define CONTROL_QUERY_MAX 4096
+#define CONTROL_TIMEOUT 2       /* seconds to wait on a slow client */
+
+extern const char *control_path;
+
+
+/* ===
+ * Control function prototypes
+ * ===
+ */
+int control_start(void);
+void control_shutdown(void);
+void control_report(void);
+void control_metrics(FILE *);
+
+/* In flowtree.c, calls back with every flow under its tree's lock until
+ * the callback returns non-zero, returns the longest hold in ns */
+uint64_t flowtree_walk(int (*)(const struct flow_summary *, void *), void *);
+
+#endif /* control.h */
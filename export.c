@@ -0,0 +1,699 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+
+#include "flowtree.h"
+#include "export.h"
+#include "bins.h"
+#include "sink.h"
+#include "ftbin.h"
+#include "ipfix.h"
+
+
+#define SENDBUFFSIZE 65536
+
+
+/* ===
+ * Export settings and stats
+ * ===
+ */
+int export_format = EXPORT_JSON;
+const char *export_format_names[EXPORT_FORMATS] = {"json", "binary", "ipfix"};
+int export_dgram_size = EXPORT_DGRAM_SIZE;
+
+uint64_t stat_export_flows = 0;
+uint64_t stat_export_datagrams = 0;
+
+
+/* ===
+ * The datagrams being filled, one per format some sink wants.  Only the
+ * janitor exports so there is no locking.  Records are encoded into
+ * record_buff first and then copied in so we know whether they fit.
+ * ===
+ */
+struct export_batch {
+  uint8_t buff[SENDBUFFSIZE];
+  int len;
+  int count;
+  uint32_t sequence;
+  int data_set; /* IPFIX only, where the data set header goes */
+};
+
+struct export_batch export_batches[EXPORT_FORMATS];
+int export_formats = 0; /* bit per format in use, from the sinks */
+uint8_t record_buff[SENDBUFFSIZE];
+time_t ipfix_template_time = 0;
+
+
+/* ===
+ * The one IPFIX template, {element id, length} in record order
+ * ===
+ */
+static const uint16_t ipfix_template_fields[IPFIX_FIELDS][2] = {
+  {IPFIX_IE_SRC_ADDR, 4},
+  {IPFIX_IE_DST_ADDR, 4},
+  {IPFIX_IE_SRC_PORT, 2},
+  {IPFIX_IE_DST_PORT, 2},
+  {IPFIX_IE_PROTOCOL, 1},
+  {IPFIX_IE_TCP_CONTROL_BITS, 1},
+  {IPFIX_IE_INGRESS_INTERFACE, 2},
+  {IPFIX_IE_EGRESS_INTERFACE, 2},
+  {IPFIX_IE_FLOW_START_SECONDS, 4},
+  {IPFIX_IE_FLOW_END_SECONDS, 4},
+  {IPFIX_IE_PACKET_DELTA_COUNT, 8},
+  {IPFIX_IE_OCTET_DELTA_COUNT, 8},
+  {IPFIX_IE_DELTA_FLOW_COUNT, 8},
+  {IPFIX_IE_ORIGINAL_EXPORTER_IPV4, 4}
+};
+
+
+/* ===
+ * JSON writer bits.  The fixed part of a flow never needs more than
+ * JSON_FLOW_MAX bytes and each source no more than JSON_SOURCE_MAX,
+ * which is what lets the writer skip bounds checks inside a record.
+ * ===
+ */
+#define JSON_FLOW_MAX 320
+#define JSON_SOURCE_MAX 288 /* with -b's rev_ counters */
+/* With -T: json_put_bins() writes 97 bytes of keys and punctuation
+ * and six u64s of up to 20 digits (217), plus up to 21 bytes per bin
+ * for bytes and 11 for packets */
+#define JSON_BINS_MAX (224 + (FLOW_BINS * 32))
+
+static const char json_digit_pairs[201] =
+  "00010203040506070809"
+  "10111213141516171819"
+  "20212223242526272829"
+  "30313233343536373839"
+  "40414243444546474849"
+  "50515253545556575859"
+  "60616263646566676869"
+  "70717273747576777879"
+  "80818283848586878889"
+  "90919293949596979899";
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+void export_append(const int, const uint8_t *, const int);
+void export_flush_format(const int);
+int export_ipfix_start(struct export_batch *);
+static inline char *json_put_str(char *, const char *, const int);
+static inline char *json_put_u64(char *, uint64_t);
+static inline char *json_put_addr(char *, const uint32_t);
+char *json_put_bins(char *, const struct flow_bins *);
+
+
+int export_init(void) {
+
+  /* A single record has to fit even if the datagram gets big, and an
+   * IPFIX message also has to have room for the template */
+  if (export_dgram_size < FTBIN_HEADER_LEN + FTBIN_FLOW_LEN) {
+    export_dgram_size = FTBIN_HEADER_LEN + FTBIN_FLOW_LEN;
+  }
+  if (export_dgram_size < IPFIX_HEADER_LEN + IPFIX_TEMPLATE_SET_LEN +
+      IPFIX_SET_HEADER_LEN + IPFIX_RECORD_LEN) {
+    export_dgram_size = IPFIX_HEADER_LEN + IPFIX_TEMPLATE_SET_LEN +
+      IPFIX_SET_HEADER_LEN + IPFIX_RECORD_LEN;
+  }
+
+  /* IPFIX message lengths are 16 bits */
+  if (export_dgram_size > SENDBUFFSIZE - 1) {
+    export_dgram_size = SENDBUFFSIZE - 1;
+  }
+
+  if (sink_start() != 0) {
+    return -1;
+  }
+  export_formats = sink_formats();
+
+  return 0;
+}
+
+
+void export_shutdown(void) {
+
+  /* Anything still being filled goes out before the sinks drain */
+  export_flush();
+  sink_shutdown();
+}
+
+
+int export_format_id(const char *name) {
+
+  int format;
+
+  for (format = 0; format < EXPORT_FORMATS; format++) {
+    if (strcmp(name, export_format_names[format]) == 0) {
+      return format;
+    }
+  }
+
+  return -1;
+}
+
+
+int export_parse_format(const char *name) {
+
+  int format;
+
+  if ((format = export_format_id(name)) < 0) {
+    return -1;
+  }
+  export_format = format;
+
+  return 0;
+}
+
+
+void export_flow(const struct flow_summary *flow) {
+
+  struct flow_source_summary *flow_source;
+  int record_len;
+
+  /* Each format is only encoded if some sink takes it */
+  if ((export_formats & (1 << EXPORT_BINARY)) != 0) {
+    record_len = encode_flow_binary(record_buff, flow);
+    export_append(EXPORT_BINARY, record_buff, record_len);
+  }
+
+  if ((export_formats & (1 << EXPORT_JSON)) != 0) {
+    record_len = encode_flow_json((char *)record_buff, sizeof(record_buff),
+				  flow);
+    export_append(EXPORT_JSON, record_buff, record_len);
+  }
+
+  if ((export_formats & (1 << EXPORT_IPFIX)) != 0) {
+    record_len = encode_flow_ipfix(record_buff, flow, 0);
+    export_append(EXPORT_IPFIX, record_buff, record_len);
+
+    /* With -b, the other way too if anything went that way */
+    for (flow_source = flow->sources; flow_source != NULL;
+	 flow_source = flow_source->next) {
+      if (flow_source->rev_flows != 0) {
+	record_len = encode_flow_ipfix(record_buff, flow, 1);
+	export_append(EXPORT_IPFIX, record_buff, record_len);
+	break;
+      }
+    }
+  }
+
+  stat_export_flows++;
+}
+
+
+/* Summaries (top talkers and such) only go out as JSON, the binary and
+ * IPFIX layouts have no room for anything but flows */
+void export_summary(const char *record, const int record_len) {
+
+  if ((export_formats & (1 << EXPORT_JSON)) != 0) {
+    export_append(EXPORT_JSON, (const uint8_t *)record, record_len);
+  }
+}
+
+
+void export_append(const int format, const uint8_t *record,
+		   const int record_len) {
+
+  struct export_batch *batch = &(export_batches[format]);
+
+  /* Send what we have if this one won't fit.  A record bigger than the
+   * datagram size just goes out in an oversized datagram by itself. */
+  if ((batch->count > 0) &&
+      (batch->len + record_len > export_dgram_size)) {
+    export_flush_format(format);
+  }
+
+  /* Headers get written on flush, leave room for them */
+  if (batch->count == 0) {
+    if (format == EXPORT_BINARY) {
+      batch->len = FTBIN_HEADER_LEN;
+    }
+    else if (format == EXPORT_IPFIX) {
+      batch->len = export_ipfix_start(batch);
+    }
+    else {
+      batch->len = 0;
+    }
+  }
+
+  /* Even by itself it has to fit the buffer behind the header */
+  if (batch->len + record_len > SENDBUFFSIZE) {
+    return;
+  }
+
+  memcpy(batch->buff + batch->len, record, record_len);
+  batch->len += record_len;
+  batch->count++;
+
+  /* No point waiting if it is already full */
+  if (batch->len >= export_dgram_size) {
+    export_flush_format(format);
+  }
+}
+
+
+void export_flush(void) {
+
+  int format;
+
+  for (format = 0; format < EXPORT_FORMATS; format++) {
+    export_flush_format(format);
+  }
+}
+
+
+void export_flush_format(const int format) {
+
+  struct export_batch *batch = &(export_batches[format]);
+
+  if (batch->count == 0) {
+    return;
+  }
+
+  /* Now that we know the count the header can be filled in */
+  if (format == EXPORT_BINARY) {
+    ftbin_put32(batch->buff, FTBIN_MAGIC);
+    ftbin_put16(batch->buff + 4, FTBIN_VERSION);
+    ftbin_put16(batch->buff + 6, batch->count);
+    ftbin_put32(batch->buff + 8, batch->sequence);
+    ftbin_put32(batch->buff + 12, time(NULL));
+  }
+  else if (format == EXPORT_IPFIX) {
+    ipfix_put16(batch->buff, IPFIX_VERSION);
+    ipfix_put16(batch->buff + 2, batch->len);
+    ipfix_put32(batch->buff + 4, time(NULL));
+    ipfix_put32(batch->buff + 8, batch->sequence);
+    ipfix_put32(batch->buff + 12, IPFIX_DOMAIN_ID);
+
+    ipfix_put16(batch->buff + batch->data_set, IPFIX_TEMPLATE_ID);
+    ipfix_put16(batch->buff + batch->data_set + 2,
+		batch->len - batch->data_set);
+  }
+
+  sink_publish(format, batch->buff, batch->len);
+
+  stat_export_datagrams++;
+
+  /* IPFIX sequence numbers count data records, not messages.  Stream
+   * sinks read it for their template messages. */
+  __atomic_store_n(&(batch->sequence), batch->sequence +
+		   ((format == EXPORT_IPFIX) ? batch->count : 1),
+		   __ATOMIC_RELAXED);
+
+  batch->len = 0;
+  batch->count = 0;
+}
+
+
+int encode_flow_binary(uint8_t *buff, const struct flow_summary *flow) {
+
+  struct flow_source_summary *flow_source;
+  uint8_t *cur;
+  int count, n;
+
+  buff[2] = (biflow_enabled != 0) ? FTBIN_FLAG_BIFLOW : 0;
+  ftbin_put32(buff + 4, flow->src_addr.s_addr);
+  ftbin_put32(buff + 8, flow->dst_addr.s_addr);
+  ftbin_put32(buff + 12, flow->start_time);
+  ftbin_put32(buff + 16, flow->end_time);
+  ftbin_put16(buff + 20, flow->src_port);
+  ftbin_put16(buff + 22, flow->dst_port);
+  buff[24] = flow->protocol;
+  buff[25] = flow->tcp_flags;
+  buff[26] = flow->rev_tcp_flags; /* 0 unless FTBIN_FLAG_BIFLOW */
+  buff[27] = 0; /* reserved */
+
+  /* The source list is already sorted by flow_src.  The count is only
+   * a byte, so past FTBIN_MAX_SOURCES the rest are left out. */
+  cur = buff + FTBIN_FLOW_LEN;
+  count = 0;
+  for (flow_source = flow->sources;
+       (flow_source != NULL) && (count < FTBIN_MAX_SOURCES);
+       flow_source = flow_source->next) {
+    ftbin_put32(cur, flow_source->flow_src);
+    ftbin_put16(cur + 4, flow_source->src_int);
+    ftbin_put16(cur + 6, flow_source->dst_int);
+    ftbin_put64(cur + 8, flow_source->num_packets);
+    ftbin_put64(cur + 16, flow_source->num_bytes);
+    ftbin_put64(cur + 24, flow_source->num_flows);
+
+    cur += FTBIN_SOURCE_LEN;
+    count++;
+  }
+
+  /* The reverse counters go after all the sources so older readers
+   * that skip by record_len never notice them */
+  if (biflow_enabled != 0) {
+    for (flow_source = flow->sources, n = 0; n < count;
+	 flow_source = flow_source->next, n++) {
+      ftbin_put64(cur, flow_source->rev_packets);
+      ftbin_put64(cur + 8, flow_source->rev_bytes);
+      ftbin_put64(cur + 16, flow_source->rev_flows);
+
+      cur += FTBIN_REV_SOURCE_LEN;
+    }
+  }
+
+  /* Sized from what actually went in */
+  ftbin_put16(buff, cur - buff);
+  buff[3] = count;
+
+  return cur - buff;
+}
+
+
+int export_ipfix_start(struct export_batch *batch) {
+
+  time_t now = time(NULL);
+  int len = IPFIX_HEADER_LEN;
+
+  /* The template rides along with the first message after a refresh */
+  if (now - ipfix_template_time >= IPFIX_TEMPLATE_REFRESH) {
+    len += encode_ipfix_template(batch->buff + len);
+    ipfix_template_time = now;
+  }
+
+  batch->data_set = len;
+
+  return len + IPFIX_SET_HEADER_LEN;
+}
+
+
+int encode_ipfix_template(uint8_t *buff) {
+
+  uint8_t *cur;
+  int field;
+
+  ipfix_put16(buff, IPFIX_SET_TEMPLATE);
+  ipfix_put16(buff + 2, IPFIX_TEMPLATE_SET_LEN);
+  ipfix_put16(buff + 4, IPFIX_TEMPLATE_ID);
+  ipfix_put16(buff + 6, IPFIX_FIELDS);
+
+  cur = buff + 8;
+  for (field = 0; field < IPFIX_FIELDS; field++) {
+    ipfix_put16(cur, ipfix_template_fields[field][0]);
+    ipfix_put16(cur + 2, ipfix_template_fields[field][1]);
+    cur += 4;
+  }
+
+  return IPFIX_TEMPLATE_SET_LEN;
+}
+
+
+/* A message with nothing but the template, for stream sinks to send
+ * ahead of everything else on a new connection.  Called from the sink
+ * threads, the sequence is whatever the janitor has got to. */
+int encode_ipfix_template_message(uint8_t *buff) {
+
+  int len = IPFIX_HEADER_LEN + IPFIX_TEMPLATE_SET_LEN;
+
+  ipfix_put16(buff, IPFIX_VERSION);
+  ipfix_put16(buff + 2, len);
+  ipfix_put32(buff + 4, time(NULL));
+  ipfix_put32(buff + 8, __atomic_load_n(&(export_batches[EXPORT_IPFIX]
+					   .sequence), __ATOMIC_RELAXED));
+  ipfix_put32(buff + 12, IPFIX_DOMAIN_ID);
+  encode_ipfix_template(buff + IPFIX_HEADER_LEN);
+
+  return len;
+}
+
+
+/* IPFIX records only go one way, so with -b the reverse direction of a
+ * flow gets a record of its own, swapped round */
+int encode_flow_ipfix(uint8_t *buff, const struct flow_summary *flow,
+		      const int reverse) {
+
+  struct flow_source_summary *flow_source, *best;
+
+  /* Counters come from whichever exporter saw the most of the flow */
+  best = flow->sources;
+  for (flow_source = flow->sources; flow_source != NULL;
+       flow_source = flow_source->next) {
+    if (((reverse == 0) && (flow_source->num_bytes > best->num_bytes)) ||
+	((reverse != 0) && (flow_source->rev_bytes > best->rev_bytes))) {
+      best = flow_source;
+    }
+  }
+
+  if (reverse == 0) {
+    ipfix_put32(buff, flow->src_addr.s_addr);
+    ipfix_put32(buff + 4, flow->dst_addr.s_addr);
+    ipfix_put16(buff + 8, flow->src_port);
+    ipfix_put16(buff + 10, flow->dst_port);
+    buff[13] = flow->tcp_flags;
+  }
+  else {
+    ipfix_put32(buff, flow->dst_addr.s_addr);
+    ipfix_put32(buff + 4, flow->src_addr.s_addr);
+    ipfix_put16(buff + 8, flow->dst_port);
+    ipfix_put16(buff + 10, flow->src_port);
+    buff[13] = flow->rev_tcp_flags;
+  }
+  buff[12] = flow->protocol;
+
+  if (best == NULL) {
+    ipfix_put16(buff + 14, 0);
+    ipfix_put16(buff + 16, 0);
+  }
+  else if (reverse == 0) {
+    ipfix_put16(buff + 14, best->src_int);
+    ipfix_put16(buff + 16, best->dst_int);
+  }
+  else {
+    ipfix_put16(buff + 14, best->dst_int);
+    ipfix_put16(buff + 16, best->src_int);
+  }
+
+  ipfix_put32(buff + 18, flow->start_time);
+  ipfix_put32(buff + 22, flow->end_time);
+
+  if (best == NULL) {
+    memset(buff + 26, 0, IPFIX_RECORD_LEN - 26);
+  }
+  else if (reverse == 0) {
+    ipfix_put64(buff + 26, best->num_packets);
+    ipfix_put64(buff + 34, best->num_bytes);
+    ipfix_put64(buff + 42, best->num_flows);
+    ipfix_put32(buff + 50, best->flow_src);
+  }
+  else {
+    ipfix_put64(buff + 26, best->rev_packets);
+    ipfix_put64(buff + 34, best->rev_bytes);
+    ipfix_put64(buff + 42, best->rev_flows);
+    ipfix_put32(buff + 50, best->flow_src);
+  }
+
+  return IPFIX_RECORD_LEN;
+}
+
+
+static inline char *json_put_str(char *out, const char *str, const int len) {
+
+  memcpy(out, str, len);
+
+  return out + len;
+}
+
+
+static inline char *json_put_u64(char *out, uint64_t val) {
+
+  char digits[20];
+  char *cur = digits + sizeof(digits);
+  int len;
+
+  /* Two digits at a time from the back */
+  while (val >= 100) {
+    cur -= 2;
+    memcpy(cur, json_digit_pairs + ((val % 100) * 2), 2);
+    val /= 100;
+  }
+
+  if (val >= 10) {
+    cur -= 2;
+    memcpy(cur, json_digit_pairs + (val * 2), 2);
+  }
+  else {
+    cur--;
+    *cur = '0' + val;
+  }
+
+  len = digits + sizeof(digits) - cur;
+  memcpy(out, cur, len);
+
+  return out + len;
+}
+
+
+static inline char *json_put_addr(char *out, const uint32_t addr) {
+
+  uint32_t octet;
+  int shift;
+
+  /* Addresses are host order so the first octet is the high byte */
+  for (shift = 24; shift >= 0; shift -= 8) {
+    octet = (addr >> shift) & 0xFF;
+
+    if (octet >= 100) {
+      *out++ = '0' + (octet / 100);
+      memcpy(out, json_digit_pairs + ((octet % 100) * 2), 2);
+      out += 2;
+    }
+    else if (octet >= 10) {
+      memcpy(out, json_digit_pairs + (octet * 2), 2);
+      out += 2;
+    }
+    else {
+      *out++ = '0' + octet;
+    }
+
+    if (shift != 0) {
+      *out++ = '.';
+    }
+  }
+
+  return out;
+}
+
+#define JSON_LIT(out, lit) json_put_str((out), (lit), sizeof(lit) - 1)
+
+
+/* The bins oldest first and the rates over them, rates are whole bits
+ * or packets per second */
+char *json_put_bins(char *out, const struct flow_bins *bins) {
+
+  uint64_t bytes = 0, packets = 0, peak_bytes = 0, peak_packets = 0;
+  int i, slot;
+
+  out = JSON_LIT(out, ",\"bins\":{\"start\":");
+  out = json_put_u64(out, (uint64_t)bins->first * flow_bin_secs);
+  out = JSON_LIT(out, ",\"width\":");
+  out = json_put_u64(out, flow_bin_secs);
+
+  out = JSON_LIT(out, ",\"bytes\":[");
+  for (i = 0; i < bins->count; i++) {
+    slot = (bins->head + i) % FLOW_BINS;
+    if (i != 0) {
+      *out++ = ',';
+    }
+    out = json_put_u64(out, bins->bytes[slot]);
+    bytes += bins->bytes[slot];
+    if (bins->bytes[slot] > peak_bytes) {
+      peak_bytes = bins->bytes[slot];
+    }
+  }
+
+  out = JSON_LIT(out, "],\"packets\":[");
+  for (i = 0; i < bins->count; i++) {
+    slot = (bins->head + i) % FLOW_BINS;
+    if (i != 0) {
+      *out++ = ',';
+    }
+    out = json_put_u64(out, bins->packets[slot]);
+    packets += bins->packets[slot];
+    if (bins->packets[slot] > peak_packets) {
+      peak_packets = bins->packets[slot];
+    }
+  }
+
+  out = JSON_LIT(out, "]},\"peak_bps\":");
+  out = json_put_u64(out, peak_bytes * 8 / flow_bin_secs);
+  out = JSON_LIT(out, ",\"avg_bps\":");
+  out = json_put_u64(out, (bins->count == 0) ? 0 :
+		     bytes * 8 / ((uint64_t)bins->count * flow_bin_secs));
+  out = JSON_LIT(out, ",\"peak_pps\":");
+  out = json_put_u64(out, peak_packets / flow_bin_secs);
+  out = JSON_LIT(out, ",\"avg_pps\":");
+  out = json_put_u64(out, (bins->count == 0) ? 0 :
+		     packets / ((uint64_t)bins->count * flow_bin_secs));
+
+  return out;
+}
+
+
+int encode_flow_json(char *buff, const int buff_size,
+		     const struct flow_summary *flow) {
+
+  struct flow_source_summary *flow_source;
+  char *out = buff;
+  char *end = buff + buff_size;
+
+  /* Not even room for the fixed part */
+  if (buff_size < JSON_FLOW_MAX) {
+    return 0;
+  }
+
+  out = JSON_LIT(out, "{\"src_addr\":\"");
+  out = json_put_addr(out, flow->src_addr.s_addr);
+  out = JSON_LIT(out, "\",\"dst_addr\":\"");
+  out = json_put_addr(out, flow->dst_addr.s_addr);
+  out = JSON_LIT(out, "\",\"protocol\":");
+  out = json_put_u64(out, flow->protocol);
+  out = JSON_LIT(out, ",\"src_port\":");
+  out = json_put_u64(out, flow->src_port);
+  out = JSON_LIT(out, ",\"dst_port\":");
+  out = json_put_u64(out, flow->dst_port);
+  out = JSON_LIT(out, ",\"tcp_flags\":");
+  out = json_put_u64(out, flow->tcp_flags);
+  if (biflow_enabled != 0) {
+    out = JSON_LIT(out, ",\"rev_tcp_flags\":");
+    out = json_put_u64(out, flow->rev_tcp_flags);
+  }
+  out = JSON_LIT(out, ",\"start_time\":");
+  out = json_put_u64(out, (uint32_t)flow->start_time);
+  out = JSON_LIT(out, ",\"end_time\":");
+  out = json_put_u64(out, (uint32_t)flow->end_time);
+  out = JSON_LIT(out, ",\"source_count\":");
+  out = json_put_u64(out, flow->source_count);
+  out = JSON_LIT(out, ",\"source_stats\":[");
+
+  for (flow_source = flow->sources; flow_source != NULL;
+       flow_source = flow_source->next) {
+
+    /* Leave room to close everything off if we have to stop early */
+    if (end - out < JSON_SOURCE_MAX + 32 +
+	((flow_source->bins != NULL) ? JSON_BINS_MAX : 0)) {
+      out = JSON_LIT(out, "],\"truncated\":true}\n");
+      return out - buff;
+    }
+
+    if (flow_source != flow->sources) {
+      *out++ = ',';
+    }
+
+    out = JSON_LIT(out, "{\"flow_source\":\"");
+    out = json_put_addr(out, flow_source->flow_src);
+    out = JSON_LIT(out, "\",\"src_int\":");
+    out = json_put_u64(out, flow_source->src_int);
+    out = JSON_LIT(out, ",\"dst_int\":");
+    out = json_put_u64(out, flow_source->dst_int);
+    out = JSON_LIT(out, ",\"num_packets\":");
+    out = json_put_u64(out, flow_source->num_packets);
+    out = JSON_LIT(out, ",\"num_bytes\":");
+    out = json_put_u64(out, flow_source->num_bytes);
+    out = JSON_LIT(out, ",\"num_flows\":");
+    out = json_put_u64(out, flow_source->num_flows);
+    if (biflow_enabled != 0) {
+      out = JSON_LIT(out, ",\"rev_packets\":");
+      out = json_put_u64(out, flow_source->rev_packets);
+      out = JSON_LIT(out, ",\"rev_bytes\":");
+      out = json_put_u64(out, flow_source->rev_bytes);
+      out = JSON_LIT(out, ",\"rev_flows\":");
+      out = json_put_u64(out, flow_source->rev_flows);
+    }
+    if (flow_source->bins != NULL) {
+      out = json_put_bins(out, flow_source->bins);
+    }
+    *out++ = '}';
+  }
+
+  out = JSON_LIT(out, "]}\n");
+
+  return out - buff;
+}
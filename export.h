@@ -0,0 +1,46 @@
+#ifndef EXPORT_H
+#define EXPORT_H 1
+
+#include <stdint.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Export formats
+ * ===
+ */
+#define EXPORT_JSON 0
+#define EXPORT_BINARY 1
+#define EXPORT_IPFIX 2
+#define EXPORT_FORMATS 3
+
+/* Default max datagram size, -m overrides it */
+#define EXPORT_DGRAM_SIZE 1400
+
+extern int export_format;
+extern const char *export_format_names[EXPORT_FORMATS];
+extern int export_dgram_size;
+
+extern uint64_t stat_export_flows;
+extern uint64_t stat_export_datagrams;
+
+
+/* ===
+ * Export function prototypes
+ * ===
+ */
+int export_init(void);
+void export_flow(const struct flow_summary *);
+void export_summary(const char *, const int);
+void export_flush(void);
+void export_shutdown(void);
+int export_parse_format(const char *);
+int export_format_id(const char *);
+int encode_flow_binary(uint8_t *, const struct flow_summary *);
+int encode_flow_json(char *, const int, const struct flow_summary *);
+int encode_flow_ipfix(uint8_t *, const struct flow_summary *, const int);
+int encode_ipfix_template(uint8_t *);
+int encode_ipfix_template_message(uint8_t *);
+
+#endif /* export.h */
@@ -0,0 +1,260 @@
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "exporter.h"
+#include "metrics.h"
+
+
+/* ===
+ * The registry itself
+ * ===
+ */
+struct exporter exporters[EXPORTER_MAX];
+uint64_t exporter_overflow = 0; /* datagrams from exporters that didn't fit */
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+uint64_t exporter_key(const in_addr_t, const uint8_t, const uint8_t);
+void exporter_name(const struct exporter *, char *, const size_t);
+
+
+uint64_t exporter_key(const in_addr_t addr, const uint8_t engine_type,
+		      const uint8_t engine_id) {
+
+  return ((uint64_t)addr << 32) | EXPORTER_KEY_USED |
+    ((uint64_t)engine_type << 8) | engine_id;
+}
+
+
+struct exporter *exporter_get(const in_addr_t addr, const uint8_t engine_type,
+			      const uint8_t engine_id) {
+
+  uint64_t key = exporter_key(addr, engine_type, engine_id);
+  uint64_t cur, empty;
+  uint32_t slot;
+  int probe;
+
+  slot = (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) &
+    (EXPORTER_MAX - 1);
+
+  for (probe = 0; probe < EXPORTER_MAX; probe++) {
+    cur = __atomic_load_n(&(exporters[slot].key), __ATOMIC_ACQUIRE);
+
+    if (cur == key) {
+      return &(exporters[slot]);
+    }
+
+    /* Claim it, unless someone else just did */
+    if (cur == 0) {
+      empty = 0;
+      if (__atomic_compare_exchange_n(&(exporters[slot].key), &empty, key,
+				      0, __ATOMIC_ACQ_REL,
+				      __ATOMIC_ACQUIRE) != 0) {
+	return &(exporters[slot]);
+      }
+      if (empty == key) {
+	return &(exporters[slot]);
+      }
+    }
+
+    slot = (slot + 1) & (EXPORTER_MAX - 1);
+  }
+
+  __atomic_fetch_add(&exporter_overflow, 1, __ATOMIC_RELAXED);
+
+  return NULL;
+}
+
+
+void exporter_datagram(struct exporter *e, const uint16_t version,
+		       const uint16_t sample_rate, const size_t size,
+		       const time_t recv_time) {
+
+  if (e == NULL) {
+    return;
+  }
+
+  __atomic_fetch_add(&(e->datagrams), 1, __ATOMIC_RELAXED);
+  __atomic_fetch_add(&(e->bytes), size, __ATOMIC_RELAXED);
+  __atomic_store_n(&(e->version), version, __ATOMIC_RELAXED);
+  __atomic_store_n(&(e->sample_rate), sample_rate, __ATOMIC_RELAXED);
+  __atomic_store_n(&(e->last_seen), recv_time, __ATOMIC_RELAXED);
+}
+
+
+/* The header sequence counts flows, so the next datagram should start
+ * where this one's records end */
+void exporter_sequence(struct exporter *e, const uint32_t seq,
+		       const int records) {
+
+  int32_t skipped;
+
+  if (e == NULL) {
+    return;
+  }
+
+  __atomic_fetch_add(&(e->records), records, __ATOMIC_RELAXED);
+
+  if ((e->seq_valid != 0) && (seq != e->next_seq)) {
+    __atomic_fetch_add(&(e->seq_gaps), 1, __ATOMIC_RELAXED);
+
+    /* Going backwards is a restart or reordering, nothing was lost */
+    skipped = (int32_t)(seq - e->next_seq);
+    if (skipped > 0) {
+      __atomic_fetch_add(&(e->seq_lost), skipped, __ATOMIC_RELAXED);
+    }
+  }
+
+  e->next_seq = seq + records;
+  e->seq_valid = 1;
+}
+
+
+void exporter_error(struct exporter *e) {
+
+  if (e == NULL) {
+    return;
+  }
+
+  __atomic_fetch_add(&(e->parse_errors), 1, __ATOMIC_RELAXED);
+}
+
+
+void exporter_name(const struct exporter *e, char *name, const size_t len) {
+
+  struct in_addr addr;
+  uint64_t key = __atomic_load_n(&(e->key), __ATOMIC_ACQUIRE);
+
+  /* The receive loop keeps peer addresses in host order */
+  addr.s_addr = htonl((in_addr_t)(key >> 32));
+  snprintf(name, len, "%s", inet_ntoa(addr));
+}
+
+
+/* ===
+ * Reporting
+ * ===
+ */
+void exporter_report(void) {
+
+  struct exporter *e;
+  char name[INET_ADDRSTRLEN];
+  time_t now = time(NULL);
+  uint64_t key;
+  int slot;
+
+  for (slot = 0; slot < EXPORTER_MAX; slot++) {
+    e = &(exporters[slot]);
+    if ((key = __atomic_load_n(&(e->key), __ATOMIC_ACQUIRE)) == 0) {
+      continue;
+    }
+
+    exporter_name(e, name, sizeof(name));
+    fprintf(stderr, "exporter %s engine %u/%u (v%u): %lu datagrams; "
+	    "%lu records; %lu bytes; %lu errors; %lu sequence gaps "
+	    "(%lu records lost); sampling %u; last seen %ld seconds ago\n",
+	    name, (unsigned int)((key >> 8) & 0xFF),
+	    (unsigned int)(key & 0xFF),
+	    (unsigned int)__atomic_load_n(&(e->version), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(e->datagrams), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(e->records), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(e->bytes), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(e->parse_errors), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(e->seq_gaps), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(e->seq_lost), __ATOMIC_RELAXED),
+	    (unsigned int)__atomic_load_n(&(e->sample_rate), __ATOMIC_RELAXED),
+	    (long)(now - __atomic_load_n(&(e->last_seen), __ATOMIC_RELAXED)));
+  }
+
+  if (exporter_overflow > 0) {
+    fprintf(stderr, "datagrams from exporters past the first %d: %lu\n",
+	    EXPORTER_MAX, __atomic_load_n(&exporter_overflow,
+					  __ATOMIC_RELAXED));
+  }
+}
+
+
+void exporter_metrics(FILE *out) {
+
+  static const struct {
+    const char *name;
+    const char *type;
+    const char *help;
+    size_t offset;
+  } info[] = {
+    {"flowtree_exporter_datagrams_total", "counter",
+     "Datagrams received from each exporter",
+     offsetof(struct exporter, datagrams)},
+    {"flowtree_exporter_bytes_total", "counter",
+     "Datagram bytes received from each exporter",
+     offsetof(struct exporter, bytes)},
+    {"flowtree_exporter_records_total", "counter",
+     "Flow records received from each exporter",
+     offsetof(struct exporter, records)},
+    {"flowtree_exporter_parse_errors_total", "counter",
+     "Datagrams from each exporter that could not be parsed",
+     offsetof(struct exporter, parse_errors)},
+    {"flowtree_exporter_sequence_gaps_total", "counter",
+     "Times each exporter's flow sequence number jumped",
+     offsetof(struct exporter, seq_gaps)},
+    {"flowtree_exporter_sequence_lost_total", "counter",
+     "Flow records each exporter's sequence numbers say were lost",
+     offsetof(struct exporter, seq_lost)},
+    {NULL, NULL, NULL, 0}
+  };
+
+  struct exporter *e;
+  char name[INET_ADDRSTRLEN];
+  uint64_t key;
+  int i, slot;
+
+  for (i = 0; info[i].name != NULL; i++) {
+    metrics_header(out, info[i].name, info[i].type, info[i].help);
+
+    for (slot = 0; slot < EXPORTER_MAX; slot++) {
+      e = &(exporters[slot]);
+      if ((key = __atomic_load_n(&(e->key), __ATOMIC_ACQUIRE)) == 0) {
+	continue;
+      }
+
+      exporter_name(e, name, sizeof(name));
+      fprintf(out, "%s{exporter=\"%s\",engine=\"%u/%u\"} %lu\n",
+	      info[i].name, name, (unsigned int)((key >> 8) & 0xFF),
+	      (unsigned int)(key & 0xFF),
+	      __atomic_load_n((uint64_t *)((char *)e + info[i].offset),
+			      __ATOMIC_RELAXED));
+    }
+  }
+
+  metrics_header(out, "flowtree_exporter_last_seen_seconds", "gauge",
+		 "When each exporter last sent a datagram, unix time");
+  for (slot = 0; slot < EXPORTER_MAX; slot++) {
+    e = &(exporters[slot]);
+    if ((key = __atomic_load_n(&(e->key), __ATOMIC_ACQUIRE)) == 0) {
+      continue;
+    }
+
+    exporter_name(e, name, sizeof(name));
+    fprintf(out, "flowtree_exporter_last_seen_seconds{exporter=\"%s\","
+	    "engine=\"%u/%u\"} %ld\n", name,
+	    (unsigned int)((key >> 8) & 0xFF), (unsigned int)(key & 0xFF),
+	    (long)__atomic_load_n(&(e->last_seen), __ATOMIC_RELAXED));
+  }
+
+  metrics_header(out, "flowtree_exporter_overflow_total", "counter",
+		 "Datagrams from exporters that did not fit in the registry");
+  fprintf(out, "flowtree_exporter_overflow_total %lu\n",
+	  __atomic_load_n(&exporter_overflow, __ATOMIC_RELAXED));
+}
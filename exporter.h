@@ -0,0 +1,63 @@
+#ifndef EXPORTER_H
+#define EXPORTER_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * The exporter registry
+ *
+ * One entry per exporter, keyed by the peer address of its datagrams
+ * and the engine type and id from the NetFlow header (v7 has none, so
+ * those are 0).  Entries live in a fixed open addressing table and are
+ * claimed with a compare and swap on the key, so finding or adding an
+ * exporter never takes a lock.  Entries are never removed.
+ *
+ * The counters are bumped with relaxed atomics and read the same way by
+ * the stats and metrics output.
+ *
+ * NetFlow v5 and v7 have no templates, so the header state kept here
+ * is the version and the v5 sampling interval.
+ * ===
+ */
+#define EXPORTER_MAX 1024 /* must be a power of two */
+
+#define EXPORTER_KEY_USED 0x10000 /* so exporter 0.0.0.0 engine 0 is not 0 */
+
+struct exporter {
+  uint64_t key; /* 0 while the slot is free */
+  uint64_t datagrams;
+  uint64_t bytes;        /* datagram bytes */
+  uint64_t records;
+  uint64_t parse_errors; /* wrong size or unknown format */
+  uint64_t seq_gaps;     /* sequence jumps */
+  uint64_t seq_lost;     /* records the jumps skipped over */
+  uint32_t next_seq;     /* only the receive thread touches it */
+  int seq_valid;
+  uint16_t version;
+  uint16_t sample_rate;  /* v5 sampling interval, 0 if unsampled */
+  time_t last_seen;
+} __attribute__((aligned(CACHE_LINE)));
+
+extern struct exporter exporters[EXPORTER_MAX];
+extern uint64_t exporter_overflow;
+
+
+/* ===
+ * Exporter function prototypes
+ * ===
+ */
+struct exporter *exporter_get(const in_addr_t, const uint8_t, const uint8_t);
+void exporter_datagram(struct exporter *, const uint16_t, const uint16_t,
+		       const size_t, const time_t);
+void exporter_sequence(struct exporter *, const uint32_t, const int);
+void exporter_error(struct exporter *);
+void exporter_report(void);
+void exporter_metrics(FILE *);
+
+#endif /* exporter.h */
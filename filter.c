@@ -0,0 +1,708 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <ctype.h>
+#include <stdint.h>
+
+#include "flowtree.h"
+#include "filter.h"
+
+
+/* ===
+ * The grammar is
+ *
+ *   expr      := and_expr ( ("or" | "||") and_expr )*
+ *   and_expr  := not_expr ( ("and" | "&&") not_expr )*
+ *   not_expr  := ("not" | "!") not_expr | "(" expr ")" | primitive
+ *
+ *   primitive := proto <num|name> | tcp | udp | icmp
+ *              | [src|dst] port <num>[-<num>]
+ *              | [src|dst] interface <num>[-<num>]
+ *              | [src|dst] host|net [in] <range>
+ *              | src|dst [in] <range>
+ *              | exporter [in] <range>
+ *              | tcpflags <num|FSRPAUEC>
+ *
+ * where <range> is anything parse_addr_range() takes.  A primitive
+ * without src or dst matches either side.
+ * ===
+ */
+
+enum filter_node_type {
+  FN_TEST,
+  FN_AND,
+  FN_OR,
+  FN_NOT
+};
+
+struct filter_node {
+  int type;
+  struct filter_insn test;
+  struct filter_node *a;
+  struct filter_node *b;
+};
+
+enum filter_dir {
+  FD_EITHER,
+  FD_SRC,
+  FD_DST
+};
+
+struct filter_parser {
+  const char *pos;
+  char tok[128];
+  char *err;
+  size_t errlen;
+  int failed;
+};
+
+struct filter_gen {
+  struct filter_prog *prog;
+  int *label_pos;
+  int labels;
+  int failed;
+};
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+void filter_error(struct filter_parser *, const char *, ...);
+void filter_next(struct filter_parser *);
+int filter_accept(struct filter_parser *, const char *);
+struct filter_node *filter_new_node(const int, struct filter_node *,
+				    struct filter_node *);
+struct filter_node *filter_new_test(const int, const int, const uint32_t,
+				    const uint32_t);
+struct filter_node *filter_new_either(const int, const int, const int,
+				      const uint32_t, const uint32_t);
+void filter_free_node(struct filter_node *);
+int filter_parse_num_range(struct filter_parser *, const uint32_t,
+			   uint32_t *, uint32_t *);
+struct filter_node *filter_parse_expr(struct filter_parser *);
+struct filter_node *filter_parse_and(struct filter_parser *);
+struct filter_node *filter_parse_not(struct filter_parser *);
+struct filter_node *filter_parse_primitive(struct filter_parser *);
+int filter_count_nodes(const struct filter_node *);
+int filter_new_label(struct filter_gen *);
+void filter_place_label(struct filter_gen *, const int);
+void filter_emit(struct filter_gen *, const struct filter_insn *);
+void filter_gen_node(struct filter_gen *, const struct filter_node *,
+		     const int, const int);
+
+
+void filter_error(struct filter_parser *p, const char *fmt, ...) {
+
+  va_list ap;
+
+  /* Only the first error is interesting */
+  if (p->failed != 0) {
+    return;
+  }
+  p->failed = 1;
+
+  if ((p->err != NULL) && (p->errlen > 0)) {
+    va_start(ap, fmt);
+    vsnprintf(p->err, p->errlen, fmt, ap);
+    va_end(ap);
+  }
+}
+
+
+void filter_next(struct filter_parser *p) {
+
+  int len = 0;
+
+  while (isspace((unsigned char)*(p->pos)) != 0) {
+    p->pos++;
+  }
+
+  /* Single character tokens */
+  if ((*(p->pos) == '(') || (*(p->pos) == ')') || (*(p->pos) == '!')) {
+    p->tok[0] = *(p->pos);
+    p->tok[1] = '\0';
+    p->pos++;
+    return;
+  }
+
+  /* Two character operators */
+  if (((p->pos[0] == '&') && (p->pos[1] == '&')) ||
+      ((p->pos[0] == '|') && (p->pos[1] == '|'))) {
+    p->tok[0] = p->pos[0];
+    p->tok[1] = p->pos[1];
+    p->tok[2] = '\0';
+    p->pos += 2;
+    return;
+  }
+
+  /* Everything else runs to the next space or paren */
+  while ((*(p->pos) != '\0') && (isspace((unsigned char)*(p->pos)) == 0) &&
+	 (*(p->pos) != '(') && (*(p->pos) != ')')) {
+    if (len < (int)sizeof(p->tok) - 1) {
+      p->tok[len++] = *(p->pos);
+    }
+    p->pos++;
+  }
+  p->tok[len] = '\0';
+}
+
+
+int filter_accept(struct filter_parser *p, const char *word) {
+
+  if (strcasecmp(p->tok, word) == 0) {
+    filter_next(p);
+    return 1;
+  }
+
+  return 0;
+}
+
+
+struct filter_node *filter_new_node(const int type, struct filter_node *a,
+				    struct filter_node *b) {
+
+  struct filter_node *node;
+
+  node = calloc(1, sizeof(struct filter_node));
+  if (node == NULL) {
+    filter_free_node(a);
+    filter_free_node(b);
+    return NULL;
+  }
+
+  node->type = type;
+  node->a = a;
+  node->b = b;
+
+  return node;
+}
+
+
+struct filter_node *filter_new_test(const int op, const int field,
+				    const uint32_t lo, const uint32_t hi) {
+
+  struct filter_node *node;
+
+  node = filter_new_node(FN_TEST, NULL, NULL);
+  if (node == NULL) {
+    return NULL;
+  }
+
+  node->test.op = op;
+  node->test.field = field;
+  node->test.lo = lo;
+  node->test.hi = hi;
+
+  return node;
+}
+
+
+struct filter_node *filter_new_either(const int dir, const int src_field,
+				      const int dst_field, const uint32_t lo,
+				      const uint32_t hi) {
+
+  if (dir == FD_SRC) {
+    return filter_new_test(FOP_RANGE, src_field, lo, hi);
+  }
+  else if (dir == FD_DST) {
+    return filter_new_test(FOP_RANGE, dst_field, lo, hi);
+  }
+  else {
+    return filter_new_node(FN_OR,
+			   filter_new_test(FOP_RANGE, src_field, lo, hi),
+			   filter_new_test(FOP_RANGE, dst_field, lo, hi));
+  }
+}
+
+
+void filter_free_node(struct filter_node *node) {
+
+  if (node == NULL) {
+    return;
+  }
+
+  filter_free_node(node->a);
+  filter_free_node(node->b);
+  free(node);
+}
+
+
+int filter_parse_num_range(struct filter_parser *p, const uint32_t max,
+			   uint32_t *lo, uint32_t *hi) {
+
+  char *end;
+  unsigned long val;
+
+  /* Either N or N-M */
+  val = strtoul(p->tok, &end, 10);
+  if ((end == p->tok) || (val > max)) {
+    filter_error(p, "bad number '%s'", p->tok);
+    return -1;
+  }
+  *lo = val;
+  *hi = val;
+
+  if (*end == '-') {
+    val = strtoul(end + 1, &end, 10);
+    if ((val > max) || (val < *lo)) {
+      filter_error(p, "bad range '%s'", p->tok);
+      return -1;
+    }
+    *hi = val;
+  }
+
+  if (*end != '\0') {
+    filter_error(p, "bad number '%s'", p->tok);
+    return -1;
+  }
+
+  filter_next(p);
+
+  return 0;
+}
+
+
+struct filter_node *filter_parse_expr(struct filter_parser *p) {
+
+  struct filter_node *node;
+
+  node = filter_parse_and(p);
+
+  while ((p->failed == 0) &&
+	 ((filter_accept(p, "or") != 0) || (filter_accept(p, "||") != 0))) {
+    node = filter_new_node(FN_OR, node, filter_parse_and(p));
+  }
+
+  return node;
+}
+
+
+struct filter_node *filter_parse_and(struct filter_parser *p) {
+
+  struct filter_node *node;
+
+  node = filter_parse_not(p);
+
+  while ((p->failed == 0) &&
+	 ((filter_accept(p, "and") != 0) || (filter_accept(p, "&&") != 0))) {
+    node = filter_new_node(FN_AND, node, filter_parse_not(p));
+  }
+
+  return node;
+}
+
+
+struct filter_node *filter_parse_not(struct filter_parser *p) {
+
+  struct filter_node *node;
+
+  if ((filter_accept(p, "not") != 0) || (filter_accept(p, "!") != 0)) {
+    return filter_new_node(FN_NOT, filter_parse_not(p), NULL);
+  }
+
+  if (filter_accept(p, "(") != 0) {
+    node = filter_parse_expr(p);
+
+    if (filter_accept(p, ")") == 0) {
+      filter_error(p, "expected ')' but got '%s'", p->tok);
+    }
+
+    return node;
+  }
+
+  return filter_parse_primitive(p);
+}
+
+
+struct filter_node *filter_parse_primitive(struct filter_parser *p) {
+
+  int dir = FD_EITHER;
+  uint32_t lo, hi;
+  in_addr_t addr_start, addr_end;
+  const char *flag_chars = "FSRPAUEC";
+  const char *flag;
+  char *end;
+  int i;
+
+  if (p->tok[0] == '\0') {
+    filter_error(p, "unexpected end of filter");
+    return NULL;
+  }
+
+  if (filter_accept(p, "src") != 0) {
+    dir = FD_SRC;
+  }
+  else if (filter_accept(p, "dst") != 0) {
+    dir = FD_DST;
+  }
+
+  /* === Protocol === */
+  if ((dir == FD_EITHER) && (filter_accept(p, "proto") != 0)) {
+    if (strcasecmp(p->tok, "tcp") == 0) {
+      lo = 6;
+    }
+    else if (strcasecmp(p->tok, "udp") == 0) {
+      lo = 17;
+    }
+    else if (strcasecmp(p->tok, "icmp") == 0) {
+      lo = 1;
+    }
+    else {
+      if (filter_parse_num_range(p, 255, &lo, &hi) != 0) {
+	return NULL;
+      }
+      return filter_new_test(FOP_RANGE, FF_PROTO, lo, hi);
+    }
+
+    filter_next(p);
+    return filter_new_test(FOP_RANGE, FF_PROTO, lo, lo);
+  }
+  if (dir == FD_EITHER) {
+    if (filter_accept(p, "tcp") != 0) {
+      return filter_new_test(FOP_RANGE, FF_PROTO, 6, 6);
+    }
+    if (filter_accept(p, "udp") != 0) {
+      return filter_new_test(FOP_RANGE, FF_PROTO, 17, 17);
+    }
+    if (filter_accept(p, "icmp") != 0) {
+      return filter_new_test(FOP_RANGE, FF_PROTO, 1, 1);
+    }
+  }
+
+  /* === Ports === */
+  if (filter_accept(p, "port") != 0) {
+    if (filter_parse_num_range(p, 65535, &lo, &hi) != 0) {
+      return NULL;
+    }
+    return filter_new_either(dir, FF_SRC_PORT, FF_DST_PORT, lo, hi);
+  }
+
+  /* === Interfaces === */
+  if ((filter_accept(p, "interface") != 0) ||
+      (filter_accept(p, "int") != 0)) {
+    if (filter_parse_num_range(p, 65535, &lo, &hi) != 0) {
+      return NULL;
+    }
+    return filter_new_either(dir, FF_SRC_INT, FF_DST_INT, lo, hi);
+  }
+
+  /* === Exporter === */
+  if ((dir == FD_EITHER) && (filter_accept(p, "exporter") != 0)) {
+    filter_accept(p, "in");
+
+    if (parse_addr_range(p->tok, &addr_start, &addr_end) != 0) {
+      filter_error(p, "bad address range '%s'", p->tok);
+      return NULL;
+    }
+    filter_next(p);
+
+    return filter_new_test(FOP_RANGE, FF_EXPORTER, addr_start, addr_end);
+  }
+
+  /* === TCP flags, all of the given ones must be set === */
+  if ((dir == FD_EITHER) && (filter_accept(p, "tcpflags") != 0)) {
+    lo = strtoul(p->tok, &end, 0);
+
+    if ((end == p->tok) || (*end != '\0') || (lo > 0xFF)) {
+      /* Not a number so try flag letters */
+      lo = 0;
+      for (i = 0; p->tok[i] != '\0'; i++) {
+	if ((flag = strchr(flag_chars, toupper((unsigned char)p->tok[i])))
+	    == NULL) {
+	  filter_error(p, "bad tcp flags '%s'", p->tok);
+	  return NULL;
+	}
+	lo |= 1 << (flag - flag_chars);
+      }
+    }
+    filter_next(p);
+
+    return filter_new_test(FOP_BITS, FF_TCP_FLAGS, lo, 0);
+  }
+
+  /* === Addresses === */
+  if ((filter_accept(p, "host") != 0) || (filter_accept(p, "net") != 0) ||
+      (dir != FD_EITHER)) {
+    filter_accept(p, "in");
+
+    if (parse_addr_range(p->tok, &addr_start, &addr_end) != 0) {
+      filter_error(p, "bad address range '%s'", p->tok);
+      return NULL;
+    }
+    filter_next(p);
+
+    return filter_new_either(dir, FF_SRC_ADDR, FF_DST_ADDR,
+			     addr_start, addr_end);
+  }
+
+  filter_error(p, "unexpected '%s'", p->tok);
+
+  return NULL;
+}
+
+
+int filter_count_nodes(const struct filter_node *node) {
+
+  if (node == NULL) {
+    return 0;
+  }
+
+  return 1 + filter_count_nodes(node->a) + filter_count_nodes(node->b);
+}
+
+
+int filter_new_label(struct filter_gen *g) {
+
+  g->label_pos[g->labels] = -1;
+
+  return g->labels++;
+}
+
+
+void filter_place_label(struct filter_gen *g, const int label) {
+  g->label_pos[label] = g->prog->len;
+}
+
+
+void filter_emit(struct filter_gen *g, const struct filter_insn *insn) {
+
+  if (g->prog->len >= FILTER_MAX_INSNS) {
+    g->failed = 1;
+    return;
+  }
+
+  g->prog->insns[g->prog->len] = *insn;
+  g->prog->len++;
+}
+
+
+void filter_gen_node(struct filter_gen *g, const struct filter_node *node,
+		     const int l_true, const int l_false) {
+
+  struct filter_insn insn;
+  int l_mid;
+
+  /* Only happens if building the tree ran out of memory */
+  if (node == NULL) {
+    g->failed = 1;
+    return;
+  }
+
+  /* Jump targets are label numbers here, they get fixed up later */
+  switch (node->type) {
+  case FN_TEST:
+    insn = node->test;
+    insn.jt = l_true;
+    insn.jf = l_false;
+    filter_emit(g, &insn);
+    break;
+
+  case FN_NOT:
+    filter_gen_node(g, node->a, l_false, l_true);
+    break;
+
+  case FN_AND:
+    l_mid = filter_new_label(g);
+    filter_gen_node(g, node->a, l_mid, l_false);
+    filter_place_label(g, l_mid);
+    filter_gen_node(g, node->b, l_true, l_false);
+    break;
+
+  case FN_OR:
+    l_mid = filter_new_label(g);
+    filter_gen_node(g, node->a, l_true, l_mid);
+    filter_place_label(g, l_mid);
+    filter_gen_node(g, node->b, l_true, l_false);
+    break;
+  }
+}
+
+
+struct filter_prog *filter_compile(const char *expr, char *err,
+				   const size_t errlen) {
+
+  struct filter_parser p;
+  struct filter_gen g;
+  struct filter_node *root = NULL;
+  struct filter_insn insn;
+  int l_accept, l_reject;
+  int nodes;
+  int i;
+
+  memset(&p, 0, sizeof(p));
+  p.pos = expr;
+  p.err = err;
+  p.errlen = errlen;
+
+  /* === Parse === */
+  filter_next(&p);
+  if (p.tok[0] != '\0') {
+    root = filter_parse_expr(&p);
+
+    if ((p.failed == 0) && (p.tok[0] != '\0')) {
+      filter_error(&p, "unexpected '%s'", p.tok);
+    }
+    if ((p.failed == 0) && (root == NULL)) {
+      filter_error(&p, "out of memory");
+    }
+    if (p.failed != 0) {
+      filter_free_node(root);
+      return NULL;
+    }
+  }
+
+  /* === Generate the jump program === */
+  nodes = filter_count_nodes(root);
+
+  memset(&g, 0, sizeof(g));
+  g.prog = calloc(1, sizeof(struct filter_prog) +
+		  (nodes + 2) * sizeof(struct filter_insn));
+  g.label_pos = malloc((nodes + 2) * sizeof(int));
+  if ((g.prog == NULL) || (g.label_pos == NULL)) {
+    snprintf(err, errlen, "out of memory");
+    free(g.prog);
+    free(g.label_pos);
+    filter_free_node(root);
+    return NULL;
+  }
+
+  l_accept = filter_new_label(&g);
+  l_reject = filter_new_label(&g);
+
+  if (root != NULL) {
+    filter_gen_node(&g, root, l_accept, l_reject);
+  }
+
+  memset(&insn, 0, sizeof(insn));
+  insn.op = FOP_RET;
+
+  filter_place_label(&g, l_accept);
+  insn.lo = 1;
+  filter_emit(&g, &insn);
+
+  filter_place_label(&g, l_reject);
+  insn.lo = 0;
+  filter_emit(&g, &insn);
+
+  filter_free_node(root);
+
+  if (g.failed != 0) {
+    snprintf(err, errlen, "unable to generate the filter program");
+    free(g.label_pos);
+    free(g.prog);
+    return NULL;
+  }
+
+  /* Now turn the labels into instruction numbers */
+  for (i = 0; i < g.prog->len; i++) {
+    if (g.prog->insns[i].op != FOP_RET) {
+      g.prog->insns[i].jt = g.label_pos[g.prog->insns[i].jt];
+      g.prog->insns[i].jf = g.label_pos[g.prog->insns[i].jf];
+    }
+  }
+  free(g.label_pos);
+
+  g.prog->source = strdup(expr);
+
+  return g.prog;
+}
+
+
+struct filter_prog *filter_load_file(const char *path, char *err,
+				     const size_t errlen) {
+
+  struct filter_prog *prog;
+  FILE *filter_fh;
+  char line[1024];
+  char *expr = NULL;
+  char *cur;
+  size_t expr_len = 0;
+
+  if ((filter_fh = fopen(path, "r")) == NULL) {
+    snprintf(err, errlen, "unable to open %s", path);
+    return NULL;
+  }
+
+  /* The whole file is one expression, # starts a comment */
+  while (fgets(line, sizeof(line), filter_fh) != NULL) {
+    if ((cur = strchr(line, '#')) != NULL) {
+      *cur = '\0';
+    }
+
+    cur = realloc(expr, expr_len + strlen(line) + 2);
+    if (cur == NULL) {
+      free(expr);
+      fclose(filter_fh);
+      snprintf(err, errlen, "out of memory");
+      return NULL;
+    }
+    expr = cur;
+
+    strcpy(expr + expr_len, line);
+    expr_len += strlen(line);
+    expr[expr_len++] = ' ';
+    expr[expr_len] = '\0';
+  }
+  fclose(filter_fh);
+
+  prog = filter_compile((expr == NULL) ? "" : expr, err, errlen);
+  free(expr);
+
+  return prog;
+}
+
+
+int filter_match(const struct filter_prog *prog,
+		 const struct unified_flow *flow) {
+
+  const struct filter_insn *insn;
+  uint32_t vals[FF_TCP_FLAGS + 1];
+  uint32_t val;
+  int pc = 0;
+
+  /* Pull the fields out once so each test is just an indexed load */
+  vals[FF_PROTO] = flow->protocol;
+  vals[FF_SRC_ADDR] = flow->src_addr.s_addr;
+  vals[FF_DST_ADDR] = flow->dst_addr.s_addr;
+  vals[FF_SRC_PORT] = flow->src_port;
+  vals[FF_DST_PORT] = flow->dst_port;
+  vals[FF_EXPORTER] = flow->flow_src;
+  vals[FF_SRC_INT] = flow->src_int;
+  vals[FF_DST_INT] = flow->dst_int;
+  vals[FF_TCP_FLAGS] = flow->tcp_flags;
+
+  /* All jumps go forward so this always ends at a RET */
+  for (;;) {
+    insn = &(prog->insns[pc]);
+    val = vals[insn->field];
+
+    if (insn->op == FOP_RANGE) {
+      pc = ((val - insn->lo) <= (insn->hi - insn->lo)) ? insn->jt : insn->jf;
+    }
+    else if (insn->op == FOP_BITS) {
+      pc = ((val & insn->lo) == insn->lo) ? insn->jt : insn->jf;
+    }
+    else {
+      return insn->lo;
+    }
+  }
+}
+
+
+void filter_free(struct filter_prog *prog) {
+
+  if (prog == NULL) {
+    return;
+  }
+
+  free(prog->source);
+  free(prog);
+}
+
+
+void filter_free_rcu(void *prog) {
+  filter_free((struct filter_prog *)prog);
+}
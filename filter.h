@@ -0,0 +1,65 @@
+#ifndef FILTER_H
+#define FILTER_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Compiled flow filters
+ *
+ * An expression like "not (proto 17 and dst port 53)" is compiled into
+ * a flat program of tests.  Every test checks one field of the unified
+ * flow and jumps to jt if it matched or jf if it didn't, a RET insn ends
+ * the program with its verdict in lo (1 = keep, 0 = drop).
+ * ===
+ */
+enum filter_field {
+  FF_PROTO,
+  FF_SRC_ADDR,
+  FF_DST_ADDR,
+  FF_SRC_PORT,
+  FF_DST_PORT,
+  FF_EXPORTER,
+  FF_SRC_INT,
+  FF_DST_INT,
+  FF_TCP_FLAGS
+};
+
+enum filter_op {
+  FOP_RANGE, /* lo <= field <= hi */
+  FOP_BITS,  /* (field & lo) == lo */
+  FOP_RET    /* return lo */
+};
+
+struct filter_insn {
+  uint8_t op;
+  uint8_t field;
+  uint16_t jt;
+  uint16_t jf;
+  uint32_t lo;
+  uint32_t hi;
+};
+
+#define FILTER_MAX_INSNS 4096
+
+struct filter_prog {
+  int len;
+  char *source;
+  struct filter_insn insns[];
+};
+
+
+/* ===
+ * Filter function prototypes
+ * ===
+ */
+struct filter_prog *filter_compile(const char *, char *, const size_t);
+struct filter_prog *filter_load_file(const char *, char *, const size_t);
+int filter_match(const struct filter_prog *, const struct unified_flow *);
+void filter_free(struct filter_prog *);
+void filter_free_rcu(void *);
+
+#endif /* filter.h */
@@ -0,0 +1,210 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ftbin.h"
+#include "ftshm.h"
+
+
+/* ===
+ * flowtree-decode
+ *
+ * Reference consumer of the binary export format.  Listens where
+ * flowtree sends (or wherever -l/-p say) and prints every flow as a
+ * line of text.  With -S it reads a shm sink's ring instead.
+ * ===
+ */
+#define LISTENADDR "127.0.0.1"
+#define LISTENPORT 2056
+#define RECVBUFFSIZE 65536
+
+
+/* ===
+ * Function prototypes
+ * ===
+ */
+int main(int, char * const []);
+void format_addr(char *, const uint32_t);
+void decode_datagram(const uint8_t *, const size_t);
+int read_ring(const char *);
+
+
+int main(int argc, char * const argv[]) {
+
+  struct sockaddr_in bind_addrin;
+  const char *listen_addr = LISTENADDR;
+  const char *ring = NULL;
+  int listen_port = LISTENPORT;
+  uint8_t buffer[RECVBUFFSIZE];
+  ssize_t msgsize;
+  int sock_fh;
+  int opt;
+
+  while ((opt = getopt(argc, argv, "l:p:S:h")) != -1) {
+    switch (opt) {
+    case 'l':
+      listen_addr = optarg;
+      break;
+    case 'p':
+      listen_port = atoi(optarg);
+      break;
+    case 'S':
+      ring = optarg;
+      break;
+    default:
+      fprintf(stderr, "usage: %s [-l addr] [-p port] [-S shm name]\n",
+	      argv[0]);
+      return (opt == 'h') ? 0 : 1;
+    }
+  }
+
+  if (ring != NULL) {
+    return read_ring(ring);
+  }
+
+  if ((sock_fh = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    perror("socket");
+    return 1;
+  }
+
+  memset(&bind_addrin, 0, sizeof(bind_addrin));
+  bind_addrin.sin_family = AF_INET;
+  bind_addrin.sin_port = htons(listen_port);
+  bind_addrin.sin_addr.s_addr = inet_addr(listen_addr);
+
+  if (bind(sock_fh, (const struct sockaddr *)&bind_addrin,
+	   sizeof(bind_addrin)) == -1) {
+    perror("bind");
+    return 1;
+  }
+
+  while ((msgsize = recv(sock_fh, buffer, sizeof(buffer), 0)) >= 0) {
+    decode_datagram(buffer, msgsize);
+    fflush(stdout);
+  }
+
+  perror("recv");
+  close(sock_fh);
+
+  return 1;
+}
+
+
+void format_addr(char *out, const uint32_t addr) {
+
+  sprintf(out, "%u.%u.%u.%u", (addr >> 24) & 0xFF, (addr >> 16) & 0xFF,
+	  (addr >> 8) & 0xFF, addr & 0xFF);
+}
+
+
+void decode_datagram(const uint8_t *buff, const size_t len) {
+
+  struct ftbin_header header;
+  struct ftbin_flow *flow;
+  char src[16], dst[16], exporter[16];
+  size_t offset;
+  int header_len;
+  int record_len;
+  int i, j;
+
+  if ((header_len = ftbin_decode_header(buff, len, &header)) <= 0) {
+    fprintf(stderr, "Not a flowtree binary datagram (%d bytes)\n", (int)len);
+    return;
+  }
+  offset = header_len;
+
+  flow = malloc(sizeof(struct ftbin_flow));
+  if (flow == NULL) {
+    return;
+  }
+
+  printf("# datagram seq=%u time=%u flows=%u\n", header.sequence,
+	 header.export_time, header.count);
+
+  for (i = 0; i < header.count; i++) {
+    if ((record_len = ftbin_decode_flow(buff + offset, len - offset,
+					flow)) <= 0) {
+      fprintf(stderr, "Truncated flow record %d\n", i);
+      break;
+    }
+    offset += record_len;
+
+    format_addr(src, flow->src_addr);
+    format_addr(dst, flow->dst_addr);
+    printf("%s:%u -> %s:%u proto=%u flags=0x%02x start=%u end=%u "
+	   "sources=%u\n", src, flow->src_port, dst, flow->dst_port,
+	   flow->protocol, flow->tcp_flags, flow->start_time, flow->end_time,
+	   flow->source_count);
+
+    if ((flow->flags & FTBIN_FLAG_BIFLOW) != 0) {
+      printf("\trev_flags=0x%02x\n", flow->rev_tcp_flags);
+    }
+
+    for (j = 0; j < flow->source_count; j++) {
+      format_addr(exporter, flow->sources[j].flow_src);
+      printf("\t%s in=%u out=%u packets=%lu bytes=%lu flows=%lu\n",
+	     exporter, flow->sources[j].src_int, flow->sources[j].dst_int,
+	     flow->sources[j].num_packets, flow->sources[j].num_bytes,
+	     flow->sources[j].num_flows);
+      if ((flow->flags & FTBIN_FLAG_BIFLOW) != 0) {
+	printf("\t%s rev packets=%lu bytes=%lu flows=%lu\n", exporter,
+	       flow->sources[j].rev_packets, flow->sources[j].rev_bytes,
+	       flow->sources[j].rev_flows);
+      }
+    }
+  }
+
+  free(flow);
+}
+
+
+int read_ring(const char *name) {
+
+  struct ftshm_reader reader;
+  struct timespec sleep_time;
+  const uint8_t *data;
+  uint32_t len;
+  uint64_t overruns = 0;
+
+  if (ftshm_attach(name, &reader) != 0) {
+    fprintf(stderr, "Unable to attach to shared memory ring %s\n", name);
+    return 1;
+  }
+
+  sleep_time.tv_sec = 0;
+  sleep_time.tv_nsec = 1000000;
+
+  for (;;) {
+    /* Nothing new, poll again in a millisecond */
+    if (ftshm_next(&reader, &data, &len) == 0) {
+      fflush(stdout);
+      nanosleep(&sleep_time, NULL);
+      continue;
+    }
+
+    /* Decoded straight out of the ring */
+    decode_datagram(data, len);
+
+    if (ftshm_done(&reader) != 0) {
+      printf("# datagram was overwritten while it was read, ignore it\n");
+    }
+
+    if (reader.overruns != overruns) {
+      fprintf(stderr, "Fell behind, %lu datagrams lost so far (lag %lu)\n",
+	      reader.overruns, ftshm_lag(&reader));
+      overruns = reader.overruns;
+    }
+  }
+
+  ftshm_detach(&reader);
+
+  return 0;
+}
@@ -0,0 +1,1023 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <time.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "ftbin.h"
+#include "ftcol.h"
+
+
+/* ===
+ * flowtree-query
+ *
+ * Scans columnar archive segments (archive:<dir>,columnar=1) for rows
+ * matching a set of predicates and prints totals or the top groups.
+ * Segments are mmapped and blocks are handed out to worker threads;
+ * a block is skipped on its index (min/max, then bloom filters for
+ * exact matches) before any column is touched, and then only the
+ * columns the query needs are decoded.  Predicates are all ranges and
+ * are evaluated a vector of rows at a time.
+ *
+ * A flow seen by several exporters has a row for each of them.  Unless
+ * the query is about exporters (-e, or -g exporter) only the primary
+ * row of each flow is counted, so a flow's bytes aren't added up once
+ * per exporter that saw it.
+ *
+ * Top talkers to a /24 over the last 6 hours:
+ *
+ *   flowtree-query -d 10.1.2.0/24 -l 6h -g src_addr -n 20 /archive
+ * ===
+ */
+#define QUERY_MAX_PREDS 16
+#define QUERY_MAX_THREADS 64
+#define QUERY_TOP 10
+
+/* Metrics groups are ranked by */
+#define METRIC_BYTES 0
+#define METRIC_PACKETS 1
+#define METRIC_FLOWS 2
+#define METRIC_ROWS 3
+#define METRICS 4
+
+/* Vectors of rows for the predicate scans, 4 x u64 (AVX2 and up) */
+#define QVEC_LANES 4
+typedef uint64_t qvec __attribute__((vector_size(QVEC_LANES * 8)));
+
+
+/* A predicate is always lo <= column <= hi */
+struct query_pred {
+  int col;
+  uint64_t lo;
+  uint64_t hi;
+};
+
+struct query_segment {
+  char *path;
+  const uint8_t *data;
+  size_t len;
+  struct ftcol_file file;
+};
+
+struct query_work {
+  struct query_segment *seg;
+  uint32_t block;
+};
+
+struct agg_entry {
+  uint64_t key;
+  uint64_t sums[METRICS];
+  int used;
+};
+
+struct agg_table {
+  struct agg_entry *entries;
+  uint64_t mask;
+  uint64_t count;
+};
+
+struct query_thread {
+  pthread_t thread;
+  struct agg_table table;
+  uint64_t totals[METRICS];
+
+  /* Per thread stats */
+  uint64_t blocks;
+  uint64_t skipped_minmax;
+  uint64_t skipped_bloom;
+  uint64_t rows;
+  uint64_t errors;
+
+  /* Decoded columns and the selection, 64 byte aligned */
+  uint64_t *cols[FTCOL_COLUMNS];
+  uint64_t *sel;
+};
+
+
+/* ===
+ * The query, set up by main and read only after that
+ * ===
+ */
+struct query_pred preds[QUERY_MAX_PREDS];
+int pred_count = 0;
+int group_col = -1;
+uint64_t group_mask = ~(uint64_t)0;
+int group_bits = 32;
+int rank_metric = METRIC_BYTES;
+
+struct query_segment *segments = NULL;
+int segment_count = 0;
+struct query_work *work = NULL;
+uint64_t work_count = 0;
+uint64_t work_next = 0;
+
+
+/* ===
+ * Function prototypes
+ * ===
+ */
+int main(int, char * const []);
+void usage(const char *);
+int add_pred(const int, const uint64_t, const uint64_t);
+int parse_prefix(const char *, uint64_t *, uint64_t *);
+int parse_range(const char *, const uint64_t, uint64_t *, uint64_t *);
+int parse_duration(const char *, uint64_t *);
+int parse_time(const char *, uint64_t *);
+int find_column(const char *);
+int add_path(const char *);
+int add_segment(const char *);
+void *thread_query(void *);
+void query_block(struct query_thread *, const struct query_work *);
+int block_skip(const struct ftcol_block *, int *);
+uint64_t scan_range(const uint64_t *, uint64_t *, const uint32_t,
+		    const uint64_t, const uint64_t, const int);
+int agg_init(struct agg_table *, const uint64_t);
+struct agg_entry *agg_find(struct agg_table *, const uint64_t);
+void agg_merge(struct agg_table *, const struct agg_table *);
+void top_groups(const struct agg_table *, const int);
+void format_key(char *, const size_t, const uint64_t);
+int is_addr_column(const int);
+
+
+int main(int argc, char * const argv[]) {
+
+  struct query_thread *threads;
+  struct agg_table merged;
+  struct timespec start_time, end_time;
+  uint64_t lo, hi, secs;
+  uint64_t totals[METRICS] = {0, 0, 0, 0};
+  uint64_t blocks = 0, skipped_minmax = 0, skipped_bloom = 0;
+  uint64_t rows = 0, errors = 0, mapped = 0;
+  double elapsed;
+  char *slash;
+  int thread_count;
+  int top = QUERY_TOP;
+  int opt;
+  int i, b, m;
+
+  thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+  while ((opt = getopt(argc, argv, "s:d:e:S:D:P:t:T:l:g:o:n:j:h")) != -1) {
+    switch (opt) {
+    case 's':
+    case 'd':
+    case 'e':
+      if (parse_prefix(optarg, &lo, &hi) != 0) {
+	fprintf(stderr, "Bad address or prefix %s\n", optarg);
+	return 1;
+      }
+      add_pred((opt == 's') ? FTCOL_SRC_ADDR :
+	       ((opt == 'd') ? FTCOL_DST_ADDR : FTCOL_EXPORTER), lo, hi);
+      break;
+    case 'S':
+    case 'D':
+      if (parse_range(optarg, 65535, &lo, &hi) != 0) {
+	fprintf(stderr, "Bad port or port range %s\n", optarg);
+	return 1;
+      }
+      add_pred((opt == 'S') ? FTCOL_SRC_PORT : FTCOL_DST_PORT, lo, hi);
+      break;
+    case 'P':
+      if (parse_range(optarg, 255, &lo, &hi) != 0) {
+	fprintf(stderr, "Bad protocol %s\n", optarg);
+	return 1;
+      }
+      add_pred(FTCOL_PROTOCOL, lo, hi);
+      break;
+    case 't':
+      /* Flows that were still going at or after this time */
+      if (parse_time(optarg, &secs) != 0) {
+	fprintf(stderr, "Bad time %s, want seconds since the epoch\n", optarg);
+	return 1;
+      }
+      add_pred(FTCOL_END_TIME, secs, UINT32_MAX);
+      break;
+    case 'T':
+      /* Flows that had started by this time */
+      if (parse_time(optarg, &secs) != 0) {
+	fprintf(stderr, "Bad time %s, want seconds since the epoch\n", optarg);
+	return 1;
+      }
+      add_pred(FTCOL_START_TIME, 0, secs);
+      break;
+    case 'l':
+      if (parse_duration(optarg, &secs) != 0) {
+	fprintf(stderr, "Bad duration %s\n", optarg);
+	return 1;
+      }
+      add_pred(FTCOL_END_TIME, time(NULL) - secs, UINT32_MAX);
+      break;
+    case 'g':
+      if ((slash = strchr(optarg, '/')) != NULL) {
+	*(slash++) = '\0';
+      }
+      if ((group_col = find_column(optarg)) < 0) {
+	fprintf(stderr, "Unknown column %s\n", optarg);
+	return 1;
+      }
+      if (slash != NULL) {
+	group_bits = atoi(slash);
+	if ((!is_addr_column(group_col)) || (group_bits < 0) ||
+	    (group_bits > 32)) {
+	  fprintf(stderr, "Prefix lengths only work on address columns\n");
+	  return 1;
+	}
+	group_mask = (group_bits == 0) ? 0 :
+	  (0xFFFFFFFFULL << (32 - group_bits)) & 0xFFFFFFFFULL;
+      }
+      break;
+    case 'o':
+      if (strcmp(optarg, "bytes") == 0) {
+	rank_metric = METRIC_BYTES;
+      }
+      else if (strcmp(optarg, "packets") == 0) {
+	rank_metric = METRIC_PACKETS;
+      }
+      else if (strcmp(optarg, "flows") == 0) {
+	rank_metric = METRIC_FLOWS;
+      }
+      else if (strcmp(optarg, "rows") == 0) {
+	rank_metric = METRIC_ROWS;
+      }
+      else {
+	fprintf(stderr, "Unknown metric %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 'n':
+      top = atoi(optarg);
+      break;
+    case 'j':
+      thread_count = atoi(optarg);
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  if (optind >= argc) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* Count each flow once, unless it's each exporter's view we want */
+  for (i = 0; i < pred_count; i++) {
+    if (preds[i].col == FTCOL_EXPORTER) {
+      break;
+    }
+  }
+  if ((i == pred_count) && (group_col != FTCOL_EXPORTER)) {
+    add_pred(FTCOL_PRIMARY, 1, 1);
+  }
+
+  if (thread_count < 1) {
+    thread_count = 1;
+  }
+  if (thread_count > QUERY_MAX_THREADS) {
+    thread_count = QUERY_MAX_THREADS;
+  }
+
+  /* === Map every segment and list its blocks === */
+  for (i = optind; i < argc; i++) {
+    if (add_path(argv[i]) != 0) {
+      return 1;
+    }
+  }
+
+  for (i = 0; i < segment_count; i++) {
+    work_count += segments[i].file.blocks;
+    mapped += segments[i].len;
+  }
+
+  if ((work = malloc((work_count + 1) * sizeof(struct query_work))) == NULL) {
+    fprintf(stderr, "Unable to allocate the work list\n");
+    return 1;
+  }
+  work_count = 0;
+  for (i = 0; i < segment_count; i++) {
+    for (b = 0; b < segments[i].file.blocks; b++) {
+      work[work_count].seg = &(segments[i]);
+      work[work_count].block = b;
+      work_count++;
+    }
+  }
+
+  /* === Run it === */
+  if ((threads = calloc(thread_count, sizeof(struct query_thread))) == NULL) {
+    return 1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start_time);
+
+  for (i = 0; i < thread_count; i++) {
+    for (b = 0; b < FTCOL_COLUMNS; b++) {
+      if (posix_memalign((void **)&(threads[i].cols[b]), 64,
+			 (FTCOL_BLOCK_ROWS + QVEC_LANES) *
+			 sizeof(uint64_t)) != 0) {
+	return 1;
+      }
+    }
+    if ((posix_memalign((void **)&(threads[i].sel), 64,
+			(FTCOL_BLOCK_ROWS + QVEC_LANES) *
+			sizeof(uint64_t)) != 0) ||
+	(agg_init(&(threads[i].table), 1024) != 0)) {
+      fprintf(stderr, "Unable to allocate thread buffers\n");
+      return 1;
+    }
+
+    if (pthread_create(&(threads[i].thread), NULL, thread_query,
+		       &(threads[i])) != 0) {
+      fprintf(stderr, "Unable to start query thread %d\n", i);
+      return 1;
+    }
+  }
+
+  if (agg_init(&merged, 1024) != 0) {
+    return 1;
+  }
+
+  for (i = 0; i < thread_count; i++) {
+    pthread_join(threads[i].thread, NULL);
+
+    for (m = 0; m < METRICS; m++) {
+      totals[m] += threads[i].totals[m];
+    }
+    blocks += threads[i].blocks;
+    skipped_minmax += threads[i].skipped_minmax;
+    skipped_bloom += threads[i].skipped_bloom;
+    rows += threads[i].rows;
+    errors += threads[i].errors;
+
+    if (group_col >= 0) {
+      agg_merge(&merged, &(threads[i].table));
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end_time);
+  elapsed = (double)(end_time.tv_sec - start_time.tv_sec) +
+    (double)(end_time.tv_nsec - start_time.tv_nsec) / 1e9;
+
+  /* === Results === */
+  if (group_col >= 0) {
+    top_groups(&merged, top);
+  }
+  printf("total: bytes %lu packets %lu flows %lu rows %lu\n",
+	 totals[METRIC_BYTES], totals[METRIC_PACKETS], totals[METRIC_FLOWS],
+	 totals[METRIC_ROWS]);
+
+  fprintf(stderr, "%d segments, %lu blocks (%lu skipped on min/max, %lu on "
+	  "bloom), %lu rows scanned, %lu matched, %lu bad blocks\n",
+	  segment_count, blocks, skipped_minmax, skipped_bloom, rows,
+	  totals[METRIC_ROWS], errors);
+  fprintf(stderr, "%.3f seconds with %d threads, %.1f MB of segments "
+	  "(%.2f GB/s)\n", elapsed, thread_count, (double)mapped / 1e6,
+	  (elapsed > 0) ? (double)mapped / elapsed / 1e9 : 0.0);
+
+  return (errors > 0) ? 2 : 0;
+}
+
+
+void usage(const char *prog) {
+
+  fprintf(stderr, "usage: %s [options] <segment or dir> ...\n", prog);
+  fprintf(stderr, "  -s <prefix>     source address or prefix\n");
+  fprintf(stderr, "  -d <prefix>     destination address or prefix\n");
+  fprintf(stderr, "  -e <prefix>     exporter address or prefix, counts "
+	  "every exporter's row\n                  of a flow instead of "
+	  "one per flow\n");
+  fprintf(stderr, "  -S <port[-port]>  source port(s)\n");
+  fprintf(stderr, "  -D <port[-port]>  destination port(s)\n");
+  fprintf(stderr, "  -P <proto[-proto]>  protocol(s)\n");
+  fprintf(stderr, "  -t <time>       flows still active at or after this "
+	  "unix time\n");
+  fprintf(stderr, "  -T <time>       flows started at or before this "
+	  "unix time\n");
+  fprintf(stderr, "  -l <dur>        flows active in the last <dur> "
+	  "(s, m, h or d suffix)\n");
+  fprintf(stderr, "  -g <col[/bits]>  group by a column, addresses can "
+	  "take a prefix length\n");
+  fprintf(stderr, "  -o <metric>     rank groups by bytes, packets, flows "
+	  "or rows (default bytes)\n");
+  fprintf(stderr, "  -n <num>        how many groups to show (default %d)\n",
+	  QUERY_TOP);
+  fprintf(stderr, "  -j <num>        threads (default all CPUs)\n");
+}
+
+
+int add_pred(const int col, const uint64_t lo, const uint64_t hi) {
+
+  if (pred_count >= QUERY_MAX_PREDS) {
+    fprintf(stderr, "Too many predicates\n");
+    exit(1);
+  }
+
+  preds[pred_count].col = col;
+  preds[pred_count].lo = lo;
+  preds[pred_count].hi = hi;
+  pred_count++;
+
+  return 0;
+}
+
+
+int parse_prefix(const char *str, uint64_t *lo, uint64_t *hi) {
+
+  struct in_addr addr;
+  char buff[32];
+  char *slash;
+  uint32_t mask;
+  int bits = 32;
+
+  if (strlen(str) >= sizeof(buff)) {
+    return -1;
+  }
+  strcpy(buff, str);
+
+  if ((slash = strchr(buff, '/')) != NULL) {
+    *(slash++) = '\0';
+    bits = atoi(slash);
+    if ((bits < 0) || (bits > 32)) {
+      return -1;
+    }
+  }
+
+  if (inet_aton(buff, &addr) == 0) {
+    return -1;
+  }
+
+  mask = (bits == 0) ? 0 : 0xFFFFFFFFU << (32 - bits);
+  *lo = ntohl(addr.s_addr) & mask;
+  *hi = *lo | ~mask;
+  *hi &= 0xFFFFFFFFULL;
+
+  return 0;
+}
+
+
+int parse_range(const char *str, const uint64_t max, uint64_t *lo,
+		uint64_t *hi) {
+
+  char *end;
+
+  *lo = strtoull(str, &end, 10);
+  if (end == str) {
+    return -1;
+  }
+
+  *hi = *lo;
+  if (*end == '-') {
+    *hi = strtoull(end + 1, &end, 10);
+  }
+
+  if ((*end != '\0') || (*lo > *hi) || (*hi > max)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int parse_duration(const char *str, uint64_t *secs) {
+
+  char *end;
+
+  *secs = strtoull(str, &end, 10);
+  if (end == str) {
+    return -1;
+  }
+
+  switch (*end) {
+  case '\0':
+  case 's':
+    break;
+  case 'm':
+    *secs *= 60;
+    break;
+  case 'h':
+    *secs *= 3600;
+    break;
+  case 'd':
+    *secs *= 86400;
+    break;
+  default:
+    return -1;
+  }
+
+  return 0;
+}
+
+
+/* Seconds since the epoch, which is all the time columns can hold */
+int parse_time(const char *str, uint64_t *secs) {
+
+  char *end;
+
+  if ((*str < '0') || (*str > '9')) {
+    return -1;
+  }
+
+  *secs = strtoull(str, &end, 10);
+  if ((*end != '\0') || (*secs > UINT32_MAX)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int find_column(const char *name) {
+
+  int col;
+
+  for (col = 0; col < FTCOL_COLUMNS; col++) {
+    if (strcmp(name, ftcol_column_names[col]) == 0) {
+      return col;
+    }
+  }
+
+  return -1;
+}
+
+
+int is_addr_column(const int col) {
+  return ((col == FTCOL_SRC_ADDR) || (col == FTCOL_DST_ADDR) ||
+	  (col == FTCOL_EXPORTER));
+}
+
+
+int add_path(const char *path) {
+
+  struct stat st;
+  struct dirent *ent;
+  DIR *dir;
+  char *full;
+  size_t len;
+
+  if (stat(path, &st) != 0) {
+    perror(path);
+    return -1;
+  }
+
+  if (!S_ISDIR(st.st_mode)) {
+    return add_segment(path);
+  }
+
+  /* Every finished segment in the directory */
+  if ((dir = opendir(path)) == NULL) {
+    perror(path);
+    return -1;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    len = strlen(ent->d_name);
+    if ((ent->d_name[0] == '.') || (len < 4) ||
+	(strcmp(ent->d_name + len - 4, ".ftc") != 0)) {
+      continue;
+    }
+
+    if ((full = malloc(strlen(path) + len + 2)) == NULL) {
+      closedir(dir);
+      return -1;
+    }
+    sprintf(full, "%s/%s", path, ent->d_name);
+
+    if (add_segment(full) != 0) {
+      free(full);
+      closedir(dir);
+      return -1;
+    }
+    free(full);
+  }
+
+  closedir(dir);
+
+  return 0;
+}
+
+
+int add_segment(const char *path) {
+
+  struct query_segment *seg, *grown;
+  struct stat st;
+  void *data;
+  int fh;
+
+  if ((fh = open(path, O_RDONLY)) == -1) {
+    perror(path);
+    return -1;
+  }
+
+  if ((fstat(fh, &st) != 0) || (st.st_size == 0)) {
+    close(fh);
+    fprintf(stderr, "Skipping empty segment %s\n", path);
+    return 0;
+  }
+
+  /* The mapping stays until exit, the fd isn't needed for it */
+  data = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fh, 0);
+  close(fh);
+  if (data == MAP_FAILED) {
+    perror("mmap");
+    return -1;
+  }
+  madvise(data, st.st_size, MADV_WILLNEED);
+
+  grown = realloc(segments, (segment_count + 1) * sizeof(struct query_segment));
+  if (grown == NULL) {
+    return -1;
+  }
+  segments = grown;
+
+  seg = &(segments[segment_count]);
+  seg->data = data;
+  seg->len = st.st_size;
+
+  if (ftcol_open(seg->data, seg->len, &(seg->file)) != 0) {
+    fprintf(stderr, "Skipping %s, not a finished columnar segment\n", path);
+    munmap(data, st.st_size);
+    return 0;
+  }
+
+  seg->path = strdup(path);
+  segment_count++;
+
+  return 0;
+}
+
+
+/* ===
+ * The workers.  Each one pulls blocks off the shared list until it is
+ * empty and keeps its own totals and group table.
+ * ===
+ */
+void *thread_query(void *arg) {
+
+  struct query_thread *qt = (struct query_thread *)arg;
+  uint64_t next;
+
+  while ((next = __sync_fetch_and_add(&work_next, 1)) < work_count) {
+    query_block(qt, &(work[next]));
+  }
+
+  return NULL;
+}
+
+
+int block_skip(const struct ftcol_block *b, int *bloom) {
+
+  int p, slot;
+
+  for (p = 0; p < pred_count; p++) {
+    /* Nothing in the block is in range */
+    if ((b->max[preds[p].col] < preds[p].lo) ||
+	(b->min[preds[p].col] > preds[p].hi)) {
+      return 1;
+    }
+
+    /* An exact value has to be in the bloom filter */
+    slot = ftcol_bloom_slot[preds[p].col];
+    if ((preds[p].lo == preds[p].hi) && (slot >= 0) &&
+	(!ftcol_bloom_test(b->blooms[slot], preds[p].lo))) {
+      *bloom = 1;
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+
+uint64_t scan_range(const uint64_t *vals, uint64_t *sel, const uint32_t rows,
+		    const uint64_t lo, const uint64_t hi, const int first) {
+
+  const qvec *v = (const qvec *)vals;
+  qvec *s = (qvec *)sel;
+  qvec m, counts = {0, 0, 0, 0};
+  uint64_t span = hi - lo;
+  uint64_t count = 0;
+  uint32_t i, n;
+
+  /* lo <= x <= hi is one unsigned compare: x - lo <= hi - lo.  The
+   * buffers have room past rows so the last vector can run over, the
+   * extra lanes are masked off below.
+   */
+  n = (rows + QVEC_LANES - 1) / QVEC_LANES;
+  for (i = 0; i < n; i++) {
+    m = (qvec)((v[i] - lo) <= span);
+    if (first == 0) {
+      m &= s[i];
+    }
+    s[i] = m;
+    counts += m & 1;
+  }
+
+  for (i = rows; i < n * QVEC_LANES; i++) {
+    count -= sel[i] & 1;
+    sel[i] = 0;
+  }
+
+  for (i = 0; i < QVEC_LANES; i++) {
+    count += counts[i];
+  }
+
+  return count;
+}
+
+
+void query_block(struct query_thread *qt, const struct query_work *w) {
+
+  const uint8_t *decoded[FTCOL_COLUMNS];
+  struct ftcol_block b;
+  struct agg_entry *entry;
+  uint64_t matched = 0;
+  uint64_t key;
+  uint32_t i;
+  int bloom = 0;
+  int col, p;
+
+  qt->blocks++;
+
+  if (ftcol_block(&(w->seg->file), w->block, &b) != 0) {
+    qt->errors++;
+    return;
+  }
+
+  if (block_skip(&b, &bloom) != 0) {
+    if (bloom != 0) {
+      qt->skipped_bloom++;
+    }
+    else {
+      qt->skipped_minmax++;
+    }
+    return;
+  }
+
+  qt->rows += b.rows;
+  memset(decoded, 0, sizeof(decoded));
+
+  /* === Filter, decoding each column the first time it's needed === */
+  for (p = 0; p < pred_count; p++) {
+    col = preds[p].col;
+    if (decoded[col] == NULL) {
+      if (ftcol_decode_column(b.chunks[col], b.chunk_lens[col], b.rows,
+			      qt->cols[col]) != 0) {
+	qt->errors++;
+	return;
+      }
+      decoded[col] = b.chunks[col];
+    }
+
+    matched = scan_range(qt->cols[col], qt->sel, b.rows, preds[p].lo,
+			 preds[p].hi, (p == 0));
+    if (matched == 0) {
+      return;
+    }
+  }
+
+  if (pred_count == 0) {
+    for (i = 0; i < b.rows; i++) {
+      qt->sel[i] = ~(uint64_t)0;
+    }
+    matched = b.rows;
+  }
+
+  /* === Aggregate the rows that made it === */
+  for (col = FTCOL_PACKETS; col <= FTCOL_FLOWS; col++) {
+    if ((decoded[col] == NULL) &&
+	(ftcol_decode_column(b.chunks[col], b.chunk_lens[col], b.rows,
+			     qt->cols[col]) != 0)) {
+      qt->errors++;
+      return;
+    }
+    decoded[col] = b.chunks[col];
+  }
+
+  if ((group_col >= 0) && (decoded[group_col] == NULL) &&
+      (ftcol_decode_column(b.chunks[group_col], b.chunk_lens[group_col],
+			   b.rows, qt->cols[group_col]) != 0)) {
+    qt->errors++;
+    return;
+  }
+
+  for (i = 0; i < b.rows; i++) {
+    if (qt->sel[i] == 0) {
+      continue;
+    }
+
+    qt->totals[METRIC_BYTES] += qt->cols[FTCOL_BYTES][i];
+    qt->totals[METRIC_PACKETS] += qt->cols[FTCOL_PACKETS][i];
+    qt->totals[METRIC_FLOWS] += qt->cols[FTCOL_FLOWS][i];
+    qt->totals[METRIC_ROWS]++;
+
+    if (group_col < 0) {
+      continue;
+    }
+
+    key = qt->cols[group_col][i] & group_mask;
+    if ((entry = agg_find(&(qt->table), key)) == NULL) {
+      qt->errors++;
+      return;
+    }
+    entry->sums[METRIC_BYTES] += qt->cols[FTCOL_BYTES][i];
+    entry->sums[METRIC_PACKETS] += qt->cols[FTCOL_PACKETS][i];
+    entry->sums[METRIC_FLOWS] += qt->cols[FTCOL_FLOWS][i];
+    entry->sums[METRIC_ROWS]++;
+  }
+}
+
+
+/* ===
+ * Group tables, open addressing kept under half full
+ * ===
+ */
+int agg_init(struct agg_table *t, const uint64_t size) {
+
+  if ((t->entries = calloc(size, sizeof(struct agg_entry))) == NULL) {
+    return -1;
+  }
+  t->mask = size - 1;
+  t->count = 0;
+
+  return 0;
+}
+
+
+struct agg_entry *agg_find(struct agg_table *t, const uint64_t key) {
+
+  struct agg_table bigger;
+  struct agg_entry *entry;
+  uint64_t i;
+
+  if ((t->count + 1) * 2 > t->mask + 1) {
+    if (agg_init(&bigger, (t->mask + 1) * 2) != 0) {
+      return NULL;
+    }
+    agg_merge(&bigger, t);
+    free(t->entries);
+    *t = bigger;
+  }
+
+  for (i = ftcol_bloom_hash(key) & t->mask; ; i = (i + 1) & t->mask) {
+    entry = &(t->entries[i]);
+    if (entry->used == 0) {
+      entry->used = 1;
+      entry->key = key;
+      t->count++;
+      return entry;
+    }
+    if (entry->key == key) {
+      return entry;
+    }
+  }
+}
+
+
+void agg_merge(struct agg_table *dst, const struct agg_table *src) {
+
+  struct agg_entry *entry;
+  uint64_t i;
+  int m;
+
+  for (i = 0; i <= src->mask; i++) {
+    if (src->entries[i].used == 0) {
+      continue;
+    }
+    if ((entry = agg_find(dst, src->entries[i].key)) == NULL) {
+      continue;
+    }
+    for (m = 0; m < METRICS; m++) {
+      entry->sums[m] += src->entries[i].sums[m];
+    }
+  }
+}
+
+
+void top_groups(const struct agg_table *t, const int top) {
+
+  const struct agg_entry **heap, *tmp;
+  char key[32];
+  uint64_t i;
+  int count = 0;
+  int n, c;
+
+  if (top <= 0) {
+    return;
+  }
+  if ((heap = calloc(top, sizeof(struct agg_entry *))) == NULL) {
+    return;
+  }
+
+  /* A min-heap of the best so far, the root is the one to beat */
+  for (i = 0; i <= t->mask; i++) {
+    if (t->entries[i].used == 0) {
+      continue;
+    }
+
+    if (count < top) {
+      n = count++;
+      heap[n] = &(t->entries[i]);
+      while ((n > 0) && (heap[n]->sums[rank_metric] <
+			 heap[(n - 1) / 2]->sums[rank_metric])) {
+	tmp = heap[n];
+	heap[n] = heap[(n - 1) / 2];
+	heap[(n - 1) / 2] = tmp;
+	n = (n - 1) / 2;
+      }
+      continue;
+    }
+
+    if (t->entries[i].sums[rank_metric] <= heap[0]->sums[rank_metric]) {
+      continue;
+    }
+
+    heap[0] = &(t->entries[i]);
+    n = 0;
+    for (;;) {
+      c = (2 * n) + 1;
+      if (c >= count) {
+	break;
+      }
+      if ((c + 1 < count) &&
+	  (heap[c + 1]->sums[rank_metric] < heap[c]->sums[rank_metric])) {
+	c++;
+      }
+      if (heap[n]->sums[rank_metric] <= heap[c]->sums[rank_metric]) {
+	break;
+      }
+      tmp = heap[n];
+      heap[n] = heap[c];
+      heap[c] = tmp;
+      n = c;
+    }
+  }
+
+  /* Pop the heap into reverse order so the biggest prints first */
+  for (n = count - 1; n > 0; n--) {
+    tmp = heap[0];
+    heap[0] = heap[n];
+    heap[n] = tmp;
+
+    i = 0;
+    for (;;) {
+      c = (2 * i) + 1;
+      if (c >= n) {
+	break;
+      }
+      if ((c + 1 < n) &&
+	  (heap[c + 1]->sums[rank_metric] < heap[c]->sums[rank_metric])) {
+	c++;
+      }
+      if (heap[i]->sums[rank_metric] <= heap[c]->sums[rank_metric]) {
+	break;
+      }
+      tmp = heap[i];
+      heap[i] = heap[c];
+      heap[c] = tmp;
+      i = c;
+    }
+  }
+
+  printf("%-20s %16s %14s %12s %12s\n", ftcol_column_names[group_col],
+	 "bytes", "packets", "flows", "rows");
+  for (n = 0; n < count; n++) {
+    format_key(key, sizeof(key), heap[n]->key);
+    printf("%-20s %16lu %14lu %12lu %12lu\n", key,
+	   heap[n]->sums[METRIC_BYTES], heap[n]->sums[METRIC_PACKETS],
+	   heap[n]->sums[METRIC_FLOWS], heap[n]->sums[METRIC_ROWS]);
+  }
+  printf("(%lu groups)\n", t->count);
+
+  free(heap);
+}
+
+
+void format_key(char *buff, const size_t len, const uint64_t key) {
+
+  if (!is_addr_column(group_col)) {
+    snprintf(buff, len, "%lu", key);
+    return;
+  }
+
+  if (group_bits < 32) {
+    snprintf(buff, len, "%lu.%lu.%lu.%lu/%d", (key >> 24) & 0xFF,
+	     (key >> 16) & 0xFF, (key >> 8) & 0xFF, key & 0xFF, group_bits);
+  }
+  else {
+    snprintf(buff, len, "%lu.%lu.%lu.%lu", (key >> 24) & 0xFF,
+	     (key >> 16) & 0xFF, (key >> 8) & 0xFF, key & 0xFF);
+  }
+}
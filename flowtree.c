@@ -7,6 +7,7 @@
 #include <stdint.h>
 #include <signal.h>
 #include <errno.h>
+#include <ctype.h>
 
 /* We want to favor the BSD structs over the Linux ones */
 #ifndef __USE_BSD
@@ -29,165 +30,119 @@
 /* The AVL tree */
 #include "pavl.h"
 
+/* The shared flow structs */
+#include "flowtree.h"
+
+/* The flow filter compiler */
+#include "filter.h"
+
+/* Getting expired flows out */
+#include "export.h"
+#include "ftbin.h"
+#include "sink.h"
+#include "stats.h"
+#include "metrics.h"
+#include "hist.h"
+#include "exporter.h"
+#include "control.h"
+#include "topk.h"
+#include "hll.h"
+#include "rollup.h"
+#include "matrix.h"
+#include "bins.h"
+
 /* The listen loop and thread(s) */
 int terminate = 0;
+volatile sig_atomic_t reload_pending = 0;
 
 /* Network stuff */
 #define LISTENADDR "132.239.1.114"
 #define LISTENPORT 2055
 #define SOCKBUFF 1024 * 1024 /* 1 MB */
 #define RECVBUFFSIZE 65536
+int sock_fh;
+
+/* Exporters allowed to send to us, -A turns it on */
+const char *allow_file = NULL;
 
-#define SENDSRC "127.0.0.1"
-#define SENDDST "127.0.0.1"
-#define SENDPORT 2056
-#define SENDBUFFSIZE 65536
-int send_fh;
 
 
 /* ===
- * Netflow structs and other values
- * http://www.cisco.com/en/US/docs/net_mgmt/netflow_collection_engine/
- * 3.6/user/guide/format.html#wp1006108
+ * The exclude list vars
  * ===
  */
 
-/* === Netflow v5 === */
-struct netflow_v5 {
-  uint16_t version;
-  uint16_t flow_count;
-  uint32_t uptime;
-  uint32_t unix_sec;
-  uint32_t nsec;
-  uint32_t flow_sequence;
-  uint8_t engine_type;
-  uint8_t engine_id;
-  uint16_t sample_rate;
-} __attribute__((__packed__));
-
-struct netflow_v5_record {
-  in_addr_t src_addr;
-  in_addr_t dst_addr;
-  in_addr_t next_hop;
-  uint16_t src_int; 
-  uint16_t dst_int;
-  uint32_t num_packets;
-  uint32_t num_bytes;
-  uint32_t start_time;
-  uint32_t end_time;
-  uint16_t src_port;
-  uint16_t dst_port;
-  uint8_t pad1;
-  uint8_t tcp_flags;
-  uint8_t protocol;
-  uint8_t tos;
-  uint16_t src_as;
-  uint16_t dst_as;
-  uint8_t src_mask;
-  uint8_t dst_mask;
-  uint16_t pad2;
-} __attribute__((__packed__));  
-
-
-/* === Netflow v7 === */
-struct netflow_v7 {
-  uint16_t version;
-  uint16_t flow_count;
-  uint32_t uptime;
-  uint32_t unix_sec;
-  uint32_t nsec;
-  uint32_t flow_sequence;
-  uint32_t reserved;
-} __attribute__((__packed__));
-
-struct netflow_v7_record {
-  in_addr_t src_addr;
-  in_addr_t dst_addr;
-  in_addr_t next_hop;
-  uint16_t src_int; 
-  uint16_t dst_int;
-  uint32_t num_packets;
-  uint32_t num_bytes;
-  uint32_t start_time;
-  uint32_t end_time;
-  uint16_t src_port;
-  uint16_t dst_port;
-  uint8_t flags1;
-  uint8_t tcp_flags;
-  uint8_t protocol;
-  uint8_t tos;
-  uint16_t src_as;
-  uint16_t dst_as;
-  uint8_t src_mask;
-  uint8_t dst_mask;
-  uint16_t flags2;
-  uint32_t flow_src;
-} __attribute__((__packed__));  
+/* Where the exclusion ranges get loaded from, -x overrides it */
+#define EXCLUDEFILE "flowtree.exclude"
+const char *exclude_file = EXCLUDEFILE;
+
+
+int thread_slots_used = 0;
+__thread int thread_slot_id = -1;
 
 
 /* ===
- * The unified flow struct that all other formats will be converted to
+ * The flattened exclusion index
+ *
+ * This is a DIR-24-8 table built from the merged ranges in the exclude
+ * tree.  The top 24 bits of an address index tbl24.  An entry of 0 means
+ * not excluded, otherwise it is the range id + 1 unless the high bit is
+ * set in which case the low 15 bits pick a 256 entry group in tbl8
+ * that is indexed by the low 8 bits of the address.
  * ===
  */
-struct unified_flow {
-  in_addr_t flow_src;
-  time_t recv_time;
-  uint16_t src_int;
-  uint16_t dst_int;
-  struct in_addr src_addr;
-  struct in_addr dst_addr;
-  uint8_t protocol;
-  uint16_t src_port;
-  uint16_t dst_port;
-  uint8_t tcp_flags;
-  uint32_t num_packets;
-  uint32_t num_bytes;
-  time_t start_time;
-  time_t end_time;
+#define EXCLUDE_TBL24_SIZE (1 << 24)
+#define EXCLUDE_TBL8_FLAG 0x8000
+#define EXCLUDE_MAX_RANGES 0x7FFF
+#define EXCLUDE_MAX_TBL8 0x8000
+
+struct exclude_index {
+  uint16_t *tbl24;
+  uint16_t *tbl8;
+  int tbl8_groups;
+  int tbl8_alloc;
+  int range_count;
+  struct exclude_node *ranges; /* range id -> range */
+  uint64_t *thread_hits[MAX_THREADS]; /* per-thread, indexed by range id */
 };
 
+struct exclude_index *exclude_idx; /* RCU protected */
+
 
 /* ===
- * The flow summary to insert into the flow trees
+ * The compiled flow filter, from -f or -F (which can be reloaded)
  * ===
  */
-struct flow_source_summary {
-  in_addr_t flow_src;
-  uint16_t src_int;
-  uint16_t dst_int;
-  uint64_t num_packets;
-  uint64_t num_bytes;  
-  uint64_t num_flows;  
-  struct flow_source_summary *next;
-};
-
-struct flow_summary {
-  time_t time_added;
-  time_t time_updated;
-  struct in_addr src_addr;
-  struct in_addr dst_addr;
-  uint8_t protocol;
-  uint16_t src_port;
-  uint16_t dst_port;
-  uint8_t tcp_flags;
-  time_t start_time;
-  time_t end_time;
-  uint8_t source_count;
-  struct flow_source_summary *sources;
-};
+struct filter_prog *flow_filter = NULL; /* RCU protected */
+const char *filter_expr = NULL;
+const char *filter_file = NULL;
 
 
 /* ===
- * The exclude list structs and vars
+ * RCU-style deferred reclamation
+ *
+ * Readers bracket their use of anything published with rcu_publish()
+ * with rcu_read_lock() / rcu_read_unlock() which only stamp the reader's
+ * slot with the current epoch.  Writers swap the pointer and retire the
+ * old object, it gets freed once every reader has either left or
+ * entered after the swap.
  * ===
  */
-struct exclude_node {
-  in_addr_t addr_start;
-  in_addr_t addr_end;
-  uint64_t exclude_count;
+struct rcu_reader {
+  uint64_t epoch; /* 0 when not in a read section */
+} __attribute__((aligned(CACHE_LINE)));
+
+struct rcu_retired {
+  void *ptr;
+  void (*free_func)(void *);
+  uint64_t epoch;
+  struct rcu_retired *next;
 };
 
-struct pavl_table *exclude_tree;  
+uint64_t rcu_epoch = 1;
+struct rcu_reader rcu_readers[MAX_THREADS];
+struct rcu_retired *rcu_retired_list = NULL;
+pthread_mutex_t rcu_retire_mutex = PTHREAD_MUTEX_INITIALIZER;
 
 
 /* ===
@@ -196,6 +151,12 @@ struct pavl_table *exclude_tree;
  */
 int main(int, char * const []);
 void sig_terminate(int);
+void sig_reload(int);
+void sig_histograms(int);
+void usage(const char *);
+void reload_config(void);
+int load_socket_filter(void);
+struct filter_prog *load_filter(void);
 void packet_callback(const struct sockaddr_in *, const u_char *,
 		     const size_t, const time_t);
 void parse_netflow_v5(const struct sockaddr_in *, const u_char *,
@@ -204,13 +165,29 @@ void parse_netflow_v7(const struct sockaddr_in *, const u_char *,
 		      const size_t, const time_t);
 void flow_callback(const struct unified_flow *);
 int compare_flows(const void *, const void *, void *);
+int compare_biflows(const void *, const void *, void *);
+int flow_endpoint_order(const struct flow_summary *);
+int flow_tree_num(const struct flow_summary *);
 int compare_excludes(const void *, const void *, void *);
 void * copy_flow(const void *, void *);
-void add_exclusion(const in_addr_t, const in_addr_t);
-int is_excluded(const in_addr_t);
+void add_exclusion(struct pavl_table *, const in_addr_t, const in_addr_t);
+struct exclude_index *load_exclude_index(const char *, const int);
+struct exclude_index *build_exclude_index(struct pavl_table *);
+int exclude_set_tbl8(struct exclude_index *, const uint32_t, const int,
+		     const int, const uint16_t);
+void free_exclude_index(struct exclude_index *);
+void free_exclude_index_rcu(void *);
+uint64_t *exclude_thread_hits(struct exclude_index *);
+void exclude_lookup_batch(struct exclude_index *, in_addr_t *,
+			  uint16_t *, const int);
+uint64_t exclude_range_hits(const struct exclude_index *, const int);
+void flow_batch_callback(const struct unified_flow *, const int);
 void *thread_flow_janitor(void *);
-void free_source_list(struct flow_source_summary *);
-void print_flow_json(const struct flow_summary *);
+void *thread_stats(void *);
+void print_stats(const struct flow_stats *, const struct flow_stats *,
+		 const time_t, const time_t);
+void tree_lock(const int, const int);
+void lockprof_report(const uint64_t);
 
 
 /* ===
@@ -226,6 +203,41 @@ struct hash_node_tree {
 
 struct hash_node_tree flow_hash_trees[TREES];  
 
+/* Both directions of a conversation share a flow, -b turns it on */
+int biflow_enabled = 0;
+
+
+/* ===
+ * Tree lock profiling (-L)
+ *
+ * tree_lock() tries the mutex first and only reads the clock when that
+ * fails, so an uncontended lock costs one extra increment.  A tree's
+ * counters are only ever written by whoever holds its mutex, so they
+ * need no atomics beyond keeping the stats thread from seeing a torn
+ * value.  Waits are split by who was waiting: with one receive thread
+ * every receive side wait is a collision with the janitor, while hot
+ * trees holding far more than their share of the flows point at the
+ * hash instead.
+ * ===
+ */
+#define LOCKPROF_TOP 10 /* hottest trees in the report */
+
+#define LOCK_RECEIVE 0
+#define LOCK_JANITOR 1
+#define LOCK_QUERY 2
+#define LOCK_ROLES 3
+
+struct tree_lock_stats {
+  uint64_t acquired;
+  uint64_t contended[LOCK_ROLES]; /* by who had to wait */
+  uint64_t wait_ns;
+};
+
+const char *lock_role_names[LOCK_ROLES] = {"receive", "janitor", "query"};
+
+int lockprof_enabled = 0;
+struct tree_lock_stats *lockprof = NULL; /* TREES of them with -L */
+
 
 /* === The purge parameters === */
 #define MIN_FLOW_AGE 60
@@ -254,22 +266,21 @@ struct hash_node_tree flow_hash_trees[TREES];
 
 
 /* ===
- * Some stats vars
+ * The global time vars
  * ===
  */
-uint64_t stat_flow_packets = 0, stat_total_flows = 0, stat_excluded_flows = 0;
-uint64_t stat_new_flows = 0, stat_dup_flows = 0, stat_current_flows = 0;
-uint64_t stat_proto_flows[256];
-pthread_mutex_t stat_current_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define STATS_RATE 60
+time_t start_time;
 
 
 /* ===
- * The global time vars
+ * Janitor timings, only the janitor writes them
  * ===
  */
-#define STATS_RATE 60
-time_t last_stats_update;
-time_t start_time;
+uint64_t janitor_sweeps = 0;
+uint64_t janitor_expired = 0;
+uint64_t janitor_sweep_ns = 0; /* all sweeps */
+uint64_t janitor_last_sweep_ns = 0;
 
 
 int main(int argc, char * const argv[]) {
@@ -279,10 +290,8 @@ int main(int argc, char * const argv[]) {
   sigset_t sigmask, emptysigmask;
 
   /* === Socket vars === */
-  struct sockaddr_in bind_addrin, peer_addrin, send_addrin;
+  struct sockaddr_in bind_addrin, peer_addrin;
   in_addr_t bind_addr;
-  in_addr_t send_addr;
-  int sock_fh;
   int setsockbuff = SOCKBUFF, getsockbuff;
   socklen_t sockbufflen = sizeof(getsockbuff);
   socklen_t peeraddrlen = sizeof(peer_addrin);
@@ -297,13 +306,136 @@ int main(int argc, char * const argv[]) {
 
   /* === Thread vars === */
   pthread_t flow_janitor;
+  pthread_t stats_reporter;
   int thread_ret;
 
   /* === Misc vars === */
-  time_t cur_time;
-  uint32_t time_diff;
+  uint64_t hist_time;
+  const char *bench_name = NULL;
+  unsigned long num;
+  char *end;
+  int opt;
   int i;
 
+  /* Handle the command line */
+  while ((opt = getopt(argc, argv, "x:f:F:A:o:m:s:q:r:M:H:LC:K:D:R:I:T:bB:h")) != -1) {
+    switch (opt) {
+    case 'o':
+      if (export_parse_format(optarg) != 0) {
+	fprintf(stderr, "Unknown export format %s\n", optarg);
+	return 1;
+      }
+      break;
+    case 'm':
+      export_dgram_size = atoi(optarg);
+      break;
+    case 's':
+      if (sink_add(optarg) != 0) {
+	return 1;
+      }
+      break;
+    case 'q':
+      sink_queue_slots = atoi(optarg);
+      break;
+    case 'r':
+      sink_rate = atoi(optarg);
+      break;
+    case 'M':
+      metrics_listen = optarg;
+      break;
+    case 'H':
+      /* Digits only, strtoul() would take -1 as 4 billion */
+      if ((*optarg < '0') || (*optarg > '9') ||
+	  ((num = strtoul(optarg, &end, 10)) < 1) || (num > UINT32_MAX) ||
+	  (*end != '\0')) {
+	fprintf(stderr, "Bad -H %s, want a positive sampling rate\n", optarg);
+	return 1;
+      }
+      hist_enabled = 1;
+      hist_sample = num;
+      break;
+    case 'L':
+      lockprof_enabled = 1;
+      break;
+    case 'C':
+      control_path = optarg;
+      break;
+    case 'K':
+      topk_interval_secs = atoi(optarg);
+      if (topk_interval_secs < 0) {
+	topk_interval_secs = 0;
+      }
+      break;
+    case 'D':
+      if (hll_parse(optarg) != 0) {
+	return 1;
+      }
+      break;
+    case 'R':
+      if (rollup_parse(optarg) != 0) {
+	return 1;
+      }
+      break;
+    case 'I':
+      matrix_interval_secs = atoi(optarg);
+      if (matrix_interval_secs < 0) {
+	matrix_interval_secs = 0;
+      }
+      break;
+    case 'T':
+      flow_bin_secs = atoi(optarg);
+      if (flow_bin_secs < 0) {
+	flow_bin_secs = 0;
+      }
+      break;
+    case 'A':
+      allow_file = optarg;
+      break;
+    case 'x':
+      exclude_file = optarg;
+      break;
+    case 'f':
+      filter_expr = optarg;
+      break;
+    case 'F':
+      filter_file = optarg;
+      break;
+    case 'b':
+      biflow_enabled = 1;
+      break;
+    case 'B':
+      bench_name = optarg;
+      break;
+    case 'h':
+      usage(argv[0]);
+      return 0;
+    default:
+      usage(argv[0]);
+      return 1;
+    }
+  }
+
+  /* One or the other, quietly dropping half of what was asked for
+   * would be worse than refusing
+   */
+  if ((filter_expr != NULL) && (filter_file != NULL)) {
+    fprintf(stderr, "Use -f or -F for the flow filter, not both.\n");
+    usage(argv[0]);
+    return 1;
+  }
+
+  /* Compile the flow filter up front so mistakes show up right away */
+  if ((filter_expr != NULL) || (filter_file != NULL)) {
+    if ((flow_filter = load_filter()) == NULL) {
+      return 1;
+    }
+  }
+
+  /* Benchmarks don't need any sockets */
+  if (bench_name != NULL) {
+    return run_benchmark(bench_name, flow_filter);
+  }
+
   /* Before we start listening we need to setup a signal
    * handler so we can cleanly exit */
   memset(&sa_new, 0, sizeof(struct sigaction));
@@ -312,12 +444,20 @@ int main(int argc, char * const argv[]) {
   memset(&sa_new, 0, sizeof(struct sigaction));
   sa_new.sa_handler = sig_terminate;
   sigaction(SIGINT, &sa_new, &sa_old);
+  memset(&sa_new, 0, sizeof(struct sigaction));
+  sa_new.sa_handler = sig_reload;
+  sigaction(SIGHUP, &sa_new, &sa_old);
+  memset(&sa_new, 0, sizeof(struct sigaction));
+  sa_new.sa_handler = sig_histograms;
+  sigaction(SIGUSR1, &sa_new, &sa_old);
 
   /* Setup the masks for pselect() */
   sigemptyset(&emptysigmask);
   sigemptyset(&sigmask);
   sigaddset(&sigmask, SIGTERM);
   sigaddset(&sigmask, SIGINT);
+  sigaddset(&sigmask, SIGHUP);
+  sigaddset(&sigmask, SIGUSR1);
 
 
   /* Make our listen socket */
@@ -344,30 +484,6 @@ int main(int argc, char * const argv[]) {
   }
 
 
-  /* Make our send socket */
-  if ((send_fh = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
-    fprintf(stderr, "Creation of send socket failed.\n");
-    return 1;
-  }
-
-  /* Try to set the send socket buffer */
-  if (setsockopt(send_fh, SOL_SOCKET, SO_SNDBUF,
-		 &setsockbuff, sizeof(setsockbuff)) == -1) {
-    fprintf(stderr, "Setting send socket send buffer failed.\n");
-    return 1;
-  }
-
-  /* Now find out what our socket buffer really is set to */
-  if (getsockopt(send_fh, SOL_SOCKET, SO_SNDBUF,
-		 &getsockbuff, &sockbufflen) == -1) {
-    fprintf(stderr, "Unable to get send socket send buffer.\n");
-    return 1;
-  }
-  else {
-    fprintf(stderr, "Send socket send buffer is %d bytes\n", getsockbuff);
-  }
-
-
   /* Setup the binding struct */
   bind_addr = inet_addr(LISTENADDR);
   memset(&bind_addrin, 0, sizeof(bind_addrin));
@@ -383,128 +499,79 @@ int main(int argc, char * const argv[]) {
     return 1;
   }  
 
+  /* Have the kernel throw out junk and unknown exporters for us */
+  if (load_socket_filter() != 0) {
+    if (allow_file != NULL) {
+      fprintf(stderr, "Unable to set up the exporter allowlist.\n");
+      return 1;
+    }
+
+    fprintf(stderr, "Continuing without a socket filter.\n");
+  }
 
-  /* Setup the send binding struct */
-  send_addr = inet_addr(SENDSRC);
-  memset(&send_addrin, 0, sizeof(send_addrin));
-  send_addrin.sin_family = AF_INET;
-  send_addrin.sin_port = 0;
-  send_addrin.sin_addr.s_addr = send_addr;
 
-  /* Do the send bind */
-  if (bind(send_fh, (const struct sockaddr *)&send_addrin,
-	   sizeof(send_addrin)) == -1) {
-    fprintf(stderr, "Binding to sending socket failed.\n");
-    perror("bind");
+  /* Get the export side ready */
+  if (export_init() != 0) {
     return 1;
-  }  
+  }
 
   
-  /* Create the exclude tree */
-  exclude_tree = pavl_create(compare_excludes, NULL, NULL);
-
-  /* Populate the exclusion tree */
-  add_exclusion(inet_network("132.239.1.114"), inet_network("132.239.1.116"));
-  add_exclusion(inet_network("132.239.1.199"), inet_network("132.239.1.204"));
-  add_exclusion(inet_network("44.0.0.0"), inet_network("44.255.255.255"));
+  /* Load the exclusions and flatten them into the lookup index */
+  if ((exclude_idx = load_exclude_index(exclude_file, 1)) == NULL) {
+    fprintf(stderr, "Loading the exclusions failed.\n");
+    return 1;
+  }
 
 
   /* Create the flow trees */
   for (i = 0; i < TREES; i++) {
-    flow_hash_trees[i].tree = pavl_create(compare_flows, NULL, NULL);
+    flow_hash_trees[i].tree = pavl_create((biflow_enabled != 0) ?
+					  compare_biflows : compare_flows,
+					  NULL, NULL);
     pthread_mutex_init(&(flow_hash_trees[i].tree_mutex), NULL);
   }
 
+  if (lockprof_enabled != 0) {
+    if ((lockprof = calloc(TREES, sizeof(struct tree_lock_stats))) == NULL) {
+      fprintf(stderr, "Unable to allocate the tree lock counters.\n");
+      return 1;
+    }
+  }
+
   /* Record what time we started */
   start_time = time(NULL);
-  last_stats_update = start_time;
 
-  /* Before listening, start the janitor thread */
+  if (hist_init() != 0) {
+    fprintf(stderr, "Unable to allocate the latency histograms.\n");
+    return 1;
+  }
+
+  if (hll_init() != 0) {
+    return 1;
+  }
+
+  /* Before listening, start the janitor and stats threads */
   thread_ret = pthread_create(&flow_janitor, NULL, thread_flow_janitor, NULL);
+  thread_ret = pthread_create(&stats_reporter, NULL, thread_stats, NULL);
+
+  /* Metrics can be scraped as soon as there is something to count */
+  if (metrics_start() != 0) {
+    return 1;
+  }
+
+  if (control_start() != 0) {
+    return 1;
+  }
   
   /* Testing receive, will do better in final code */
   while (terminate == 0) {
 
-    /* Check if we need to update the stats */
-    cur_time = time(NULL);
-    time_diff = cur_time - last_stats_update;
-
-    if (time_diff >= STATS_RATE) {
-      last_stats_update = cur_time;
-
-      time_diff = cur_time - start_time;
-
-      if (stat_new_flows == 0) {
-	fprintf(stderr, "--\n");
-	fprintf(stderr, "NO FLOWS\n");
-      }
-      else {
-	fprintf(stderr, "--\n");
-	fprintf(stderr, "flowtree stats:\n");
-	fprintf(stderr, "===============\n");
-	fprintf(stderr, "runtime: %d seconds; total packets: %lu; "
-		"total flows: %lu\n", (int)time_diff,
-		stat_flow_packets, stat_total_flows);
-	fprintf(stderr, "packet rate: %.02f pps; "
-		"flow rate: %.02f fps; new flow rate %.02f fps\n",
-		(double)stat_flow_packets / (double)time_diff,
-		(double)(stat_total_flows) / (double)time_diff,
-		(double)stat_new_flows / (double)time_diff);
-	fprintf(stderr, "excluded flows: %lu (%.02f%%)\n",
-		stat_excluded_flows, ((double)stat_excluded_flows /
-				      (double)stat_total_flows) * 100);
-
-	/* === *** ACQUIRE STATS LOCK *** === */
-	pthread_mutex_lock(&stat_current_mutex);
-
-	fprintf(stderr, "currently tracking flows: %lu\n", stat_current_flows);
-
-	/* === *** UNLOCK STATS LOCK *** === */
-	pthread_mutex_unlock(&stat_current_mutex);
-
-	fprintf(stderr, "total unique flows: %lu (%.02f%%)\n",
-		stat_new_flows, ((double)stat_new_flows /
-				 (double)(stat_total_flows)) * 100);
-	fprintf(stderr, "unique tcp flows: %lu (%.02f%%)\n",
-		stat_proto_flows[6], ((double)stat_proto_flows[6] /
-				      (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique udp flows: %lu (%.02f%%)\n",
-		stat_proto_flows[17], ((double)stat_proto_flows[17] /
-				       (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique icmp flows: %lu (%.02f%%)\n",
-		stat_proto_flows[1], ((double)stat_proto_flows[1] /
-				      (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique eth-in-ip flows: %lu (%.02f%%)\n",
-		stat_proto_flows[97], ((double)stat_proto_flows[97] /
-				       (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique 6in4 flows: %lu (%.02f%%)\n",
-		stat_proto_flows[41], ((double)stat_proto_flows[41] /
-				       (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique pim flows: %lu (%.02f%%)\n",
-		stat_proto_flows[103], ((double)stat_proto_flows[103] /
-					(double)stat_new_flows) * 100);
-	fprintf(stderr, "unique igmp flows: %lu (%.02f%%)\n",
-		stat_proto_flows[2], ((double)stat_proto_flows[2] /
-				      (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique ip in ip flows: %lu (%.02f%%)\n",
-		stat_proto_flows[4], ((double)stat_proto_flows[4] /
-				      (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique eigrp flows: %lu (%.02f%%)\n",
-		stat_proto_flows[88], ((double)stat_proto_flows[88] /
-				       (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique esp flows: %lu (%.02f%%)\n",
-		stat_proto_flows[50], ((double)stat_proto_flows[50] /
-				       (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique ah flows: %lu (%.02f%%)\n",
-		stat_proto_flows[51], ((double)stat_proto_flows[51] /
-				       (double)stat_new_flows) * 100);
-	fprintf(stderr, "unique gre flows: %lu (%.02f%%)\n",
-		stat_proto_flows[47], ((double)stat_proto_flows[47] /
-				       (double)stat_new_flows) * 100);
-      }
+    /* Got a SIGHUP, rebuild whatever can be reloaded */
+    if (reload_pending != 0) {
+      reload_pending = 0;
+      reload_config();
     }
 
-
     /* prep for the select */
     FD_ZERO(&read_fd);
     FD_SET(sock_fh, &read_fd);
@@ -550,10 +617,16 @@ int main(int argc, char * const argv[]) {
 
 
       /* Update the counter */
-      stat_flow_packets += 1;
+      stat_add(&(stats_mine()->flow_packets), 1);
 
       recv_time = time(NULL);
+
+      /* Anything RCU protected stays put until we're done with this one */
+      rcu_read_lock();
+      hist_time = hist_start(HIST_PACKET);
       packet_callback(&peer_addrin, buffer, msgsize, recv_time);
+      hist_record(HIST_PACKET, hist_time);
+      rcu_read_unlock();
     }
     
   }
@@ -561,6 +634,14 @@ int main(int argc, char * const argv[]) {
   /* === Stopped listening, must have gotten signal === */
   fprintf(stderr, "Waiting for threads to finish before exiting...\n");
   pthread_join(flow_janitor, NULL);
+  pthread_join(stats_reporter, NULL);
+  metrics_shutdown();
+  control_shutdown();
+  export_shutdown();
+  topk_shutdown();
+  hll_shutdown();
+  rollup_shutdown();
+  matrix_shutdown();
 
   close(sock_fh);
 
@@ -571,6 +652,8 @@ int main(int argc, char * const argv[]) {
 void packet_callback(const struct sockaddr_in *peer, const u_char *flow,
 		     const size_t flow_size, const time_t recv_time) {
 
+  struct exporter *ex;
+
   /* Check for netflow v5 */
   if (flow_size > sizeof(struct netflow_v5)) {
     if (ntohs(((struct netflow_v5 *)flow)->version) == 5) {
@@ -593,6 +676,9 @@ void packet_callback(const struct sockaddr_in *peer, const u_char *flow,
 
   /* Other version of netflow / sflow / jflow will be handled later */
   fprintf(stderr, "Got an uknown flow format\n");
+  ex = exporter_get(peer->sin_addr.s_addr, 0, 0);
+  exporter_datagram(ex, 0, 0, flow_size, recv_time);
+  exporter_error(ex);
 
 
 }
@@ -601,14 +687,17 @@ void packet_callback(const struct sockaddr_in *peer, const u_char *flow,
 void parse_netflow_v5(const struct sockaddr_in *peer, const u_char *flow,
 		      const size_t flow_size, const time_t recv_time) {
 
-  struct unified_flow current_flow;
+  struct unified_flow flow_batch[FLOW_BATCH];
+  struct unified_flow *current_flow;
   struct netflow_v5_record * record_v5;
+  struct exporter *ex;
 
   /* ===
    * Misc vars
    * ===
    */
   int records = 0;
+  int batch_count = 0;
   int i;
 
   /* ===
@@ -625,9 +714,17 @@ void parse_netflow_v5(const struct sockaddr_in *peer, const u_char *flow,
     return;
   }
 
+  ex = exporter_get(peer->sin_addr.s_addr,
+		     ((struct netflow_v5 *)flow)->engine_type,
+		     ((struct netflow_v5 *)flow)->engine_id);
+  exporter_datagram(ex, 5,
+		    ntohs(((struct netflow_v5 *)flow)->sample_rate) & 0x3FFF,
+		    flow_size, recv_time);
+
   records = ntohs(((struct netflow_v5 *)flow)->flow_count);
   if (flow_size != sizeof(struct netflow_v5) +
       (records * sizeof(struct netflow_v5_record))) {
+    exporter_error(ex);
     
     fprintf(stderr,
 	    "wrong size; flow_count=%d; flow_size=%d; v5=%d, v5r=%d\n",
@@ -637,6 +734,8 @@ void parse_netflow_v5(const struct sockaddr_in *peer, const u_char *flow,
     return;
   }
   /*fprintf(stderr, "Got a valid looking netflow v5 packet\n");*/
+  exporter_sequence(ex, ntohl(((struct netflow_v5 *)flow)->flow_sequence),
+		    records);
   
 
   /* ===
@@ -649,31 +748,43 @@ void parse_netflow_v5(const struct sockaddr_in *peer, const u_char *flow,
   for (i = 0; i < records; i++) {
     
     /* Fill in our current flow info */
-    current_flow.flow_src = peer->sin_addr.s_addr;
-    current_flow.recv_time = recv_time;
-    current_flow.src_int = ntohs(record_v5[i].src_int);
-    current_flow.dst_int = ntohs(record_v5[i].dst_int);
-    current_flow.src_addr.s_addr = ntohl(record_v5[i].src_addr);
-    current_flow.dst_addr.s_addr = ntohl(record_v5[i].dst_addr);
-    current_flow.protocol = record_v5[i].protocol;
-    current_flow.src_port = ntohs(record_v5[i].src_port);
-    current_flow.dst_port = ntohs(record_v5[i].dst_port);
-    current_flow.tcp_flags = record_v5[i].tcp_flags;
-    current_flow.num_packets = ntohl(record_v5[i].num_packets);
-    current_flow.num_bytes = ntohl(record_v5[i].num_bytes);
+    current_flow = &(flow_batch[batch_count]);
+    current_flow->flow_src = peer->sin_addr.s_addr; /* host order already */
+    current_flow->recv_time = recv_time;
+    current_flow->src_int = ntohs(record_v5[i].src_int);
+    current_flow->dst_int = ntohs(record_v5[i].dst_int);
+    current_flow->src_addr.s_addr = ntohl(record_v5[i].src_addr);
+    current_flow->dst_addr.s_addr = ntohl(record_v5[i].dst_addr);
+    current_flow->protocol = record_v5[i].protocol;
+    current_flow->src_port = ntohs(record_v5[i].src_port);
+    current_flow->dst_port = ntohs(record_v5[i].dst_port);
+    current_flow->tcp_flags = record_v5[i].tcp_flags;
+    current_flow->src_as = ntohs(record_v5[i].src_as);
+    current_flow->dst_as = ntohs(record_v5[i].dst_as);
+    current_flow->num_packets = ntohl(record_v5[i].num_packets);
+    current_flow->num_bytes = ntohl(record_v5[i].num_bytes);
 
     /* Time calculations require a bit of math, namely
      * curtime - ((uptime - start) / 1000)
      */
-    current_flow.start_time = ntohl(((struct netflow_v5 *)flow)->unix_sec) -
+    current_flow->start_time = ntohl(((struct netflow_v5 *)flow)->unix_sec) -
       (((ntohl(((struct netflow_v5 *)flow)->uptime) -		\
 	 ntohl(record_v5[i].start_time)) & 0xFFFFFFFF) / 1000);
-    current_flow.end_time = ntohl(((struct netflow_v5 *)flow)->unix_sec) -
+    current_flow->end_time = ntohl(((struct netflow_v5 *)flow)->unix_sec) -
       (((ntohl(((struct netflow_v5 *)flow)->uptime) -		\
 	 ntohl(record_v5[i].end_time)) & 0xFFFFFFFF) / 1000);
 
-    /* Now handle the current unified flow */
-    flow_callback(&current_flow);
+    /* Now handle the current batch of unified flows once it fills */
+    batch_count++;
+    if (batch_count == FLOW_BATCH) {
+      flow_batch_callback(flow_batch, batch_count);
+      batch_count = 0;
+    }
+  }
+
+  /* Handle whatever is left over */
+  if (batch_count > 0) {
+    flow_batch_callback(flow_batch, batch_count);
   }
 }
 
@@ -681,14 +792,17 @@ void parse_netflow_v5(const struct sockaddr_in *peer, const u_char *flow,
 void parse_netflow_v7(const struct sockaddr_in *peer, const u_char *flow,
 		      const size_t flow_size, const time_t recv_time) {
 
-  struct unified_flow current_flow;
+  struct unified_flow flow_batch[FLOW_BATCH];
+  struct unified_flow *current_flow;
   struct netflow_v7_record * record_v7;
+  struct exporter *ex;
 
   /* ===
    * Misc vars
    * ===
    */
   int records = 0;
+  int batch_count = 0;
   int i;
 
   /* ===
@@ -705,9 +819,14 @@ void parse_netflow_v7(const struct sockaddr_in *peer, const u_char *flow,
     return;
   }
 
+  /* v7 has no engine fields */
+  ex = exporter_get(peer->sin_addr.s_addr, 0, 0);
+  exporter_datagram(ex, 7, 0, flow_size, recv_time);
+
   records = ntohs(((struct netflow_v7 *)flow)->flow_count);
   if (flow_size != sizeof(struct netflow_v7) +
       (records * sizeof(struct netflow_v7_record))) {
+    exporter_error(ex);
     
     fprintf(stderr,
 	    "wrong size; flow_count=%d; flow_size=%d; v7=%d, v7r=%d\n",
@@ -717,6 +836,8 @@ void parse_netflow_v7(const struct sockaddr_in *peer, const u_char *flow,
     return;
   }
   /*fprintf(stderr, "Got a valid looking netflow v7 packet\n");*/
+  exporter_sequence(ex, ntohl(((struct netflow_v7 *)flow)->flow_sequence),
+		    records);
   
 
   /* ===
@@ -729,93 +850,134 @@ void parse_netflow_v7(const struct sockaddr_in *peer, const u_char *flow,
   for (i = 0; i < records; i++) {
     
     /* Fill in our current flow info */
-    current_flow.flow_src = ntohl(record_v7[i].flow_src);
-    current_flow.recv_time = recv_time;
-    current_flow.src_int = ntohs(record_v7[i].src_int);
-    current_flow.dst_int = ntohs(record_v7[i].dst_int);
-    current_flow.src_addr.s_addr = ntohl(record_v7[i].src_addr);
-    current_flow.dst_addr.s_addr = ntohl(record_v7[i].dst_addr);
-    current_flow.protocol = record_v7[i].protocol;
-    current_flow.src_port = ntohs(record_v7[i].src_port);
-    current_flow.dst_port = ntohs(record_v7[i].dst_port);
-    current_flow.tcp_flags = record_v7[i].tcp_flags;
-    current_flow.num_packets = ntohl(record_v7[i].num_packets);
-    current_flow.num_bytes = ntohl(record_v7[i].num_bytes);
+    current_flow = &(flow_batch[batch_count]);
+    current_flow->flow_src = ntohl(record_v7[i].flow_src);
+    current_flow->recv_time = recv_time;
+    current_flow->src_int = ntohs(record_v7[i].src_int);
+    current_flow->dst_int = ntohs(record_v7[i].dst_int);
+    current_flow->src_addr.s_addr = ntohl(record_v7[i].src_addr);
+    current_flow->dst_addr.s_addr = ntohl(record_v7[i].dst_addr);
+    current_flow->protocol = record_v7[i].protocol;
+    current_flow->src_port = ntohs(record_v7[i].src_port);
+    current_flow->dst_port = ntohs(record_v7[i].dst_port);
+    current_flow->tcp_flags = record_v7[i].tcp_flags;
+    current_flow->src_as = ntohs(record_v7[i].src_as);
+    current_flow->dst_as = ntohs(record_v7[i].dst_as);
+    current_flow->num_packets = ntohl(record_v7[i].num_packets);
+    current_flow->num_bytes = ntohl(record_v7[i].num_bytes);
 
     /* Time calculations require a bit of math, namely
      * curtime - ((uptime - start) / 1000)
      */
-    current_flow.start_time = ntohl(((struct netflow_v7 *)flow)->unix_sec) -
+    current_flow->start_time = ntohl(((struct netflow_v7 *)flow)->unix_sec) -
       (((ntohl(((struct netflow_v7 *)flow)->uptime) -		\
 	 ntohl(record_v7[i].start_time)) & 0xFFFFFFFF) / 1000);
-    current_flow.end_time = ntohl(((struct netflow_v7 *)flow)->unix_sec) -
+    current_flow->end_time = ntohl(((struct netflow_v7 *)flow)->unix_sec) -
       (((ntohl(((struct netflow_v7 *)flow)->uptime) -		\
 	 ntohl(record_v7[i].end_time)) & 0xFFFFFFFF) / 1000);
 
-    /* Now handle the current unified flow */
-    flow_callback(&current_flow);
+    /* Now handle the current batch of unified flows once it fills */
+    batch_count++;
+    if (batch_count == FLOW_BATCH) {
+      flow_batch_callback(flow_batch, batch_count);
+      batch_count = 0;
+    }
+  }
+
+  /* Handle whatever is left over */
+  if (batch_count > 0) {
+    flow_batch_callback(flow_batch, batch_count);
   }
 }
 
 
-void flow_callback(const struct unified_flow *current_flow) {
+void flow_batch_callback(const struct unified_flow *flows,
+			 const int flow_count) {
 
   /* ===
-   * Flow tree and summary vars
+   * Exclusion lookup vars
    * ===
    */
-  struct flow_summary cur_flow_summary;
-  struct flow_summary *flow_summary_copy;
-  struct flow_summary **flow_summary_probe;
-  struct flow_source_summary *new_flow_source_summary;
-  struct flow_source_summary **cur_flow_source_summary;
-  int tree_num;
+  in_addr_t addrs[FLOW_BATCH * 2];
+  uint16_t ex_results[FLOW_BATCH * 2];
+  struct filter_prog *filter;
+  struct flow_stats *stats = stats_mine();
+  uint64_t hist_time;
+  int i;
 
   /* ===
-   * Misc vars
+   * Update the stats that we got some flows
    * ===
    */
-  struct in_addr temp_inaddr_src, temp_inaddr_dst;
-  int source_updated;
+  stat_add(&(stats->total_flows), flow_count);
+
 
   /* ===
-   * Update the stats that we got a flow
-   * ===
+   * Check all of the addresses in this batch against the exclusions
+   * in one pass.  The src of flow i lands at 2i and the dst at 2i + 1
+   * === 
    */
-  stat_total_flows += 1;
+  for (i = 0; i < flow_count; i++) {
+    addrs[i * 2] = flows[i].src_addr.s_addr;
+    addrs[i * 2 + 1] = flows[i].dst_addr.s_addr;
+  }
 
+  exclude_lookup_batch(__atomic_load_n(&exclude_idx, __ATOMIC_ACQUIRE),
+		       addrs, ex_results, flow_count * 2);
 
-  temp_inaddr_src.s_addr = htonl(current_flow->src_addr.s_addr);
-  temp_inaddr_dst.s_addr = htonl(current_flow->dst_addr.s_addr);
-  /*
-    fprintf(stderr, "Got proto %d flow from %s:%d",
-    current_flow->protocol,
-    inet_ntoa(temp_inaddr_src),
-    current_flow->src_port);
-    fprintf(stderr, " to %s:%d (%u to %u)\n",
-    inet_ntoa(temp_inaddr_dst),
-    current_flow->dst_port,
-    (unsigned int)current_flow->start_time,
-    (unsigned int)current_flow->end_time);
-  */
+
+  /* Now run the filter and hand off whatever survives */
+  filter = __atomic_load_n(&flow_filter, __ATOMIC_ACQUIRE);
+
+  for (i = 0; i < flow_count; i++) {
+    if ((ex_results[i * 2] != 0) || (ex_results[i * 2 + 1] != 0)) {
+      stat_add(&(stats->excluded_flows), 1);
+
+      continue;
+    }
+
+    if ((filter != NULL) && (filter_match(filter, &(flows[i])) == 0)) {
+      stat_add(&(stats->filtered_flows), 1);
+
+      continue;
+    }
+
+    hist_time = hist_start(HIST_FLOW);
+    flow_callback(&(flows[i]));
+    hist_record(HIST_FLOW, hist_time);
+  }
+}
 
 
+void flow_callback(const struct unified_flow *current_flow) {
+
   /* ===
-   * Check to see if this flow is excluded
-   * === 
+   * Flow tree and summary vars
+   * ===
    */
-  if ((is_excluded(current_flow->src_addr.s_addr) == 1) ||
-      (is_excluded(current_flow->dst_addr.s_addr) == 1)) {
+  struct flow_summary cur_flow_summary;
+  struct flow_summary *flow_summary_copy;
+  struct flow_summary **flow_summary_probe;
+  struct flow_source_summary *new_flow_source_summary;
+  struct flow_source_summary **cur_flow_source_summary;
+  int tree_num;
+  int reverse = 0; /* -b, this record goes the other way */
 
-    /*
-    fprintf(stderr, "excluded %s -> ", inet_ntoa(temp_inaddr_src));
-    fprintf(stderr, "%s\n", inet_ntoa(temp_inaddr_dst));
-    */
+  /* ===
+   * Misc vars
+   * ===
+   */
+  struct flow_stats *stats;
+  uint64_t hist_time;
+  int source_updated;
 
-    stat_excluded_flows += 1;
 
-    return;
-  }
+  /* Heavy hitters, distinct counts, rollups and the interface matrices
+   * see every record, merged or not */
+  topk_record(current_flow);
+  hll_record(current_flow);
+  rollup_record(current_flow);
+  matrix_record(current_flow);
 
 
   /* ===
@@ -832,6 +994,7 @@ void flow_callback(const struct unified_flow *current_flow) {
   cur_flow_summary.src_port = current_flow->src_port;
   cur_flow_summary.dst_port = current_flow->dst_port;
   cur_flow_summary.tcp_flags = current_flow->tcp_flags;
+  cur_flow_summary.rev_tcp_flags = 0;
   cur_flow_summary.start_time = current_flow->start_time;
   cur_flow_summary.end_time = current_flow->end_time;
   cur_flow_summary.source_count = 0; /* gets updated later */
@@ -841,10 +1004,12 @@ void flow_callback(const struct unified_flow *current_flow) {
   flow_summary_copy = copy_flow(&cur_flow_summary, NULL);
 
   /* Figure out which tree to use */
-  tree_num = TREEHASH(flow_summary_copy);
+  tree_num = flow_tree_num(flow_summary_copy);
    
   /* === *** ACQUIRE TREE LOCK *** === */
-  pthread_mutex_lock(&(flow_hash_trees[tree_num].tree_mutex));
+  hist_time = hist_start(HIST_TREE_LOCK);
+  tree_lock(tree_num, LOCK_RECEIVE);
+  hist_record(HIST_TREE_LOCK, hist_time);
 
   /* Search and possibly insert this flow */
   flow_summary_probe =
@@ -867,17 +1032,10 @@ void flow_callback(const struct unified_flow *current_flow) {
     /* well that was easy, nothing fancy to do now */
 
     /* should increment new flow counters */
-    stat_new_flows++;
-
-    /* === *** ACQUIRE STATS LOCK *** === */
-    pthread_mutex_lock(&stat_current_mutex);
-
-    stat_current_flows++;
-
-    /* === *** UNLOCK STATS LOCK *** === */
-    pthread_mutex_unlock(&stat_current_mutex);
-
-    stat_proto_flows[(*flow_summary_probe)->protocol] += 1;
+    stats = stats_mine();
+    stat_add(&(stats->new_flows), 1);
+    stat_add(&(stats->current_flows), 1);
+    stat_add(&(stats->proto_flows[(*flow_summary_probe)->protocol]), 1);
   }
   else {
     /* fprintf(stderr, "Flow already in tree; flows=%u\n",
@@ -885,11 +1043,24 @@ void flow_callback(const struct unified_flow *current_flow) {
     */
 
     /* update the stats */
-    stat_dup_flows++;
+    stat_add(&(stats_mine()->dup_flows), 1);
 
       
+    /* With -b the flow in the tree may be the other way round */
+    if ((biflow_enabled != 0) &&
+	(((*flow_summary_probe)->src_addr.s_addr !=
+	  flow_summary_copy->src_addr.s_addr) ||
+	 ((*flow_summary_probe)->src_port != flow_summary_copy->src_port))) {
+      reverse = 1;
+    }
+
     /* update some summay stuff about this flow */
-    (*flow_summary_probe)->tcp_flags |= flow_summary_copy->tcp_flags;
+    if (reverse == 0) {
+      (*flow_summary_probe)->tcp_flags |= flow_summary_copy->tcp_flags;
+    }
+    else {
+      (*flow_summary_probe)->rev_tcp_flags |= flow_summary_copy->tcp_flags;
+    }
     if ((*flow_summary_probe)->start_time > flow_summary_copy->start_time) {
       (*flow_summary_probe)->start_time = flow_summary_copy->start_time;
     }
@@ -933,9 +1104,19 @@ void flow_callback(const struct unified_flow *current_flow) {
     else if (current_flow->flow_src ==
 	     (*cur_flow_source_summary)->flow_src) {
       /* We need to update this flow source */
-      (*cur_flow_source_summary)->num_packets += current_flow->num_packets;
-      (*cur_flow_source_summary)->num_bytes += current_flow->num_bytes;
-      (*cur_flow_source_summary)->num_flows += 1;
+      if (reverse == 0) {
+	(*cur_flow_source_summary)->num_packets += current_flow->num_packets;
+	(*cur_flow_source_summary)->num_bytes += current_flow->num_bytes;
+	(*cur_flow_source_summary)->num_flows += 1;
+	if ((*cur_flow_source_summary)->bins != NULL) {
+	  bins_add((*cur_flow_source_summary)->bins, current_flow);
+	}
+      }
+      else {
+	(*cur_flow_source_summary)->rev_packets += current_flow->num_packets;
+	(*cur_flow_source_summary)->rev_bytes += current_flow->num_bytes;
+	(*cur_flow_source_summary)->rev_flows += 1;
+      }
       
       source_updated = 1;
       break;
@@ -952,18 +1133,41 @@ void flow_callback(const struct unified_flow *current_flow) {
     
     /* Set the new fields */
     new_flow_source_summary->flow_src = current_flow->flow_src;
-    new_flow_source_summary->src_int = current_flow->src_int;
-    new_flow_source_summary->dst_int = current_flow->dst_int;
-    new_flow_source_summary->num_packets = current_flow->num_packets;
-    new_flow_source_summary->num_bytes = current_flow->num_bytes;
-    new_flow_source_summary->num_flows = 1;
+    if (reverse == 0) {
+      new_flow_source_summary->src_int = current_flow->src_int;
+      new_flow_source_summary->dst_int = current_flow->dst_int;
+      new_flow_source_summary->num_packets = current_flow->num_packets;
+      new_flow_source_summary->num_bytes = current_flow->num_bytes;
+      new_flow_source_summary->num_flows = 1;
+      new_flow_source_summary->rev_packets = 0;
+      new_flow_source_summary->rev_bytes = 0;
+      new_flow_source_summary->rev_flows = 0;
+    }
+    else {
+      /* The interfaces are kept the forward way round too */
+      new_flow_source_summary->src_int = current_flow->dst_int;
+      new_flow_source_summary->dst_int = current_flow->src_int;
+      new_flow_source_summary->num_packets = 0;
+      new_flow_source_summary->num_bytes = 0;
+      new_flow_source_summary->num_flows = 0;
+      new_flow_source_summary->rev_packets = current_flow->num_packets;
+      new_flow_source_summary->rev_bytes = current_flow->num_bytes;
+      new_flow_source_summary->rev_flows = 1;
+    }
+    new_flow_source_summary->bins = bins_new();
+    if ((new_flow_source_summary->bins != NULL) && (reverse == 0)) {
+      bins_add(new_flow_source_summary->bins, current_flow);
+    }
     
     /* Now insert this into the list */
     new_flow_source_summary->next = *cur_flow_source_summary;
     *cur_flow_source_summary = new_flow_source_summary;
     
-    /* Update the source count for the flow */
-    (*flow_summary_probe)->source_count += 1;
+    /* Update the source count for the flow, it's only a byte and the
+     * binary export stops at FTBIN_MAX_SOURCES anyway */
+    if ((*flow_summary_probe)->source_count < FTBIN_MAX_SOURCES) {
+      (*flow_summary_probe)->source_count += 1;
+    }
   }
 
   /* === *** RELEASE TREE LOCK *** === */
@@ -978,6 +1182,168 @@ void sig_terminate(int signo) {
 }
 
 
+void sig_reload(int signo) {
+  /* The main loop does the actual reload */
+  reload_pending = 1;
+}
+
+
+void sig_histograms(int signo) {
+  /* Recording checks this every time, nothing else to do */
+  hist_enabled = !hist_enabled;
+}
+
+
+void usage(const char *prog) {
+
+  fprintf(stderr, "usage: %s [options]\n", prog);
+  fprintf(stderr, "  -x <file>  exclusion ranges file (default %s)\n",
+	  EXCLUDEFILE);
+  fprintf(stderr, "  -f <expr>  only keep flows matching this filter\n");
+  fprintf(stderr, "  -F <file>  read the filter from a file instead\n");
+  fprintf(stderr, "  -A <file>  only accept datagrams from exporters in "
+	  "these ranges\n");
+  fprintf(stderr, "  -o <fmt>   export format, json, binary or ipfix "
+	  "(default json)\n");
+  fprintf(stderr, "  -m <size>  max export datagram size (default %d)\n",
+	  EXPORT_DGRAM_SIZE);
+  fprintf(stderr, "  -s <sink>  export to this sink, can be repeated "
+	  "(default udp:127.0.0.1:2056)\n");
+  fprintf(stderr, "             udp:<addr>:<port>, tcp:<addr>:<port>, "
+	  "unix:<path>, file:<path> or\n");
+  fprintf(stderr, "             archive:<dir> (,rotate=<secs> "
+	  ",compress=gzip|none ,level=<1-9> ,direct=1\n");
+  fprintf(stderr, "             ,columnar=1) or shm:<name> (,slots=<num>)\n");
+  fprintf(stderr, "             then ,policy=block|drop|spill ,queue=<num> "
+	  ",rate=<num> ,spill=<file>\n");
+  fprintf(stderr, "             ,format=json|binary|ipfix\n");
+  fprintf(stderr, "  -q <num>   default sink queue size in datagrams "
+	  "(default %d)\n", SINK_QUEUE_SLOTS);
+  fprintf(stderr, "  -r <rate>  default sink pacing in datagrams per "
+	  "second (default unpaced)\n");
+  fprintf(stderr, "  -M <[addr:]port>  serve Prometheus metrics over HTTP "
+	  "(addr defaults to %s)\n", METRICS_ADDR);
+  fprintf(stderr, "  -H <num>   time 1 in <num> of each pipeline stage for "
+	  "the latency histograms\n");
+  fprintf(stderr, "  -L         profile the tree locks and report the "
+	  "hottest trees\n");
+  fprintf(stderr, "  -C <path>  answer live flow queries on this unix "
+	  "socket\n");
+  fprintf(stderr, "  -K <secs>  send top talker summaries every <secs> "
+	  "seconds (json sinks only)\n");
+  fprintf(stderr, "  -D <num>[:<entries>]  alert on addresses with <num> "
+	  "distinct peers or ports\n             in a minute, tracking "
+	  "<entries> of each (default %d, json sinks only)\n", HLL_ENTRIES);
+  fprintf(stderr, "  -R <name>=<field>[,<field>...][@<secs>][:<entries>]\n"
+	  "             send byte, packet and record totals per key every "
+	  "<secs> (default %d),\n             can be repeated; fields are "
+	  "exporter, src[/len], dst[/len], src_int,\n             dst_int, "
+	  "src_as, dst_as, proto, src_port and dst_port (json sinks only)\n",
+	  ROLLUP_INTERVAL);
+  fprintf(stderr, "  -I <secs>  send per exporter interface traffic "
+	  "matrices every <secs> seconds\n             (json sinks only)\n");
+  fprintf(stderr, "  -T <secs>  keep each flow's bytes and packets in "
+	  "<secs> wide bins, up to %d\n             of them (json sinks "
+	  "only)\n", FLOW_BINS);
+  fprintf(stderr, "  -b         keep both directions of a conversation in "
+	  "one flow, with\n             separate counters for the reverse "
+	  "direction\n");
+  fprintf(stderr, "  -B <name>  run a benchmark and exit (filter, json, "
+	  "topk, hll,\n             rollup, matrix)\n");
+  fprintf(stderr, "  -h         show this help\n");
+  fprintf(stderr, "Send SIGHUP to reload the exclusions, filter file "
+	  "and allowlist.\n");
+  fprintf(stderr, "Send SIGUSR1 to turn the latency histograms off and "
+	  "on.\n");
+}
+
+
+int load_socket_filter(void) {
+
+  struct pavl_table *allow_tree = NULL;
+  int ret;
+
+  if (allow_file != NULL) {
+    if ((allow_tree = load_range_file(allow_file, 0)) == NULL) {
+      return -1;
+    }
+  }
+
+  ret = attach_socket_filter(sock_fh, allow_tree);
+
+  if (allow_tree != NULL) {
+    pavl_destroy(allow_tree, free_exclusion);
+  }
+
+  return ret;
+}
+
+
+struct filter_prog *load_filter(void) {
+
+  struct filter_prog *prog;
+  char err[256];
+
+  if (filter_file != NULL) {
+    prog = filter_load_file(filter_file, err, sizeof(err));
+  }
+  else {
+    prog = filter_compile(filter_expr, err, sizeof(err));
+  }
+
+  if (prog == NULL) {
+    fprintf(stderr, "Bad flow filter: %s\n", err);
+  }
+  else {
+    fprintf(stderr, "Compiled flow filter to %d instructions\n", prog->len);
+  }
+
+  return prog;
+}
+
+
+void reload_config(void) {
+
+  struct exclude_index *new_idx;
+  struct filter_prog *new_filter;
+
+  fprintf(stderr, "Reloading exclusions from %s\n", exclude_file);
+
+  /* Build the new index off to the side, the old one stays in use
+   * if anything goes wrong, including the file having gone missing */
+  if ((new_idx = load_exclude_index(exclude_file, 0)) == NULL) {
+    fprintf(stderr, "Reloading exclusions failed, keeping the old ones.\n");
+  }
+  else {
+    rcu_publish((void **)&exclude_idx, new_idx, free_exclude_index_rcu);
+  }
+
+  /* Attaching a new program replaces the old one atomically */
+  if (allow_file != NULL) {
+    fprintf(stderr, "Reloading exporter allowlist from %s\n", allow_file);
+
+    if (load_socket_filter() != 0) {
+      fprintf(stderr, "Reloading the allowlist failed, "
+	      "keeping the old one.\n");
+    }
+  }
+
+  /* Only a filter that came from a file can change */
+  if (filter_file != NULL) {
+    fprintf(stderr, "Reloading flow filter from %s\n", filter_file);
+
+    if ((new_filter = load_filter()) == NULL) {
+      fprintf(stderr, "Reloading the filter failed, keeping the old one.\n");
+    }
+    else {
+      rcu_publish((void **)&flow_filter, new_filter, filter_free_rcu);
+    }
+  }
+
+  rcu_reclaim();
+}
+
+
 int compare_flows(const void *a, const void *b, void *param) {
 
   const struct flow_summary *fa = a;
@@ -1019,8 +1385,95 @@ int compare_flows(const void *a, const void *b, void *param) {
 }
 
 
-void * copy_flow(const void *a, void *param) {
-  
+/* Which endpoint of a flow sorts first, 1 if it's the destination */
+int flow_endpoint_order(const struct flow_summary *f) {
+
+  if (f->src_addr.s_addr != f->dst_addr.s_addr) {
+    return (f->src_addr.s_addr > f->dst_addr.s_addr) ? 1 : 0;
+  }
+
+  return (f->src_port > f->dst_port) ? 1 : 0;
+}
+
+
+/* Like compare_flows() but on the lower endpoint then the higher one, so
+ * A->B and B->A compare equal */
+int compare_biflows(const void *a, const void *b, void *param) {
+
+  const struct flow_summary *fa = a;
+  const struct flow_summary *fb = b;
+  in_addr_t a_lo, a_hi, b_lo, b_hi;
+  uint16_t a_lo_port, a_hi_port, b_lo_port, b_hi_port;
+
+  if (fa->protocol != fb->protocol) {
+    return (fa->protocol > fb->protocol) ? 1 : -1;
+  }
+
+  if (flow_endpoint_order(fa) == 0) {
+    a_lo = fa->src_addr.s_addr;
+    a_hi = fa->dst_addr.s_addr;
+    a_lo_port = fa->src_port;
+    a_hi_port = fa->dst_port;
+  }
+  else {
+    a_lo = fa->dst_addr.s_addr;
+    a_hi = fa->src_addr.s_addr;
+    a_lo_port = fa->dst_port;
+    a_hi_port = fa->src_port;
+  }
+
+  if (flow_endpoint_order(fb) == 0) {
+    b_lo = fb->src_addr.s_addr;
+    b_hi = fb->dst_addr.s_addr;
+    b_lo_port = fb->src_port;
+    b_hi_port = fb->dst_port;
+  }
+  else {
+    b_lo = fb->dst_addr.s_addr;
+    b_hi = fb->src_addr.s_addr;
+    b_lo_port = fb->dst_port;
+    b_hi_port = fb->src_port;
+  }
+
+  if (a_lo != b_lo) {
+    return (a_lo > b_lo) ? 1 : -1;
+  }
+  else if (a_hi != b_hi) {
+    return (a_hi > b_hi) ? 1 : -1;
+  }
+  else if (a_lo_port != b_lo_port) {
+    return (a_lo_port > b_lo_port) ? 1 : -1;
+  }
+  else if (a_hi_port != b_hi_port) {
+    return (a_hi_port > b_hi_port) ? 1 : -1;
+  }
+  else {
+    return 0;
+  }
+}
+
+
+/* The tree a flow lives in, with -b both directions hash the same */
+int flow_tree_num(const struct flow_summary *f) {
+
+  struct flow_summary canon;
+
+  if ((biflow_enabled == 0) || (flow_endpoint_order(f) == 0)) {
+    return TREEHASH(f);
+  }
+
+  canon.src_addr = f->dst_addr;
+  canon.dst_addr = f->src_addr;
+  canon.src_port = f->dst_port;
+  canon.dst_port = f->src_port;
+  canon.protocol = f->protocol;
+
+  return TREEHASH(&canon);
+}
+
+
+void * copy_flow(const void *a, void *param) {
+  
   struct flow_summary *f = malloc(sizeof(struct flow_summary));
 
   if (f == NULL) {
@@ -1052,7 +1505,8 @@ int compare_excludes(const void *a, const void *b, void *param) {
 }
 
 
-void add_exclusion(const in_addr_t addr_start, const in_addr_t addr_end) {
+void add_exclusion(struct pavl_table *ex_tree, const in_addr_t addr_start,
+		   const in_addr_t addr_end) {
 
   struct exclude_node *ex;
   struct exclude_node *ex_del;
@@ -1062,10 +1516,9 @@ void add_exclusion(const in_addr_t addr_start, const in_addr_t addr_end) {
 
   ex->addr_start = addr_start;
   ex->addr_end = addr_end;
-  ex->exclude_count = 0;
 
   /* Search for and possibly insert this exclude */
-  ex_probe = (struct exclude_node **)pavl_probe(exclude_tree, ex);
+  ex_probe = (struct exclude_node **)pavl_probe(ex_tree, ex);
   
   /* Figure out what happened */
   if (ex_probe == NULL) {
@@ -1089,10 +1542,10 @@ void add_exclusion(const in_addr_t addr_start, const in_addr_t addr_end) {
     }
 
     /* Now remove the old exclude */
-    ex_del = (struct exclude_node *)pavl_delete(exclude_tree, *ex_probe);
+    ex_del = (struct exclude_node *)pavl_delete(ex_tree, *ex_probe);
 
     /* Now insert this new combined exclude */
-    add_exclusion(ex->addr_start, ex->addr_end);
+    add_exclusion(ex_tree, ex->addr_start, ex->addr_end);
     
     /* cleanup */
     free(ex);
@@ -1104,25 +1557,517 @@ void add_exclusion(const in_addr_t addr_start, const in_addr_t addr_end) {
 }
 
 
-int is_excluded(const in_addr_t check_addr) {
+void free_exclusion(void *ex, void *param) {
+  free(ex);
+}
 
-  struct exclude_node check_ex;
-  struct exclude_node *ex_search;
 
-  check_ex.addr_start = check_addr;
-  check_ex.addr_end = check_addr;
-  check_ex.exclude_count = 0;
+int parse_addr_range(const char *str, in_addr_t *addr_start,
+		     in_addr_t *addr_end) {
 
-  ex_search = (struct exclude_node *)pavl_find(exclude_tree, &check_ex);
+  char buff[64];
+  char *sep;
+  struct in_addr temp_inaddr;
+  int len = 0;
+  int masklen;
 
-  if (ex_search == NULL) {
-    return 0;
+  /* Make a copy without any whitespace in it */
+  while ((*str != '\0') && (len < (int)sizeof(buff) - 1)) {
+    if (isspace((unsigned char)*str) == 0) {
+      buff[len++] = *str;
+    }
+    str++;
+  }
+  buff[len] = '\0';
+
+  /* Too long to be an address range, don't just cut it short */
+  while (isspace((unsigned char)*str) != 0) {
+    str++;
+  }
+  if (*str != '\0') {
+    return -1;
+  }
+
+  if ((sep = strchr(buff, '/')) != NULL) {
+    /* CIDR style a.b.c.d/len, and an empty len isn't /0 */
+    *sep = '\0';
+    if ((sep[1] == '\0') || (strlen(sep + 1) > 2) ||
+	(strspn(sep + 1, "0123456789") != strlen(sep + 1))) {
+      return -1;
+    }
+    masklen = atoi(sep + 1);
+
+    if ((inet_pton(AF_INET, buff, &temp_inaddr) != 1) ||
+	(masklen < 0) || (masklen > 32)) {
+      return -1;
+    }
+
+    *addr_start = ntohl(temp_inaddr.s_addr);
+    if (masklen == 0) {
+      *addr_start = 0;
+      *addr_end = 0xFFFFFFFF;
+    }
+    else {
+      *addr_start &= 0xFFFFFFFF << (32 - masklen);
+      *addr_end = *addr_start | (0xFFFFFFFF >> masklen);
+    }
+  }
+  else if ((sep = strchr(buff, '-')) != NULL) {
+    /* Range style a.b.c.d-e.f.g.h */
+    *sep = '\0';
+
+    if (inet_pton(AF_INET, buff, &temp_inaddr) != 1) {
+      return -1;
+    }
+    *addr_start = ntohl(temp_inaddr.s_addr);
+
+    if (inet_pton(AF_INET, sep + 1, &temp_inaddr) != 1) {
+      return -1;
+    }
+    *addr_end = ntohl(temp_inaddr.s_addr);
+
+    if (*addr_start > *addr_end) {
+      return -1;
+    }
   }
   else {
-    ex_search->exclude_count += 1;
-    return 1;
+    /* Just a single address */
+    if (inet_pton(AF_INET, buff, &temp_inaddr) != 1) {
+      return -1;
+    }
+    *addr_start = ntohl(temp_inaddr.s_addr);
+    *addr_end = *addr_start;
+  }
+
+  return 0;
+}
+
+
+struct pavl_table *load_range_file(const char *path, const int missing_ok) {
+
+  struct pavl_table *ex_tree;
+  FILE *ex_fh;
+  char line[256];
+  char *cur;
+  in_addr_t addr_start, addr_end;
+  int line_num = 0;
+
+  ex_tree = pavl_create(compare_excludes, NULL, NULL);
+  if (ex_tree == NULL) {
+    return NULL;
+  }
+
+  /* Some callers are fine with no file, it's just no ranges */
+  if ((ex_fh = fopen(path, "r")) == NULL) {
+    if (missing_ok != 0) {
+      fprintf(stderr, "Unable to open %s, treating it as empty.\n", path);
+      return ex_tree;
+    }
+
+    fprintf(stderr, "Unable to open %s.\n", path);
+    pavl_destroy(ex_tree, free_exclusion);
+    return NULL;
+  }
+
+  /* One range per line: a.b.c.d, a.b.c.d/len or a.b.c.d - e.f.g.h */
+  while (fgets(line, sizeof(line), ex_fh) != NULL) {
+    line_num++;
+
+    /* Strip comments and leading whitespace */
+    if ((cur = strchr(line, '#')) != NULL) {
+      *cur = '\0';
+    }
+    cur = line;
+    while (isspace((unsigned char)*cur) != 0) {
+      cur++;
+    }
+    if (*cur == '\0') {
+      continue;
+    }
+
+    if (parse_addr_range(cur, &addr_start, &addr_end) != 0) {
+      fprintf(stderr, "%s:%d: bad address range\n", path, line_num);
+      fclose(ex_fh);
+      pavl_destroy(ex_tree, free_exclusion);
+      return NULL;
+    }
+
+    add_exclusion(ex_tree, addr_start, addr_end);
+  }
+
+  fclose(ex_fh);
+
+  return ex_tree;
+}
+
+
+struct exclude_index *load_exclude_index(const char *path,
+				       const int missing_ok) {
+
+  struct pavl_table *ex_tree;
+  struct exclude_index *idx;
+
+  /* At startup no exclusion file just means nothing gets excluded */
+  if ((ex_tree = load_range_file(path, missing_ok)) == NULL) {
+    return NULL;
+  }
+
+  /* The index keeps its own copy of the ranges */
+  idx = build_exclude_index(ex_tree);
+  pavl_destroy(ex_tree, free_exclusion);
+
+  if (idx != NULL) {
+    fprintf(stderr, "Loaded %d exclusion ranges\n", idx->range_count);
+  }
+
+  return idx;
+}
+
+
+/* The clock everything that times itself uses */
+uint64_t monotonic_ns(void) {
+
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+
+  return ((uint64_t)now.tv_sec * 1000000000) + now.tv_nsec;
+}
+
+
+int thread_slot(void) {
+
+  /* Hand out slots the first time a thread asks for one */
+  if (thread_slot_id < 0) {
+    thread_slot_id = __sync_fetch_and_add(&thread_slots_used, 1);
+
+    if (thread_slot_id >= MAX_THREADS) {
+      fprintf(stderr, "Out of thread slots, sharing the last one.\n");
+      thread_slot_id = MAX_THREADS - 1;
+    }
+  }
+
+  return thread_slot_id;
+}
+
+
+/* -1 if a new tbl8 group couldn't be allocated, idx is left as it was */
+int exclude_set_tbl8(struct exclude_index *idx, const uint32_t addr24,
+		     const int low, const int high, const uint16_t val) {
+
+  uint16_t *tbl8;
+  uint16_t entry;
+  int group;
+  int i;
+
+  entry = idx->tbl24[addr24];
+
+  /* This /24 doesn't have a tbl8 group yet so make one that inherits
+   * whatever the /24 used to point at */
+  if ((entry & EXCLUDE_TBL8_FLAG) == 0) {
+
+    if (idx->tbl8_groups == idx->tbl8_alloc) {
+      if ((tbl8 = realloc(idx->tbl8, idx->tbl8_alloc * 2 * 256 *
+			  sizeof(uint16_t))) == NULL) {
+	return -1;
+      }
+      idx->tbl8 = tbl8;
+      idx->tbl8_alloc *= 2;
+    }
+
+    group = idx->tbl8_groups;
+    idx->tbl8_groups++;
+
+    for (i = 0; i < 256; i++) {
+      idx->tbl8[(group << 8) | i] = entry;
+    }
+
+    idx->tbl24[addr24] = EXCLUDE_TBL8_FLAG | group;
+  }
+  else {
+    group = entry & ~EXCLUDE_TBL8_FLAG;
+  }
+
+  for (i = low; i <= high; i++) {
+    idx->tbl8[(group << 8) | i] = val;
+  }
+
+  return 0;
+}
+
+
+struct exclude_index *build_exclude_index(struct pavl_table *ex_tree) {
+
+  struct exclude_index *idx;
+  struct pavl_traverser traverser;
+  struct exclude_node *ex;
+  uint32_t first24, last24, cur24;
+  uint16_t val;
+  int failed;
+  int i;
+
+  idx = calloc(1, sizeof(struct exclude_index));
+  if (idx == NULL) {
+    return NULL;
+  }
+
+  /* calloc() so the untouched parts of the table stay as zero pages */
+  idx->tbl24 = calloc(EXCLUDE_TBL24_SIZE, sizeof(uint16_t));
+  idx->tbl8_alloc = 16;
+  idx->tbl8 = malloc(idx->tbl8_alloc * 256 * sizeof(uint16_t));
+  idx->range_count = pavl_count(ex_tree);
+  idx->ranges = malloc((idx->range_count + 1) *
+		       sizeof(struct exclude_node));
+
+  if ((idx->tbl24 == NULL) || (idx->tbl8 == NULL) ||
+      (idx->ranges == NULL)) {
+    free_exclude_index(idx);
+    return NULL;
+  }
+
+  if (idx->range_count > EXCLUDE_MAX_RANGES) {
+    fprintf(stderr, "Too many exclusion ranges (%d), max is %d.\n",
+	    idx->range_count, EXCLUDE_MAX_RANGES);
+    free_exclude_index(idx);
+    return NULL;
+  }
+
+  /* The tree hands the merged ranges back in order */
+  i = 0;
+  pavl_t_init(&traverser, ex_tree);
+  while ((ex = (struct exclude_node *)pavl_t_next(&traverser)) != NULL) {
+    idx->ranges[i] = *ex;
+    val = i + 1;
+
+    first24 = ex->addr_start >> 8;
+    last24 = ex->addr_end >> 8;
+    failed = 0;
+
+    if (first24 == last24) {
+      /* The whole range lives inside one /24 */
+      if (((ex->addr_start & 0xFF) == 0) && ((ex->addr_end & 0xFF) == 0xFF)) {
+	idx->tbl24[first24] = val;
+      }
+      else {
+	failed |= exclude_set_tbl8(idx, first24, ex->addr_start & 0xFF,
+				   ex->addr_end & 0xFF, val);
+      }
+    }
+    else {
+      /* Partial head, whole /24s in the middle, partial tail */
+      cur24 = first24;
+      if ((ex->addr_start & 0xFF) != 0) {
+	failed |= exclude_set_tbl8(idx, first24, ex->addr_start & 0xFF,
+				   0xFF, val);
+	cur24++;
+      }
+
+      for (; cur24 < last24; cur24++) {
+	idx->tbl24[cur24] = val;
+      }
+
+      if ((ex->addr_end & 0xFF) != 0xFF) {
+	failed |= exclude_set_tbl8(idx, last24, 0, ex->addr_end & 0xFF,
+				   val);
+      }
+      else {
+	idx->tbl24[last24] = val;
+      }
+    }
+
+    if (failed != 0) {
+      fprintf(stderr, "Out of memory building the exclusion index.\n");
+      free_exclude_index(idx);
+      return NULL;
+    }
+
+    if (idx->tbl8_groups > EXCLUDE_MAX_TBL8) {
+      fprintf(stderr, "Exclusion ranges need too many tbl8 groups.\n");
+      free_exclude_index(idx);
+      return NULL;
+    }
+
+    i++;
+  }
+
+  return idx;
+}
+
+
+void free_exclude_index(struct exclude_index *idx) {
+
+  int i;
+
+  if (idx == NULL) {
+    return;
+  }
+
+  for (i = 0; i < MAX_THREADS; i++) {
+    free(idx->thread_hits[i]);
+  }
+
+  free(idx->tbl24);
+  free(idx->tbl8);
+  free(idx->ranges);
+  free(idx);
+}
+
+
+void free_exclude_index_rcu(void *idx) {
+  free_exclude_index((struct exclude_index *)idx);
+}
+
+
+uint64_t *exclude_thread_hits(struct exclude_index *idx) {
+
+  int slot = thread_slot();
+  size_t hits_size;
+
+  /* Each thread gets its own cache line aligned counters on first use */
+  if (idx->thread_hits[slot] == NULL) {
+    hits_size = ((idx->range_count * sizeof(uint64_t)) + CACHE_LINE) &
+      ~(CACHE_LINE - 1);
+
+    if (posix_memalign((void **)&(idx->thread_hits[slot]), CACHE_LINE,
+		       hits_size) != 0) {
+      return NULL;
+    }
+    memset(idx->thread_hits[slot], 0, hits_size);
+  }
+
+  return idx->thread_hits[slot];
+}
+
+
+void exclude_lookup_batch(struct exclude_index *idx, in_addr_t *addrs,
+			  uint16_t *results, const int count) {
+
+  uint64_t *hits;
+  int i;
+
+  /* First pass only touches tbl24 so the loads can all be in flight */
+  for (i = 0; i < count; i++) {
+    results[i] = idx->tbl24[addrs[i] >> 8];
   }
 
+  /* Second pass resolves the few that point into tbl8 */
+  for (i = 0; i < count; i++) {
+    if ((results[i] & EXCLUDE_TBL8_FLAG) != 0) {
+      results[i] = idx->tbl8[((results[i] & ~EXCLUDE_TBL8_FLAG) << 8) |
+			     (addrs[i] & 0xFF)];
+    }
+  }
+
+  /* Count the hits against each range */
+  hits = exclude_thread_hits(idx);
+  if (hits != NULL) {
+    for (i = 0; i < count; i++) {
+      if (results[i] != 0) {
+	hits[results[i] - 1] += 1;
+      }
+    }
+  }
+}
+
+
+uint64_t exclude_range_hits(const struct exclude_index *idx,
+			    const int range_id) {
+
+  uint64_t total = 0;
+  int i;
+
+  /* Sum up what every thread has seen */
+  for (i = 0; i < MAX_THREADS; i++) {
+    if (idx->thread_hits[i] != NULL) {
+      total += idx->thread_hits[i][range_id];
+    }
+  }
+
+  return total;
+}
+
+
+void rcu_read_lock(void) {
+
+  /* The seq_cst store keeps the pointer loads that follow from being
+   * done before the writer can see that we're here */
+  __atomic_store_n(&(rcu_readers[thread_slot()].epoch),
+		   __atomic_load_n(&rcu_epoch, __ATOMIC_SEQ_CST),
+		   __ATOMIC_SEQ_CST);
+}
+
+
+void rcu_read_unlock(void) {
+  __atomic_store_n(&(rcu_readers[thread_slot()].epoch), 0, __ATOMIC_RELEASE);
+}
+
+
+void rcu_publish(void **ptr, void *new_ptr, void (*free_func)(void *)) {
+
+  struct rcu_retired *retired;
+  void *old_ptr;
+
+  /* After this no new reader can find the old object */
+  old_ptr = __atomic_exchange_n(ptr, new_ptr, __ATOMIC_SEQ_CST);
+
+  if (old_ptr == NULL) {
+    return;
+  }
+
+  retired = malloc(sizeof(struct rcu_retired));
+  retired->ptr = old_ptr;
+  retired->free_func = free_func;
+
+  /* === *** ACQUIRE RETIRE LOCK *** === */
+  pthread_mutex_lock(&rcu_retire_mutex);
+
+  /* Readers that show up with this epoch or later never saw old_ptr */
+  retired->epoch = __atomic_add_fetch(&rcu_epoch, 1, __ATOMIC_SEQ_CST);
+  retired->next = rcu_retired_list;
+  rcu_retired_list = retired;
+
+  /* === *** RELEASE RETIRE LOCK *** === */
+  pthread_mutex_unlock(&rcu_retire_mutex);
+}
+
+
+void rcu_reclaim(void) {
+
+  struct rcu_retired **cur_retired;
+  struct rcu_retired *done;
+  uint64_t oldest_reader = UINT64_MAX;
+  uint64_t reader_epoch;
+  int i;
+
+  /* Find the oldest epoch any reader is still in */
+  for (i = 0; i < MAX_THREADS; i++) {
+    reader_epoch = __atomic_load_n(&(rcu_readers[i].epoch), __ATOMIC_SEQ_CST);
+
+    if ((reader_epoch != 0) && (reader_epoch < oldest_reader)) {
+      oldest_reader = reader_epoch;
+    }
+  }
+
+  /* === *** ACQUIRE RETIRE LOCK *** === */
+  pthread_mutex_lock(&rcu_retire_mutex);
+
+  /* Free everything nobody can still be looking at */
+  cur_retired = &rcu_retired_list;
+  while (*cur_retired != NULL) {
+    if ((*cur_retired)->epoch <= oldest_reader) {
+      done = *cur_retired;
+      *cur_retired = done->next;
+
+      done->free_func(done->ptr);
+      free(done);
+    }
+    else {
+      cur_retired = &((*cur_retired)->next);
+    }
+  }
+
+  /* === *** RELEASE RETIRE LOCK *** === */
+  pthread_mutex_unlock(&rcu_retire_mutex);
 }
 
 
@@ -1134,6 +2079,8 @@ void *thread_flow_janitor(void * arg) {
   int tree_num;
   struct pavl_traverser traverser;
   struct flow_summary *flow_last, *flow_cur;
+  uint64_t sweep_start_ns, sweep_ns;
+  uint64_t hist_time;
   int deleted;
 
   while (terminate == 0) {
@@ -1147,10 +2094,13 @@ void *thread_flow_janitor(void * arg) {
 
     deleted = 0;
     cur_time = time(NULL);
+    sweep_start_ns = monotonic_ns();
     for (tree_num = 0; tree_num < TREES; tree_num++) {
 
       /* === *** ACQUIRE TREE LOCK *** === */
-      pthread_mutex_lock(&(flow_hash_trees[tree_num].tree_mutex));      
+      hist_time = hist_start(HIST_TREE_LOCK);
+      tree_lock(tree_num, LOCK_JANITOR);
+      hist_record(HIST_TREE_LOCK, hist_time);
 
       pavl_t_init(&traverser, flow_hash_trees[tree_num].tree);
 
@@ -1173,7 +2123,9 @@ void *thread_flow_janitor(void * arg) {
 	   * (outputting comes later)
 	   * ===
 	   */
-	  print_flow_json(flow_last);
+	  hist_time = hist_start(HIST_EXPORT);
+	  export_flow(flow_last);
+	  hist_record(HIST_EXPORT, hist_time);
 
 	  /* Free the flow sources list */
 	  free_source_list(flow_last->sources);
@@ -1194,14 +2146,30 @@ void *thread_flow_janitor(void * arg) {
 
     } /* END for tree_num */
 
-    /* === *** ACQUIRE STATS LOCK *** === */
-    pthread_mutex_lock(&stat_current_mutex);
-    
-    /* Update current stats */
-    stat_current_flows -= deleted;
+    /* Last interval's heavy hitters, rollups and interface matrices, if
+     * it is over, and any alerts */
+    topk_export();
+    hll_export();
+    rollup_export();
+    matrix_export(cur_time);
+
+    /* Push out whatever is still sitting in a partial datagram */
+    export_flush();
+
+    sweep_ns = monotonic_ns() - sweep_start_ns;
+    hist_add(HIST_JANITOR, sweep_ns);
+    __atomic_store_n(&janitor_last_sweep_ns, sweep_ns, __ATOMIC_RELAXED);
+    __atomic_store_n(&janitor_sweep_ns, janitor_sweep_ns + sweep_ns,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&janitor_expired, janitor_expired + deleted,
+		     __ATOMIC_RELAXED);
+    __atomic_store_n(&janitor_sweeps, janitor_sweeps + 1, __ATOMIC_RELAXED);
 
-    /* === *** UNLOCK STATS LOCK *** === */
-    pthread_mutex_unlock(&stat_current_mutex);
+    /* Free anything retired by a reload that readers are done with */
+    rcu_reclaim();
+
+    /* Update current stats */
+    stat_sub(&(stats_mine()->current_flows), deleted);
     
 
   } /* END while terminate */
@@ -1221,6 +2189,7 @@ void free_source_list(struct flow_source_summary *f_source) {
     f_source = f_source->next; /* grab the next one */
 
     /* Get rid of the struct */
+    free(cur_f_source->bins);
     free(cur_f_source);
   }
 
@@ -1228,119 +2197,394 @@ void free_source_list(struct flow_source_summary *f_source) {
 }
 
 
-void print_flow_json(const struct flow_summary *flow) {
+/* ===
+ * The stats thread.  It snapshots the per-thread counters every
+ * STATS_RATE and prints them so the receive loop never has to.
+ * ===
+ */
+void *thread_stats(void *arg) {
 
-  /* === Misc vars === */
-  struct flow_source_summary *flow_source;
-  struct in_addr temp_inaddr_src, temp_inaddr_dst, temp_inaddr_flow;
-  char outbuff[SENDBUFFSIZE + 1];
-  int outindex;
-  struct sockaddr_in send_addrin;
+  struct flow_stats *cur, *last, *tmp;
+  struct timeval sleep_time;
+  time_t cur_time, last_time;
+
+  cur = calloc(1, sizeof(struct flow_stats));
+  last = calloc(1, sizeof(struct flow_stats));
+  if ((cur == NULL) || (last == NULL)) {
+    fprintf(stderr, "Unable to allocate the stats snapshots.\n");
+    free(cur);
+    free(last);
+    return NULL;
+  }
 
-  temp_inaddr_src.s_addr = htonl(flow->src_addr.s_addr);
-  temp_inaddr_dst.s_addr = htonl(flow->dst_addr.s_addr);
+  last_time = start_time;
 
+  while (terminate == 0) {
 
-  /* This is some ugly-ass code.  I can't think of a way to do it securely
-   * and cleanly though ...
-   */
+    /* Check once a second so shutdown isn't held up */
+    sleep_time.tv_sec = 1;
+    sleep_time.tv_usec = 0;
+    select(0, NULL, NULL, NULL, &sleep_time);
 
-  outindex = 0;
-
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "{\n");
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"src_addr\": \"%s\",\n", inet_ntoa(temp_inaddr_src));
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"dst_addr\": \"%s\",\n", inet_ntoa(temp_inaddr_dst));
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"protocol\": %d,\n", flow->protocol);
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"src_port\": %d,\n", flow->src_port);
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"dst_port\": %d,\n", flow->dst_port);
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"tcp_flags\": %d,\n", flow->tcp_flags);
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"start_time\": %d,\n", (int)(flow->start_time));
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"end_time\": %d,\n", (int)(flow->end_time));
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"source_count\": %d,\n", flow->source_count);
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t\"source_stats\": [\n");
-
-  flow_source = flow->sources;
-  while (flow_source != NULL) {
-
-    temp_inaddr_flow.s_addr = htonl(flow_source->flow_src);
-
-    outindex +=
-      snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	       "\t\t{\n");
-    outindex +=
-      snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	       "\t\t\"flow_source\": \"%s\",\n", inet_ntoa(temp_inaddr_flow));
-    outindex +=
-      snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	       "\t\t\"src_int\": %d,\n", flow_source->src_int);
-    outindex +=
-      snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	       "\t\t\"dst_int\": %d,\n", flow_source->dst_int);
-    outindex +=
-      snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	       "\t\t\"num_packets\": %lu,\n", flow_source->num_packets);
-    outindex +=
-      snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	       "\t\t\"num_bytes\": %lu,\n", flow_source->num_bytes);
-    outindex +=
-      snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	       "\t\t\"num_flows\": %lu\n", flow_source->num_flows);
-
-    flow_source = flow_source->next;
-
-    if (flow_source == NULL) {
-      outindex +=
-	snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-		 "\t\t}\n");
+    cur_time = time(NULL);
+    if (cur_time - last_time < STATS_RATE) {
+      continue;
     }
-    else {
-      outindex +=
-	snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-		 "\t\t},\n");
+
+    stats_snapshot(cur);
+    print_stats(cur, last, cur_time, last_time);
+
+    /* This snapshot is what the next interval's rates are against */
+    tmp = last;
+    last = cur;
+    cur = tmp;
+    last_time = cur_time;
+  }
+
+  free(cur);
+  free(last);
+
+  return NULL;
+}
+
+
+void print_stats(const struct flow_stats *cur, const struct flow_stats *last,
+		 const time_t cur_time, const time_t last_time) {
+
+  /* The protocols worth a line of their own */
+  static const struct {
+    int proto;
+    const char *name;
+  } protos[] = {
+    {6, "tcp"}, {17, "udp"}, {1, "icmp"}, {97, "eth-in-ip"}, {41, "6in4"},
+    {103, "pim"}, {2, "igmp"}, {4, "ip in ip"}, {88, "eigrp"}, {50, "esp"},
+    {51, "ah"}, {47, "gre"}, {-1, NULL}
+  };
+
+  struct exclude_index *cur_exclude_idx;
+  struct in_addr temp_inaddr;
+  uint64_t sock_drops;
+  double time_diff, interval;
+  int i;
+
+  if (cur->new_flows == 0) {
+    fprintf(stderr, "--\n");
+    fprintf(stderr, "NO FLOWS\n");
+    return;
+  }
+
+  time_diff = (double)(cur_time - start_time);
+  interval = (double)(cur_time - last_time);
+
+  fprintf(stderr, "--\n");
+  fprintf(stderr, "flowtree stats:\n");
+  fprintf(stderr, "===============\n");
+  fprintf(stderr, "runtime: %d seconds; total packets: %lu; "
+	  "total flows: %lu\n", (int)time_diff,
+	  cur->flow_packets, cur->total_flows);
+  fprintf(stderr, "packet rate: %.02f pps; "
+	  "flow rate: %.02f fps; new flow rate %.02f fps\n",
+	  (double)cur->flow_packets / time_diff,
+	  (double)(cur->total_flows) / time_diff,
+	  (double)cur->new_flows / time_diff);
+  fprintf(stderr, "last %d seconds: %.02f pps; %.02f fps; "
+	  "new flow rate %.02f fps\n", (int)interval,
+	  (double)(cur->flow_packets - last->flow_packets) / interval,
+	  (double)(cur->total_flows - last->total_flows) / interval,
+	  (double)(cur->new_flows - last->new_flows) / interval);
+  fprintf(stderr, "excluded flows: %lu (%.02f%%)\n",
+	  cur->excluded_flows, ((double)cur->excluded_flows /
+				(double)cur->total_flows) * 100);
+  fprintf(stderr, "filtered flows: %lu (%.02f%%)\n",
+	  cur->filtered_flows, ((double)cur->filtered_flows /
+				(double)cur->total_flows) * 100);
+  fprintf(stderr, "exported flows: %lu in %lu datagrams\n",
+	  stat_export_flows, stat_export_datagrams);
+  sink_report();
+  if (socket_drops(sock_fh, &sock_drops) == 0) {
+    fprintf(stderr, "kernel dropped packets (socket filter and "
+	    "overflow): %lu\n", sock_drops);
+  }
+  rcu_read_lock();
+  cur_exclude_idx = __atomic_load_n(&exclude_idx, __ATOMIC_ACQUIRE);
+  for (i = 0; i < cur_exclude_idx->range_count; i++) {
+    temp_inaddr.s_addr = htonl(cur_exclude_idx->ranges[i].addr_start);
+    fprintf(stderr, "exclude range %s", inet_ntoa(temp_inaddr));
+    temp_inaddr.s_addr = htonl(cur_exclude_idx->ranges[i].addr_end);
+    fprintf(stderr, " - %s: %lu hits\n", inet_ntoa(temp_inaddr),
+	    exclude_range_hits(cur_exclude_idx, i));
+  }
+  rcu_read_unlock();
+  exporter_report();
+  control_report();
+
+  fprintf(stderr, "currently tracking flows: %lu\n", cur->current_flows);
+  fprintf(stderr, "total unique flows: %lu (%.02f%%)\n",
+	  cur->new_flows, ((double)cur->new_flows /
+			   (double)(cur->total_flows)) * 100);
+
+  for (i = 0; protos[i].name != NULL; i++) {
+    fprintf(stderr, "unique %s flows: %lu (%.02f%%)\n", protos[i].name,
+	    cur->proto_flows[protos[i].proto],
+	    ((double)cur->proto_flows[protos[i].proto] /
+	     (double)cur->new_flows) * 100);
+  }
+
+  hll_report();
+  rollup_report();
+  matrix_report();
+  hist_report();
+
+  if (lockprof != NULL) {
+    lockprof_report(cur->current_flows);
+  }
+}
+
+
+/* ===
+ * Walking the live flows for the control socket, see control.h
+ * ===
+ */
+uint64_t flowtree_walk(int (*callback)(const struct flow_summary *, void *),
+		       void *arg) {
+
+  struct pavl_traverser traverser;
+  struct flow_summary *flow;
+  uint64_t hold_start_ns, hold_ns, max_hold_ns = 0;
+  int tree_num, stop = 0;
+
+  for (tree_num = 0; (tree_num < TREES) && (stop == 0); tree_num++) {
+
+    /* === *** ACQUIRE TREE LOCK *** === */
+    tree_lock(tree_num, LOCK_QUERY);
+    hold_start_ns = monotonic_ns();
+
+    pavl_t_init(&traverser, flow_hash_trees[tree_num].tree);
+    while ((flow = (struct flow_summary *)pavl_t_next(&traverser)) != NULL) {
+      if ((stop = callback(flow, arg)) != 0) {
+	break;
+      }
+    }
+
+    hold_ns = monotonic_ns() - hold_start_ns;
+
+    /* === *** RELEASE TREE LOCK *** === */
+    pthread_mutex_unlock(&(flow_hash_trees[tree_num].tree_mutex));
+
+    if (hold_ns > max_hold_ns) {
+      max_hold_ns = hold_ns;
     }
   }
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "\t]\n");
-  outindex +=
-    snprintf(outbuff + outindex, SENDBUFFSIZE - outindex - 1,
-	     "}\n");
-  
-  /* Terminate the string */
-  outbuff[outindex] = '\0';
 
+  return max_hold_ns;
+}
 
-  /*fprintf(stdout, "%s", outbuff);*/
 
-  send_addrin.sin_family = AF_INET;
-  send_addrin.sin_port = htons(SENDPORT);
-  inet_aton(SENDDST, &(send_addrin.sin_addr));
+void tree_lock(const int tree_num, const int role) {
 
-  sendto(send_fh, outbuff, outindex, 0,
-	 (const struct sockaddr *)&send_addrin, sizeof(send_addrin));
-   
-  
+  struct tree_lock_stats *ls;
+  uint64_t wait_start_ns;
+
+  if (lockprof == NULL) {
+    pthread_mutex_lock(&(flow_hash_trees[tree_num].tree_mutex));
+    return;
+  }
+
+  ls = &(lockprof[tree_num]);
+
+  if (pthread_mutex_trylock(&(flow_hash_trees[tree_num].tree_mutex)) != 0) {
+    wait_start_ns = monotonic_ns();
+    pthread_mutex_lock(&(flow_hash_trees[tree_num].tree_mutex));
+
+    /* We hold it now so the counters are ours */
+    stat_add(&(ls->wait_ns), monotonic_ns() - wait_start_ns);
+    stat_add(&(ls->contended[role]), 1);
+  }
+
+  stat_add(&(ls->acquired), 1);
+}
+
+
+void lockprof_report(const uint64_t current_flows) {
+
+  struct tree_lock_stats *ls;
+  int top[LOCKPROF_TOP];
+  uint64_t top_wait[LOCKPROF_TOP];
+  uint64_t acquired = 0, contended[LOCK_ROLES], wait_ns = 0, ns;
+  uint64_t tree_contended;
+  unsigned int flows;
+  int tree_num, top_count = 0, i, role;
+
+  memset(contended, 0, sizeof(contended));
+
+  for (tree_num = 0; tree_num < TREES; tree_num++) {
+    ls = &(lockprof[tree_num]);
+
+    acquired += __atomic_load_n(&(ls->acquired), __ATOMIC_RELAXED);
+    for (role = 0; role < LOCK_ROLES; role++) {
+      contended[role] += __atomic_load_n(&(ls->contended[role]),
+					 __ATOMIC_RELAXED);
+    }
+    ns = __atomic_load_n(&(ls->wait_ns), __ATOMIC_RELAXED);
+    wait_ns += ns;
+
+    /* Keep the trees with the most waiting, most first */
+    if (ns == 0) {
+      continue;
+    }
+    if (top_count < LOCKPROF_TOP) {
+      top_count++;
+    }
+    else if (ns <= top_wait[top_count - 1]) {
+      continue;
+    }
+    for (i = top_count - 1; (i > 0) && (top_wait[i - 1] < ns); i--) {
+      top[i] = top[i - 1];
+      top_wait[i] = top_wait[i - 1];
+    }
+    top[i] = tree_num;
+    top_wait[i] = ns;
+  }
+
+  tree_contended = 0;
+  for (role = 0; role < LOCK_ROLES; role++) {
+    tree_contended += contended[role];
+  }
+
+  fprintf(stderr, "tree locks: %lu acquired; %lu contended (%.04f%%); "
+	  "%.03f ms waiting\n", acquired, tree_contended,
+	  (acquired == 0) ? 0.0 :
+	  ((double)tree_contended / (double)acquired) * 100,
+	  (double)wait_ns / 1e6);
+  for (role = 0; role < LOCK_ROLES; role++) {
+    fprintf(stderr, "  %s waited: %lu times\n", lock_role_names[role],
+	    contended[role]);
+  }
+
+  if (top_count == 0) {
+    return;
+  }
+
+  fprintf(stderr, "hottest trees (mean %.02f flows per tree):\n",
+	  (double)current_flows / (double)TREES);
+  for (i = 0; i < top_count; i++) {
+    ls = &(lockprof[top[i]]);
+
+    /* === *** ACQUIRE TREE LOCK *** === */
+    pthread_mutex_lock(&(flow_hash_trees[top[i]].tree_mutex));
+    flows = pavl_count(flow_hash_trees[top[i]].tree);
+    /* === *** RELEASE TREE LOCK *** === */
+    pthread_mutex_unlock(&(flow_hash_trees[top[i]].tree_mutex));
+
+    tree_contended = 0;
+    for (role = 0; role < LOCK_ROLES; role++) {
+      tree_contended += __atomic_load_n(&(ls->contended[role]),
+					__ATOMIC_RELAXED);
+    }
+
+    fprintf(stderr, "  tree %d: %u flows; %lu acquired; %lu contended "
+	    "(receive %lu, janitor %lu, query %lu); %.03f ms waiting\n",
+	    top[i], flows,
+	    __atomic_load_n(&(ls->acquired), __ATOMIC_RELAXED), tree_contended,
+	    __atomic_load_n(&(ls->contended[LOCK_RECEIVE]), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(ls->contended[LOCK_JANITOR]), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(ls->contended[LOCK_QUERY]), __ATOMIC_RELAXED),
+	    (double)top_wait[i] / 1e6);
+  }
+}
+
+
+/* ===
+ * flowtree's own part of a metrics scrape, see metrics.c
+ * ===
+ */
+void flowtree_metrics(FILE *out) {
+
+  struct exclude_index *cur_exclude_idx;
+  struct in_addr temp_inaddr;
+  uint64_t sock_drops;
+  uint64_t acquired, contended[LOCK_ROLES], wait_ns;
+  int i, role;
+
+  metrics_header(out, "flowtree_start_time_seconds", "gauge",
+		 "When flowtree started, unix time");
+  fprintf(out, "flowtree_start_time_seconds %lu\n", (uint64_t)start_time);
+
+  metrics_header(out, "flowtree_trees", "gauge",
+		 "Flow trees the flows are hashed over");
+  fprintf(out, "flowtree_trees %d\n", TREES);
+
+  metrics_header(out, "flowtree_janitor_sweeps_total", "counter",
+		 "Janitor passes over the flow trees");
+  fprintf(out, "flowtree_janitor_sweeps_total %lu\n",
+	  __atomic_load_n(&janitor_sweeps, __ATOMIC_RELAXED));
+
+  metrics_header(out, "flowtree_janitor_expired_total", "counter",
+		 "Flows expired and exported by the janitor");
+  fprintf(out, "flowtree_janitor_expired_total %lu\n",
+	  __atomic_load_n(&janitor_expired, __ATOMIC_RELAXED));
+
+  metrics_header(out, "flowtree_janitor_sweep_seconds_total", "counter",
+		 "Time spent in janitor passes");
+  fprintf(out, "flowtree_janitor_sweep_seconds_total %.6f\n",
+	  (double)__atomic_load_n(&janitor_sweep_ns, __ATOMIC_RELAXED) / 1e9);
+
+  metrics_header(out, "flowtree_janitor_last_sweep_seconds", "gauge",
+		 "How long the last janitor pass took");
+  fprintf(out, "flowtree_janitor_last_sweep_seconds %.6f\n",
+	  (double)__atomic_load_n(&janitor_last_sweep_ns, __ATOMIC_RELAXED) /
+	  1e9);
+
+  if (socket_drops(sock_fh, &sock_drops) == 0) {
+    metrics_header(out, "flowtree_kernel_drops_total", "counter",
+		   "Datagrams the kernel dropped (socket filter and "
+		   "overflow)");
+    fprintf(out, "flowtree_kernel_drops_total %lu\n", sock_drops);
+  }
+
+  metrics_header(out, "flowtree_exclude_hits_total", "counter",
+		 "Flow records matching each exclusion range");
+  rcu_read_lock();
+  cur_exclude_idx = __atomic_load_n(&exclude_idx, __ATOMIC_ACQUIRE);
+  for (i = 0; i < cur_exclude_idx->range_count; i++) {
+    temp_inaddr.s_addr = htonl(cur_exclude_idx->ranges[i].addr_start);
+    fprintf(out, "flowtree_exclude_hits_total{range=\"%s",
+	    inet_ntoa(temp_inaddr));
+    temp_inaddr.s_addr = htonl(cur_exclude_idx->ranges[i].addr_end);
+    fprintf(out, "-%s\"} %lu\n", inet_ntoa(temp_inaddr),
+	    exclude_range_hits(cur_exclude_idx, i));
+  }
+  rcu_read_unlock();
+
+  if (lockprof == NULL) {
+    return;
+  }
+
+  acquired = 0;
+  wait_ns = 0;
+  memset(contended, 0, sizeof(contended));
+  for (i = 0; i < TREES; i++) {
+    acquired += __atomic_load_n(&(lockprof[i].acquired), __ATOMIC_RELAXED);
+    wait_ns += __atomic_load_n(&(lockprof[i].wait_ns), __ATOMIC_RELAXED);
+    for (role = 0; role < LOCK_ROLES; role++) {
+      contended[role] += __atomic_load_n(&(lockprof[i].contended[role]),
+					 __ATOMIC_RELAXED);
+    }
+  }
+
+  metrics_header(out, "flowtree_tree_lock_acquired_total", "counter",
+		 "Tree mutex acquisitions (-L)");
+  fprintf(out, "flowtree_tree_lock_acquired_total %lu\n", acquired);
+
+  metrics_header(out, "flowtree_tree_lock_contended_total", "counter",
+		 "Tree mutex acquisitions that had to wait, by who waited");
+  for (role = 0; role < LOCK_ROLES; role++) {
+    fprintf(out, "flowtree_tree_lock_contended_total{waiter=\"%s\"} %lu\n",
+	    lock_role_names[role], contended[role]);
+  }
 
+  metrics_header(out, "flowtree_tree_lock_wait_seconds_total", "counter",
+		 "Time spent waiting for tree mutexes");
+  fprintf(out, "flowtree_tree_lock_wait_seconds_total %.6f\n",
+	  (double)wait_ns / 1e9);
 }
@@ -0,0 +1,210 @@
+#ifndef FLOWTREE_H
+#define FLOWTREE_H 1
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+
+/* ===
+ * Netflow structs and other values
+ * http://www.cisco.com/en/US/docs/net_mgmt/netflow_collection_engine/
+ * 3.6/user/guide/format.html#wp1006108
+ * ===
+ */
+
+/* === Netflow v5 === */
+struct netflow_v5 {
+  uint16_t version;
+  uint16_t flow_count;
+  uint32_t uptime;
+  uint32_t unix_sec;
+  uint32_t nsec;
+  uint32_t flow_sequence;
+  uint8_t engine_type;
+  uint8_t engine_id;
+  uint16_t sample_rate;
+} __attribute__((__packed__));
+
+struct netflow_v5_record {
+  in_addr_t src_addr;
+  in_addr_t dst_addr;
+  in_addr_t next_hop;
+  uint16_t src_int; 
+  uint16_t dst_int;
+  uint32_t num_packets;
+  uint32_t num_bytes;
+  uint32_t start_time;
+  uint32_t end_time;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t pad1;
+  uint8_t tcp_flags;
+  uint8_t protocol;
+  uint8_t tos;
+  uint16_t src_as;
+  uint16_t dst_as;
+  uint8_t src_mask;
+  uint8_t dst_mask;
+  uint16_t pad2;
+} __attribute__((__packed__));  
+
+
+/* === Netflow v7 === */
+struct netflow_v7 {
+  uint16_t version;
+  uint16_t flow_count;
+  uint32_t uptime;
+  uint32_t unix_sec;
+  uint32_t nsec;
+  uint32_t flow_sequence;
+  uint32_t reserved;
+} __attribute__((__packed__));
+
+struct netflow_v7_record {
+  in_addr_t src_addr;
+  in_addr_t dst_addr;
+  in_addr_t next_hop;
+  uint16_t src_int; 
+  uint16_t dst_int;
+  uint32_t num_packets;
+  uint32_t num_bytes;
+  uint32_t start_time;
+  uint32_t end_time;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t flags1;
+  uint8_t tcp_flags;
+  uint8_t protocol;
+  uint8_t tos;
+  uint16_t src_as;
+  uint16_t dst_as;
+  uint8_t src_mask;
+  uint8_t dst_mask;
+  uint16_t flags2;
+  uint32_t flow_src;
+} __attribute__((__packed__));
+
+
+/* ===
+ * The unified flow struct that all other formats will be converted to.
+ * Every address in it, flow_src included, is host byte order.
+ * ===
+ */
+struct unified_flow {
+  in_addr_t flow_src; /* v5: the peer, already ntohl()ed by main() */
+  time_t recv_time;
+  uint16_t src_int;
+  uint16_t dst_int;
+  struct in_addr src_addr;
+  struct in_addr dst_addr;
+  uint8_t protocol;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t tcp_flags;
+  uint16_t src_as;
+  uint16_t dst_as;
+  uint32_t num_packets;
+  uint32_t num_bytes;
+  time_t start_time;
+  time_t end_time;
+};
+
+/* Parsers hand flows on in batches of up to this many */
+#define FLOW_BATCH 64
+
+
+/* ===
+ * The flow summary to insert into the flow trees
+ *
+ * With -b (biflow) A->B and B->A are the same flow: the trees compare
+ * on the two endpoints in a fixed order, whichever way round the record
+ * has them.  The first record seen sets which way is forward, and the
+ * records going the other way are kept in the rev_ fields instead.
+ * ===
+ */
+struct flow_bins; /* see bins.h */
+
+extern int biflow_enabled; /* -b */
+
+struct flow_source_summary {
+  in_addr_t flow_src;
+  uint16_t src_int;
+  uint16_t dst_int;
+  uint64_t num_packets;
+  uint64_t num_bytes;  
+  uint64_t num_flows;  
+  uint64_t rev_packets; /* the rev_ fields stay 0 unless -b */
+  uint64_t rev_bytes;
+  uint64_t rev_flows;
+  struct flow_bins *bins; /* NULL unless -T */
+  struct flow_source_summary *next;
+};
+
+struct flow_summary {
+  time_t time_added;
+  time_t time_updated;
+  struct in_addr src_addr;
+  struct in_addr dst_addr;
+  uint8_t protocol;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t tcp_flags;
+  uint8_t rev_tcp_flags;
+  time_t start_time;
+  time_t end_time;
+  uint8_t source_count;
+  struct flow_source_summary *sources;
+};
+
+
+/* ===
+ * Address ranges, as used by the exclude list and the exporter
+ * allowlist.  load_range_file() merges them into a pavl tree.
+ * ===
+ */
+struct exclude_node {
+  in_addr_t addr_start;
+  in_addr_t addr_end;
+};
+
+
+/* ===
+ * Per-thread slots
+ *
+ * Anything that wants per-thread storage (counters and such) indexes
+ * an array of MAX_THREADS entries with thread_slot()
+ * ===
+ */
+#define MAX_THREADS 64
+#define CACHE_LINE 64
+
+
+/* ===
+ * Shared function prototypes
+ * ===
+ */
+struct pavl_table;
+
+int thread_slot(void);
+int parse_addr_range(const char *, in_addr_t *, in_addr_t *);
+struct pavl_table *load_range_file(const char *, const int);
+void free_exclusion(void *, void *);
+void rcu_read_lock(void);
+void rcu_read_unlock(void);
+void rcu_publish(void **, void *, void (*)(void *));
+void rcu_reclaim(void);
+void free_source_list(struct flow_source_summary *);
+uint64_t monotonic_ns(void);
+
+/* bench.c */
+struct filter_prog;
+void bench_random_flows(struct unified_flow *, const int);
+int run_benchmark(const char *, const struct filter_prog *);
+
+/* sockfilter.c */
+int attach_socket_filter(const int, struct pavl_table *);
+int socket_drops(const int, uint64_t *);
+
+#endif /* flowtree.h */
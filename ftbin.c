@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ftbin.h"
+
+
+/* ===
+ * Reference decoder for the flowtree binary export format
+ *
+ * This file only depends on ftbin.h so consumers can copy the pair
+ * into their own code.
+ * ===
+ */
+
+
+int ftbin_decode_header(const uint8_t *buff, const size_t len,
+			struct ftbin_header *header) {
+
+  if (len < FTBIN_HEADER_LEN) {
+    return -1;
+  }
+
+  header->magic = ftbin_get32(buff);
+  header->version = ftbin_get16(buff + 4);
+  header->count = ftbin_get16(buff + 6);
+  header->sequence = ftbin_get32(buff + 8);
+  header->export_time = ftbin_get32(buff + 12);
+
+  if ((header->magic != FTBIN_MAGIC) || (header->version > FTBIN_VERSION)) {
+    return -1;
+  }
+
+  return FTBIN_HEADER_LEN;
+}
+
+
+int ftbin_decode_flow(const uint8_t *buff, const size_t len,
+		      struct ftbin_flow *flow) {
+
+  const uint8_t *src;
+  int i;
+
+  if (len < FTBIN_FLOW_LEN) {
+    return -1;
+  }
+
+  flow->record_len = ftbin_get16(buff);
+  flow->flags = buff[2];
+  flow->source_count = buff[3];
+  flow->src_addr = ftbin_get32(buff + 4);
+  flow->dst_addr = ftbin_get32(buff + 8);
+  flow->start_time = ftbin_get32(buff + 12);
+  flow->end_time = ftbin_get32(buff + 16);
+  flow->src_port = ftbin_get16(buff + 20);
+  flow->dst_port = ftbin_get16(buff + 22);
+  flow->protocol = buff[24];
+  flow->tcp_flags = buff[25];
+  flow->rev_tcp_flags = buff[26];
+
+  /* The record has to hold its sources and fit in what we were given */
+  if ((flow->record_len > len) ||
+      (flow->record_len < FTBIN_FLOW_LEN +
+       (flow->source_count * FTBIN_SOURCE_LEN))) {
+    return -1;
+  }
+  if (((flow->flags & FTBIN_FLAG_BIFLOW) != 0) &&
+      (flow->record_len < FTBIN_FLOW_LEN +
+       (flow->source_count * (FTBIN_SOURCE_LEN + FTBIN_REV_SOURCE_LEN)))) {
+    return -1;
+  }
+
+  src = buff + FTBIN_FLOW_LEN;
+  for (i = 0; i < flow->source_count; i++) {
+    flow->sources[i].flow_src = ftbin_get32(src);
+    flow->sources[i].src_int = ftbin_get16(src + 4);
+    flow->sources[i].dst_int = ftbin_get16(src + 6);
+    flow->sources[i].num_packets = ftbin_get64(src + 8);
+    flow->sources[i].num_bytes = ftbin_get64(src + 16);
+    flow->sources[i].num_flows = ftbin_get64(src + 24);
+    flow->sources[i].rev_packets = 0;
+    flow->sources[i].rev_bytes = 0;
+    flow->sources[i].rev_flows = 0;
+
+    src += FTBIN_SOURCE_LEN;
+  }
+
+  if ((flow->flags & FTBIN_FLAG_BIFLOW) != 0) {
+    for (i = 0; i < flow->source_count; i++) {
+      flow->sources[i].rev_packets = ftbin_get64(src);
+      flow->sources[i].rev_bytes = ftbin_get64(src + 8);
+      flow->sources[i].rev_flows = ftbin_get64(src + 16);
+
+      src += FTBIN_REV_SOURCE_LEN;
+    }
+  }
+
+  /* Skip over anything a newer version tacked on */
+  return flow->record_len;
+}
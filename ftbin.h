@@ -0,0 +1,160 @@
+#ifndef FTBIN_H
+#define FTBIN_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* ===
+ * The flowtree binary export format
+ *
+ * Everything is fixed width and little-endian no matter what the host
+ * is.  Addresses are the 32-bit value of the IPv4 address, so a.b.c.d
+ * is (a << 24) | (b << 16) | (c << 8) | d.  Times are unix seconds.
+ *
+ * A datagram is a header followed by count flow records:
+ *
+ *   header (16 bytes)
+ *     u32 magic          FTBIN_MAGIC
+ *     u16 version        FTBIN_VERSION
+ *     u16 count          flow records in this datagram
+ *     u32 sequence       datagram sequence number, per exporter
+ *     u32 export_time    when the datagram was built
+ *
+ *   flow record (28 bytes + source_count * 36 bytes, plus
+ *                source_count * 24 bytes with FTBIN_FLAG_BIFLOW)
+ *     u16 record_len     the whole record including the sources
+ *     u8  flags          FTBIN_FLAG_*
+ *     u8  source_count
+ *     u32 src_addr
+ *     u32 dst_addr
+ *     u32 start_time
+ *     u32 end_time
+ *     u16 src_port
+ *     u16 dst_port
+ *     u8  protocol
+ *     u8  tcp_flags
+ *     u8  rev_tcp_flags  FTBIN_FLAG_BIFLOW only, 0 otherwise
+ *     u8  reserved
+ *
+ *   source stats (36 bytes each, sorted by flow_src)
+ *     u32 flow_src
+ *     u16 src_int
+ *     u16 dst_int
+ *     u64 num_packets
+ *     u64 num_bytes
+ *     u64 num_flows
+ *
+ *   reverse source stats (24 bytes each, FTBIN_FLAG_BIFLOW only, in the
+ *   same order as the sources)
+ *     u64 rev_packets
+ *     u64 rev_bytes
+ *     u64 rev_flows
+ *
+ * FTBIN_FLAG_BIFLOW means the exporter ran with -b: the flow covers both
+ * directions, src/dst is whichever way was seen first, and the rev_
+ * fields count what went dst to src.
+ *
+ * Readers must use record_len to find the next record so that later
+ * versions can append fields to a record without breaking them.
+ * ===
+ */
+#define FTBIN_MAGIC 0x4E425446 /* "FTBN" on the wire */
+#define FTBIN_VERSION 1
+
+#define FTBIN_HEADER_LEN 16
+#define FTBIN_FLOW_LEN 28
+#define FTBIN_SOURCE_LEN 36
+#define FTBIN_REV_SOURCE_LEN 24
+
+#define FTBIN_FLAG_BIFLOW 0x01
+
+/* The source count is a byte, a flow seen by more exporters than that
+ * only goes out with the first FTBIN_MAX_SOURCES of them */
+#define FTBIN_MAX_SOURCES 255
+
+/* The biggest possible record, every source both ways */
+#define FTBIN_MAX_RECORD_LEN (FTBIN_FLOW_LEN + \
+			      (FTBIN_MAX_SOURCES * \
+			       (FTBIN_SOURCE_LEN + FTBIN_REV_SOURCE_LEN)))
+
+struct ftbin_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t count;
+  uint32_t sequence;
+  uint32_t export_time;
+};
+
+struct ftbin_source {
+  uint32_t flow_src;
+  uint16_t src_int;
+  uint16_t dst_int;
+  uint64_t num_packets;
+  uint64_t num_bytes;
+  uint64_t num_flows;
+  uint64_t rev_packets; /* FTBIN_FLAG_BIFLOW only, 0 otherwise */
+  uint64_t rev_bytes;
+  uint64_t rev_flows;
+};
+
+struct ftbin_flow {
+  uint16_t record_len;
+  uint8_t flags;
+  uint8_t source_count;
+  uint32_t src_addr;
+  uint32_t dst_addr;
+  uint32_t start_time;
+  uint32_t end_time;
+  uint16_t src_port;
+  uint16_t dst_port;
+  uint8_t protocol;
+  uint8_t tcp_flags;
+  uint8_t rev_tcp_flags;
+  struct ftbin_source sources[FTBIN_MAX_SOURCES];
+};
+
+
+/* ===
+ * Little-endian helpers
+ * ===
+ */
+static inline void ftbin_put16(uint8_t *p, const uint16_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+}
+
+static inline void ftbin_put32(uint8_t *p, const uint32_t v) {
+  p[0] = v & 0xFF;
+  p[1] = (v >> 8) & 0xFF;
+  p[2] = (v >> 16) & 0xFF;
+  p[3] = (v >> 24) & 0xFF;
+}
+
+static inline void ftbin_put64(uint8_t *p, const uint64_t v) {
+  ftbin_put32(p, v & 0xFFFFFFFF);
+  ftbin_put32(p + 4, v >> 32);
+}
+
+static inline uint16_t ftbin_get16(const uint8_t *p) {
+  return (uint16_t)p[0] | ((uint16_t)p[1] << 8);
+}
+
+static inline uint32_t ftbin_get32(const uint8_t *p) {
+  return (uint32_t)p[0] | ((uint32_t)p[1] << 8) |
+    ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t ftbin_get64(const uint8_t *p) {
+  return (uint64_t)ftbin_get32(p) | ((uint64_t)ftbin_get32(p + 4) << 32);
+}
+
+
+/* ===
+ * Reference decoder, see ftbin.c
+ * ===
+ */
+int ftbin_decode_header(const uint8_t *, const size_t, struct ftbin_header *);
+int ftbin_decode_flow(const uint8_t *, const size_t, struct ftbin_flow *);
+
+#endif /* ftbin.h */
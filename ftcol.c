@@ -0,0 +1,569 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "ftbin.h"
+#include "ftcol.h"
+
+
+/* ===
+ * Columnar segment writer and reader, see ftcol.h for the layout.  Like
+ * ftbin.c this only depends on its headers so other tools can use it.
+ * ===
+ */
+const char *ftcol_column_names[FTCOL_COLUMNS] = {
+  "start_time", "end_time", "src_addr", "dst_addr", "src_port", "dst_port",
+  "protocol", "tcp_flags", "exporter", "src_int", "dst_int",
+  "packets", "bytes", "flows", "primary"
+};
+
+const int ftcol_bloom_slot[FTCOL_COLUMNS] = {
+  -1, -1, 0, 1, 2, 3, -1, -1, 4, -1, -1, -1, -1, -1, -1
+};
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+static inline int ftcol_bits(const uint64_t);
+static inline size_t ftcol_packed_len(const uint32_t, const int);
+static inline uint64_t ftcol_zigzag(const uint64_t);
+static inline uint64_t ftcol_unzigzag(const uint64_t);
+size_t ftcol_pack(const uint64_t *, const uint32_t, const int, uint64_t *,
+		  uint8_t *);
+void ftcol_unpack(const uint8_t *, const uint32_t, const int, uint64_t *);
+size_t ftcol_encode_column(struct ftcol_writer *, const uint64_t *,
+			   const uint32_t, uint8_t *);
+int ftcol_compare_u64(const void *, const void *);
+
+
+static inline int ftcol_bits(const uint64_t v) {
+  return (v == 0) ? 0 : 64 - __builtin_clzll(v);
+}
+
+
+static inline size_t ftcol_packed_len(const uint32_t n, const int width) {
+
+  /* One spare word so the unpacker can always read two */
+  return ((((uint64_t)n * width) + 63) / 64 + 1) * 8;
+}
+
+
+static inline uint64_t ftcol_zigzag(const uint64_t v) {
+  return (v << 1) ^ (uint64_t)((int64_t)v >> 63);
+}
+
+
+static inline uint64_t ftcol_unzigzag(const uint64_t v) {
+  return (v >> 1) ^ (uint64_t)(-(int64_t)(v & 1));
+}
+
+
+size_t ftcol_pack(const uint64_t *vals, const uint32_t n, const int width,
+		  uint64_t *words, uint8_t *out) {
+
+  size_t len = ftcol_packed_len(n, width);
+  uint64_t bit;
+  uint32_t i;
+  int off;
+
+  memset(words, 0, len);
+
+  if (width > 0) {
+    for (i = 0; i < n; i++) {
+      bit = (uint64_t)i * width;
+      off = bit & 63;
+
+      words[bit >> 6] |= vals[i] << off;
+      if (off + width > 64) {
+	words[(bit >> 6) + 1] |= vals[i] >> (64 - off);
+      }
+    }
+  }
+
+  for (i = 0; i < len / 8; i++) {
+    ftbin_put64(out + (i * 8), words[i]);
+  }
+
+  return len;
+}
+
+
+void ftcol_unpack(const uint8_t *in, const uint32_t n, const int width,
+		  uint64_t *out) {
+
+  uint64_t mask, bit, v;
+  uint32_t i;
+  int off;
+
+  if (width == 0) {
+    memset(out, 0, n * sizeof(uint64_t));
+    return;
+  }
+
+  mask = (width == 64) ? ~(uint64_t)0 : (((uint64_t)1 << width) - 1);
+
+  for (i = 0; i < n; i++) {
+    bit = (uint64_t)i * width;
+    off = bit & 63;
+
+    v = ftbin_get64(in + ((bit >> 6) * 8)) >> off;
+    if (off + width > 64) {
+      v |= ftbin_get64(in + (((bit >> 6) + 1) * 8)) << (64 - off);
+    }
+    out[i] = v & mask;
+  }
+}
+
+
+int ftcol_compare_u64(const void *a, const void *b) {
+
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+  return (x > y) - (x < y);
+}
+
+
+/* ===
+ * Writer
+ * ===
+ */
+int ftcol_writer_init(struct ftcol_writer *w) {
+
+  w->rows = 0;
+  w->offset = 0;
+  w->index_len = 0;
+  w->blocks = 0;
+
+  if (w->index == NULL) {
+    w->index_size = 64 * FTCOL_INDEX_LEN;
+    if ((w->index = malloc(w->index_size)) == NULL) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+void ftcol_writer_free(struct ftcol_writer *w) {
+
+  free(w->index);
+  w->index = NULL;
+}
+
+
+int ftcol_encode_header(struct ftcol_writer *w, uint8_t *buff) {
+
+  ftbin_put32(buff, FTCOL_MAGIC);
+  ftbin_put16(buff + 4, FTCOL_VERSION);
+  ftbin_put16(buff + 6, FTCOL_COLUMNS);
+  ftbin_put32(buff + 8, FTCOL_BLOCK_ROWS);
+  ftbin_put32(buff + 12, 0);
+
+  w->offset += FTCOL_HEADER_LEN;
+
+  return FTCOL_HEADER_LEN;
+}
+
+
+int ftcol_add_row(struct ftcol_writer *w, const struct ftbin_flow *flow,
+		  const int source) {
+
+  const struct ftbin_source *src;
+  int r = w->rows;
+  int i, best = 0;
+
+  w->cols[FTCOL_START_TIME][r] = flow->start_time;
+  w->cols[FTCOL_END_TIME][r] = flow->end_time;
+  w->cols[FTCOL_SRC_ADDR][r] = flow->src_addr;
+  w->cols[FTCOL_DST_ADDR][r] = flow->dst_addr;
+  w->cols[FTCOL_SRC_PORT][r] = flow->src_port;
+  w->cols[FTCOL_DST_PORT][r] = flow->dst_port;
+  w->cols[FTCOL_PROTOCOL][r] = flow->protocol;
+  w->cols[FTCOL_TCP_FLAGS][r] = flow->tcp_flags;
+
+  /* A flow without sources still gets a row, with zero counters */
+  if ((source >= 0) && (source < flow->source_count)) {
+    src = &(flow->sources[source]);
+    w->cols[FTCOL_EXPORTER][r] = src->flow_src;
+    w->cols[FTCOL_SRC_INT][r] = src->src_int;
+    w->cols[FTCOL_DST_INT][r] = src->dst_int;
+    w->cols[FTCOL_PACKETS][r] = src->num_packets;
+    w->cols[FTCOL_BYTES][r] = src->num_bytes;
+    w->cols[FTCOL_FLOWS][r] = src->num_flows;
+
+    /* The first source with the most bytes, like encode_flow_ipfix() */
+    for (i = 1; i < flow->source_count; i++) {
+      if (flow->sources[i].num_bytes > flow->sources[best].num_bytes) {
+	best = i;
+      }
+    }
+    w->cols[FTCOL_PRIMARY][r] = (source == best);
+  }
+  else {
+    w->cols[FTCOL_EXPORTER][r] = 0;
+    w->cols[FTCOL_SRC_INT][r] = 0;
+    w->cols[FTCOL_DST_INT][r] = 0;
+    w->cols[FTCOL_PACKETS][r] = 0;
+    w->cols[FTCOL_BYTES][r] = 0;
+    w->cols[FTCOL_FLOWS][r] = 0;
+    w->cols[FTCOL_PRIMARY][r] = 1;
+  }
+
+  w->rows++;
+
+  /* Full, time for ftcol_encode_block() */
+  return (w->rows == FTCOL_BLOCK_ROWS);
+}
+
+
+size_t ftcol_encode_column(struct ftcol_writer *w, const uint64_t *vals,
+			   const uint32_t rows, uint8_t *out) {
+
+  uint64_t min, max, zmin, zmax, z;
+  size_t for_len, delta_len, dict_len;
+  size_t len;
+  uint32_t i, dict_count = 0;
+  uint32_t lo, hi, mid;
+  int for_width, delta_width = 0, dict_width = 0;
+  uint64_t *values = w->values;
+
+  /* === Sizes for each encoding === */
+  min = max = vals[0];
+  for (i = 1; i < rows; i++) {
+    min = (vals[i] < min) ? vals[i] : min;
+    max = (vals[i] > max) ? vals[i] : max;
+  }
+  for_width = ftcol_bits(max - min);
+  for_len = FTCOL_CHUNK_HDR + ftcol_packed_len(rows, for_width);
+
+  delta_len = SIZE_MAX;
+  zmin = 0;
+  if (rows > 1) {
+    zmin = zmax = ftcol_zigzag(vals[1] - vals[0]);
+    for (i = 2; i < rows; i++) {
+      z = ftcol_zigzag(vals[i] - vals[i - 1]);
+      zmin = (z < zmin) ? z : zmin;
+      zmax = (z > zmax) ? z : zmax;
+    }
+    delta_width = ftcol_bits(zmax - zmin);
+    delta_len = FTCOL_CHUNK_HDR + ftcol_packed_len(rows - 1, delta_width);
+  }
+
+  dict_len = SIZE_MAX;
+  if (for_width > 0) {
+    memcpy(values, vals, rows * sizeof(uint64_t));
+    qsort(values, rows, sizeof(uint64_t), ftcol_compare_u64);
+    for (i = 0; i < rows; i++) {
+      if ((i == 0) || (values[i] != values[dict_count - 1])) {
+	values[dict_count++] = values[i];
+      }
+    }
+
+    if (dict_count <= FTCOL_DICT_MAX) {
+      dict_width = ftcol_bits(dict_count - 1);
+      dict_len = FTCOL_CHUNK_HDR + (dict_count * 8) +
+	ftcol_packed_len(rows, dict_width);
+    }
+  }
+
+  /* === Write out the smallest, FOR on ties since it decodes fastest === */
+  if ((dict_len < for_len) && (dict_len < delta_len)) {
+    out[0] = FTCOL_ENC_DICT;
+    out[1] = dict_width;
+    ftbin_put64(out + 8, 0);
+    ftbin_put64(out + 16, dict_count);
+
+    len = FTCOL_CHUNK_HDR;
+    for (i = 0; i < dict_count; i++) {
+      ftbin_put64(out + len, values[i]);
+      len += 8;
+    }
+
+    /* The dictionary is sorted so each index is a binary search */
+    for (i = 0; i < rows; i++) {
+      lo = 0;
+      hi = dict_count - 1;
+      while (lo < hi) {
+	mid = (lo + hi) / 2;
+	if (values[mid] < vals[i]) {
+	  lo = mid + 1;
+	}
+	else {
+	  hi = mid;
+	}
+      }
+      w->indexes[i] = lo;
+    }
+
+    len += ftcol_pack(w->indexes, rows, dict_width, w->words, out + len);
+  }
+  else if (delta_len < for_len) {
+    out[0] = FTCOL_ENC_DELTA;
+    out[1] = delta_width;
+    ftbin_put64(out + 8, vals[0]);
+    ftbin_put64(out + 16, zmin);
+
+    for (i = 1; i < rows; i++) {
+      values[i - 1] = ftcol_zigzag(vals[i] - vals[i - 1]) - zmin;
+    }
+    len = FTCOL_CHUNK_HDR;
+    len += ftcol_pack(values, rows - 1, delta_width, w->words, out + len);
+  }
+  else {
+    out[0] = FTCOL_ENC_FOR;
+    out[1] = for_width;
+    ftbin_put64(out + 8, min);
+    ftbin_put64(out + 16, 0);
+
+    for (i = 0; i < rows; i++) {
+      values[i] = vals[i] - min;
+    }
+    len = FTCOL_CHUNK_HDR;
+    len += ftcol_pack(values, rows, for_width, w->words, out + len);
+  }
+
+  ftbin_put16(out + 2, 0);
+  ftbin_put32(out + 4, len);
+
+  return len;
+}
+
+
+size_t ftcol_encode_block(struct ftcol_writer *w, uint8_t *out) {
+
+  uint8_t *entry, *col_entry, *bloom;
+  uint8_t *grown;
+  uint64_t min, max;
+  size_t len = 0, chunk_len;
+  int col, slot;
+  int i;
+
+  if (w->rows == 0) {
+    return 0;
+  }
+
+  /* Room for this block's index entry and the trailer */
+  if (w->index_len + FTCOL_INDEX_LEN + FTCOL_TRAILER_LEN > w->index_size) {
+    if ((grown = realloc(w->index, w->index_size * 2)) == NULL) {
+      return 0;
+    }
+    w->index = grown;
+    w->index_size *= 2;
+  }
+
+  entry = w->index + w->index_len;
+  memset(entry, 0, FTCOL_INDEX_LEN);
+  ftbin_put64(entry, w->offset);
+  ftbin_put32(entry + 8, w->rows);
+
+  for (col = 0; col < FTCOL_COLUMNS; col++) {
+    min = max = w->cols[col][0];
+    for (i = 1; i < w->rows; i++) {
+      min = (w->cols[col][i] < min) ? w->cols[col][i] : min;
+      max = (w->cols[col][i] > max) ? w->cols[col][i] : max;
+    }
+
+    chunk_len = ftcol_encode_column(w, w->cols[col], w->rows, out + len);
+
+    col_entry = entry + 16 + (col * FTCOL_INDEX_COLUMN_LEN);
+    ftbin_put32(col_entry, len);
+    ftbin_put32(col_entry + 4, chunk_len);
+    ftbin_put64(col_entry + 8, min);
+    ftbin_put64(col_entry + 16, max);
+
+    if ((slot = ftcol_bloom_slot[col]) >= 0) {
+      bloom = entry + 16 + (FTCOL_COLUMNS * FTCOL_INDEX_COLUMN_LEN) +
+	(slot * FTCOL_BLOOM_BYTES);
+      for (i = 0; i < w->rows; i++) {
+	ftcol_bloom_add(bloom, w->cols[col][i]);
+      }
+    }
+
+    len += chunk_len;
+  }
+
+  w->index_len += FTCOL_INDEX_LEN;
+  w->blocks++;
+  w->offset += len;
+  w->rows = 0;
+
+  return len;
+}
+
+
+size_t ftcol_encode_index(struct ftcol_writer *w, const uint8_t **out) {
+
+  uint8_t *trailer = w->index + w->index_len;
+
+  /* encode_block always leaves room for this */
+  ftbin_put64(trailer, w->offset);
+  ftbin_put32(trailer + 8, w->blocks);
+  ftbin_put32(trailer + 12, FTCOL_MAGIC);
+
+  *out = w->index;
+  w->offset += w->index_len + FTCOL_TRAILER_LEN;
+
+  return w->index_len + FTCOL_TRAILER_LEN;
+}
+
+
+/* ===
+ * Reader
+ * ===
+ */
+int ftcol_open(const uint8_t *data, const size_t len, struct ftcol_file *f) {
+
+  const uint8_t *trailer;
+  uint64_t index_offset;
+
+  if (len < FTCOL_HEADER_LEN + FTCOL_TRAILER_LEN) {
+    return -1;
+  }
+
+  if ((ftbin_get32(data) != FTCOL_MAGIC) ||
+      (ftbin_get16(data + 4) > FTCOL_VERSION) ||
+      (ftbin_get16(data + 6) != FTCOL_COLUMNS)) {
+    return -1;
+  }
+
+  trailer = data + len - FTCOL_TRAILER_LEN;
+  if (ftbin_get32(trailer + 12) != FTCOL_MAGIC) {
+    return -1;
+  }
+
+  index_offset = ftbin_get64(trailer);
+  f->blocks = ftbin_get32(trailer + 8);
+
+  /* Bound the offset first so a huge one can't wrap the sum */
+  if ((index_offset < FTCOL_HEADER_LEN) ||
+      (index_offset > len - FTCOL_TRAILER_LEN) ||
+      ((uint64_t)f->blocks * FTCOL_INDEX_LEN !=
+       len - FTCOL_TRAILER_LEN - index_offset)) {
+    return -1;
+  }
+
+  f->data = data;
+  f->len = len;
+  f->index = data + index_offset;
+
+  return 0;
+}
+
+
+int ftcol_block(const struct ftcol_file *f, const uint32_t num,
+		struct ftcol_block *b) {
+
+  const uint8_t *entry, *col_entry;
+  uint64_t offset, block_end;
+  uint32_t chunk_off;
+  int col, slot;
+
+  if (num >= f->blocks) {
+    return -1;
+  }
+
+  entry = f->index + ((size_t)num * FTCOL_INDEX_LEN);
+  offset = ftbin_get64(entry);
+  b->rows = ftbin_get32(entry + 8);
+
+  /* Blocks end where the next one (or the index) starts */
+  block_end = (num + 1 < f->blocks) ?
+    ftbin_get64(entry + FTCOL_INDEX_LEN) : (uint64_t)(f->index - f->data);
+
+  /* A corrupt index mustn't point outside the block area */
+  if ((offset > block_end) ||
+      (block_end > (uint64_t)(f->index - f->data)) ||
+      (b->rows > FTCOL_BLOCK_ROWS)) {
+    return -1;
+  }
+  b->data = f->data + offset;
+
+  for (col = 0; col < FTCOL_COLUMNS; col++) {
+    col_entry = entry + 16 + (col * FTCOL_INDEX_COLUMN_LEN);
+    chunk_off = ftbin_get32(col_entry);
+    b->chunk_lens[col] = ftbin_get32(col_entry + 4);
+    b->min[col] = ftbin_get64(col_entry + 8);
+    b->max[col] = ftbin_get64(col_entry + 16);
+
+    if (offset + chunk_off + b->chunk_lens[col] > block_end) {
+      return -1;
+    }
+    b->chunks[col] = b->data + chunk_off;
+
+    if ((slot = ftcol_bloom_slot[col]) >= 0) {
+      b->blooms[slot] = entry + 16 +
+	(FTCOL_COLUMNS * FTCOL_INDEX_COLUMN_LEN) + (slot * FTCOL_BLOOM_BYTES);
+    }
+  }
+
+  return 0;
+}
+
+
+int ftcol_decode_column(const uint8_t *chunk, const uint32_t len,
+			const uint32_t rows, uint64_t *out) {
+
+  uint64_t base, ref, v;
+  uint32_t i;
+  int encoding, width;
+
+  if ((len < FTCOL_CHUNK_HDR) || (rows == 0)) {
+    return -1;
+  }
+
+  encoding = chunk[0];
+  width = chunk[1];
+  base = ftbin_get64(chunk + 8);
+  ref = ftbin_get64(chunk + 16);
+
+  if (width > 64) {
+    return -1;
+  }
+
+  switch (encoding) {
+  case FTCOL_ENC_FOR:
+    if (len < FTCOL_CHUNK_HDR + ftcol_packed_len(rows, width)) {
+      return -1;
+    }
+    ftcol_unpack(chunk + FTCOL_CHUNK_HDR, rows, width, out);
+    for (i = 0; i < rows; i++) {
+      out[i] += base;
+    }
+    break;
+
+  case FTCOL_ENC_DELTA:
+    if (len < FTCOL_CHUNK_HDR + ftcol_packed_len(rows - 1, width)) {
+      return -1;
+    }
+    ftcol_unpack(chunk + FTCOL_CHUNK_HDR, rows - 1, width, out + 1);
+    v = base;
+    out[0] = v;
+    for (i = 1; i < rows; i++) {
+      v += ftcol_unzigzag(out[i] + ref);
+      out[i] = v;
+    }
+    break;
+
+  case FTCOL_ENC_DICT:
+    if ((ref == 0) || (ref > FTCOL_DICT_MAX) ||
+	(len < FTCOL_CHUNK_HDR + (ref * 8) + ftcol_packed_len(rows, width))) {
+      return -1;
+    }
+    ftcol_unpack(chunk + FTCOL_CHUNK_HDR + (ref * 8), rows, width, out);
+    for (i = 0; i < rows; i++) {
+      if (out[i] >= ref) {
+	return -1;
+      }
+      out[i] = ftbin_get64(chunk + FTCOL_CHUNK_HDR + (out[i] * 8));
+    }
+    break;
+
+  default:
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,215 @@
+#ifndef FTCOL_H
+#define FTCOL_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "ftbin.h"
+
+
+/* ===
+ * The flowtree columnar archive format
+ *
+ * A segment holds one row per (flow, source) pair, so a flow seen by
+ * three exporters is three rows that share the flow fields.  The primary
+ * column is 1 on just one of them, the source that saw the most bytes
+ * (the one IPFIX export picks), so summing only primary rows counts
+ * every flow once.  Rows are
+ * grouped into blocks of up to FTCOL_BLOCK_ROWS and every block stores
+ * each column separately.  Everything is little-endian like ftbin.
+ *
+ *   header (16 bytes)
+ *     u32 magic          FTCOL_MAGIC
+ *     u16 version        FTCOL_VERSION
+ *     u16 columns        FTCOL_COLUMNS
+ *     u32 block_rows     most rows a block can have
+ *     u32 reserved
+ *
+ *   blocks, each one a chunk per column back to back
+ *
+ *   index, one FTCOL_INDEX_LEN entry per block
+ *     u64 offset         where the block starts in the file
+ *     u32 rows
+ *     u32 reserved
+ *     per column (24 bytes each)
+ *       u32 chunk_off    from the start of the block
+ *       u32 chunk_len
+ *       u64 min
+ *       u64 max
+ *     per bloomed column, FTCOL_BLOOM_BYTES of bloom filter
+ *
+ *   trailer (16 bytes)
+ *     u64 index_offset
+ *     u32 blocks
+ *     u32 magic          FTCOL_MAGIC again
+ *
+ * The index is at the end so a segment can be written in one pass, a
+ * reader starts from the trailer.  A column chunk is
+ *
+ *     u8  encoding       FTCOL_ENC_*
+ *     u8  width          bits per packed value
+ *     u16 reserved
+ *     u32 len            the whole chunk
+ *     u64 base
+ *     u64 ref
+ *     [u64 dictionary values, FTCOL_ENC_DICT only]
+ *     packed values, width bits each, LSB first in u64 words, plus one
+ *     spare word
+ *
+ * and the encodings are
+ *
+ *   FTCOL_ENC_FOR    value = base + packed
+ *   FTCOL_ENC_DELTA  first value is base, the rest are zigzag deltas
+ *                    from the previous value stored as packed + ref
+ *   FTCOL_ENC_DICT   ref values in the dictionary, packed are indexes
+ *
+ * The writer picks whichever is smallest for each chunk.
+ * ===
+ */
+#define FTCOL_MAGIC 0x4C435446 /* "FTCL" on the wire */
+#define FTCOL_VERSION 2
+
+#define FTCOL_HEADER_LEN 16
+#define FTCOL_TRAILER_LEN 16
+#define FTCOL_CHUNK_HDR 24
+
+#define FTCOL_BLOCK_ROWS 4096
+#define FTCOL_DICT_MAX 1024
+
+#define FTCOL_ENC_FOR 0
+#define FTCOL_ENC_DELTA 1
+#define FTCOL_ENC_DICT 2
+
+/* The columns, in the order they are stored */
+#define FTCOL_START_TIME 0
+#define FTCOL_END_TIME 1
+#define FTCOL_SRC_ADDR 2
+#define FTCOL_DST_ADDR 3
+#define FTCOL_SRC_PORT 4
+#define FTCOL_DST_PORT 5
+#define FTCOL_PROTOCOL 6
+#define FTCOL_TCP_FLAGS 7
+#define FTCOL_EXPORTER 8
+#define FTCOL_SRC_INT 9
+#define FTCOL_DST_INT 10
+#define FTCOL_PACKETS 11
+#define FTCOL_BYTES 12
+#define FTCOL_FLOWS 13
+#define FTCOL_PRIMARY 14
+#define FTCOL_COLUMNS 15
+
+/* Columns that get a bloom filter, for equality lookups */
+#define FTCOL_BLOOMS 5
+#define FTCOL_BLOOM_BYTES 4096 /* 32768 bits, 3 hashes */
+
+#define FTCOL_INDEX_COLUMN_LEN 24
+#define FTCOL_INDEX_LEN (16 + (FTCOL_COLUMNS * FTCOL_INDEX_COLUMN_LEN) + \
+			 (FTCOL_BLOOMS * FTCOL_BLOOM_BYTES))
+
+/* Worst case size of an encoded block */
+#define FTCOL_BLOCK_MAX (FTCOL_COLUMNS * (FTCOL_CHUNK_HDR +		\
+					  (8 * FTCOL_DICT_MAX) +	\
+					  (8 * (FTCOL_BLOCK_ROWS + 2))))
+
+extern const char *ftcol_column_names[FTCOL_COLUMNS];
+extern const int ftcol_bloom_slot[FTCOL_COLUMNS];
+
+
+/* ===
+ * Bloom filter helpers, shared by the writer and readers
+ * ===
+ */
+static inline uint64_t ftcol_bloom_hash(uint64_t v) {
+
+  /* splitmix64's finalizer */
+  v ^= v >> 30;
+  v *= 0xBF58476D1CE4E5B9ULL;
+  v ^= v >> 27;
+  v *= 0x94D049BB133111EBULL;
+  v ^= v >> 31;
+
+  return v;
+}
+
+static inline void ftcol_bloom_add(uint8_t *bloom, const uint64_t v) {
+
+  uint64_t h = ftcol_bloom_hash(v);
+  uint32_t mask = (FTCOL_BLOOM_BYTES * 8) - 1;
+
+  bloom[(h & mask) >> 3] |= 1 << (h & 7);
+  bloom[((h >> 21) & mask) >> 3] |= 1 << ((h >> 21) & 7);
+  bloom[((h >> 42) & mask) >> 3] |= 1 << ((h >> 42) & 7);
+}
+
+static inline int ftcol_bloom_test(const uint8_t *bloom, const uint64_t v) {
+
+  uint64_t h = ftcol_bloom_hash(v);
+  uint32_t mask = (FTCOL_BLOOM_BYTES * 8) - 1;
+
+  return (((bloom[(h & mask) >> 3] >> (h & 7)) & 1) &&
+	  ((bloom[((h >> 21) & mask) >> 3] >> ((h >> 21) & 7)) & 1) &&
+	  ((bloom[((h >> 42) & mask) >> 3] >> ((h >> 42) & 7)) & 1));
+}
+
+
+/* ===
+ * Writer.  It does no I/O, it hands back encoded bytes for the caller
+ * to write: the header, then a block whenever ftcol_add_row() says one
+ * is full, then whatever block is left and the index.
+ * ===
+ */
+struct ftcol_writer {
+  int rows;
+  uint64_t offset; /* bytes handed out so far */
+  uint64_t cols[FTCOL_COLUMNS][FTCOL_BLOCK_ROWS];
+
+  /* Scratch for the encoders */
+  uint64_t values[FTCOL_BLOCK_ROWS];
+  uint64_t indexes[FTCOL_BLOCK_ROWS];
+  uint64_t words[FTCOL_BLOCK_ROWS + 2];
+
+  /* The index so far, the trailer gets tacked on the end */
+  uint8_t *index;
+  size_t index_len;
+  size_t index_size;
+  uint32_t blocks;
+};
+
+int ftcol_writer_init(struct ftcol_writer *);
+void ftcol_writer_free(struct ftcol_writer *);
+int ftcol_encode_header(struct ftcol_writer *, uint8_t *);
+int ftcol_add_row(struct ftcol_writer *, const struct ftbin_flow *, const int);
+size_t ftcol_encode_block(struct ftcol_writer *, uint8_t *);
+size_t ftcol_encode_index(struct ftcol_writer *, const uint8_t **);
+
+
+/* ===
+ * Reader.  Everything points into the caller's buffer (normally an
+ * mmap of the whole segment), nothing is copied until a column chunk
+ * is decoded.
+ * ===
+ */
+struct ftcol_file {
+  const uint8_t *data;
+  size_t len;
+  const uint8_t *index;
+  uint32_t blocks;
+};
+
+struct ftcol_block {
+  const uint8_t *data;
+  uint32_t rows;
+  const uint8_t *chunks[FTCOL_COLUMNS];
+  uint32_t chunk_lens[FTCOL_COLUMNS];
+  uint64_t min[FTCOL_COLUMNS];
+  uint64_t max[FTCOL_COLUMNS];
+  const uint8_t *blooms[FTCOL_BLOOMS];
+};
+
+int ftcol_open(const uint8_t *, const size_t, struct ftcol_file *);
+int ftcol_block(const struct ftcol_file *, const uint32_t,
+		struct ftcol_block *);
+int ftcol_decode_column(const uint8_t *, const uint32_t, const uint32_t,
+			uint64_t *);
+
+#endif /* ftcol.h */
@@ -0,0 +1,370 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "ftshm.h"
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+int ftshm_claim_writer(const char *, const int);
+int ftshm_claim_reader(struct ftshm_reader *);
+
+
+/* ===
+ * Writer
+ * ===
+ */
+int ftshm_create(const char *name, const uint32_t slots,
+		 const uint32_t data_size, struct ftshm_writer *w) {
+
+  struct ftshm_header *header;
+  struct ftshm_reader_slot *readers;
+  struct stat st;
+  uint64_t slot_count, slot_size, seq;
+  void *base;
+  int fh, ret;
+
+  for (slot_count = 1; slot_count < slots; slot_count <<= 1);
+  slot_size = (FTSHM_SLOT_HDR + data_size + FTSHM_ALIGN - 1) &
+    ~(uint64_t)(FTSHM_ALIGN - 1);
+
+  memset(w, 0, sizeof(struct ftshm_writer));
+  w->len = FTSHM_HEADER_LEN + (slot_count * slot_size);
+  w->mask = slot_count - 1;
+  w->data_size = slot_size - FTSHM_SLOT_HDR;
+
+  if ((fh = shm_open(name, O_RDWR | O_CREAT, FTSHM_MODE)) == -1) {
+    fprintf(stderr, "Unable to open shared memory %s: %s\n", name,
+	    strerror(errno));
+    return -1;
+  }
+
+  /* The umask usually takes the group write bit away */
+  if (fchmod(fh, FTSHM_MODE) != 0) {
+    fprintf(stderr, "Unable to set the mode on shared memory %s: %s\n",
+	    name, strerror(errno));
+  }
+
+  /* Claimed before the size changes, a live writer has it mapped */
+  if ((ret = ftshm_claim_writer(name, fh)) != 0) {
+    close(fh);
+    return ret;
+  }
+
+  if ((fstat(fh, &st) != 0) ||
+      ((st.st_size != w->len) && (ftruncate(fh, w->len) != 0))) {
+    fprintf(stderr, "Unable to size shared memory %s: %s\n", name,
+	    strerror(errno));
+    close(fh);
+    return -1;
+  }
+
+  base = mmap(NULL, w->len, PROT_READ | PROT_WRITE, MAP_SHARED, fh, 0);
+  close(fh);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Unable to map shared memory %s: %s\n", name,
+	    strerror(errno));
+    return -1;
+  }
+
+  w->base = base;
+  w->header = header = (struct ftshm_header *)base;
+
+  /* A ring left by an earlier run with the same shape is carried on
+   * with, so readers that stayed attached don't have to start over.
+   */
+  if ((header->magic != FTSHM_MAGIC) || (header->version != FTSHM_VERSION) ||
+      (header->slot_count != slot_count) || (header->slot_size != slot_size)) {
+    __atomic_store_n(&(header->magic), 0, __ATOMIC_RELEASE);
+
+    readers = ftshm_reader_slots(w->base);
+    memset(readers, 0, FTSHM_READERS * sizeof(struct ftshm_reader_slot));
+    for (seq = 0; seq < slot_count; seq++) {
+      ftshm_slot(w->base, slot_size, w->mask, seq)->seq = FTSHM_BUSY;
+    }
+
+    header->version = FTSHM_VERSION;
+    header->slot_count = slot_count;
+    header->slot_size = slot_size;
+    header->write_seq = 0;
+    __atomic_store_n(&(header->magic), FTSHM_MAGIC, __ATOMIC_RELEASE);
+  }
+
+  return 0;
+}
+
+
+/* It's a single writer ring, don't share it with a live flowtree.
+ * Claiming it is a compare and swap so two starting at once can't both
+ * get it.  Growing the object to hold the header is safe even if
+ * someone else has it mapped, only shrinking it isn't.
+ */
+int ftshm_claim_writer(const char *name, const int fh) {
+
+  struct ftshm_header *header;
+  struct stat st;
+  uint64_t pid;
+  void *base;
+  int ret = 0;
+
+  if ((fstat(fh, &st) != 0) ||
+      ((st.st_size < FTSHM_HEADER_LEN) &&
+       (ftruncate(fh, FTSHM_HEADER_LEN) != 0))) {
+    fprintf(stderr, "Unable to size shared memory %s: %s\n", name,
+	    strerror(errno));
+    return -1;
+  }
+
+  base = mmap(NULL, FTSHM_HEADER_LEN, PROT_READ | PROT_WRITE, MAP_SHARED,
+	      fh, 0);
+  if (base == MAP_FAILED) {
+    fprintf(stderr, "Unable to map shared memory %s: %s\n", name,
+	    strerror(errno));
+    return -1;
+  }
+  header = (struct ftshm_header *)base;
+
+  pid = __atomic_load_n(&(header->writer_pid), __ATOMIC_ACQUIRE);
+  if (((pid != 0) && ((kill(pid, 0) == 0) || (errno != ESRCH))) ||
+      (!__atomic_compare_exchange_n(&(header->writer_pid), &pid, getpid(), 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+    fprintf(stderr, "Shared memory %s is already written by pid %lu\n",
+	    name, (unsigned long)pid);
+    ret = FTSHM_IN_USE;
+  }
+
+  munmap(base, FTSHM_HEADER_LEN);
+
+  return ret;
+}
+
+
+int ftshm_write(struct ftshm_writer *w, const uint8_t *data,
+		const uint32_t len) {
+
+  struct ftshm_slot *slot;
+  uint64_t seq;
+
+  if (len > w->data_size) {
+    return -1;
+  }
+
+  /* Only we ever change write_seq */
+  seq = w->header->write_seq;
+  slot = ftshm_slot(w->base, w->header->slot_size, w->mask, seq);
+
+  __atomic_store_n(&(slot->seq), FTSHM_BUSY, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  memcpy(slot->data, data, len);
+  slot->len = len;
+
+  __atomic_store_n(&(slot->seq), seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&(w->header->write_seq), seq + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+
+void ftshm_close(struct ftshm_writer *w) {
+
+  /* The object stays so readers can finish what's in it */
+  if (w->base != NULL) {
+    w->header->writer_pid = 0;
+    munmap(w->base, w->len);
+    w->base = NULL;
+  }
+}
+
+
+/* ===
+ * Reader
+ * ===
+ */
+int ftshm_attach(const char *name, struct ftshm_reader *r) {
+
+  struct ftshm_header *header;
+  struct stat st;
+  uint32_t slot_count;
+  int writable = 1;
+  void *base;
+  int fh;
+
+  memset(r, 0, sizeof(struct ftshm_reader));
+
+  if ((fh = shm_open(name, O_RDWR, 0)) == -1) {
+    if ((errno != EACCES) || ((fh = shm_open(name, O_RDONLY, 0)) == -1)) {
+      return -1;
+    }
+    writable = 0;
+  }
+
+  if ((fstat(fh, &st) != 0) || (st.st_size < FTSHM_HEADER_LEN)) {
+    close(fh);
+    return -1;
+  }
+
+  base = mmap(NULL, st.st_size,
+	      writable ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED,
+	      fh, 0);
+  close(fh);
+  if (base == MAP_FAILED) {
+    return -1;
+  }
+
+  r->base = base;
+  r->len = st.st_size;
+  r->header = header = (struct ftshm_header *)base;
+
+  /* The mask only works for a power of two and a slot has to at least
+   * hold its own header
+   */
+  slot_count = header->slot_count;
+  if ((__atomic_load_n(&(header->magic), __ATOMIC_ACQUIRE) != FTSHM_MAGIC) ||
+      (header->version != FTSHM_VERSION) ||
+      (slot_count == 0) || ((slot_count & (slot_count - 1)) != 0) ||
+      (header->slot_size < FTSHM_SLOT_HDR) ||
+      (FTSHM_HEADER_LEN + ((uint64_t)slot_count * header->slot_size) !=
+       r->len)) {
+    munmap(base, st.st_size);
+    r->base = NULL;
+    return -1;
+  }
+
+  r->mask = slot_count - 1;
+  r->slot_size = header->slot_size;
+
+  /* Only what's written from now on */
+  r->cursor = __atomic_load_n(&(header->write_seq), __ATOMIC_ACQUIRE);
+
+  if (writable) {
+    ftshm_claim_reader(r);
+  }
+
+  return 0;
+}
+
+
+int ftshm_claim_reader(struct ftshm_reader *r) {
+
+  struct ftshm_reader_slot *readers;
+  uint64_t pid;
+  int i;
+
+  readers = ftshm_reader_slots(r->base);
+
+  /* Free slots, or ones left by readers that have gone away */
+  for (i = 0; i < FTSHM_READERS; i++) {
+    pid = __atomic_load_n(&(readers[i].pid), __ATOMIC_ACQUIRE);
+    if ((pid != 0) && ((kill(pid, 0) == 0) || (errno != ESRCH))) {
+      continue;
+    }
+
+    if (__atomic_compare_exchange_n(&(readers[i].pid), &pid, getpid(), 0,
+				    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      r->me = &(readers[i]);
+      __atomic_store_n(&(r->me->cursor), r->cursor, __ATOMIC_RELAXED);
+      __atomic_store_n(&(r->me->overruns), 0, __ATOMIC_RELAXED);
+      return 0;
+    }
+  }
+
+  /* Reading still works, the writer just can't see us */
+  return -1;
+}
+
+
+int ftshm_next(struct ftshm_reader *r, const uint8_t **data, uint32_t *len) {
+
+  struct ftshm_slot *slot;
+  uint64_t write_seq, lost;
+
+  for (;;) {
+    write_seq = __atomic_load_n(&(r->header->write_seq), __ATOMIC_ACQUIRE);
+    if (r->cursor >= write_seq) {
+      return 0;
+    }
+
+    /* Lapped, skip to the oldest datagram still in the ring */
+    if (write_seq - r->cursor > r->mask + 1) {
+      lost = write_seq - (r->mask + 1) - r->cursor;
+      r->overruns += lost;
+      r->cursor += lost;
+    }
+
+    slot = ftshm_slot(r->base, r->slot_size, r->mask, r->cursor);
+    if (__atomic_load_n(&(slot->seq), __ATOMIC_ACQUIRE) != r->cursor) {
+      /* Overwritten since we looked at write_seq */
+      r->overruns++;
+      r->cursor++;
+      continue;
+    }
+
+    *data = slot->data;
+    *len = slot->len;
+    if (*len > r->slot_size - FTSHM_SLOT_HDR) {
+      *len = r->slot_size - FTSHM_SLOT_HDR;
+    }
+
+    return 1;
+  }
+}
+
+
+int ftshm_done(struct ftshm_reader *r) {
+
+  struct ftshm_slot *slot;
+  int valid;
+
+  slot = ftshm_slot(r->base, r->slot_size, r->mask, r->cursor);
+
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  valid = (__atomic_load_n(&(slot->seq), __ATOMIC_RELAXED) == r->cursor);
+
+  if (!valid) {
+    r->overruns++;
+  }
+  r->cursor++;
+
+  if (r->me != NULL) {
+    __atomic_store_n(&(r->me->cursor), r->cursor, __ATOMIC_RELAXED);
+    __atomic_store_n(&(r->me->overruns), r->overruns, __ATOMIC_RELAXED);
+  }
+
+  return valid ? 0 : -1;
+}
+
+
+uint64_t ftshm_lag(const struct ftshm_reader *r) {
+
+  return __atomic_load_n(&(r->header->write_seq), __ATOMIC_ACQUIRE) -
+    r->cursor;
+}
+
+
+void ftshm_detach(struct ftshm_reader *r) {
+
+  if (r->base == NULL) {
+    return;
+  }
+
+  if (r->me != NULL) {
+    __atomic_store_n(&(r->me->pid), 0, __ATOMIC_RELEASE);
+    r->me = NULL;
+  }
+
+  munmap(r->base, r->len);
+  r->base = NULL;
+}
@@ -0,0 +1,144 @@
+#ifndef FTSHM_H
+#define FTSHM_H 1
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+/* ===
+ * The flowtree shared memory ring
+ *
+ * For consumers on the same host: the shm sink writes every binary
+ * export datagram (see ftbin.h) into a ring of fixed size slots in a
+ * POSIX shared memory object, /dev/shm/<name>, and readers map it and
+ * read the datagrams in place.  There is one writer and any number of
+ * readers, each with its own cursor.  The writer never waits for
+ * anyone; a reader that falls more than a ring behind loses the oldest
+ * datagrams and counts them as overruns.
+ *
+ * Everything is in host byte order, it never leaves the host.
+ *
+ *   header (FTSHM_HEADER_LEN bytes)
+ *     struct ftshm_header, then FTSHM_READERS reader slots
+ *
+ *   slot_count slots of slot_size bytes each
+ *     u64 seq            sequence number of the datagram in the slot
+ *     u32 len
+ *     u32 reserved
+ *     datagram
+ *
+ * Datagram n goes in slot n % slot_count.  A slot is a seqlock: the
+ * writer sets seq to FTSHM_BUSY, writes the datagram, then sets seq to
+ * n and only after that bumps write_seq.  A reader that finds seq == n
+ * both before and after looking at the datagram knows it wasn't
+ * overwritten underneath it.
+ * ===
+ */
+#define FTSHM_MAGIC 0x4D485346 /* "FSHM" */
+#define FTSHM_VERSION 1
+
+#define FTSHM_HEADER_LEN 4096
+#define FTSHM_READERS 32
+#define FTSHM_SLOT_HDR 16
+#define FTSHM_ALIGN 64
+
+#define FTSHM_BUSY (~(uint64_t)0)
+
+/* Readers publish their cursor in the header so they map it writable,
+ * which takes group write access.  Anyone else who can read the object
+ * still gets a read-only attach, just without a reader slot.
+ */
+#define FTSHM_MODE 0660
+
+struct ftshm_header {
+  uint32_t magic;
+  uint16_t version;
+  uint16_t reserved;
+  uint32_t slot_count;
+  uint32_t slot_size;
+  uint64_t writer_pid;
+  uint8_t pad1[FTSHM_ALIGN - 24];
+
+  /* Next sequence number the writer will use */
+  uint64_t write_seq __attribute__((aligned(FTSHM_ALIGN)));
+  uint8_t pad2[FTSHM_ALIGN - 8];
+};
+
+/* Each reader publishes where it is so the writer can report lag */
+struct ftshm_reader_slot {
+  uint64_t pid; /* 0 if free */
+  uint64_t cursor;
+  uint64_t overruns;
+  uint8_t pad[FTSHM_ALIGN - 24];
+} __attribute__((aligned(FTSHM_ALIGN)));
+
+struct ftshm_slot {
+  uint64_t seq;
+  uint32_t len;
+  uint32_t reserved;
+  uint8_t data[];
+};
+
+
+/* ===
+ * Writer side, used by the shm sink
+ * ===
+ */
+struct ftshm_writer {
+  uint8_t *base;
+  size_t len;
+  struct ftshm_header *header;
+  uint64_t mask;
+  uint32_t data_size; /* largest datagram a slot holds */
+};
+
+/* ftshm_create() returns FTSHM_IN_USE if another live process is
+ * already writing the ring */
+#define FTSHM_IN_USE -2
+
+int ftshm_create(const char *, const uint32_t, const uint32_t,
+		 struct ftshm_writer *);
+int ftshm_write(struct ftshm_writer *, const uint8_t *, const uint32_t);
+void ftshm_close(struct ftshm_writer *);
+
+
+/* ===
+ * Reader side.  ftshm_next() hands back a pointer into the ring and
+ * ftshm_done() says whether the slot was overwritten while the caller
+ * was looking at it, in which case whatever it read has to be thrown
+ * away.  Neither makes a system call.  A reader without write access
+ * attaches read-only and has no slot (me is NULL), so the writer can't
+ * report its lag.
+ * ===
+ */
+struct ftshm_reader {
+  uint8_t *base;
+  size_t len;
+  struct ftshm_header *header;
+  struct ftshm_reader_slot *me;
+  uint64_t mask;
+  uint32_t slot_size;
+  uint64_t cursor;
+  uint64_t overruns;
+};
+
+int ftshm_attach(const char *, struct ftshm_reader *);
+int ftshm_next(struct ftshm_reader *, const uint8_t **, uint32_t *);
+int ftshm_done(struct ftshm_reader *);
+uint64_t ftshm_lag(const struct ftshm_reader *);
+void ftshm_detach(struct ftshm_reader *);
+
+
+static inline struct ftshm_reader_slot *ftshm_reader_slots(uint8_t *base) {
+  return (struct ftshm_reader_slot *)(base + sizeof(struct ftshm_header));
+}
+
+static inline struct ftshm_slot *ftshm_slot(uint8_t *base,
+					    const uint32_t slot_size,
+					    const uint64_t mask,
+					    const uint64_t seq) {
+  return (struct ftshm_slot *)(base + FTSHM_HEADER_LEN +
+			       ((seq & mask) * slot_size));
+}
+
+#endif /* ftshm.h */
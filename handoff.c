@@ -0,0 +1,95 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#include "handoff.h"
+
+
+/* ===
+ * The receive thread side.  old is the table just finished (or NULL),
+ * and keep says whether it has anything worth sending.  Returns a table
+ * to reuse, or NULL if the caller has to allocate one.
+ * ===
+ */
+void *handoff_rollover(struct handoff *h, void *old, const int keep) {
+
+  void *next;
+
+  /* === *** ACQUIRE HANDOFF LOCK *** === */
+  pthread_mutex_lock(h->mutex);
+
+  next = h->spare;
+  h->spare = NULL;
+
+  /* The janitor hasn't sent the last one yet, the newer one wins */
+  if (h->done != NULL) {
+    __atomic_store_n(&(h->dropped), h->dropped + 1, __ATOMIC_RELAXED);
+    if (next == NULL) {
+      next = h->done;
+    }
+    else {
+      free(h->done);
+    }
+    h->done = NULL;
+  }
+
+  if ((old != NULL) && (keep != 0)) {
+    h->done = old;
+    old = NULL;
+  }
+
+  /* === *** RELEASE HANDOFF LOCK *** === */
+  pthread_mutex_unlock(h->mutex);
+
+  if (next == NULL) {
+    return old;
+  }
+
+  free(old);
+
+  return next;
+}
+
+
+/* ===
+ * The janitor side, take the finished table (if any) and give it back
+ * once it's been sent
+ * ===
+ */
+void *handoff_take(struct handoff *h) {
+
+  void *t;
+
+  /* === *** ACQUIRE HANDOFF LOCK *** === */
+  pthread_mutex_lock(h->mutex);
+  t = h->done;
+  h->done = NULL;
+  /* === *** RELEASE HANDOFF LOCK *** === */
+  pthread_mutex_unlock(h->mutex);
+
+  return t;
+}
+
+
+void handoff_return(struct handoff *h, void *t) {
+
+  /* === *** ACQUIRE HANDOFF LOCK *** === */
+  pthread_mutex_lock(h->mutex);
+  if (h->spare == NULL) {
+    h->spare = t;
+    t = NULL;
+  }
+  /* === *** RELEASE HANDOFF LOCK *** === */
+  pthread_mutex_unlock(h->mutex);
+
+  free(t);
+}
+
+
+/* Only once both sides are done with it */
+void handoff_free(struct handoff *h) {
+
+  free(h->done);
+  free(h->spare);
+  h->done = h->spare = NULL;
+}
@@ -0,0 +1,41 @@
+#ifndef HANDOFF_H
+#define HANDOFF_H 1
+
+#include <stdint.h>
+#include <pthread.h>
+
+
+/* ===
+ * Interval hand off
+ *
+ * The topk and rollup tables are filled by the receive thread and sent
+ * by the janitor.  At the end of an interval the receive thread swaps
+ * in a fresh table and leaves the finished one in done; the janitor
+ * takes it, sends it and puts it back as the spare for the next swap,
+ * so in steady state nothing is allocated.  If the janitor hasn't got
+ * to done by the next rollover the newer table replaces it and the
+ * older one is counted in dropped.
+ *
+ * The tables themselves are opaque here, anything allocated with
+ * malloc() works.  mutex only covers done, spare and dropped; several
+ * hand offs can share one.
+ * ===
+ */
+struct handoff {
+  pthread_mutex_t *mutex;
+  void *done;        /* finished, waiting to be sent */
+  void *spare;       /* sent, ready for reuse */
+  uint64_t dropped;  /* intervals the janitor never got to */
+};
+
+
+/* ===
+ * Hand off function prototypes
+ * ===
+ */
+void *handoff_rollover(struct handoff *, void *, const int);
+void *handoff_take(struct handoff *);
+void handoff_return(struct handoff *, void *);
+void handoff_free(struct handoff *);
+
+#endif /* handoff.h */
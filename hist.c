@@ -0,0 +1,189 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "flowtree.h"
+#include "hist.h"
+#include "metrics.h"
+
+
+/* ===
+ * Histogram settings and the per-thread histograms
+ * ===
+ */
+volatile int hist_enabled = 0;
+uint32_t hist_sample = HIST_SAMPLE;
+
+const char *hist_stage_names[HIST_STAGES] = {
+  "packet", "flow", "tree_lock", "janitor", "export", "sink_send"
+};
+
+struct hist_thread *hist_threads = NULL;
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+uint64_t hist_bucket_value(const int);
+
+
+int hist_init(void) {
+
+  /* Allocated even when off so SIGUSR1 can turn it on later */
+  if (posix_memalign((void **)&hist_threads, CACHE_LINE,
+		     MAX_THREADS * sizeof(struct hist_thread)) != 0) {
+    hist_threads = NULL;
+    return -1;
+  }
+  memset(hist_threads, 0, MAX_THREADS * sizeof(struct hist_thread));
+
+  if (hist_sample < 1) {
+    hist_sample = 1;
+  }
+
+  return 0;
+}
+
+
+void hist_snapshot(const int stage, struct hist *snap) {
+
+  struct hist *h;
+  uint64_t max;
+  int slot, b;
+
+  memset(snap, 0, sizeof(struct hist));
+
+  if (hist_threads == NULL) {
+    return;
+  }
+
+  for (slot = 0; slot < MAX_THREADS; slot++) {
+    h = &(hist_threads[slot].stages[stage]);
+
+    snap->count += __atomic_load_n(&(h->count), __ATOMIC_RELAXED);
+    snap->sum += __atomic_load_n(&(h->sum), __ATOMIC_RELAXED);
+    max = __atomic_load_n(&(h->max), __ATOMIC_RELAXED);
+    if (max > snap->max) {
+      snap->max = max;
+    }
+
+    for (b = 0; b < HIST_BUCKETS; b++) {
+      snap->buckets[b] += __atomic_load_n(&(h->buckets[b]),
+					  __ATOMIC_RELAXED);
+    }
+  }
+}
+
+
+uint64_t hist_bucket_value(const int bucket) {
+
+  int msb;
+
+  if (bucket < HIST_SUB) {
+    return bucket;
+  }
+
+  /* The top of the bucket, every value in it is at most this */
+  msb = (bucket >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+
+  return ((((uint64_t)HIST_SUB + (bucket & (HIST_SUB - 1))) + 1) <<
+	  (msb - HIST_SUB_BITS)) - 1;
+}
+
+
+uint64_t hist_quantile(const struct hist *h, const double q) {
+
+  uint64_t want, seen = 0;
+  int b;
+
+  if (h->count == 0) {
+    return 0;
+  }
+
+  want = (uint64_t)(q * (double)h->count);
+  if (want >= h->count) {
+    want = h->count - 1;
+  }
+
+  /* Bucket counts and count are read separately so they can disagree a
+   * little, max catches anything that runs off the end */
+  for (b = 0; b < HIST_BUCKETS; b++) {
+    seen += h->buckets[b];
+    if (seen > want) {
+      return (hist_bucket_value(b) < h->max) ? hist_bucket_value(b) : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+
+/* ===
+ * Output, with the rest of the stats and in metrics scrapes
+ * ===
+ */
+void hist_report(void) {
+
+  struct hist *snap;
+  int stage;
+
+  if ((hist_threads == NULL) ||
+      ((snap = malloc(sizeof(struct hist))) == NULL)) {
+    return;
+  }
+
+  fprintf(stderr, "latency (%s, 1 in %u sampled):\n",
+	  (hist_enabled != 0) ? "on" : "off", hist_sample);
+
+  for (stage = 0; stage < HIST_STAGES; stage++) {
+    hist_snapshot(stage, snap);
+    if (snap->count == 0) {
+      continue;
+    }
+
+    fprintf(stderr, "  %s: %lu timed; mean %.3f us; p50 %.3f us; "
+	    "p99 %.3f us; p999 %.3f us; max %.3f us\n",
+	    hist_stage_names[stage], snap->count,
+	    (double)snap->sum / (double)snap->count / 1e3,
+	    (double)hist_quantile(snap, 0.5) / 1e3,
+	    (double)hist_quantile(snap, 0.99) / 1e3,
+	    (double)hist_quantile(snap, 0.999) / 1e3,
+	    (double)snap->max / 1e3);
+  }
+
+  free(snap);
+}
+
+
+void hist_metrics(FILE *out) {
+
+  static const double quantiles[] = {0.5, 0.99, 0.999};
+  struct hist *snap;
+  int stage, q;
+
+  if ((hist_threads == NULL) ||
+      ((snap = malloc(sizeof(struct hist))) == NULL)) {
+    return;
+  }
+
+  metrics_header(out, "flowtree_stage_latency_seconds", "summary",
+		 "Time spent in each pipeline stage, sampled");
+
+  for (stage = 0; stage < HIST_STAGES; stage++) {
+    hist_snapshot(stage, snap);
+
+    for (q = 0; q < 3; q++) {
+      fprintf(out, "flowtree_stage_latency_seconds{stage=\"%s\","
+	      "quantile=\"%g\"} %.9f\n", hist_stage_names[stage],
+	      quantiles[q], (double)hist_quantile(snap, quantiles[q]) / 1e9);
+    }
+    fprintf(out, "flowtree_stage_latency_seconds_sum{stage=\"%s\"} %.9f\n",
+	    hist_stage_names[stage], (double)snap->sum / 1e9);
+    fprintf(out, "flowtree_stage_latency_seconds_count{stage=\"%s\"} %lu\n",
+	    hist_stage_names[stage], snap->count);
+  }
+
+  free(snap);
+}
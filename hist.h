@@ -0,0 +1,135 @@
+#ifndef HIST_H
+#define HIST_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Latency histograms for the pipeline stages
+ *
+ * HDR style log-linear buckets: values below HIST_SUB nanoseconds get a
+ * bucket each and every power of two above that is split into HIST_SUB
+ * buckets, so any value lands in a bucket within 1/HIST_SUB (about 6%)
+ * of it.  Every thread records into its own copy, owned like the stats
+ * counters (see stats.h), and readers add the copies up.
+ *
+ * Off unless -H is given.  -H <n> times 1 in n of each stage and
+ * SIGUSR1 turns recording off and on again while running.
+ * ===
+ */
+#define HIST_SAMPLE 16 /* if SIGUSR1 turns it on without -H */
+
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 40 /* about 18 minutes in ns, longer is clamped */
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+/* The stages */
+#define HIST_PACKET 0      /* packet_callback(), per datagram */
+#define HIST_FLOW 1        /* flow_callback(), per record */
+#define HIST_TREE_LOCK 2   /* waiting for a tree mutex */
+#define HIST_JANITOR 3     /* one janitor sweep */
+#define HIST_EXPORT 4      /* export_flow(), encoding and batching */
+#define HIST_SINK_SEND 5   /* one sink send() call */
+#define HIST_STAGES 6
+
+struct hist {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+struct hist_thread {
+  uint32_t ticks[HIST_STAGES]; /* for sampling */
+  struct hist stages[HIST_STAGES];
+} __attribute__((aligned(CACHE_LINE)));
+
+extern volatile int hist_enabled;
+extern uint32_t hist_sample;
+extern const char *hist_stage_names[HIST_STAGES];
+extern struct hist_thread *hist_threads;
+
+
+static inline int hist_bucket(uint64_t v) {
+
+  int msb;
+
+  if (v < HIST_SUB) {
+    return v;
+  }
+
+  msb = 63 - __builtin_clzll(v);
+  if (msb >= HIST_MAX_BITS) {
+    return HIST_BUCKETS - 1;
+  }
+
+  return ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) +
+    ((v >> (msb - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+
+/* A start time if this one is being timed, 0 if not */
+static inline uint64_t hist_start(const int stage) {
+
+  struct hist_thread *t;
+
+  if ((hist_enabled == 0) || (hist_threads == NULL)) {
+    return 0;
+  }
+
+  t = &(hist_threads[thread_slot()]);
+  if ((t->ticks[stage]++ % hist_sample) != 0) {
+    return 0;
+  }
+
+  return monotonic_ns();
+}
+
+
+/* Record a time measured some other way, not sampled */
+static inline void hist_add(const int stage, const uint64_t ns) {
+
+  struct hist *h;
+  int b;
+
+  if ((hist_enabled == 0) || (hist_threads == NULL)) {
+    return;
+  }
+
+  h = &(hist_threads[thread_slot()].stages[stage]);
+  b = hist_bucket(ns);
+
+  /* Owner-only writes, same as the stats counters */
+  __atomic_store_n(&(h->buckets[b]), h->buckets[b] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&(h->sum), h->sum + ns, __ATOMIC_RELAXED);
+  if (ns > h->max) {
+    __atomic_store_n(&(h->max), ns, __ATOMIC_RELAXED);
+  }
+  __atomic_store_n(&(h->count), h->count + 1, __ATOMIC_RELAXED);
+}
+
+
+/* Finish what hist_start() started */
+static inline void hist_record(const int stage, const uint64_t start_ns) {
+
+  if (start_ns != 0) {
+    hist_add(stage, monotonic_ns() - start_ns);
+  }
+}
+
+
+/* ===
+ * Hist function prototypes
+ * ===
+ */
+int hist_init(void);
+void hist_snapshot(const int, struct hist *);
+uint64_t hist_quantile(const struct hist *, const double);
+void hist_report(void);
+void hist_metrics(FILE *);
+
+#endif /* hist.h */
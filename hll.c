@@ -0,0 +1,411 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "export.h"
+#include "metrics.h"
+#include "hll.h"
+
+
+/* ===
+ * HLL settings and state
+ * ===
+ */
+uint32_t hll_threshold = 0;
+uint32_t hll_entries = HLL_ENTRIES;
+
+const char *hll_kind_names[HLL_KINDS] = {
+  "dst_sources", "src_destinations", "src_ports"
+};
+
+/* Only the receive thread touches the tables */
+struct hll_entry *hll_tables[HLL_KINDS] = {NULL, NULL, NULL};
+uint32_t hll_mask = 0;
+
+/* Written by the receive thread, read by anyone */
+uint64_t hll_raised[HLL_KINDS] = {0, 0, 0};
+uint64_t hll_evictions = 0;
+
+/* hll_mutex covers the queue and the dropped count */
+struct hll_alert hll_queue[HLL_ALERT_QUEUE];
+int hll_queued = 0;
+uint64_t hll_dropped = 0;
+uint64_t hll_sent = 0; /* janitor only */
+pthread_mutex_t hll_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* 2^-n for every register value and linear counting for every number of
+ * zero registers, so an update never calls into libm */
+double hll_pow[64 - HLL_BITS + 2];
+double hll_linear[HLL_REGISTERS + 1];
+
+#define HLL_ALPHA (0.7213 / (1.0 + (1.079 / HLL_REGISTERS)))
+#define HLL_RECORD_MAX 512
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+void hll_update(const int, const uint64_t, const uint64_t, const time_t,
+		const uint32_t);
+struct hll_entry *hll_find(struct hll_entry *, const uint64_t, const time_t,
+			   const uint32_t);
+uint32_t hll_estimate(const struct hll_entry *);
+void hll_alert(const int, const struct hll_entry *, const time_t);
+int hll_encode(char *, const struct hll_alert *);
+
+
+/* splitmix64's finalizer, the registers need all 64 bits well mixed */
+static inline uint64_t hll_hash(uint64_t x) {
+
+  x ^= x >> 30;
+  x *= 0xBF58476D1CE4E5B9ULL;
+  x ^= x >> 27;
+  x *= 0x94D049BB133111EBULL;
+  x ^= x >> 31;
+
+  return x;
+}
+
+
+int hll_parse(const char *arg) {
+
+  char *end;
+  unsigned long threshold, entries;
+
+  threshold = strtoul(arg, &end, 10);
+  entries = HLL_ENTRIES;
+
+  if (*end == ':') {
+    entries = strtoul(end + 1, &end, 10);
+  }
+
+  if ((*end != '\0') || (threshold == 0) || (threshold > UINT32_MAX) ||
+      (entries < HLL_PROBE) || (entries > HLL_ENTRIES_MAX)) {
+    fprintf(stderr, "Bad -D %s, want <threshold>[:<entries>] with at "
+	    "least %d and at most %d entries\n", arg, HLL_PROBE,
+	    HLL_ENTRIES_MAX);
+    return -1;
+  }
+
+  /* Round up to a power of two for the mask */
+  hll_entries = HLL_PROBE;
+  while (hll_entries < entries) {
+    hll_entries <<= 1;
+  }
+  hll_threshold = threshold;
+
+  return 0;
+}
+
+
+int hll_init(void) {
+
+  int kind, i;
+
+  if (hll_threshold == 0) {
+    return 0;
+  }
+
+  for (i = 0; i < (int)(sizeof(hll_pow) / sizeof(hll_pow[0])); i++) {
+    hll_pow[i] = ldexp(1.0, -i);
+  }
+  for (i = 1; i <= HLL_REGISTERS; i++) {
+    hll_linear[i] = HLL_REGISTERS * log((double)HLL_REGISTERS / i);
+  }
+
+  /* Zeroed entries have window 0, which is never current */
+  for (kind = 0; kind < HLL_KINDS; kind++) {
+    hll_tables[kind] = calloc(hll_entries, sizeof(struct hll_entry));
+    if (hll_tables[kind] == NULL) {
+      fprintf(stderr, "Unable to allocate %u distinct count entries.\n",
+	      hll_entries);
+      hll_shutdown();
+      return -1;
+    }
+  }
+  hll_mask = hll_entries - 1;
+
+  return 0;
+}
+
+
+void hll_shutdown(void) {
+
+  int kind;
+
+  for (kind = 0; kind < HLL_KINDS; kind++) {
+    free(hll_tables[kind]);
+    hll_tables[kind] = NULL;
+  }
+}
+
+
+/* ===
+ * The receive side, only ever called from flow_callback()
+ * ===
+ */
+void hll_record(const struct unified_flow *flow) {
+
+  if (hll_threshold == 0) {
+    return;
+  }
+
+  hll_add(flow);
+}
+
+
+void hll_add(const struct unified_flow *flow) {
+
+  uint32_t window = (uint32_t)(flow->recv_time / HLL_WINDOW) + 1;
+
+  hll_update(HLL_DST_SOURCES, flow->dst_addr.s_addr, flow->src_addr.s_addr,
+	     flow->recv_time, window);
+  hll_update(HLL_SRC_DESTS, flow->src_addr.s_addr, flow->dst_addr.s_addr,
+	     flow->recv_time, window);
+  hll_update(HLL_SRC_PORTS, flow->src_addr.s_addr,
+	     ((uint64_t)flow->protocol << 16) | flow->dst_port,
+	     flow->recv_time, window);
+}
+
+
+void hll_update(const int kind, const uint64_t key, const uint64_t item,
+		const time_t now, const uint32_t window) {
+
+  struct hll_entry *e;
+  uint64_t hash;
+  int reg;
+  uint8_t rho;
+
+  e = hll_find(hll_tables[kind], key, now, window);
+  e->records++;
+
+  /* The top bits pick the register, the rest give the run of zeros; the
+   * low bit or'ed in caps it at what the remaining bits can hold */
+  hash = hll_hash(item + kind);
+  reg = (int)(hash >> (64 - HLL_BITS));
+  rho = (uint8_t)__builtin_clzll((hash << HLL_BITS) |
+				 (1ULL << (HLL_BITS - 1))) + 1;
+
+  if (rho <= e->registers[reg]) {
+    return;
+  }
+
+  if (e->registers[reg] == 0) {
+    e->zeros--;
+  }
+  e->inv_sum += hll_pow[rho] - hll_pow[e->registers[reg]];
+  e->registers[reg] = rho;
+  e->estimate = hll_estimate(e);
+
+  if ((e->alerted == 0) && (e->estimate >= hll_threshold)) {
+    e->alerted = 1;
+    hll_alert(kind, e, now);
+  }
+}
+
+
+/* The key's entry, a free one or the smallest one evicted for it */
+struct hll_entry *hll_find(struct hll_entry *table, const uint64_t key,
+			   const time_t now, const uint32_t window) {
+
+  struct hll_entry *e, *victim = NULL;
+  uint32_t slot = (uint32_t)hll_hash(key);
+  int probe;
+
+  for (probe = 0; probe < HLL_PROBE; probe++) {
+    e = &(table[(slot + probe) & hll_mask]);
+
+    if (e->window != window) {
+      if ((victim == NULL) || (victim->window == window)) {
+	victim = e;
+      }
+      continue;
+    }
+
+    if (e->key == key) {
+      return e;
+    }
+
+    if ((victim == NULL) ||
+	((victim->window == window) && (e->estimate < victim->estimate))) {
+      victim = e;
+    }
+  }
+
+  if (victim->window == window) {
+    __atomic_store_n(&hll_evictions, hll_evictions + 1, __ATOMIC_RELAXED);
+  }
+
+  victim->key = key;
+  victim->window = window;
+  victim->estimate = 0;
+  victim->records = 0;
+  victim->zeros = HLL_REGISTERS;
+  victim->alerted = 0;
+  victim->inv_sum = HLL_REGISTERS;
+  victim->first_seen = now;
+  memset(victim->registers, 0, sizeof(victim->registers));
+
+  return victim;
+}
+
+
+uint32_t hll_estimate(const struct hll_entry *e) {
+
+  double est;
+
+  est = HLL_ALPHA * HLL_REGISTERS * HLL_REGISTERS / e->inv_sum;
+
+  /* Small range correction */
+  if ((est <= 2.5 * HLL_REGISTERS) && (e->zeros > 0)) {
+    est = hll_linear[e->zeros];
+  }
+
+  if (est >= UINT32_MAX) {
+    return UINT32_MAX;
+  }
+
+  return (uint32_t)(est + 0.5);
+}
+
+
+void hll_alert(const int kind, const struct hll_entry *e, const time_t now) {
+
+  struct hll_alert *a;
+
+  __atomic_store_n(&(hll_raised[kind]), hll_raised[kind] + 1,
+		   __ATOMIC_RELAXED);
+
+  /* === *** ACQUIRE HLL LOCK *** === */
+  pthread_mutex_lock(&hll_mutex);
+
+  if (hll_queued == HLL_ALERT_QUEUE) {
+    hll_dropped++;
+  }
+  else {
+    a = &(hll_queue[hll_queued++]);
+    a->kind = kind;
+    a->key = e->key;
+    a->estimate = e->estimate;
+    a->records = e->records;
+    a->window_start = (time_t)(e->window - 1) * HLL_WINDOW;
+    a->first_seen = e->first_seen;
+    a->when = now;
+  }
+
+  /* === *** RELEASE HLL LOCK *** === */
+  pthread_mutex_unlock(&hll_mutex);
+}
+
+
+/* ===
+ * The janitor side, sends whatever alerts are waiting
+ * ===
+ */
+void hll_export(void) {
+
+  struct hll_alert alerts[HLL_ALERT_QUEUE];
+  char record[HLL_RECORD_MAX];
+  int count, i, len;
+
+  if (hll_threshold == 0) {
+    return;
+  }
+
+  /* === *** ACQUIRE HLL LOCK *** === */
+  pthread_mutex_lock(&hll_mutex);
+  count = hll_queued;
+  memcpy(alerts, hll_queue, count * sizeof(struct hll_alert));
+  hll_queued = 0;
+  /* === *** RELEASE HLL LOCK *** === */
+  pthread_mutex_unlock(&hll_mutex);
+
+  for (i = 0; i < count; i++) {
+    len = hll_encode(record, &(alerts[i]));
+    export_summary(record, len);
+  }
+
+  __atomic_store_n(&hll_sent, hll_sent + count, __ATOMIC_RELAXED);
+}
+
+
+int hll_encode(char *record, const struct hll_alert *a) {
+
+  struct in_addr addr;
+  char key[INET_ADDRSTRLEN];
+
+  addr.s_addr = htonl((in_addr_t)a->key);
+  inet_ntop(AF_INET, &addr, key, sizeof(key));
+
+  return snprintf(record, HLL_RECORD_MAX, "{\"summary\":\"cardinality\","
+		  "\"kind\":\"%s\",\"key\":\"%s\",\"estimate\":%u,"
+		  "\"threshold\":%u,\"records\":%u,\"window_start\":%lu,"
+		  "\"window\":%d,\"first_seen\":%lu,\"time\":%lu}\n",
+		  hll_kind_names[a->kind], key, a->estimate, hll_threshold,
+		  a->records, (uint64_t)a->window_start, HLL_WINDOW,
+		  (uint64_t)a->first_seen, (uint64_t)a->when);
+}
+
+
+/* ===
+ * Stats and metrics
+ * ===
+ */
+void hll_report(void) {
+
+  int kind;
+
+  if (hll_threshold == 0) {
+    return;
+  }
+
+  fprintf(stderr, "distinct count alerts (threshold %u, %u entries, "
+	  "%lu KB):", hll_threshold, hll_entries,
+	  (uint64_t)HLL_KINDS * hll_entries * sizeof(struct hll_entry) / 1024);
+  for (kind = 0; kind < HLL_KINDS; kind++) {
+    fprintf(stderr, " %s %lu;", hll_kind_names[kind],
+	    __atomic_load_n(&(hll_raised[kind]), __ATOMIC_RELAXED));
+  }
+  fprintf(stderr, " sent %lu; dropped %lu; evictions %lu\n",
+	  __atomic_load_n(&hll_sent, __ATOMIC_RELAXED),
+	  __atomic_load_n(&hll_dropped, __ATOMIC_RELAXED),
+	  __atomic_load_n(&hll_evictions, __ATOMIC_RELAXED));
+}
+
+
+void hll_metrics(FILE *out) {
+
+  int kind;
+
+  if (hll_threshold == 0) {
+    return;
+  }
+
+  metrics_header(out, "flowtree_distinct_alerts_total", "counter",
+		 "Keys that reached the distinct count threshold");
+  for (kind = 0; kind < HLL_KINDS; kind++) {
+    fprintf(out, "flowtree_distinct_alerts_total{kind=\"%s\"} %lu\n",
+	    hll_kind_names[kind],
+	    __atomic_load_n(&(hll_raised[kind]), __ATOMIC_RELAXED));
+  }
+
+  metrics_header(out, "flowtree_distinct_alerts_dropped_total", "counter",
+		 "Alerts the janitor did not get to in time");
+  fprintf(out, "flowtree_distinct_alerts_dropped_total %lu\n",
+	  __atomic_load_n(&hll_dropped, __ATOMIC_RELAXED));
+
+  metrics_header(out, "flowtree_distinct_evictions_total", "counter",
+		 "Candidate keys evicted from a full probe window");
+  fprintf(out, "flowtree_distinct_evictions_total %lu\n",
+	  __atomic_load_n(&hll_evictions, __ATOMIC_RELAXED));
+}
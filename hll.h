@@ -0,0 +1,91 @@
+#ifndef HLL_H
+#define HLL_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Distinct counts for scan and flood detection
+ *
+ * With -D <threshold> every record that makes it to flow_callback() is
+ * counted into three HyperLogLog tables: distinct sources per
+ * destination, distinct destinations per source and distinct
+ * destination protocol/ports per source.  Each entry is HLL_REGISTERS
+ * one byte registers (about 6.5% standard error) plus its running
+ * estimate, which only has to be worked out again when a register goes
+ * up, so the common case is a hash and a compare.
+ *
+ * The tables hold candidate keys and never grow: -D <threshold>:<n>
+ * gives each one n entries (rounded up to a power of two, default
+ * HLL_ENTRIES), and memory is n * sizeof(struct hll_entry) per table.  A
+ * key looks for its entry in HLL_PROBE slots from its hash, and when all
+ * of them hold other keys the one with the smallest estimate is evicted.
+ * Entries are stamped with the HLL_WINDOW second window they were
+ * started in, a stale entry counts as free, so the tables start over
+ * every window without anyone clearing them.
+ *
+ * A key that reaches the threshold raises one alert per window.  The
+ * receive thread is the only writer to the tables; alerts are queued for
+ * the janitor, which sends each one as a JSON summary record down the
+ * JSON export stream.
+ *
+ * -B hll measures what the update costs per record.
+ * ===
+ */
+#define HLL_BITS 8
+#define HLL_REGISTERS (1 << HLL_BITS)
+#define HLL_ENTRIES 4096       /* per table without :<n> */
+#define HLL_ENTRIES_MAX (1 << 20)
+#define HLL_PROBE 8
+#define HLL_WINDOW 60          /* seconds */
+#define HLL_ALERT_QUEUE 256    /* alerts waiting on the janitor */
+
+#define HLL_DST_SOURCES 0      /* key dst addr, counts src addrs */
+#define HLL_SRC_DESTS 1        /* key src addr, counts dst addrs */
+#define HLL_SRC_PORTS 2        /* key src addr, counts dst proto/ports */
+#define HLL_KINDS 3
+
+struct hll_entry {
+  uint64_t key;
+  uint32_t window;   /* window number + 1, so 0 is never current */
+  uint32_t estimate;
+  uint32_t records;
+  uint16_t zeros;    /* registers still at 0 */
+  uint8_t alerted;
+  double inv_sum;    /* sum of 2^-register */
+  time_t first_seen;
+  uint8_t registers[HLL_REGISTERS];
+};
+
+struct hll_alert {
+  int kind;
+  uint64_t key;
+  uint32_t estimate;
+  uint32_t records;
+  time_t window_start;
+  time_t first_seen;
+  time_t when;
+};
+
+extern uint32_t hll_threshold; /* -D, 0 is off */
+extern uint32_t hll_entries;
+
+
+/* ===
+ * HLL function prototypes
+ * ===
+ */
+int hll_parse(const char *);
+int hll_init(void);
+void hll_add(const struct unified_flow *);
+void hll_record(const struct unified_flow *);
+void hll_export(void);
+void hll_shutdown(void);
+void hll_report(void);
+void hll_metrics(FILE *);
+
+#endif /* hll.h */
@@ -0,0 +1,90 @@
+#ifndef IPFIX_H
+#define IPFIX_H 1
+
+#include <stdint.h>
+
+
+/* ===
+ * IPFIX (RFC 7011) export
+ *
+ * A message is the 16 byte header, an optional template set and then
+ * one data set of fixed size records:
+ *
+ *   header
+ *     u16 version        IPFIX_VERSION
+ *     u16 length         the whole message
+ *     u32 export_time
+ *     u32 sequence       data records sent before this message
+ *     u32 domain         IPFIX_DOMAIN_ID
+ *
+ *   set header
+ *     u16 set_id         IPFIX_SET_TEMPLATE or IPFIX_TEMPLATE_ID
+ *     u16 length         the whole set
+ *
+ * Everything is network byte order.  There is one template and it goes
+ * out in the first message and again every IPFIX_TEMPLATE_REFRESH
+ * seconds so collectors that start late pick it up.  Stream sinks (tcp:
+ * and unix:) also send a message with just the template every time
+ * they connect, so a collector never has to wait for the refresh to
+ * decode a new connection.
+ *
+ * Each flow is one record however many exporters saw it; the counters
+ * and interfaces come from the source that saw the most bytes, and that
+ * source is sent as originalExporterIPv4Address.  Adding up the sources
+ * would count the same traffic once per router that saw it.
+ * ===
+ */
+#define IPFIX_VERSION 10
+#define IPFIX_DOMAIN_ID 1
+
+#define IPFIX_SET_TEMPLATE 2
+#define IPFIX_TEMPLATE_ID 256
+
+#define IPFIX_TEMPLATE_REFRESH 60
+
+#define IPFIX_HEADER_LEN 16
+#define IPFIX_SET_HEADER_LEN 4
+#define IPFIX_FIELDS 14
+#define IPFIX_TEMPLATE_SET_LEN (IPFIX_SET_HEADER_LEN + 4 + (IPFIX_FIELDS * 4))
+#define IPFIX_TEMPLATE_MSG_LEN (IPFIX_HEADER_LEN + IPFIX_TEMPLATE_SET_LEN)
+#define IPFIX_RECORD_LEN 54
+
+/* Information elements, from the IANA registry */
+#define IPFIX_IE_OCTET_DELTA_COUNT 1
+#define IPFIX_IE_PACKET_DELTA_COUNT 2
+#define IPFIX_IE_DELTA_FLOW_COUNT 3
+#define IPFIX_IE_PROTOCOL 4
+#define IPFIX_IE_TCP_CONTROL_BITS 6
+#define IPFIX_IE_SRC_PORT 7
+#define IPFIX_IE_SRC_ADDR 8
+#define IPFIX_IE_INGRESS_INTERFACE 10
+#define IPFIX_IE_DST_PORT 11
+#define IPFIX_IE_DST_ADDR 12
+#define IPFIX_IE_EGRESS_INTERFACE 14
+#define IPFIX_IE_FLOW_START_SECONDS 150
+#define IPFIX_IE_FLOW_END_SECONDS 151
+#define IPFIX_IE_ORIGINAL_EXPORTER_IPV4 403
+
+
+/* ===
+ * Network order helpers
+ * ===
+ */
+static inline void ipfix_put16(uint8_t *p, const uint16_t v) {
+  p[0] = (v >> 8) & 0xFF;
+  p[1] = v & 0xFF;
+}
+
+static inline void ipfix_put32(uint8_t *p, const uint32_t v) {
+  p[0] = (v >> 24) & 0xFF;
+  p[1] = (v >> 16) & 0xFF;
+  p[2] = (v >> 8) & 0xFF;
+  p[3] = v & 0xFF;
+}
+
+static inline void ipfix_put64(uint8_t *p, const uint64_t v) {
+  ipfix_put32(p, v >> 32);
+  ipfix_put32(p + 4, v & 0xFFFFFFFF);
+}
+
+#endif /* ipfix.h */
@@ -0,0 +1,350 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "export.h"
+#include "metrics.h"
+#include "matrix.h"
+
+
+/* ===
+ * Matrix settings and state
+ * ===
+ */
+int matrix_interval_secs = 0;
+
+/* Only the receive thread adds to the table, anyone can read it */
+struct matrix *matrices[MATRIX_EXPORTERS];
+struct matrix *matrix_last = NULL; /* receive thread, the last one used */
+uint64_t matrix_overflow = 0;      /* records from exporters that didn't fit */
+
+/* Janitor only */
+time_t matrix_start = 0; /* of what hasn't been sent yet */
+time_t matrix_next = 0;
+uint64_t matrix_summaries = 0;
+
+#define MATRIX_RECORD_MAX 4096
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+struct matrix *matrix_get(const in_addr_t);
+int matrix_iface(struct matrix *, const uint16_t);
+int matrix_encode(char *, struct matrix *, const int, const uint32_t,
+		  const time_t, const int);
+
+
+static inline uint32_t matrix_hash(const uint32_t key) {
+  return (key * 2654435761U) >> 16;
+}
+
+
+/* ===
+ * The receive side, only ever called from flow_callback().  Exporters
+ * are keyed on flow_src, host order for v5 and v7 alike, so the labels
+ * below come out the same as exporter_name()'s for the same router.
+ * ===
+ */
+struct matrix *matrix_get(const in_addr_t exporter) {
+
+  struct matrix *m;
+  uint32_t slot;
+  int probe;
+
+  /* Records mostly come a datagram's worth at a time */
+  if ((matrix_last != NULL) && (matrix_last->exporter == exporter)) {
+    return matrix_last;
+  }
+
+  slot = matrix_hash(exporter);
+  for (probe = 0; probe < MATRIX_EXPORTERS; probe++) {
+    slot &= MATRIX_EXPORTERS - 1;
+    m = matrices[slot];
+
+    if (m == NULL) {
+      if ((m = calloc(1, sizeof(struct matrix))) == NULL) {
+	return NULL;
+      }
+      m->exporter = exporter;
+      __atomic_store_n(&(matrices[slot]), m, __ATOMIC_RELEASE);
+      return (matrix_last = m);
+    }
+
+    if (m->exporter == exporter) {
+      return (matrix_last = m);
+    }
+    slot++;
+  }
+
+  return NULL;
+}
+
+
+/* The dense id for an interface index, interning it if it's new */
+int matrix_iface(struct matrix *m, const uint16_t ifindex) {
+
+  uint32_t slot;
+  int id;
+
+  for (slot = matrix_hash(ifindex); ; slot++) {
+    slot &= MATRIX_SLOTS - 1;
+
+    if (m->slots[slot] == 0) {
+      if (m->iface_count == MATRIX_OTHER) {
+	return MATRIX_OTHER;
+      }
+      id = m->iface_count;
+      m->ifaces[id] = ifindex;
+      m->slots[slot] = id + 1;
+      __atomic_store_n(&(m->iface_count), id + 1, __ATOMIC_RELEASE);
+      return id;
+    }
+
+    if (m->ifaces[m->slots[slot] - 1] == ifindex) {
+      return m->slots[slot] - 1;
+    }
+  }
+}
+
+
+void matrix_add(const struct unified_flow *flow) {
+
+  struct matrix *m;
+  struct matrix_cell *cell;
+  int src, dst;
+
+  if ((m = matrix_get(flow->flow_src)) == NULL) {
+    __atomic_store_n(&matrix_overflow, matrix_overflow + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  src = matrix_iface(m, flow->src_int);
+  dst = matrix_iface(m, flow->dst_int);
+  if ((src == MATRIX_OTHER) || (dst == MATRIX_OTHER)) {
+    __atomic_store_n(&(m->other_records), m->other_records + 1,
+		     __ATOMIC_RELAXED);
+  }
+
+  cell = &(m->cells[src][dst]);
+  __atomic_store_n(&(cell->bytes), cell->bytes + flow->num_bytes,
+		   __ATOMIC_RELAXED);
+  __atomic_store_n(&(cell->packets), cell->packets + flow->num_packets,
+		   __ATOMIC_RELAXED);
+}
+
+
+void matrix_record(const struct unified_flow *flow) {
+
+  if (matrix_interval_secs == 0) {
+    return;
+  }
+
+  matrix_add(flow);
+}
+
+
+/* ===
+ * The janitor side, sends what changed once the interval is up
+ * ===
+ */
+void matrix_export(const time_t now) {
+
+  struct matrix *m;
+  char record[MATRIX_RECORD_MAX];
+  time_t start;
+  uint32_t count;
+  int slot, src, len, interval;
+
+  if (matrix_interval_secs == 0) {
+    return;
+  }
+
+  /* Intervals line up on multiples of -I, one the janitor got to late
+   * runs up to the boundary before it did */
+  if (matrix_next == 0) {
+    matrix_start = now - (now % matrix_interval_secs);
+    matrix_next = matrix_start + matrix_interval_secs;
+    return;
+  }
+  if (now < matrix_next) {
+    return;
+  }
+  start = matrix_start;
+  matrix_start = now - (now % matrix_interval_secs);
+  matrix_next = matrix_start + matrix_interval_secs;
+  interval = (int)(matrix_start - start);
+
+  for (slot = 0; slot < MATRIX_EXPORTERS; slot++) {
+    if ((m = __atomic_load_n(&(matrices[slot]), __ATOMIC_ACQUIRE)) == NULL) {
+      continue;
+    }
+
+    if ((m->sent == NULL) &&
+	((m->sent = calloc(MATRIX_IFACES * MATRIX_IFACES,
+			   sizeof(struct matrix_cell))) == NULL)) {
+      continue;
+    }
+
+    count = __atomic_load_n(&(m->iface_count), __ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&(m->other_records), __ATOMIC_RELAXED) > 0) {
+      count = MATRIX_IFACES;
+    }
+
+    for (src = 0; src < (int)count; src++) {
+      len = matrix_encode(record, m, src, count, start, interval);
+      if (len > 0) {
+	export_summary(record, len);
+	__atomic_store_n(&matrix_summaries, matrix_summaries + 1,
+			 __ATOMIC_RELAXED);
+      }
+    }
+  }
+}
+
+
+/* One source interface's row of what changed since it was last sent,
+ * entries are [dst_int, bytes, packets], 0 if nothing changed */
+int matrix_encode(char *record, struct matrix *m, const int src,
+		  const uint32_t count, const time_t start, const int interval) {
+
+  struct in_addr addr;
+  struct matrix_cell *cell, *sent;
+  char name[INET_ADDRSTRLEN];
+  uint64_t bytes, packets;
+  int dst, len, shown = 0;
+
+  addr.s_addr = htonl(m->exporter);
+  inet_ntop(AF_INET, &addr, name, sizeof(name));
+
+  len = snprintf(record, MATRIX_RECORD_MAX, "{\"summary\":"
+		 "\"interface_matrix\",\"exporter\":\"%s\","
+		 "\"interval_start\":%lu,\"interval\":%d,\"src_int\":%d,"
+		 "\"dst\":[", name, (uint64_t)start, interval,
+		 (src == MATRIX_OTHER) ? -1 : (int)m->ifaces[src]);
+
+  for (dst = 0; dst < (int)count; dst++) {
+    cell = &(m->cells[src][dst]);
+    sent = &(m->sent[(src * MATRIX_IFACES) + dst]);
+
+    bytes = __atomic_load_n(&(cell->bytes), __ATOMIC_RELAXED);
+    packets = __atomic_load_n(&(cell->packets), __ATOMIC_RELAXED);
+    if ((bytes == sent->bytes) && (packets == sent->packets)) {
+      continue;
+    }
+
+    len += snprintf(record + len, MATRIX_RECORD_MAX - len,
+		    "%s[%d,%lu,%lu]", (shown == 0) ? "" : ",",
+		    (dst == MATRIX_OTHER) ? -1 : (int)m->ifaces[dst],
+		    bytes - sent->bytes, packets - sent->packets);
+    sent->bytes = bytes;
+    sent->packets = packets;
+    shown++;
+  }
+
+  if (shown == 0) {
+    return 0;
+  }
+
+  len += snprintf(record + len, MATRIX_RECORD_MAX - len, "]}\n");
+
+  return len;
+}
+
+
+void matrix_shutdown(void) {
+
+  int slot;
+
+  /* Everyone else is done by now */
+  for (slot = 0; slot < MATRIX_EXPORTERS; slot++) {
+    if (matrices[slot] != NULL) {
+      free(matrices[slot]->sent);
+      free(matrices[slot]);
+      matrices[slot] = NULL;
+    }
+  }
+  matrix_last = NULL;
+}
+
+
+/* ===
+ * Stats and metrics
+ * ===
+ */
+void matrix_report(void) {
+
+  struct matrix *m;
+  uint64_t other = 0;
+  int exporters = 0, ifaces = 0, slot;
+
+  if (matrix_interval_secs == 0) {
+    return;
+  }
+
+  for (slot = 0; slot < MATRIX_EXPORTERS; slot++) {
+    if ((m = __atomic_load_n(&(matrices[slot]), __ATOMIC_ACQUIRE)) == NULL) {
+      continue;
+    }
+    exporters++;
+    ifaces += __atomic_load_n(&(m->iface_count), __ATOMIC_ACQUIRE);
+    other += __atomic_load_n(&(m->other_records), __ATOMIC_RELAXED);
+  }
+
+  fprintf(stderr, "interface matrix every %d seconds: %d exporters; %d "
+	  "interfaces; %lu summaries sent; %lu records past %d interfaces; "
+	  "%lu records past %d exporters\n", matrix_interval_secs, exporters,
+	  ifaces, __atomic_load_n(&matrix_summaries, __ATOMIC_RELAXED), other,
+	  MATRIX_OTHER, __atomic_load_n(&matrix_overflow, __ATOMIC_RELAXED),
+	  MATRIX_EXPORTERS);
+}
+
+
+void matrix_metrics(FILE *out) {
+
+  struct matrix *m;
+  char name[INET_ADDRSTRLEN];
+  struct in_addr addr;
+  int slot;
+
+  if (matrix_interval_secs == 0) {
+    return;
+  }
+
+  metrics_header(out, "flowtree_matrix_interfaces", "gauge",
+		 "Interfaces interned for each exporter's matrix");
+  for (slot = 0; slot < MATRIX_EXPORTERS; slot++) {
+    if ((m = __atomic_load_n(&(matrices[slot]), __ATOMIC_ACQUIRE)) == NULL) {
+      continue;
+    }
+    addr.s_addr = htonl(m->exporter);
+    inet_ntop(AF_INET, &addr, name, sizeof(name));
+    fprintf(out, "flowtree_matrix_interfaces{exporter=\"%s\"} %u\n", name,
+	    __atomic_load_n(&(m->iface_count), __ATOMIC_ACQUIRE));
+  }
+
+  metrics_header(out, "flowtree_matrix_other_records_total", "counter",
+		 "Records on interfaces past the matrix size");
+  for (slot = 0; slot < MATRIX_EXPORTERS; slot++) {
+    if ((m = __atomic_load_n(&(matrices[slot]), __ATOMIC_ACQUIRE)) == NULL) {
+      continue;
+    }
+    addr.s_addr = htonl(m->exporter);
+    inet_ntop(AF_INET, &addr, name, sizeof(name));
+    fprintf(out, "flowtree_matrix_other_records_total{exporter=\"%s\"} %lu\n",
+	    name, __atomic_load_n(&(m->other_records), __ATOMIC_RELAXED));
+  }
+
+  metrics_header(out, "flowtree_matrix_overflow_records_total", "counter",
+		 "Records from exporters past the matrix table size");
+  fprintf(out, "flowtree_matrix_overflow_records_total %lu\n",
+	  __atomic_load_n(&matrix_overflow, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,68 @@
+#ifndef MATRIX_H
+#define MATRIX_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Interface traffic matrices
+ *
+ * With -I <secs> every record that makes it to flow_callback() adds its
+ * bytes and packets to a src_int by dst_int matrix for the exporter it
+ * came from.  Each exporter interns its interface indexes as it sees
+ * them into dense ids, so its matrix is a flat array of
+ * MATRIX_IFACES x MATRIX_IFACES counters (64 KB) and an update is two
+ * small hash probes and two stores.  Interfaces past the first
+ * MATRIX_OTHER share the last id and are reported as -1.
+ *
+ * The receive thread is the only writer.  Matrices are allocated the
+ * first time an exporter is seen, published with a release store and
+ * never freed, and the counters only ever go up and are stored with
+ * relaxed atomics, so nothing is locked.  Every <secs> the janitor reads
+ * them, subtracts what it sent last time (its own copy, another 64 KB
+ * per exporter) and sends one JSON summary record per exporter and
+ * source interface down the JSON export stream.
+ *
+ * -B matrix measures what the update costs per record.
+ * ===
+ */
+#define MATRIX_EXPORTERS 256  /* must be a power of two */
+#define MATRIX_IFACES 64
+#define MATRIX_OTHER (MATRIX_IFACES - 1)
+#define MATRIX_SLOTS 256      /* interface hash, must be a power of two */
+
+struct matrix_cell {
+  uint64_t bytes;
+  uint64_t packets;
+};
+
+struct matrix {
+  in_addr_t exporter;
+  uint32_t iface_count;           /* ids in use, published with a release */
+  uint16_t ifaces[MATRIX_IFACES]; /* interface index of each id */
+  uint8_t slots[MATRIX_SLOTS];    /* interface index hash, id + 1 */
+  uint64_t other_records;         /* records on interfaces that didn't fit */
+  struct matrix_cell cells[MATRIX_IFACES][MATRIX_IFACES];
+  struct matrix_cell *sent;       /* janitor only, totals last sent */
+};
+
+extern int matrix_interval_secs; /* -I, 0 is off */
+
+
+/* ===
+ * Matrix function prototypes
+ * ===
+ */
+void matrix_add(const struct unified_flow *);
+void matrix_record(const struct unified_flow *);
+void matrix_export(const time_t);
+void matrix_shutdown(void);
+void matrix_report(void);
+void matrix_metrics(FILE *);
+
+#endif /* matrix.h */
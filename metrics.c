@@ -0,0 +1,363 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "stats.h"
+#include "export.h"
+#include "metrics.h"
+#include "hist.h"
+#include "exporter.h"
+#include "control.h"
+#include "hll.h"
+#include "rollup.h"
+#include "matrix.h"
+
+
+/* ===
+ * Metrics settings and state
+ * ===
+ */
+const char *metrics_listen = NULL; /* -M, off unless given */
+
+int metrics_fh = -1;
+int metrics_stopping = 0;
+pthread_t metrics_thread;
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+void *thread_metrics(void *);
+void metrics_serve(const int);
+void metrics_write(FILE *);
+int metrics_wait(const int, const short, const uint64_t);
+int metrics_send(const int, const char *, const size_t, const uint64_t);
+
+
+int metrics_start(void) {
+
+  struct sockaddr_in bind_addrin;
+  char addr[64];
+  const char *port;
+  int on = 1;
+
+  if (metrics_listen == NULL) {
+    return 0;
+  }
+
+  /* [addr:]port, loopback unless told otherwise */
+  if ((port = strrchr(metrics_listen, ':')) != NULL) {
+    if ((size_t)(port - metrics_listen) >= sizeof(addr)) {
+      fprintf(stderr, "Bad metrics address %s\n", metrics_listen);
+      return -1;
+    }
+    memcpy(addr, metrics_listen, port - metrics_listen);
+    addr[port - metrics_listen] = '\0';
+    port++;
+  }
+  else {
+    strcpy(addr, METRICS_ADDR);
+    port = metrics_listen;
+  }
+
+  memset(&bind_addrin, 0, sizeof(bind_addrin));
+  bind_addrin.sin_family = AF_INET;
+  bind_addrin.sin_port = htons(atoi(port));
+  if ((atoi(port) <= 0) || (atoi(port) > 65535) ||
+      (inet_aton(addr, &(bind_addrin.sin_addr)) == 0)) {
+    fprintf(stderr, "Bad metrics address %s\n", metrics_listen);
+    return -1;
+  }
+
+  if ((metrics_fh = socket(AF_INET, SOCK_STREAM, 0)) == -1) {
+    perror("socket");
+    return -1;
+  }
+  setsockopt(metrics_fh, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+  if ((bind(metrics_fh, (const struct sockaddr *)&bind_addrin,
+	    sizeof(bind_addrin)) == -1) ||
+      (listen(metrics_fh, 16) == -1)) {
+    fprintf(stderr, "Unable to listen for metrics on %s:%s\n", addr, port);
+    perror("bind");
+    close(metrics_fh);
+    metrics_fh = -1;
+    return -1;
+  }
+
+  if (pthread_create(&metrics_thread, NULL, thread_metrics, NULL) != 0) {
+    fprintf(stderr, "Unable to start the metrics thread\n");
+    close(metrics_fh);
+    metrics_fh = -1;
+    return -1;
+  }
+
+  fprintf(stderr, "Serving metrics on http://%s:%s/metrics\n", addr, port);
+
+  return 0;
+}
+
+
+void metrics_shutdown(void) {
+
+  if (metrics_fh == -1) {
+    return;
+  }
+
+  __atomic_store_n(&metrics_stopping, 1, __ATOMIC_RELEASE);
+  pthread_join(metrics_thread, NULL);
+
+  close(metrics_fh);
+  metrics_fh = -1;
+}
+
+
+/* ===
+ * The metrics thread, one scrape at a time
+ * ===
+ */
+void *thread_metrics(void *arg) {
+
+  struct pollfd pfd;
+  int client_fh;
+
+  pfd.fd = metrics_fh;
+  pfd.events = POLLIN;
+
+  while (__atomic_load_n(&metrics_stopping, __ATOMIC_ACQUIRE) == 0) {
+    /* Wake up now and then to see if we're done */
+    if (poll(&pfd, 1, 500) <= 0) {
+      continue;
+    }
+
+    if ((client_fh = accept(metrics_fh, NULL, NULL)) == -1) {
+      continue;
+    }
+
+    metrics_serve(client_fh);
+    close(client_fh);
+  }
+
+  return NULL;
+}
+
+
+void metrics_serve(const int client_fh) {
+
+  char request[METRICS_REQUEST_MAX + 1];
+  char header[256];
+  char *body = NULL;
+  size_t body_len = 0;
+  uint64_t deadline;
+  ssize_t got;
+  size_t len = 0;
+  FILE *out;
+
+  /* Nobody gets to hold the thread for long, however slowly they trickle */
+  deadline = monotonic_ns() + ((uint64_t)METRICS_TIMEOUT * 1000000000);
+
+  /* Only the request line matters but read the whole header */
+  while (len < METRICS_REQUEST_MAX) {
+    if (metrics_wait(client_fh, POLLIN, deadline) != 0) {
+      return;
+    }
+    if ((got = read(client_fh, request + len,
+		    METRICS_REQUEST_MAX - len)) <= 0) {
+      return;
+    }
+    len += got;
+    request[len] = '\0';
+
+    if (strstr(request, "\r\n\r\n") != NULL) {
+      break;
+    }
+  }
+  request[len] = '\0';
+
+  if ((strncmp(request, "GET /metrics ", 13) != 0) &&
+      (strncmp(request, "GET / ", 6) != 0)) {
+    snprintf(header, sizeof(header), "HTTP/1.1 404 Not Found\r\n"
+	     "Content-Length: 0\r\nConnection: close\r\n\r\n");
+    metrics_send(client_fh, header, strlen(header), deadline);
+    return;
+  }
+
+  if ((out = open_memstream(&body, &body_len)) == NULL) {
+    return;
+  }
+  metrics_write(out);
+  fclose(out);
+
+  snprintf(header, sizeof(header), "HTTP/1.1 200 OK\r\n"
+	   "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n"
+	   "Content-Length: %lu\r\nConnection: close\r\n\r\n",
+	   (unsigned long)body_len);
+
+  if (metrics_send(client_fh, header, strlen(header), deadline) == 0) {
+    metrics_send(client_fh, body, body_len, deadline);
+  }
+
+  free(body);
+}
+
+
+/* Wait for the client to be ready, but not past the deadline */
+int metrics_wait(const int client_fh, const short events,
+		 const uint64_t deadline) {
+
+  struct pollfd pfd;
+  uint64_t now;
+  int ret;
+
+  pfd.fd = client_fh;
+  pfd.events = events;
+
+  for (;;) {
+    if ((now = monotonic_ns()) >= deadline) {
+      return -1;
+    }
+
+    /* Round up so we don't spin on the last partial millisecond */
+    ret = poll(&pfd, 1, (int)((deadline - now + 999999) / 1000000));
+    if (ret > 0) {
+      return 0;
+    }
+    if ((ret == -1) && (errno != EINTR)) {
+      return -1;
+    }
+  }
+}
+
+
+int metrics_send(const int client_fh, const char *data, const size_t len,
+		 const uint64_t deadline) {
+
+  size_t sent = 0;
+  ssize_t ret;
+
+  while (sent < len) {
+    if (metrics_wait(client_fh, POLLOUT, deadline) != 0) {
+      return -1;
+    }
+    if ((ret = send(client_fh, data + sent, len - sent,
+		    MSG_NOSIGNAL | MSG_DONTWAIT)) <= 0) {
+      if ((ret == -1) &&
+	  ((errno == EINTR) || (errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+	continue;
+      }
+      return -1;
+    }
+    sent += ret;
+  }
+
+  return 0;
+}
+
+
+/* ===
+ * The scrape itself
+ * ===
+ */
+void metrics_header(FILE *out, const char *name, const char *type,
+		    const char *help) {
+
+  fprintf(out, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, type);
+}
+
+
+void metrics_label_value(FILE *out, const char *value) {
+
+  /* Label values escape backslash, double quote and newline */
+  for (; *value != '\0'; value++) {
+    if ((*value == '\\') || (*value == '"')) {
+      fputc('\\', out);
+      fputc(*value, out);
+    }
+    else if (*value == '\n') {
+      fputs("\\n", out);
+    }
+    else {
+      fputc(*value, out);
+    }
+  }
+}
+
+
+void metrics_write(FILE *out) {
+
+  struct flow_stats *snap;
+  int proto;
+
+  if ((snap = malloc(sizeof(struct flow_stats))) == NULL) {
+    return;
+  }
+  stats_snapshot(snap);
+
+  metrics_header(out, "flowtree_packets_total", "counter",
+		 "NetFlow datagrams received");
+  fprintf(out, "flowtree_packets_total %lu\n", snap->flow_packets);
+
+  metrics_header(out, "flowtree_flows_total", "counter",
+		 "Flow records received");
+  fprintf(out, "flowtree_flows_total %lu\n", snap->total_flows);
+
+  metrics_header(out, "flowtree_flows_excluded_total", "counter",
+		 "Flow records dropped by the exclusion list");
+  fprintf(out, "flowtree_flows_excluded_total %lu\n", snap->excluded_flows);
+
+  metrics_header(out, "flowtree_flows_filtered_total", "counter",
+		 "Flow records dropped by the flow filter");
+  fprintf(out, "flowtree_flows_filtered_total %lu\n", snap->filtered_flows);
+
+  metrics_header(out, "flowtree_flows_new_total", "counter",
+		 "Flow records that started a new flow");
+  fprintf(out, "flowtree_flows_new_total %lu\n", snap->new_flows);
+
+  metrics_header(out, "flowtree_flows_duplicate_total", "counter",
+		 "Flow records merged into a flow already being tracked");
+  fprintf(out, "flowtree_flows_duplicate_total %lu\n", snap->dup_flows);
+
+  metrics_header(out, "flowtree_flows_current", "gauge",
+		 "Flows in the flow trees right now");
+  fprintf(out, "flowtree_flows_current %lu\n", snap->current_flows);
+
+  metrics_header(out, "flowtree_protocol_flows_total", "counter",
+		 "New flows by IP protocol");
+  for (proto = 0; proto < 256; proto++) {
+    fprintf(out, "flowtree_protocol_flows_total{protocol=\"%d\"} %lu\n",
+	    proto, snap->proto_flows[proto]);
+  }
+
+  metrics_header(out, "flowtree_export_flows_total", "counter",
+		 "Flows handed to the export sinks");
+  fprintf(out, "flowtree_export_flows_total %lu\n",
+	  __atomic_load_n(&stat_export_flows, __ATOMIC_RELAXED));
+
+  metrics_header(out, "flowtree_export_datagrams_total", "counter",
+		 "Export datagrams built");
+  fprintf(out, "flowtree_export_datagrams_total %lu\n",
+	  __atomic_load_n(&stat_export_datagrams, __ATOMIC_RELAXED));
+
+  free(snap);
+
+  flowtree_metrics(out);
+  sink_metrics(out);
+  exporter_metrics(out);
+  control_metrics(out);
+  hll_metrics(out);
+  rollup_metrics(out);
+  matrix_metrics(out);
+  hist_metrics(out);
+}
@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+
+
+/* ===
+ * Prometheus metrics
+ *
+ * With -M [addr:]port a thread of its own answers HTTP GETs for
+ * /metrics with everything flowtree counts, in the Prometheus text
+ * exposition format.  Everything it reads is either a per-thread
+ * counter summed on the spot or an atomic, so a scrape never takes a
+ * lock the receive path or the janitor could be waiting on.
+ *
+ * Rates are left to Prometheus (rate() over the _total counters).
+ * ===
+ */
+#define METRICS_ADDR "127.0.0.1"
+#define METRICS_REQUEST_MAX 4096
+#define METRICS_TIMEOUT 2 /* seconds a client gets for the whole request */
+
+extern const char *metrics_listen;
+
+
+/* ===
+ * Metrics function prototypes
+ * ===
+ */
+int metrics_start(void);
+void metrics_shutdown(void);
+
+/* Helpers for the parts of flowtree that add their own metrics */
+void metrics_header(FILE *, const char *, const char *, const char *);
+void metrics_label_value(FILE *, const char *);
+
+/* Each one writes its own section of a scrape */
+void flowtree_metrics(FILE *);
+void sink_metrics(FILE *);
+
+#endif /* metrics.h */
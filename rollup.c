@@ -0,0 +1,512 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "export.h"
+#include "metrics.h"
+#include "rollup.h"
+
+
+/* ===
+ * Rollup settings and state
+ * ===
+ */
+struct rollup rollups[ROLLUP_MAX];
+int rollup_count = 0;
+pthread_mutex_t rollup_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define ROLLUP_RECORD_MAX 512
+
+/* What a key can be made of */
+const struct {
+  const char *name;
+  size_t offset;
+  int size;
+  int addr; /* takes a /len prefix and prints as an address */
+} rollup_field_info[] = {
+  /* Host order for v5 and v7 alike, so /len masks the right octets */
+  {"exporter", offsetof(struct unified_flow, flow_src), 4, 1},
+  {"src", offsetof(struct unified_flow, src_addr), 4, 1},
+  {"dst", offsetof(struct unified_flow, dst_addr), 4, 1},
+  {"src_int", offsetof(struct unified_flow, src_int), 2, 0},
+  {"dst_int", offsetof(struct unified_flow, dst_int), 2, 0},
+  {"src_as", offsetof(struct unified_flow, src_as), 2, 0},
+  {"dst_as", offsetof(struct unified_flow, dst_as), 2, 0},
+  {"proto", offsetof(struct unified_flow, protocol), 1, 0},
+  {"src_port", offsetof(struct unified_flow, src_port), 2, 0},
+  {"dst_port", offsetof(struct unified_flow, dst_port), 2, 0},
+  {NULL, 0, 0, 0}
+};
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+int rollup_parse_field(struct rollup_field *, const char *, const size_t);
+struct rollup_table *rollup_alloc(const struct rollup *);
+void rollup_reset(const struct rollup *, struct rollup_table *, const time_t);
+void rollup_add(const struct rollup *, struct rollup_table *,
+		const struct unified_flow *);
+void rollup_rollover(struct rollup *, const time_t);
+int rollup_encode(char *, const struct rollup *, const struct rollup_table *,
+		  const struct rollup_entry *);
+
+
+static inline uint32_t rollup_hash(const uint32_t *key, const int count) {
+
+  uint64_t h = 0;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    h = (h ^ key[i]) * 0x9E3779B97F4A7C15ULL;
+  }
+
+  return (uint32_t)(h >> 32);
+}
+
+
+/* ===
+ * Parsing -R
+ * ===
+ */
+int rollup_parse_field(struct rollup_field *field, const char *spec,
+		       const size_t len) {
+
+  const char *slash;
+  size_t name_len;
+  char *end;
+  int i;
+
+  slash = memchr(spec, '/', len);
+  name_len = (slash != NULL) ? (size_t)(slash - spec) : len;
+
+  for (i = 0; rollup_field_info[i].name != NULL; i++) {
+    if ((strlen(rollup_field_info[i].name) == name_len) &&
+	(strncmp(rollup_field_info[i].name, spec, name_len) == 0)) {
+      break;
+    }
+  }
+  if (rollup_field_info[i].name == NULL) {
+    return -1;
+  }
+
+  field->type = i;
+  field->offset = rollup_field_info[i].offset;
+  field->size = rollup_field_info[i].size;
+  field->prefix = 32;
+  field->mask = (field->size == 4) ? 0xFFFFFFFF :
+    (uint32_t)((1 << (field->size * 8)) - 1);
+
+  if (slash != NULL) {
+    if (rollup_field_info[i].addr == 0) {
+      return -1;
+    }
+    field->prefix = (int)strtol(slash + 1, &end, 10);
+    if ((end != spec + len) || (end == slash + 1) ||
+	(field->prefix < 0) || (field->prefix > 32)) {
+      return -1;
+    }
+    field->mask = (field->prefix == 0) ? 0 :
+      (uint32_t)(0xFFFFFFFFULL << (32 - field->prefix));
+  }
+
+  return 0;
+}
+
+
+int rollup_parse(const char *arg) {
+
+  struct rollup *r;
+  const char *p, *field_end;
+  unsigned long entries = ROLLUP_ENTRIES;
+  char *end;
+  long interval = ROLLUP_INTERVAL;
+  size_t len;
+
+  if (rollup_count == ROLLUP_MAX) {
+    fprintf(stderr, "At most %d rollups\n", ROLLUP_MAX);
+    return -1;
+  }
+  r = &(rollups[rollup_count]);
+  memset(r, 0, sizeof(struct rollup));
+
+  if (((p = strchr(arg, '=')) == NULL) || (p == arg) ||
+      ((size_t)(p - arg) >= ROLLUP_NAME_MAX)) {
+    fprintf(stderr, "Bad -R %s, want <name>=<field>[,<field>...]"
+	    "[@<secs>][:<entries>]\n", arg);
+    return -1;
+  }
+
+  /* It goes into JSON and metric labels without any escaping */
+  len = strspn(arg, "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+	       "0123456789_-");
+  if (arg + len != p) {
+    fprintf(stderr, "Bad -R %s, a rollup name is letters, digits, _ and -\n",
+	    arg);
+    return -1;
+  }
+  memcpy(r->name, arg, p - arg);
+  r->handoff.mutex = &rollup_mutex;
+  p++;
+
+  /* The fields run up to the first of @, : or the end */
+  while (1) {
+    field_end = p + strcspn(p, ",@:");
+    len = field_end - p;
+
+    if (r->field_count == ROLLUP_FIELDS) {
+      fprintf(stderr, "Rollup %s has more than %d fields\n", r->name,
+	      ROLLUP_FIELDS);
+      return -1;
+    }
+    if ((len == 0) ||
+	(rollup_parse_field(&(r->fields[r->field_count]), p, len) != 0)) {
+      fprintf(stderr, "Rollup %s: bad field %.*s, try exporter, src[/len], "
+	      "dst[/len], src_int, dst_int, src_as, dst_as, proto, src_port "
+	      "or dst_port\n", r->name, (int)len, p);
+      return -1;
+    }
+    r->field_count++;
+
+    p = field_end;
+    if (*p != ',') {
+      break;
+    }
+    p++;
+  }
+
+  if (*p == '@') {
+    interval = strtol(p + 1, &end, 10);
+    p = end;
+  }
+  if (*p == ':') {
+    entries = strtoul(p + 1, &end, 10);
+    p = end;
+  }
+
+  if ((*p != '\0') || (interval <= 0) || (entries < 8) ||
+      (entries > ROLLUP_ENTRIES_MAX)) {
+    fprintf(stderr, "Rollup %s: bad interval or size in %s (at most %d "
+	    "entries)\n", r->name, arg, ROLLUP_ENTRIES_MAX);
+    return -1;
+  }
+
+  r->interval = (int)interval;
+  r->entries = 8;
+  while (r->entries < entries) {
+    r->entries <<= 1;
+  }
+
+  rollup_count++;
+
+  return 0;
+}
+
+
+/* ===
+ * The tables
+ * ===
+ */
+struct rollup_table *rollup_alloc(const struct rollup *r) {
+
+  return malloc(sizeof(struct rollup_table) +
+		(r->entries * sizeof(struct rollup_entry)));
+}
+
+
+void rollup_reset(const struct rollup *r, struct rollup_table *t,
+		  const time_t start) {
+
+  t->start = start;
+  t->used = 0;
+  t->overflow_records = 0;
+  t->overflow_bytes = 0;
+  t->overflow_packets = 0;
+  memset(t->entries, 0, r->entries * sizeof(struct rollup_entry));
+}
+
+
+void rollup_add(const struct rollup *r, struct rollup_table *t,
+		const struct unified_flow *flow) {
+
+  struct rollup_entry *e;
+  uint32_t key[ROLLUP_FIELDS];
+  const uint8_t *p;
+  uint32_t slot, mask = r->entries - 1;
+  int i;
+
+  for (i = 0; i < r->field_count; i++) {
+    p = (const uint8_t *)flow + r->fields[i].offset;
+    switch (r->fields[i].size) {
+    case 1:
+      key[i] = *p;
+      break;
+    case 2:
+      key[i] = *(const uint16_t *)p;
+      break;
+    default:
+      key[i] = *(const uint32_t *)p;
+      break;
+    }
+    key[i] &= r->fields[i].mask;
+  }
+
+  for (slot = rollup_hash(key, r->field_count) & mask; ;
+       slot = (slot + 1) & mask) {
+    e = &(t->entries[slot]);
+
+    if (e->records == 0) {
+      /* A new key, if there is still room for one */
+      if (t->used >= ROLLUP_FULL(r->entries)) {
+	t->overflow_records++;
+	t->overflow_bytes += flow->num_bytes;
+	t->overflow_packets += flow->num_packets;
+	return;
+      }
+      memcpy(e->key, key, r->field_count * sizeof(uint32_t));
+      t->used++;
+      break;
+    }
+
+    if (memcmp(e->key, key, r->field_count * sizeof(uint32_t)) == 0) {
+      break;
+    }
+  }
+
+  e->bytes += flow->num_bytes;
+  e->packets += flow->num_packets;
+  e->records++;
+}
+
+
+/* ===
+ * The receive side, only ever called from flow_callback()
+ * ===
+ */
+void rollup_record(const struct unified_flow *flow) {
+
+  struct rollup *r;
+  int i;
+
+  for (i = 0; i < rollup_count; i++) {
+    r = &(rollups[i]);
+
+    if ((r->cur == NULL) ||
+	(flow->recv_time >= r->cur->start + r->interval)) {
+      rollup_rollover(r, flow->recv_time);
+      if (r->cur == NULL) {
+	continue;
+      }
+    }
+
+    rollup_add(r, r->cur, flow);
+  }
+}
+
+
+void rollup_rollover(struct rollup *r, const time_t now) {
+
+  struct rollup_table *next, *old;
+
+  old = r->cur;
+  if (old != NULL) {
+    __atomic_store_n(&(r->overflow), r->overflow + old->overflow_records,
+		     __ATOMIC_RELAXED);
+  }
+
+  next = handoff_rollover(&(r->handoff), old,
+			  (old != NULL) &&
+			  ((old->used > 0) || (old->overflow_records > 0)));
+
+  if ((next == NULL) && ((next = rollup_alloc(r)) == NULL)) {
+    r->cur = NULL;
+    return;
+  }
+
+  rollup_reset(r, next, now - (now % r->interval));
+  r->cur = next;
+}
+
+
+/* ===
+ * The janitor side, sends every finished table
+ * ===
+ */
+void rollup_export(void) {
+
+  struct rollup *r;
+  struct rollup_table *t;
+  char record[ROLLUP_RECORD_MAX];
+  uint64_t sent;
+  uint32_t slot;
+  int i, len;
+
+  for (i = 0; i < rollup_count; i++) {
+    r = &(rollups[i]);
+
+    if ((t = handoff_take(&(r->handoff))) == NULL) {
+      continue;
+    }
+
+    sent = 0;
+    for (slot = 0; slot < r->entries; slot++) {
+      if (t->entries[slot].records == 0) {
+	continue;
+      }
+      len = rollup_encode(record, r, t, &(t->entries[slot]));
+      export_summary(record, len);
+      sent++;
+    }
+
+    if (t->overflow_records > 0) {
+      len = rollup_encode(record, r, t, NULL);
+      export_summary(record, len);
+      sent++;
+    }
+
+    __atomic_store_n(&(r->last_keys), t->used, __ATOMIC_RELAXED);
+    __atomic_store_n(&(r->sent), r->sent + sent, __ATOMIC_RELAXED);
+
+    handoff_return(&(r->handoff), t);
+  }
+}
+
+
+void rollup_shutdown(void) {
+
+  int i;
+
+  /* The receive thread is done by now */
+  for (i = 0; i < rollup_count; i++) {
+    free(rollups[i].cur);
+    rollups[i].cur = NULL;
+    handoff_free(&(rollups[i].handoff));
+  }
+}
+
+
+/* One key's totals as a JSON line, a NULL entry is the overflow line */
+int rollup_encode(char *record, const struct rollup *r,
+		  const struct rollup_table *t,
+		  const struct rollup_entry *e) {
+
+  const struct rollup_field *field;
+  struct in_addr addr;
+  char name[INET_ADDRSTRLEN];
+  int i, len;
+
+  len = snprintf(record, ROLLUP_RECORD_MAX, "{\"summary\":\"rollup\","
+		 "\"rollup\":\"%s\",\"interval_start\":%lu,\"interval\":%d,",
+		 r->name, (uint64_t)t->start, r->interval);
+
+  if (e == NULL) {
+    len += snprintf(record + len, ROLLUP_RECORD_MAX - len,
+		    "\"overflow\":true,\"bytes\":%lu,\"packets\":%lu,"
+		    "\"records\":%lu}\n", t->overflow_bytes,
+		    t->overflow_packets, t->overflow_records);
+    return len;
+  }
+
+  for (i = 0; i < r->field_count; i++) {
+    field = &(r->fields[i]);
+
+    if (rollup_field_info[field->type].addr != 0) {
+      addr.s_addr = htonl(e->key[i]);
+      inet_ntop(AF_INET, &addr, name, sizeof(name));
+      if (field->prefix < 32) {
+	len += snprintf(record + len, ROLLUP_RECORD_MAX - len,
+			"\"%s\":\"%s/%d\",", rollup_field_info[field->type].name,
+			name, field->prefix);
+      }
+      else {
+	len += snprintf(record + len, ROLLUP_RECORD_MAX - len,
+			"\"%s\":\"%s\",", rollup_field_info[field->type].name,
+			name);
+      }
+    }
+    else {
+      len += snprintf(record + len, ROLLUP_RECORD_MAX - len, "\"%s\":%u,",
+		      rollup_field_info[field->type].name, e->key[i]);
+    }
+  }
+
+  len += snprintf(record + len, ROLLUP_RECORD_MAX - len,
+		  "\"bytes\":%lu,\"packets\":%lu,\"records\":%lu}\n",
+		  e->bytes, e->packets, e->records);
+
+  return len;
+}
+
+
+/* ===
+ * Stats and metrics
+ * ===
+ */
+void rollup_report(void) {
+
+  struct rollup *r;
+  int i;
+
+  for (i = 0; i < rollup_count; i++) {
+    r = &(rollups[i]);
+    fprintf(stderr, "rollup %s every %d seconds: %u of %u keys last "
+	    "interval; %lu records sent; %lu records over the table; "
+	    "%lu intervals dropped\n", r->name, r->interval,
+	    __atomic_load_n(&(r->last_keys), __ATOMIC_RELAXED), r->entries,
+	    __atomic_load_n(&(r->sent), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(r->overflow), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(r->handoff.dropped), __ATOMIC_RELAXED));
+  }
+}
+
+
+void rollup_metrics(FILE *out) {
+
+  int i;
+
+  if (rollup_count == 0) {
+    return;
+  }
+
+  metrics_header(out, "flowtree_rollup_keys", "gauge",
+		 "Keys in each rollup's last interval sent");
+  for (i = 0; i < rollup_count; i++) {
+    fprintf(out, "flowtree_rollup_keys{rollup=\"%s\"} %u\n",
+	    rollups[i].name,
+	    __atomic_load_n(&(rollups[i].last_keys), __ATOMIC_RELAXED));
+  }
+
+  metrics_header(out, "flowtree_rollup_sent_total", "counter",
+		 "Summary records each rollup has sent");
+  for (i = 0; i < rollup_count; i++) {
+    fprintf(out, "flowtree_rollup_sent_total{rollup=\"%s\"} %lu\n",
+	    rollups[i].name,
+	    __atomic_load_n(&(rollups[i].sent), __ATOMIC_RELAXED));
+  }
+
+  metrics_header(out, "flowtree_rollup_overflow_records_total", "counter",
+		 "Records that needed a new key in a full rollup table");
+  for (i = 0; i < rollup_count; i++) {
+    fprintf(out, "flowtree_rollup_overflow_records_total{rollup=\"%s\"} "
+	    "%lu\n", rollups[i].name,
+	    __atomic_load_n(&(rollups[i].overflow), __ATOMIC_RELAXED));
+  }
+
+  metrics_header(out, "flowtree_rollup_dropped_intervals_total", "counter",
+		 "Rollup intervals replaced before the janitor sent them");
+  for (i = 0; i < rollup_count; i++) {
+    fprintf(out, "flowtree_rollup_dropped_intervals_total{rollup=\"%s\"} "
+	    "%lu\n", rollups[i].name,
+	    __atomic_load_n(&(rollups[i].handoff.dropped), __ATOMIC_RELAXED));
+  }
+}
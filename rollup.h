@@ -0,0 +1,107 @@
+#ifndef ROLLUP_H
+#define ROLLUP_H 1
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "flowtree.h"
+#include "handoff.h"
+
+
+/* ===
+ * Rollups
+ *
+ * The trees only ever aggregate on the exact key compare_flows() uses.
+ * A rollup aggregates bytes, packets and records on a coarser key of its
+ * own, given with -R (repeatable):
+ *
+ *   -R <name>=<field>[,<field>...][@<secs>][:<entries>]
+ *
+ * The name ends up as is in JSON and Prometheus labels, so it may only
+ * use letters, digits, _ and -.  A field is one of exporter, src, dst, src_int, dst_int, src_as,
+ * dst_as, proto, src_port or dst_port, and the addresses take a /len
+ * prefix (src/24).  For example:
+ *
+ *   -R subnets=src/24,dst/24 -R ifaces=exporter,src_int,dst_int@300
+ *
+ * Each rollup compiles its fields into a list of offsets and masks into
+ * the unified flow and keeps its own open addressing table of <entries>
+ * slots (rounded up to a power of two, default ROLLUP_ENTRIES).  Every
+ * record that makes it to flow_callback() updates all of them in one
+ * pass.  Once a table is three quarters full (ROLLUP_FULL) the records
+ * that would need a new key are added to an overflow line instead, so
+ * the tables never grow and the probes stay short.
+ *
+ * Like the heavy hitters (see topk.h) the receive thread is the only
+ * writer, a record past the end of a rollup's interval hands its table
+ * to the janitor and the janitor sends one JSON summary record per key
+ * down the JSON export stream.
+ *
+ * -B rollup measures what the update costs per record.
+ * ===
+ */
+#define ROLLUP_MAX 16
+#define ROLLUP_FIELDS 6
+#define ROLLUP_NAME_MAX 32
+#define ROLLUP_INTERVAL 60       /* seconds, without @<secs> */
+#define ROLLUP_ENTRIES 16384     /* without :<entries> */
+#define ROLLUP_ENTRIES_MAX (1 << 22)
+#define ROLLUP_FULL(entries) ((entries) - ((entries) >> 2)) /* 3/4 */
+
+struct rollup_field {
+  int type;      /* index into the field table in rollup.c */
+  size_t offset; /* into struct unified_flow */
+  int size;
+  int prefix;    /* addresses only */
+  uint32_t mask;
+};
+
+struct rollup_entry {
+  uint32_t key[ROLLUP_FIELDS];
+  uint64_t bytes;
+  uint64_t packets;
+  uint64_t records; /* 0 while the slot is free */
+};
+
+struct rollup_table {
+  time_t start;
+  uint32_t used;
+  uint64_t overflow_records;
+  uint64_t overflow_bytes;
+  uint64_t overflow_packets;
+  struct rollup_entry entries[];
+};
+
+struct rollup {
+  char name[ROLLUP_NAME_MAX];
+  int field_count;
+  struct rollup_field fields[ROLLUP_FIELDS];
+  int interval;
+  uint32_t entries;            /* power of two */
+
+  /* The receive thread owns cur, handoff gets it to the janitor */
+  struct rollup_table *cur;
+  struct handoff handoff;      /* all share rollup_mutex */
+
+  uint32_t last_keys;          /* keys in the last interval sent */
+  uint64_t sent;               /* summary records sent */
+  uint64_t overflow;           /* records that did not fit, ever */
+};
+
+extern struct rollup rollups[ROLLUP_MAX];
+extern int rollup_count;
+
+
+/* ===
+ * Rollup function prototypes
+ * ===
+ */
+int rollup_parse(const char *);
+void rollup_record(const struct unified_flow *);
+void rollup_export(void);
+void rollup_shutdown(void);
+void rollup_report(void);
+void rollup_metrics(FILE *);
+
+#endif /* rollup.h */
@@ -0,0 +1,1311 @@
+/* For sendmmsg() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "export.h"
+#include "sink.h"
+#include "ftshm.h"
+#include "ipfix.h"
+#include "metrics.h"
+#include "hist.h"
+
+
+/* Network stuff for the default sink */
+#define SENDSRC "127.0.0.1"
+#define SENDDST "127.0.0.1"
+#define SENDPORT 2056
+#define SEND_SOCKBUFF 1024 * 1024 /* 1 MB */
+
+
+/* Spill records are a little header and then the message */
+#define SINK_SPILL_HDR 12
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+int sink_enqueue(struct sink *, struct sink_msg *);
+struct sink_msg *sink_dequeue(struct sink *);
+uint64_t sink_depth(struct sink *);
+struct sink_msg *sink_msg_get(const uint32_t);
+void sink_release(struct sink_msg *);
+void sink_offer(struct sink *, struct sink_msg *);
+int sink_spill(struct sink *, const struct sink_msg *);
+int sink_unspill(struct sink *, struct sink_msg **, const int);
+void *thread_sink(void *);
+int sink_udp_open(struct sink *);
+int sink_udp_send(struct sink *, struct sink_msg **, const int);
+int sink_tcp_open(struct sink *);
+int sink_unix_open(struct sink *);
+int sink_file_open(struct sink *);
+int sink_stream_send(struct sink *, struct sink_msg **, const int);
+int sink_stream_template(struct sink *);
+struct sink_shm *sink_shm_state(struct sink *);
+int sink_shm_open(struct sink *);
+int sink_shm_send(struct sink *, struct sink_msg **, const int);
+int sink_shm_option(struct sink *, const char *, const char *);
+void sink_shm_close(struct sink *);
+void sink_shm_report(struct sink *);
+
+
+/* ===
+ * Sink types
+ * ===
+ */
+const struct sink_type sink_types[] = {
+  {"udp", sink_udp_open, sink_udp_send, NULL, NULL, NULL, NULL},
+  {"tcp", sink_tcp_open, sink_stream_send, NULL, NULL, NULL, NULL},
+  {"unix", sink_unix_open, sink_stream_send, NULL, NULL, NULL, NULL},
+  {"file", sink_file_open, sink_stream_send, NULL, NULL, NULL, NULL},
+  {"archive", archive_open, archive_send, archive_option, archive_tick,
+   archive_close, NULL},
+  {"shm", sink_shm_open, sink_shm_send, sink_shm_option, NULL,
+   sink_shm_close, sink_shm_report},
+  {NULL, NULL, NULL, NULL, NULL, NULL, NULL}
+};
+
+
+/* ===
+ * What the shm sink keeps in priv
+ * ===
+ */
+struct sink_shm {
+  struct ftshm_writer writer;
+  int slots;
+};
+
+
+/* ===
+ * Sinks and defaults
+ * ===
+ */
+int sink_queue_slots = SINK_QUEUE_SLOTS;
+int sink_rate = 0; /* messages per second, 0 for no pacing */
+
+struct sink *sinks[SINK_MAX];
+int sink_count = 0;
+int sink_stopping = 0;
+
+/* Released messages.  Anyone pushes but only the janitor pops, so the
+ * head it read can't be popped and pushed back behind its back (no ABA).
+ */
+struct sink_msg *sink_pool = NULL;
+int sink_pool_count = 0;
+
+
+int sink_add(const char *spec) {
+
+  struct sink *s;
+  char buff[PATH_MAX];
+  char *target, *opts, *opt, *val, *port, *saveptr;
+  int i;
+
+  if (sink_count >= SINK_MAX) {
+    fprintf(stderr, "Too many sinks, at most %d\n", SINK_MAX);
+    return -1;
+  }
+
+  if (strlen(spec) >= sizeof(buff)) {
+    fprintf(stderr, "Sink %s is too long\n", spec);
+    return -1;
+  }
+  strcpy(buff, spec);
+
+  if ((s = calloc(1, sizeof(struct sink))) == NULL) {
+    return -1;
+  }
+
+  s->policy = SINK_DROP_OLDEST;
+  s->rate = -1;
+  s->slots = -1;
+  s->format = -1;
+  s->fh = -1;
+  s->spill_fh = -1;
+
+  /* === type:target === */
+  if ((target = strchr(buff, ':')) == NULL) {
+    fprintf(stderr, "Sink %s has no type, want type:target\n", spec);
+    free(s);
+    return -1;
+  }
+  *(target++) = '\0';
+
+  for (i = 0; sink_types[i].name != NULL; i++) {
+    if (strcmp(buff, sink_types[i].name) == 0) {
+      s->type = &(sink_types[i]);
+      break;
+    }
+  }
+  if (s->type == NULL) {
+    fprintf(stderr, "Unknown sink type %s\n", buff);
+    free(s);
+    return -1;
+  }
+
+  if ((opts = strchr(target, ',')) != NULL) {
+    *(opts++) = '\0';
+  }
+
+  /* The name is the spec without options */
+  snprintf(s->name, sizeof(s->name), "%s:%s", s->type->name, target);
+
+  if ((strcmp(s->type->name, "udp") == 0) ||
+      (strcmp(s->type->name, "tcp") == 0)) {
+    s->addrin.sin_family = AF_INET;
+    if (((port = strrchr(target, ':')) == NULL) ||
+	(atoi(port + 1) <= 0) || (atoi(port + 1) > 65535)) {
+      fprintf(stderr, "Sink %s needs an address and a port\n", spec);
+      free(s);
+      return -1;
+    }
+    *(port++) = '\0';
+    s->addrin.sin_port = htons(atoi(port));
+
+    if (inet_aton(target, &(s->addrin.sin_addr)) == 0) {
+      fprintf(stderr, "Sink %s has a bad address\n", spec);
+      free(s);
+      return -1;
+    }
+  }
+  else {
+    if ((*target == '\0') || (strlen(target) >= sizeof(s->path))) {
+      fprintf(stderr, "Sink %s needs a path\n", spec);
+      free(s);
+      return -1;
+    }
+    strcpy(s->path, target);
+  }
+
+  /* === Options === */
+  for (opt = (opts == NULL) ? NULL : strtok_r(opts, ",", &saveptr);
+       opt != NULL;
+       opt = strtok_r(NULL, ",", &saveptr)) {
+    if ((val = strchr(opt, '=')) == NULL) {
+      fprintf(stderr, "Sink option %s has no value\n", opt);
+      free(s);
+      return -1;
+    }
+    *(val++) = '\0';
+
+    if ((strcmp(opt, "policy") == 0) && (strcmp(val, "block") == 0)) {
+      s->policy = SINK_BLOCK;
+    }
+    else if ((strcmp(opt, "policy") == 0) && (strcmp(val, "drop") == 0)) {
+      s->policy = SINK_DROP_OLDEST;
+    }
+    else if ((strcmp(opt, "policy") == 0) && (strcmp(val, "spill") == 0)) {
+      s->policy = SINK_SPILL;
+    }
+    else if (strcmp(opt, "queue") == 0) {
+      s->slots = atoi(val);
+    }
+    else if (strcmp(opt, "rate") == 0) {
+      s->rate = atoi(val);
+    }
+    else if ((strcmp(opt, "format") == 0) && (export_format_id(val) >= 0)) {
+      s->format = export_format_id(val);
+    }
+    else if ((strcmp(opt, "spill") == 0) &&
+	     (strlen(val) < sizeof(s->spill_path))) {
+      strcpy(s->spill_path, val);
+    }
+    else if ((s->type->option != NULL) && (s->type->option(s, opt, val) == 0)) {
+      /* The type took it */
+    }
+    else {
+      fprintf(stderr, "Bad sink option %s=%s\n", opt, val);
+      free(s);
+      return -1;
+    }
+  }
+
+  sinks[sink_count++] = s;
+
+  return 0;
+}
+
+
+int sink_start(void) {
+
+  struct sink *s;
+  uint64_t size;
+  char spec[64];
+  int i, n, ret;
+
+  /* Without any -s everything goes where it always has */
+  if (sink_count == 0) {
+    snprintf(spec, sizeof(spec), "udp:%s:%d", SENDDST, SENDPORT);
+    if (sink_add(spec) != 0) {
+      return -1;
+    }
+  }
+
+  /* Stream sinks find out about a dead peer through errors, not signals */
+  signal(SIGPIPE, SIG_IGN);
+
+  for (n = 0; n < sink_count; n++) {
+    s = sinks[n];
+
+    if (s->slots < 0) {
+      s->slots = sink_queue_slots;
+    }
+    if (s->rate < 0) {
+      s->rate = sink_rate;
+    }
+    if (s->format < 0) {
+      s->format = export_format;
+    }
+
+    /* The ring wants a power of two */
+    for (size = SINK_BATCH; size < (uint64_t)s->slots; size <<= 1);
+    s->mask = size - 1;
+
+    if ((s->cells = calloc(size, sizeof(struct sink_cell))) == NULL) {
+      fprintf(stderr, "Unable to allocate the queue for sink %s\n", s->name);
+      return -1;
+    }
+    for (i = 0; i < size; i++) {
+      s->cells[i].seq = i;
+    }
+
+    pthread_mutex_init(&(s->spill_mutex), NULL);
+    if ((s->policy == SINK_SPILL) && (s->spill_path[0] == '\0')) {
+      snprintf(s->spill_path, sizeof(s->spill_path),
+	       "%s/flowtree-spill.%d", SINK_SPILL_DIR, n);
+    }
+
+    /* A sink that can't open now keeps trying from its thread */
+    if ((ret = s->type->open(s)) == SINK_OPEN_FATAL) {
+      return -1;
+    }
+    if (ret != 0) {
+      fprintf(stderr, "Sink %s is not ready yet, will retry\n", s->name);
+    }
+
+    if (pthread_create(&(s->thread), NULL, thread_sink, s) != 0) {
+      fprintf(stderr, "Unable to start the thread for sink %s\n", s->name);
+      return -1;
+    }
+
+    fprintf(stderr, "Exporting %s to %s (%lu slot queue, policy %s)\n",
+	    export_format_names[s->format], s->name, size,
+	    (s->policy == SINK_BLOCK) ? "block" :
+	    ((s->policy == SINK_SPILL) ? "spill" : "drop"));
+  }
+
+  return 0;
+}
+
+
+void sink_shutdown(void) {
+
+  struct sink_msg *msg;
+  struct sink *s;
+  int n;
+
+  /* Every sink drains its queue (and spill) before its thread exits */
+  __atomic_store_n(&sink_stopping, 1, __ATOMIC_RELEASE);
+
+  for (n = 0; n < sink_count; n++) {
+    s = sinks[n];
+
+    pthread_join(s->thread, NULL);
+
+    if (s->type->close != NULL) {
+      s->type->close(s);
+    }
+    else if (s->fh != -1) {
+      close(s->fh);
+    }
+    if (s->spill_fh != -1) {
+      close(s->spill_fh);
+      unlink(s->spill_path);
+    }
+  }
+
+  while (sink_pool != NULL) {
+    msg = sink_pool;
+    sink_pool = msg->next;
+    free(msg);
+  }
+  sink_pool_count = 0;
+}
+
+
+/* ===
+ * The queue
+ * ===
+ */
+int sink_enqueue(struct sink *s, struct sink_msg *msg) {
+
+  struct sink_cell *cell;
+  uint64_t pos, seq;
+  int64_t diff;
+
+  pos = __atomic_load_n(&(s->enq_pos), __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &(s->cells[pos & s->mask]);
+    seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+    diff = (int64_t)seq - (int64_t)pos;
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&(s->enq_pos), &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	break;
+      }
+    }
+    else if (diff < 0) {
+      /* Full */
+      return -1;
+    }
+    else {
+      pos = __atomic_load_n(&(s->enq_pos), __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->msg = msg;
+  __atomic_store_n(&(cell->seq), pos + 1, __ATOMIC_RELEASE);
+
+  return 0;
+}
+
+
+struct sink_msg *sink_dequeue(struct sink *s) {
+
+  struct sink_cell *cell;
+  struct sink_msg *msg;
+  uint64_t pos, seq;
+  int64_t diff;
+
+  pos = __atomic_load_n(&(s->deq_pos), __ATOMIC_RELAXED);
+  for (;;) {
+    cell = &(s->cells[pos & s->mask]);
+    seq = __atomic_load_n(&(cell->seq), __ATOMIC_ACQUIRE);
+    diff = (int64_t)seq - (int64_t)(pos + 1);
+
+    if (diff == 0) {
+      if (__atomic_compare_exchange_n(&(s->deq_pos), &pos, pos + 1, 1,
+				      __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+	break;
+      }
+    }
+    else if (diff < 0) {
+      /* Empty */
+      return NULL;
+    }
+    else {
+      pos = __atomic_load_n(&(s->deq_pos), __ATOMIC_RELAXED);
+    }
+  }
+
+  msg = cell->msg;
+  __atomic_store_n(&(cell->seq), pos + s->mask + 1, __ATOMIC_RELEASE);
+
+  return msg;
+}
+
+
+/* Messages waiting in the queue.  Read the dequeue side first so a
+ * dequeue in between can't push it past what we saw enqueued, and
+ * clamp anyway since the two reads aren't one snapshot.
+ */
+uint64_t sink_depth(struct sink *s) {
+
+  uint64_t deq, enq;
+
+  deq = __atomic_load_n(&(s->deq_pos), __ATOMIC_ACQUIRE);
+  enq = __atomic_load_n(&(s->enq_pos), __ATOMIC_ACQUIRE);
+
+  return (enq > deq) ? enq - deq : 0;
+}
+
+
+/* Janitor only */
+struct sink_msg *sink_msg_get(const uint32_t len) {
+
+  struct sink_msg *msg;
+  uint32_t size;
+
+  msg = __atomic_load_n(&sink_pool, __ATOMIC_ACQUIRE);
+  while ((msg != NULL) &&
+	 (!__atomic_compare_exchange_n(&sink_pool, &msg, msg->next, 0,
+				       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))) {
+  }
+
+  if (msg != NULL) {
+    __atomic_sub_fetch(&sink_pool_count, 1, __ATOMIC_RELAXED);
+    if (msg->size >= len) {
+      return msg;
+    }
+    free(msg);
+  }
+
+  /* Sized for a full datagram so it can be reused for any of them */
+  size = len;
+  if (size < (uint32_t)export_dgram_size) {
+    size = export_dgram_size;
+  }
+  if ((msg = malloc(sizeof(struct sink_msg) + size)) == NULL) {
+    return NULL;
+  }
+  msg->size = size;
+
+  return msg;
+}
+
+
+void sink_release(struct sink_msg *msg) {
+
+  if (__atomic_sub_fetch(&(msg->refs), 1, __ATOMIC_ACQ_REL) != 0) {
+    return;
+  }
+
+  if (__atomic_load_n(&sink_pool_count, __ATOMIC_RELAXED) >= SINK_POOL_MAX) {
+    free(msg);
+    return;
+  }
+
+  __atomic_add_fetch(&sink_pool_count, 1, __ATOMIC_RELAXED);
+  msg->next = __atomic_load_n(&sink_pool, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&sink_pool, &(msg->next), msg, 0,
+				      __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+  }
+}
+
+
+/* ===
+ * The janitor side.  A message is copied once and offered to every
+ * sink, each of which applies its own policy when its queue is full.
+ * ===
+ */
+int sink_formats(void) {
+
+  int formats = 0;
+  int n;
+
+  for (n = 0; n < sink_count; n++) {
+    formats |= 1 << sinks[n]->format;
+  }
+
+  return formats;
+}
+
+
+void sink_publish(const int format, const uint8_t *data, const int len) {
+
+  struct sink_msg *msg;
+  int refs = 0;
+  int n;
+
+  for (n = 0; n < sink_count; n++) {
+    if (sinks[n]->format == format) {
+      refs++;
+    }
+  }
+
+  if (refs == 0) {
+    return;
+  }
+
+  if ((msg = sink_msg_get(len)) == NULL) {
+    for (n = 0; n < sink_count; n++) {
+      if (sinks[n]->format == format) {
+	__atomic_add_fetch(&(sinks[n]->stat_dropped), 1, __ATOMIC_RELAXED);
+      }
+    }
+    return;
+  }
+
+  msg->refs = refs;
+  msg->len = len;
+  msg->queued_ns = monotonic_ns();
+  memcpy(msg->data, data, len);
+
+  for (n = 0; n < sink_count; n++) {
+    if (sinks[n]->format == format) {
+      sink_offer(sinks[n], msg);
+    }
+  }
+}
+
+
+void sink_offer(struct sink *s, struct sink_msg *msg) {
+
+  struct sink_msg *old;
+
+  while (sink_enqueue(s, msg) != 0) {
+    if (s->policy == SINK_DROP_OLDEST) {
+      /* Make room by throwing out the head of the queue */
+      if ((old = sink_dequeue(s)) != NULL) {
+	sink_release(old);
+	__atomic_add_fetch(&(s->stat_dropped), 1, __ATOMIC_RELAXED);
+      }
+    }
+    else if (s->policy == SINK_SPILL) {
+      if (sink_spill(s, msg) == 0) {
+	__atomic_add_fetch(&(s->stat_spilled), 1, __ATOMIC_RELAXED);
+      }
+      else {
+	__atomic_add_fetch(&(s->stat_dropped), 1, __ATOMIC_RELAXED);
+      }
+      sink_release(msg);
+      return;
+    }
+    else {
+      /* Wait for the sink, unless it is never going to drain */
+      if (__atomic_load_n(&sink_stopping, __ATOMIC_ACQUIRE) != 0) {
+	__atomic_add_fetch(&(s->stat_dropped), 1, __ATOMIC_RELAXED);
+	sink_release(msg);
+	return;
+      }
+      __atomic_add_fetch(&(s->stat_blocked), 1, __ATOMIC_RELAXED);
+      sink_sleep_ns(1000000);
+    }
+  }
+
+  __atomic_add_fetch(&(s->stat_queued), 1, __ATOMIC_RELAXED);
+}
+
+
+/* ===
+ * Spilling.  Messages that didn't fit in the queue are appended to the
+ * spill file and read back once the queue is empty, so they can come
+ * out after newer messages.  The file is reset whenever it is drained.
+ * ===
+ */
+int sink_spill(struct sink *s, const struct sink_msg *msg) {
+
+  uint8_t hdr[SINK_SPILL_HDR];
+  struct iovec iov[2];
+  int ret = -1;
+
+  memcpy(hdr, &(msg->len), 4);
+  memcpy(hdr + 4, &(msg->queued_ns), 8);
+  iov[0].iov_base = hdr;
+  iov[0].iov_len = SINK_SPILL_HDR;
+  iov[1].iov_base = (void *)msg->data;
+  iov[1].iov_len = msg->len;
+
+  /* === *** ACQUIRE SPILL LOCK *** === */
+  pthread_mutex_lock(&(s->spill_mutex));
+
+  if (s->spill_fh == -1) {
+    s->spill_fh = open(s->spill_path, O_RDWR | O_CREAT | O_TRUNC, 0600);
+    if (s->spill_fh == -1) {
+      fprintf(stderr, "Unable to open spill file %s for sink %s\n",
+	      s->spill_path, s->name);
+    }
+  }
+
+  if ((s->spill_fh != -1) &&
+      (s->spill_write + SINK_SPILL_HDR + msg->len <= SINK_SPILL_MAX) &&
+      (pwritev(s->spill_fh, iov, 2, s->spill_write) ==
+       SINK_SPILL_HDR + msg->len)) {
+    s->spill_write += SINK_SPILL_HDR + msg->len;
+    ret = 0;
+  }
+
+  pthread_mutex_unlock(&(s->spill_mutex));
+  /* === *** RELEASE SPILL LOCK *** === */
+
+  return ret;
+}
+
+
+int sink_unspill(struct sink *s, struct sink_msg **msgs, const int max) {
+
+  uint8_t hdr[SINK_SPILL_HDR];
+  struct sink_msg *msg;
+  uint32_t len;
+  int count = 0;
+
+  /* === *** ACQUIRE SPILL LOCK *** === */
+  pthread_mutex_lock(&(s->spill_mutex));
+
+  while ((count < max) && (s->spill_read < s->spill_write)) {
+    if (pread(s->spill_fh, hdr, SINK_SPILL_HDR, s->spill_read) !=
+	SINK_SPILL_HDR) {
+      break;
+    }
+    memcpy(&len, hdr, 4);
+
+    if ((msg = malloc(sizeof(struct sink_msg) + len)) == NULL) {
+      break;
+    }
+    msg->size = len;
+    msg->refs = 1;
+    msg->len = len;
+    memcpy(&(msg->queued_ns), hdr + 4, 8);
+
+    if (pread(s->spill_fh, msg->data, len, s->spill_read + SINK_SPILL_HDR) !=
+	len) {
+      free(msg);
+      break;
+    }
+
+    s->spill_read += SINK_SPILL_HDR + len;
+    msgs[count++] = msg;
+  }
+
+  /* All caught up (or the file is broken), start it over */
+  if ((s->spill_fh != -1) &&
+      ((count < max) || (s->spill_read >= s->spill_write))) {
+    s->spill_read = 0;
+    s->spill_write = 0;
+    if (ftruncate(s->spill_fh, 0) != 0) {
+      s->stat_errors++;
+    }
+  }
+
+  pthread_mutex_unlock(&(s->spill_mutex));
+  /* === *** RELEASE SPILL LOCK *** === */
+
+  return count;
+}
+
+
+/* ===
+ * The sink thread, one per sink
+ * ===
+ */
+void *thread_sink(void *arg) {
+
+  struct sink *s = (struct sink *)arg;
+  struct sink_msg *msgs[SINK_BATCH];
+  uint64_t last_ns, now_ns;
+  uint64_t hist_time;
+  double tokens = SINK_BATCH;
+  int stopping;
+  int count, max, sent;
+  int i;
+
+  last_ns = monotonic_ns();
+
+  for (;;) {
+    stopping = __atomic_load_n(&sink_stopping, __ATOMIC_ACQUIRE);
+
+    if (s->type->tick != NULL) {
+      s->type->tick(s);
+    }
+
+    /* Pacing, the bucket holds at most one batch worth of tokens.  On
+     * the way out whatever is left goes as fast as it can.
+     */
+    max = SINK_BATCH;
+    if ((s->rate > 0) && (stopping == 0)) {
+      now_ns = monotonic_ns();
+      tokens += (double)(now_ns - last_ns) * (double)s->rate / 1e9;
+      last_ns = now_ns;
+
+      if (tokens > SINK_BATCH) {
+	tokens = SINK_BATCH;
+      }
+
+      if (tokens < 1) {
+	/* Sleep until the next token shows up */
+	sink_sleep_ns((uint64_t)((1 - tokens) * 1e9 / s->rate));
+	continue;
+      }
+
+      max = (int)tokens;
+    }
+
+    count = 0;
+    while ((count < max) && ((msgs[count] = sink_dequeue(s)) != NULL)) {
+      count++;
+    }
+
+    /* Only go back to the spill file once the queue is empty */
+    if ((count == 0) && (s->policy == SINK_SPILL)) {
+      count = sink_unspill(s, msgs, max);
+    }
+
+    if (count == 0) {
+      if (stopping != 0) {
+	break;
+      }
+
+      /* Nothing to do, check back in a millisecond */
+      sink_sleep_ns(1000000);
+      continue;
+    }
+
+    hist_time = hist_start(HIST_SINK_SEND);
+    sent = s->type->send(s, msgs, count);
+    hist_record(HIST_SINK_SEND, hist_time);
+
+    now_ns = monotonic_ns();
+    __atomic_store_n(&(s->stat_lag_ns), now_ns - msgs[count - 1]->queued_ns,
+		     __ATOMIC_RELAXED);
+
+    for (i = 0; i < count; i++) {
+      if (i < sent) {
+	__atomic_add_fetch(&(s->stat_bytes), msgs[i]->len, __ATOMIC_RELAXED);
+      }
+      sink_release(msgs[i]);
+    }
+
+    __atomic_add_fetch(&(s->stat_sent), sent, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&(s->stat_dropped), count - sent, __ATOMIC_RELAXED);
+
+    if (s->rate > 0) {
+      tokens -= count;
+    }
+  }
+
+  return NULL;
+}
+
+
+void sink_sleep_ns(const uint64_t ns) {
+
+  struct timespec sleep_time;
+
+  sleep_time.tv_sec = ns / 1000000000;
+  sleep_time.tv_nsec = ns % 1000000000;
+  nanosleep(&sleep_time, NULL);
+}
+
+
+/* ===
+ * UDP
+ * ===
+ */
+int sink_udp_open(struct sink *s) {
+
+  struct sockaddr_in send_addrin;
+  int setsockbuff = SEND_SOCKBUFF, getsockbuff;
+  socklen_t sockbufflen = sizeof(getsockbuff);
+
+  /* Make our send socket */
+  if ((s->fh = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) == -1) {
+    fprintf(stderr, "Creation of send socket failed.\n");
+    return -1;
+  }
+
+  /* Try to set the send socket buffer */
+  if (setsockopt(s->fh, SOL_SOCKET, SO_SNDBUF,
+		 &setsockbuff, sizeof(setsockbuff)) == -1) {
+    fprintf(stderr, "Setting send socket send buffer failed.\n");
+  }
+
+  /* Now find out what our socket buffer really is set to */
+  if (getsockopt(s->fh, SOL_SOCKET, SO_SNDBUF,
+		 &getsockbuff, &sockbufflen) == -1) {
+    fprintf(stderr, "Unable to get send socket send buffer.\n");
+  }
+  else {
+    fprintf(stderr, "Send socket send buffer is %d bytes\n", getsockbuff);
+  }
+
+  /* SENDSRC is loopback so only bind to it for loopback destinations */
+  if ((ntohl(s->addrin.sin_addr.s_addr) >> 24) == 127) {
+    memset(&send_addrin, 0, sizeof(send_addrin));
+    send_addrin.sin_family = AF_INET;
+    send_addrin.sin_port = 0;
+    send_addrin.sin_addr.s_addr = inet_addr(SENDSRC);
+
+    if (bind(s->fh, (const struct sockaddr *)&send_addrin,
+	     sizeof(send_addrin)) == -1) {
+      fprintf(stderr, "Binding to sending socket failed.\n");
+      perror("bind");
+      close(s->fh);
+      s->fh = -1;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+
+int sink_udp_send(struct sink *s, struct sink_msg **msgs, const int count) {
+
+  struct mmsghdr mmsgs[SINK_BATCH];
+  struct iovec iovs[SINK_BATCH];
+  int sent;
+  int i;
+
+  if ((s->fh == -1) && (s->type->open(s) != 0)) {
+    return 0;
+  }
+
+  memset(mmsgs, 0, sizeof(struct mmsghdr) * count);
+  for (i = 0; i < count; i++) {
+    iovs[i].iov_base = msgs[i]->data;
+    iovs[i].iov_len = msgs[i]->len;
+    mmsgs[i].msg_hdr.msg_name = &(s->addrin);
+    mmsgs[i].msg_hdr.msg_namelen = sizeof(s->addrin);
+    mmsgs[i].msg_hdr.msg_iov = &(iovs[i]);
+    mmsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  /* Anything that doesn't go out on this call counts as dropped */
+  if ((sent = sendmmsg(s->fh, mmsgs, count, 0)) < 0) {
+    s->stat_errors++;
+    sent = 0;
+  }
+
+  return sent;
+}
+
+
+/* ===
+ * Streams: TCP, Unix-domain sockets and files.  Messages are written
+ * back to back, both export formats can be split up again on the far
+ * side (binary by its counts and lengths, JSON by newlines).
+ * ===
+ */
+int sink_tcp_open(struct sink *s) {
+
+  if ((s->fh = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) == -1) {
+    return -1;
+  }
+
+  if (connect(s->fh, (const struct sockaddr *)&(s->addrin),
+	      sizeof(s->addrin)) == -1) {
+    close(s->fh);
+    s->fh = -1;
+    return -1;
+  }
+  s->need_template = 1;
+
+  return 0;
+}
+
+
+int sink_unix_open(struct sink *s) {
+
+  struct sockaddr_un addrun;
+
+  if (strlen(s->path) >= sizeof(addrun.sun_path)) {
+    return -1;
+  }
+
+  if ((s->fh = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    return -1;
+  }
+
+  memset(&addrun, 0, sizeof(addrun));
+  addrun.sun_family = AF_UNIX;
+  strcpy(addrun.sun_path, s->path);
+
+  if (connect(s->fh, (const struct sockaddr *)&addrun, sizeof(addrun)) == -1) {
+    close(s->fh);
+    s->fh = -1;
+    return -1;
+  }
+  s->need_template = 1;
+
+  return 0;
+}
+
+
+int sink_file_open(struct sink *s) {
+
+  if ((s->fh = open(s->path, O_WRONLY | O_CREAT | O_APPEND, 0644)) == -1) {
+    return -1;
+  }
+
+  return 0;
+}
+
+
+int sink_stream_send(struct sink *s, struct sink_msg **msgs, const int count) {
+
+  struct iovec iovs[SINK_BATCH];
+  size_t offset = 0;
+  ssize_t ret;
+  int first = 0;
+  int i, n;
+
+  while (first < count) {
+    if (s->fh == -1) {
+      /* Back off between attempts, doubling up to SINK_RETRY_MAX */
+      if (time(NULL) < s->retry_time) {
+	if (__atomic_load_n(&sink_stopping, __ATOMIC_ACQUIRE) != 0) {
+	  return first;
+	}
+	sink_sleep_ns(100000000);
+	continue;
+      }
+
+      if (s->type->open(s) != 0) {
+	s->retry_wait = (s->retry_wait == 0) ? 1 : s->retry_wait * 2;
+	if (s->retry_wait > SINK_RETRY_MAX) {
+	  s->retry_wait = SINK_RETRY_MAX;
+	}
+	s->retry_time = time(NULL) + s->retry_wait;
+
+	if (__atomic_load_n(&sink_stopping, __ATOMIC_ACQUIRE) != 0) {
+	  return first;
+	}
+	continue;
+      }
+
+      if (s->retry_wait != 0) {
+	__atomic_add_fetch(&(s->stat_reconnects), 1, __ATOMIC_RELAXED);
+	s->retry_wait = 0;
+      }
+    }
+
+    /* A new IPFIX connection starts with the template */
+    if ((s->need_template != 0) && (s->format == EXPORT_IPFIX)) {
+      if (sink_stream_template(s) != 0) {
+	s->stat_errors++;
+	close(s->fh);
+	s->fh = -1;
+	s->retry_wait = 1;
+	s->retry_time = time(NULL) + 1;
+	offset = 0;
+	continue;
+      }
+    }
+    s->need_template = 0;
+
+    for (i = first, n = 0; i < count; i++, n++) {
+      iovs[n].iov_base = msgs[i]->data;
+      iovs[n].iov_len = msgs[i]->len;
+    }
+    iovs[0].iov_base = (uint8_t *)iovs[0].iov_base + offset;
+    iovs[0].iov_len -= offset;
+
+    if ((ret = writev(s->fh, iovs, n)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+
+      /* Start over on a new connection, from the top of the message so
+       * the far side never sees half of one.
+       */
+      s->stat_errors++;
+      close(s->fh);
+      s->fh = -1;
+      s->retry_wait = 1;
+      s->retry_time = time(NULL) + 1;
+      offset = 0;
+      continue;
+    }
+
+    /* Move past whatever made it out */
+    offset += ret;
+    while ((first < count) && (offset >= msgs[first]->len)) {
+      offset -= msgs[first]->len;
+      first++;
+    }
+  }
+
+  return count;
+}
+
+
+/* The template message on its own, all of it or an error */
+int sink_stream_template(struct sink *s) {
+
+  uint8_t buff[IPFIX_TEMPLATE_MSG_LEN];
+  ssize_t ret;
+  int len, offset = 0;
+
+  len = encode_ipfix_template_message(buff);
+
+  while (offset < len) {
+    if ((ret = write(s->fh, buff + offset, len - offset)) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      return -1;
+    }
+    offset += ret;
+  }
+
+  return 0;
+}
+
+
+/* ===
+ * Shared memory ring, see ftshm.h.  It carries binary datagrams only
+ * and never blocks: readers that fall a ring behind lose the oldest.
+ * ===
+ */
+struct sink_shm *sink_shm_state(struct sink *s) {
+
+  struct sink_shm *shm;
+
+  if (s->priv == NULL) {
+    if ((shm = calloc(1, sizeof(struct sink_shm))) == NULL) {
+      return NULL;
+    }
+    shm->slots = SINK_SHM_SLOTS;
+    s->priv = shm;
+  }
+
+  return (struct sink_shm *)s->priv;
+}
+
+
+int sink_shm_option(struct sink *s, const char *opt, const char *val) {
+
+  struct sink_shm *shm;
+
+  if ((shm = sink_shm_state(s)) == NULL) {
+    return -1;
+  }
+
+  if ((strcmp(opt, "slots") == 0) && (atoi(val) > 0)) {
+    shm->slots = atoi(val);
+    return 0;
+  }
+
+  return -1;
+}
+
+
+int sink_shm_open(struct sink *s) {
+
+  struct sink_shm *shm;
+  char name[PATH_MAX + 1];
+
+  if ((shm = sink_shm_state(s)) == NULL) {
+    return -1;
+  }
+
+  s->format = EXPORT_BINARY;
+
+  if (shm->writer.base != NULL) {
+    return 0;
+  }
+
+  /* shm_open() names start with a slash, /dev/shm/<name> */
+  snprintf(name, sizeof(name), "%s%s", (s->path[0] == '/') ? "" : "/",
+	   s->path);
+
+  if (ftshm_create(name, shm->slots, export_dgram_size,
+		   &(shm->writer)) == FTSHM_IN_USE) {
+    return SINK_OPEN_FATAL;
+  }
+
+  return (shm->writer.base != NULL) ? 0 : -1;
+}
+
+
+int sink_shm_send(struct sink *s, struct sink_msg **msgs, const int count) {
+
+  struct sink_shm *shm = (struct sink_shm *)s->priv;
+  int i;
+
+  if ((shm->writer.base == NULL) && (sink_shm_open(s) != 0)) {
+    return 0;
+  }
+
+  /* Only a single record too big for -m can fail, it is skipped */
+  for (i = 0; i < count; i++) {
+    if (ftshm_write(&(shm->writer), msgs[i]->data, msgs[i]->len) != 0) {
+      s->stat_errors++;
+    }
+  }
+
+  return count;
+}
+
+
+void sink_shm_close(struct sink *s) {
+
+  struct sink_shm *shm = (struct sink_shm *)s->priv;
+
+  if (shm != NULL) {
+    ftshm_close(&(shm->writer));
+    free(shm);
+    s->priv = NULL;
+  }
+}
+
+
+void sink_shm_report(struct sink *s) {
+
+  struct sink_shm *shm = (struct sink_shm *)s->priv;
+  struct ftshm_reader_slot *readers;
+  uint64_t write_seq, pid;
+  int i;
+
+  if ((shm == NULL) || (shm->writer.base == NULL)) {
+    return;
+  }
+
+  readers = ftshm_reader_slots(shm->writer.base);
+  write_seq = __atomic_load_n(&(shm->writer.header->write_seq),
+			      __ATOMIC_RELAXED);
+
+  for (i = 0; i < FTSHM_READERS; i++) {
+    if ((pid = __atomic_load_n(&(readers[i].pid), __ATOMIC_RELAXED)) == 0) {
+      continue;
+    }
+
+    fprintf(stderr, "  reader %lu: lag: %lu; overruns: %lu\n", pid,
+	    write_seq - __atomic_load_n(&(readers[i].cursor),
+					__ATOMIC_RELAXED),
+	    __atomic_load_n(&(readers[i].overruns), __ATOMIC_RELAXED));
+  }
+}
+
+
+/* ===
+ * Stats, printed with the rest every STATS_RATE
+ * ===
+ */
+void sink_report(void) {
+
+  struct sink *s;
+  uint64_t now_ns, sent, bytes, depth;
+  double secs;
+  off_t spill_bytes;
+  int n;
+
+  now_ns = monotonic_ns();
+
+  for (n = 0; n < sink_count; n++) {
+    s = sinks[n];
+
+    sent = __atomic_load_n(&(s->stat_sent), __ATOMIC_RELAXED);
+    bytes = __atomic_load_n(&(s->stat_bytes), __ATOMIC_RELAXED);
+    depth = sink_depth(s);
+    secs = (s->report_ns == 0) ? 0 : (double)(now_ns - s->report_ns) / 1e9;
+
+    pthread_mutex_lock(&(s->spill_mutex));
+    spill_bytes = s->spill_write - s->spill_read;
+    pthread_mutex_unlock(&(s->spill_mutex));
+
+    fprintf(stderr, "sink %s: queued: %lu; sent: %lu (%.1f/s, %.1f KB/s); "
+	    "dropped: %lu; spilled: %lu (%ld bytes waiting); blocked: %lu; "
+	    "depth: %lu; lag: %.3f ms; errors: %lu; reconnects: %lu\n",
+	    s->name, __atomic_load_n(&(s->stat_queued), __ATOMIC_RELAXED),
+	    sent, (secs > 0) ? (double)(sent - s->report_sent) / secs : 0.0,
+	    (secs > 0) ? (double)(bytes - s->report_bytes) / secs / 1024 : 0.0,
+	    __atomic_load_n(&(s->stat_dropped), __ATOMIC_RELAXED),
+	    __atomic_load_n(&(s->stat_spilled), __ATOMIC_RELAXED),
+	    (long)spill_bytes,
+	    __atomic_load_n(&(s->stat_blocked), __ATOMIC_RELAXED), depth,
+	    (double)__atomic_load_n(&(s->stat_lag_ns), __ATOMIC_RELAXED) / 1e6,
+	    s->stat_errors,
+	    __atomic_load_n(&(s->stat_reconnects), __ATOMIC_RELAXED));
+
+    if (s->type->report != NULL) {
+      s->type->report(s);
+    }
+
+    s->report_sent = sent;
+    s->report_bytes = bytes;
+    s->report_ns = now_ns;
+  }
+}
+
+
+/* ===
+ * Sink metrics, one series per sink for each of these
+ * ===
+ */
+#define SINK_METRICS 10
+
+static const struct {
+  const char *name;
+  const char *type;
+  const char *help;
+} sink_metric_info[SINK_METRICS] = {
+  {"flowtree_sink_queued_total", "counter", "Messages queued to the sink"},
+  {"flowtree_sink_sent_total", "counter", "Messages the sink sent"},
+  {"flowtree_sink_sent_bytes_total", "counter", "Bytes the sink sent"},
+  {"flowtree_sink_dropped_total", "counter", "Messages the sink dropped"},
+  {"flowtree_sink_spilled_total", "counter",
+   "Messages written to the spill file"},
+  {"flowtree_sink_blocked_total", "counter",
+   "Times the exporter waited on a full queue"},
+  {"flowtree_sink_errors_total", "counter", "Output errors"},
+  {"flowtree_sink_reconnects_total", "counter", "Reconnects"},
+  {"flowtree_sink_queue_depth", "gauge", "Messages waiting in the queue"},
+  {"flowtree_sink_queue_slots", "gauge", "Size of the queue"}
+};
+
+
+void sink_metrics(FILE *out) {
+
+  struct sink *s;
+  uint64_t val;
+  int m, n;
+
+  for (m = 0; m < SINK_METRICS; m++) {
+    metrics_header(out, sink_metric_info[m].name, sink_metric_info[m].type,
+		   sink_metric_info[m].help);
+
+    for (n = 0; n < sink_count; n++) {
+      s = sinks[n];
+
+      switch (m) {
+      case 0:
+	val = __atomic_load_n(&(s->stat_queued), __ATOMIC_RELAXED);
+	break;
+      case 1:
+	val = __atomic_load_n(&(s->stat_sent), __ATOMIC_RELAXED);
+	break;
+      case 2:
+	val = __atomic_load_n(&(s->stat_bytes), __ATOMIC_RELAXED);
+	break;
+      case 3:
+	val = __atomic_load_n(&(s->stat_dropped), __ATOMIC_RELAXED);
+	break;
+      case 4:
+	val = __atomic_load_n(&(s->stat_spilled), __ATOMIC_RELAXED);
+	break;
+      case 5:
+	val = __atomic_load_n(&(s->stat_blocked), __ATOMIC_RELAXED);
+	break;
+      case 6:
+	val = __atomic_load_n(&(s->stat_errors), __ATOMIC_RELAXED);
+	break;
+      case 7:
+	val = __atomic_load_n(&(s->stat_reconnects), __ATOMIC_RELAXED);
+	break;
+      case 8:
+	val = sink_depth(s);
+	break;
+      default:
+	val = s->mask + 1;
+	break;
+      }
+
+      fprintf(out, "%s{sink=\"", sink_metric_info[m].name);
+      metrics_label_value(out, s->name);
+      fprintf(out, "\"} %lu\n", val);
+    }
+  }
+
+  metrics_header(out, "flowtree_sink_lag_seconds", "gauge",
+		 "Age of the last message the sink sent when it sent it");
+  for (n = 0; n < sink_count; n++) {
+    fprintf(out, "flowtree_sink_lag_seconds{sink=\"");
+    metrics_label_value(out, sinks[n]->name);
+    fprintf(out, "\"} %.6f\n",
+	    (double)__atomic_load_n(&(sinks[n]->stat_lag_ns),
+				    __ATOMIC_RELAXED) / 1e9);
+  }
+}
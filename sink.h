@@ -0,0 +1,190 @@
+#ifndef SINK_H
+#define SINK_H 1
+
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Export sinks
+ *
+ * Every finished export datagram is handed to each configured sink
+ * through its own bounded queue and a thread per sink does the actual
+ * output, so a slow or dead sink never holds up the janitor (unless it
+ * was asked to with policy=block).
+ *
+ * A sink is given with -s as type:target[,option=value...]
+ *
+ *   udp:<addr>:<port>    one datagram per message, sent with sendmmsg()
+ *   tcp:<addr>:<port>    messages back to back on a stream, reconnects
+ *   unix:<path>          same over a Unix-domain stream socket
+ *   file:<path>          appended to a file
+ *   archive:<dir>        time-rotated segment files, see archive.c
+ *   shm:<name>           ring in /dev/shm/<name> for local readers, see
+ *                        ftshm.h
+ *
+ * Options are policy=block|drop|spill (what to do when the queue is
+ * full, drop throws away the oldest queued message), queue=<slots>,
+ * rate=<messages per second>, spill=<file> and
+ * format=json|binary|ipfix.
+ * ===
+ */
+#define SINK_MAX 16
+#define SINK_QUEUE_SLOTS 16384 /* rounded up to a power of two */
+#define SINK_BATCH 64
+
+#define SINK_BLOCK 0
+#define SINK_DROP_OLDEST 1
+#define SINK_SPILL 2
+
+/* Spill files go here unless spill= says otherwise */
+#define SINK_SPILL_DIR "/var/tmp"
+#define SINK_SPILL_MAX (1024L * 1024 * 1024) /* 1 GB */
+
+/* Slots in a shm ring unless slots= says otherwise */
+#define SINK_SHM_SLOTS 8192
+
+/* Longest wait between reconnect attempts, in seconds */
+#define SINK_RETRY_MAX 30
+
+/* Released messages kept around for reuse instead of freed */
+#define SINK_POOL_MAX 256
+
+
+/* ===
+ * A queued message.  One copy is shared by every sink it was offered to
+ * and the last one done with it returns it to the pool (or frees it).
+ * ===
+ */
+struct sink_msg {
+  struct sink_msg *next; /* free list link */
+  uint32_t size; /* room in data */
+  uint32_t refs;
+  uint32_t len;
+  uint64_t queued_ns;
+  uint8_t data[];
+};
+
+
+/* ===
+ * The queue is a bounded MPMC ring (Vyukov style, a sequence number per
+ * cell).  The sink thread is the usual consumer but the janitor dequeues
+ * too when it has to make room under policy=drop.
+ * ===
+ */
+struct sink_cell {
+  uint64_t seq;
+  struct sink_msg *msg;
+};
+
+
+/* ===
+ * What a sink type has to provide.  open and send are required, the
+ * rest can be NULL.  An open that fails is retried from the sink's
+ * thread, unless it returns SINK_OPEN_FATAL for something retrying
+ * won't fix, which stops flowtree from starting.
+ *
+ *   option  takes an option sink_add doesn't know, 0 if it was used
+ *   tick    called every pass of the sink thread, even when idle
+ *   close   finishes up after the thread is done (default: close(fh))
+ *   report  adds its own lines under the sink's stats
+ * ===
+ */
+#define SINK_OPEN_FATAL -2
+
+struct sink;
+
+struct sink_type {
+  const char *name;
+  int (*open)(struct sink *);
+  int (*send)(struct sink *, struct sink_msg **, const int);
+  int (*option)(struct sink *, const char *, const char *);
+  void (*tick)(struct sink *);
+  void (*close)(struct sink *);
+  void (*report)(struct sink *);
+};
+
+
+struct sink {
+  /* === Settings === */
+  char name[PATH_MAX];
+  const struct sink_type *type;
+  int policy;
+  int rate;
+  int slots;
+  int format; /* EXPORT_*, -o unless format= says otherwise */
+  struct sockaddr_in addrin;
+  char path[PATH_MAX];
+  char spill_path[PATH_MAX];
+
+  /* === Output, only the sink thread touches these === */
+  int fh;
+  int need_template; /* IPFIX stream sinks, set on every connect */
+  int retry_wait;
+  time_t retry_time;
+  void *priv; /* whatever else the type needs */
+
+  /* === The queue === */
+  struct sink_cell *cells;
+  uint64_t mask;
+  uint64_t enq_pos __attribute__((aligned(CACHE_LINE)));
+  uint64_t deq_pos __attribute__((aligned(CACHE_LINE)));
+
+  /* === Spill file, both sides take the mutex === */
+  pthread_mutex_t spill_mutex __attribute__((aligned(CACHE_LINE)));
+  int spill_fh;
+  off_t spill_read;
+  off_t spill_write;
+
+  /* === Stats === */
+  uint64_t stat_queued __attribute__((aligned(CACHE_LINE)));
+  uint64_t stat_dropped;
+  uint64_t stat_spilled;
+  uint64_t stat_blocked;
+  uint64_t stat_sent __attribute__((aligned(CACHE_LINE)));
+  uint64_t stat_bytes;
+  uint64_t stat_errors;
+  uint64_t stat_reconnects;
+  uint64_t stat_lag_ns;
+
+  /* Where the last report left off, for rates */
+  uint64_t report_sent;
+  uint64_t report_bytes;
+  uint64_t report_ns;
+
+  pthread_t thread;
+};
+
+
+/* Defaults for sinks that don't set queue= or rate=, -q and -r */
+extern int sink_queue_slots;
+extern int sink_rate;
+
+
+/* ===
+ * Sink function prototypes
+ * ===
+ */
+int sink_add(const char *);
+int sink_start(void);
+void sink_publish(const int, const uint8_t *, const int);
+int sink_formats(void);
+void sink_shutdown(void);
+void sink_report(void);
+void sink_sleep_ns(const uint64_t);
+
+/* archive.c */
+int archive_open(struct sink *);
+int archive_send(struct sink *, struct sink_msg **, const int);
+int archive_option(struct sink *, const char *, const char *);
+void archive_tick(struct sink *);
+void archive_close(struct sink *);
+
+#endif /* sink.h */
@@ -0,0 +1,172 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/* Classic BPF for SO_ATTACH_FILTER */
+#include <linux/filter.h>
+#include <linux/sock_diag.h>
+
+#include "pavl.h"
+#include "flowtree.h"
+
+
+/* ===
+ * The kernel side socket filter
+ *
+ * For a UDP socket the filter sees the packet starting at the UDP
+ * header, the netflow header follows at UDP_HDR and the IP header is
+ * reachable through SKF_NET_OFF.  Anything the program returns 0 for is
+ * dropped before it is queued to us.  The layout is
+ *
+ *   version check -> length check -> allowlist ranges -> accept
+ *
+ * with one shared drop in the middle so every jump stays short.
+ * ===
+ */
+#define UDP_HDR 8
+#define IP_SRC_OFF 12
+
+#define BPF_ACCEPT 0xFFFFFFFF
+
+#ifndef SO_MEMINFO
+#define SO_MEMINFO 55
+#endif
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+void bpf_emit(struct sock_filter *, int *, const uint16_t, const uint8_t,
+	      const uint8_t, const uint32_t);
+
+
+void bpf_emit(struct sock_filter *insns, int *len, const uint16_t code,
+	      const uint8_t jt, const uint8_t jf, const uint32_t k) {
+
+  insns[*len].code = code;
+  insns[*len].jt = jt;
+  insns[*len].jf = jf;
+  insns[*len].k = k;
+  (*len)++;
+}
+
+
+int attach_socket_filter(const int sock_fh, struct pavl_table *allow_tree) {
+
+  struct sock_filter *insns;
+  struct sock_fprog prog;
+  struct pavl_traverser traverser;
+  struct exclude_node *range;
+  int ranges = 0;
+  int len = 0;
+
+  if (allow_tree != NULL) {
+    ranges = pavl_count(allow_tree);
+  }
+
+  /* 15 for the checks, then the load, 3 per range and the last ret */
+  if (17 + (ranges * 3) > BPF_MAXINSNS) {
+    fprintf(stderr, "Too many allowlist ranges (%d) for a socket filter.\n",
+	    ranges);
+    return -1;
+  }
+
+  insns = calloc(17 + (ranges * 3), sizeof(struct sock_filter));
+  if (insns == NULL) {
+    return -1;
+  }
+
+  /* === Version: only v5 and v7 make it in (0-1, 7) === */
+  bpf_emit(insns, &len, BPF_LD | BPF_H | BPF_ABS, 0, 0, UDP_HDR);
+  bpf_emit(insns, &len, BPF_JMP | BPF_JEQ | BPF_K, 0, 5, 5);
+
+  /* === v5: the length has to be header + count * record (2-6) === */
+  bpf_emit(insns, &len, BPF_LD | BPF_H | BPF_ABS, 0, 0, UDP_HDR + 2);
+  bpf_emit(insns, &len, BPF_ALU | BPF_MUL | BPF_K, 0, 0,
+	   sizeof(struct netflow_v5_record));
+  bpf_emit(insns, &len, BPF_ALU | BPF_ADD | BPF_K, 0, 0,
+	   UDP_HDR + sizeof(struct netflow_v5));
+  bpf_emit(insns, &len, BPF_MISC | BPF_TAX, 0, 0, 0);
+  bpf_emit(insns, &len, BPF_JMP | BPF_JA, 0, 0, 5);
+
+  /* === v7: same thing with its own sizes (7-11) === */
+  bpf_emit(insns, &len, BPF_JMP | BPF_JEQ | BPF_K, 0, 6, 7);
+  bpf_emit(insns, &len, BPF_LD | BPF_H | BPF_ABS, 0, 0, UDP_HDR + 2);
+  bpf_emit(insns, &len, BPF_ALU | BPF_MUL | BPF_K, 0, 0,
+	   sizeof(struct netflow_v7_record));
+  bpf_emit(insns, &len, BPF_ALU | BPF_ADD | BPF_K, 0, 0,
+	   UDP_HDR + sizeof(struct netflow_v7));
+  bpf_emit(insns, &len, BPF_MISC | BPF_TAX, 0, 0, 0);
+
+  /* === Compare against the real length, the drop is at 14 === */
+  bpf_emit(insns, &len, BPF_LD | BPF_W | BPF_LEN, 0, 0, 0);
+  bpf_emit(insns, &len, BPF_JMP | BPF_JEQ | BPF_X, 1, 0, 0);
+  bpf_emit(insns, &len, BPF_RET | BPF_K, 0, 0, 0);
+
+  /* === Allowlist: accept on the first range the exporter is in === */
+  if (ranges > 0) {
+    bpf_emit(insns, &len, BPF_LD | BPF_W | BPF_ABS, 0, 0,
+	     SKF_NET_OFF + IP_SRC_OFF);
+
+    pavl_t_init(&traverser, allow_tree);
+    while ((range = (struct exclude_node *)pavl_t_next(&traverser)) != NULL) {
+      /* Below the start or above the end skips to the next range */
+      bpf_emit(insns, &len, BPF_JMP | BPF_JGE | BPF_K, 0, 2,
+	       range->addr_start);
+      bpf_emit(insns, &len, BPF_JMP | BPF_JGT | BPF_K, 1, 0,
+	       range->addr_end);
+      bpf_emit(insns, &len, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+    }
+
+    bpf_emit(insns, &len, BPF_RET | BPF_K, 0, 0, 0);
+  }
+  else {
+    bpf_emit(insns, &len, BPF_RET | BPF_K, 0, 0, BPF_ACCEPT);
+  }
+
+  /* Attaching again just swaps the old program out */
+  prog.len = len;
+  prog.filter = insns;
+
+  if (setsockopt(sock_fh, SOL_SOCKET, SO_ATTACH_FILTER,
+		 &prog, sizeof(prog)) == -1) {
+    perror("setsockopt(SO_ATTACH_FILTER)");
+    free(insns);
+    return -1;
+  }
+
+  fprintf(stderr, "Attached %d instruction socket filter with %d allowed "
+	  "exporter ranges\n", len, ranges);
+
+  free(insns);
+
+  return 0;
+}
+
+
+int socket_drops(const int sock_fh, uint64_t *drops) {
+
+  uint32_t meminfo[SK_MEMINFO_VARS];
+  socklen_t meminfo_len = sizeof(meminfo);
+
+  /* sk_drops counts both filter drops and receive buffer overflows */
+  if (getsockopt(sock_fh, SOL_SOCKET, SO_MEMINFO,
+		 meminfo, &meminfo_len) == -1) {
+    return -1;
+  }
+
+  if (meminfo_len <= SK_MEMINFO_DROPS * sizeof(uint32_t)) {
+    return -1;
+  }
+
+  *drops = meminfo[SK_MEMINFO_DROPS];
+
+  return 0;
+}
@@ -0,0 +1,48 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "flowtree.h"
+#include "stats.h"
+
+
+/* ===
+ * The per-thread counters, indexed by thread_slot()
+ * ===
+ */
+struct flow_stats stats_threads[MAX_THREADS];
+
+
+void stats_snapshot(struct flow_stats *snap) {
+
+  struct flow_stats *t;
+  int slot, proto;
+
+  memset(snap, 0, sizeof(struct flow_stats));
+
+  for (slot = 0; slot < MAX_THREADS; slot++) {
+    t = &(stats_threads[slot]);
+
+    snap->flow_packets += __atomic_load_n(&(t->flow_packets),
+					  __ATOMIC_RELAXED);
+    snap->total_flows += __atomic_load_n(&(t->total_flows), __ATOMIC_RELAXED);
+    snap->excluded_flows += __atomic_load_n(&(t->excluded_flows),
+					    __ATOMIC_RELAXED);
+    snap->filtered_flows += __atomic_load_n(&(t->filtered_flows),
+					    __ATOMIC_RELAXED);
+    snap->new_flows += __atomic_load_n(&(t->new_flows), __ATOMIC_RELAXED);
+    snap->dup_flows += __atomic_load_n(&(t->dup_flows), __ATOMIC_RELAXED);
+    snap->current_flows += __atomic_load_n(&(t->current_flows),
+					   __ATOMIC_RELAXED);
+
+    for (proto = 0; proto < 256; proto++) {
+      snap->proto_flows[proto] += __atomic_load_n(&(t->proto_flows[proto]),
+						  __ATOMIC_RELAXED);
+    }
+  }
+
+  /* The janitor's decrements can be seen before the inserts they undo */
+  if ((int64_t)snap->current_flows < 0) {
+    snap->current_flows = 0;
+  }
+}
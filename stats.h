@@ -0,0 +1,60 @@
+#ifndef STATS_H
+#define STATS_H 1
+
+#include <stdint.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Flow statistics
+ *
+ * Every thread counts into its own cache line aligned copy (picked with
+ * thread_slot()) and only ever touches that one, so the hot path is a
+ * plain load and store with no lock and no lock prefix.  Readers add
+ * the copies up with stats_snapshot().  A count can be read while it is
+ * being bumped but never torn or lost.
+ *
+ * current_flows goes up on the receive side and down in the janitor, so
+ * one thread's copy can wrap below zero; the sum is still right.
+ * ===
+ */
+struct flow_stats {
+  uint64_t flow_packets;
+  uint64_t total_flows;
+  uint64_t excluded_flows;
+  uint64_t filtered_flows;
+  uint64_t new_flows;
+  uint64_t dup_flows;
+  uint64_t current_flows;
+  uint64_t proto_flows[256];
+} __attribute__((aligned(CACHE_LINE)));
+
+extern struct flow_stats stats_threads[MAX_THREADS];
+
+
+/* This thread's counters */
+static inline struct flow_stats *stats_mine(void) {
+  return &(stats_threads[thread_slot()]);
+}
+
+/* Only the owning thread writes a counter so no read-modify-write is
+ * needed, the atomics just keep the compiler from tearing it */
+static inline void stat_add(uint64_t *counter, const uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+		   __ATOMIC_RELAXED);
+}
+
+static inline void stat_sub(uint64_t *counter, const uint64_t n) {
+  __atomic_store_n(counter, __atomic_load_n(counter, __ATOMIC_RELAXED) - n,
+		   __ATOMIC_RELAXED);
+}
+
+
+/* ===
+ * Stats function prototypes
+ * ===
+ */
+void stats_snapshot(struct flow_stats *);
+
+#endif /* stats.h */
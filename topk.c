@@ -0,0 +1,390 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include <pthread.h>
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "flowtree.h"
+#include "export.h"
+#include "topk.h"
+#include "handoff.h"
+
+
+/* ===
+ * Topk settings and state
+ * ===
+ */
+int topk_interval_secs = 0;
+uint64_t topk_summaries = 0; /* summary records sent */
+
+const char *topk_dim_names[TOPK_DIMS] = {
+  "src_addr", "dst_addr", "pair", "dst_port"
+};
+const char *topk_metric_names[TOPK_METRICS] = {"bytes", "packets"};
+
+/* The receive thread owns topk_cur, topk_handoff gets it to the janitor */
+struct topk_interval *topk_cur = NULL;
+pthread_mutex_t topk_mutex = PTHREAD_MUTEX_INITIALIZER;
+struct handoff topk_handoff = {&topk_mutex, NULL, NULL, 0};
+
+#define TOPK_RECORD_MAX 2048
+
+#define TOPK_CM_INDEX(hash, row) \
+  (((hash) >> (64 - (((row) + 1) * 16))) & (TOPK_CM_WIDTH - 1))
+
+
+/* ===
+ * Local function prototypes
+ * ===
+ */
+void topk_sketch_reset(struct topk_sketch *);
+void topk_update(struct topk_sketch *, const uint64_t, const uint64_t,
+		 const uint64_t, const uint64_t);
+void topk_sift_down(struct topk_sketch *, int);
+void topk_sift_up(struct topk_sketch *, int);
+void topk_rollover(const time_t);
+int topk_encode(char *, const struct topk_interval *, const int, const int);
+void topk_key_name(char *, const size_t, const int, const uint64_t);
+int compare_topk_counters(const void *, const void *);
+
+
+static inline uint32_t topk_hash(const uint64_t key) {
+  return (uint32_t)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (TOPK_BUCKETS - 1);
+}
+
+
+void topk_sketch_reset(struct topk_sketch *sk) {
+
+  sk->used = 0;
+  memset(sk->buckets, 0xFF, sizeof(sk->buckets)); /* all -1 */
+}
+
+
+void topk_reset(struct topk_interval *ti, const time_t start) {
+
+  int dim, metric;
+
+  ti->start = start;
+  ti->records = 0;
+  ti->bytes = 0;
+  ti->packets = 0;
+
+  for (dim = 0; dim < TOPK_DIMS; dim++) {
+    for (metric = 0; metric < TOPK_METRICS; metric++) {
+      topk_sketch_reset(&(ti->sketches[dim][metric]));
+    }
+  }
+
+  memset(ti->cm, 0, sizeof(ti->cm));
+}
+
+
+/* ===
+ * The Space-Saving update
+ * ===
+ */
+void topk_sift_down(struct topk_sketch *sk, int pos) {
+
+  int child, tmp;
+
+  while ((child = (pos * 2) + 1) < sk->used) {
+    if ((child + 1 < sk->used) &&
+	(sk->counters[sk->heap[child + 1]].count <
+	 sk->counters[sk->heap[child]].count)) {
+      child++;
+    }
+    if (sk->counters[sk->heap[pos]].count <=
+	sk->counters[sk->heap[child]].count) {
+      return;
+    }
+
+    tmp = sk->heap[pos];
+    sk->heap[pos] = sk->heap[child];
+    sk->heap[child] = tmp;
+    sk->heap_pos[sk->heap[pos]] = pos;
+    sk->heap_pos[sk->heap[child]] = child;
+    pos = child;
+  }
+}
+
+
+void topk_sift_up(struct topk_sketch *sk, int pos) {
+
+  int parent, tmp;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (sk->counters[sk->heap[parent]].count <=
+	sk->counters[sk->heap[pos]].count) {
+      return;
+    }
+
+    tmp = sk->heap[pos];
+    sk->heap[pos] = sk->heap[parent];
+    sk->heap[parent] = tmp;
+    sk->heap_pos[sk->heap[pos]] = pos;
+    sk->heap_pos[sk->heap[parent]] = parent;
+    pos = parent;
+  }
+}
+
+
+/* estimate is the key's Count-Min total, this record included */
+void topk_update(struct topk_sketch *sk, const uint64_t key,
+		 const uint64_t count, const uint64_t other,
+		 const uint64_t estimate) {
+
+  struct topk_counter *c;
+  uint32_t bucket = topk_hash(key);
+  int i, *link;
+
+  /* Already counting it */
+  for (i = sk->buckets[bucket]; i != -1; i = sk->counters[i].next) {
+    if (sk->counters[i].key == key) {
+      sk->counters[i].count += count;
+      sk->counters[i].other += other;
+      topk_sift_down(sk, sk->heap_pos[i]);
+      return;
+    }
+  }
+
+  /* Room for a new one */
+  if (sk->used < TOPK_SLOTS) {
+    i = sk->used++;
+    c = &(sk->counters[i]);
+    c->key = key;
+    c->count = estimate;
+    c->other = other;
+    c->error = estimate - count;
+    c->next = sk->buckets[bucket];
+    sk->buckets[bucket] = i;
+
+    sk->heap[i] = i;
+    sk->heap_pos[i] = i;
+    topk_sift_up(sk, i);
+    return;
+  }
+
+  /* Full, the smallest counter goes to the new key if it's bigger */
+  i = sk->heap[0];
+  c = &(sk->counters[i]);
+
+  if (estimate <= c->count) {
+    return;
+  }
+
+  for (link = &(sk->buckets[topk_hash(c->key)]); *link != i;
+       link = &(sk->counters[*link].next));
+  *link = c->next;
+
+  c->key = key;
+  c->count = estimate;
+  c->error = estimate - count;
+  c->other = other;
+  c->next = sk->buckets[bucket];
+  sk->buckets[bucket] = i;
+
+  topk_sift_down(sk, 0);
+}
+
+
+void topk_add(struct topk_interval *ti, const struct unified_flow *flow) {
+
+  uint64_t keys[TOPK_DIMS];
+  uint64_t est[TOPK_METRICS], *cell;
+  uint64_t hash;
+  int dim, row;
+
+  keys[TOPK_SRC_ADDR] = flow->src_addr.s_addr;
+  keys[TOPK_DST_ADDR] = flow->dst_addr.s_addr;
+  keys[TOPK_PAIR] = ((uint64_t)flow->src_addr.s_addr << 32) |
+    flow->dst_addr.s_addr;
+  keys[TOPK_DST_PORT] = ((uint64_t)flow->protocol << 16) | flow->dst_port;
+
+  for (dim = 0; dim < TOPK_DIMS; dim++) {
+
+    /* Count-Min first, each row indexes with its own slice of one hash */
+    hash = (keys[dim] + dim) * 0x9E3779B97F4A7C15ULL;
+    est[TOPK_BYTES] = UINT64_MAX;
+    est[TOPK_PACKETS] = UINT64_MAX;
+    for (row = 0; row < TOPK_CM_DEPTH; row++) {
+      cell = ti->cm[dim][row][TOPK_CM_INDEX(hash, row)];
+      cell[TOPK_BYTES] += flow->num_bytes;
+      cell[TOPK_PACKETS] += flow->num_packets;
+      if (cell[TOPK_BYTES] < est[TOPK_BYTES]) {
+	est[TOPK_BYTES] = cell[TOPK_BYTES];
+      }
+      if (cell[TOPK_PACKETS] < est[TOPK_PACKETS]) {
+	est[TOPK_PACKETS] = cell[TOPK_PACKETS];
+      }
+    }
+
+    topk_update(&(ti->sketches[dim][TOPK_BYTES]), keys[dim],
+		flow->num_bytes, flow->num_packets, est[TOPK_BYTES]);
+    topk_update(&(ti->sketches[dim][TOPK_PACKETS]), keys[dim],
+		flow->num_packets, flow->num_bytes, est[TOPK_PACKETS]);
+  }
+
+  ti->records++;
+  ti->bytes += flow->num_bytes;
+  ti->packets += flow->num_packets;
+}
+
+
+/* ===
+ * The receive side, only ever called from flow_callback()
+ * ===
+ */
+void topk_record(const struct unified_flow *flow) {
+
+  if (topk_interval_secs == 0) {
+    return;
+  }
+
+  if ((topk_cur == NULL) ||
+      (flow->recv_time >= topk_cur->start + topk_interval_secs)) {
+    topk_rollover(flow->recv_time);
+    if (topk_cur == NULL) {
+      return;
+    }
+  }
+
+  topk_add(topk_cur, flow);
+}
+
+
+void topk_rollover(const time_t now) {
+
+  struct topk_interval *next;
+
+  next = handoff_rollover(&topk_handoff, topk_cur,
+			  (topk_cur != NULL) && (topk_cur->records > 0));
+
+  if ((next == NULL) &&
+      ((next = malloc(sizeof(struct topk_interval))) == NULL)) {
+    topk_cur = NULL;
+    return;
+  }
+
+  topk_reset(next, now - (now % topk_interval_secs));
+  topk_cur = next;
+}
+
+
+/* ===
+ * The janitor side, sends a finished interval if there is one
+ * ===
+ */
+void topk_export(void) {
+
+  struct topk_interval *ti;
+  char record[TOPK_RECORD_MAX];
+  int dim, metric, len;
+
+  if (topk_interval_secs == 0) {
+    return;
+  }
+
+  if ((ti = handoff_take(&topk_handoff)) == NULL) {
+    return;
+  }
+
+  for (dim = 0; dim < TOPK_DIMS; dim++) {
+    for (metric = 0; metric < TOPK_METRICS; metric++) {
+      len = topk_encode(record, ti, dim, metric);
+      export_summary(record, len);
+      topk_summaries++;
+    }
+  }
+
+  handoff_return(&topk_handoff, ti);
+}
+
+
+void topk_shutdown(void) {
+
+  /* The receive thread is done by now */
+  free(topk_cur);
+  topk_cur = NULL;
+  handoff_free(&topk_handoff);
+}
+
+
+int compare_topk_counters(const void *a, const void *b) {
+
+  const struct topk_counter *ca = *(const struct topk_counter **)a;
+  const struct topk_counter *cb = *(const struct topk_counter **)b;
+
+  if (ca->count != cb->count) {
+    return (ca->count < cb->count) ? 1 : -1;
+  }
+
+  return 0;
+}
+
+
+void topk_key_name(char *name, const size_t len, const int dim,
+		   const uint64_t key) {
+
+  struct in_addr addr;
+  char src[INET_ADDRSTRLEN];
+
+  switch (dim) {
+  case TOPK_PAIR:
+    addr.s_addr = htonl((in_addr_t)(key >> 32));
+    inet_ntop(AF_INET, &addr, src, sizeof(src));
+    addr.s_addr = htonl((in_addr_t)key);
+    snprintf(name, len, "%s>", src);
+    inet_ntop(AF_INET, &addr, name + strlen(name), len - strlen(name));
+    break;
+  case TOPK_DST_PORT:
+    snprintf(name, len, "%u/%u", (unsigned int)(key >> 16),
+	     (unsigned int)(key & 0xFFFF));
+    break;
+  default:
+    addr.s_addr = htonl((in_addr_t)key);
+    inet_ntop(AF_INET, &addr, name, len);
+    break;
+  }
+}
+
+
+/* One sketch's top list as a JSON line, entries are
+ * [key, count, the other count, error] */
+int topk_encode(char *record, const struct topk_interval *ti, const int dim,
+		const int metric) {
+
+  const struct topk_sketch *sk = &(ti->sketches[dim][metric]);
+  const struct topk_counter *sorted[TOPK_SLOTS];
+  char name[2 * INET_ADDRSTRLEN];
+  int i, len, shown;
+
+  for (i = 0; i < sk->used; i++) {
+    sorted[i] = &(sk->counters[i]);
+  }
+  qsort(sorted, sk->used, sizeof(sorted[0]), compare_topk_counters);
+  shown = (sk->used < TOPK_REPORT) ? sk->used : TOPK_REPORT;
+
+  len = snprintf(record, TOPK_RECORD_MAX, "{\"summary\":\"topk\","
+		 "\"dimension\":\"%s\",\"by\":\"%s\",\"interval_start\":%lu,"
+		 "\"interval\":%d,\"records\":%lu,\"bytes\":%lu,"
+		 "\"packets\":%lu,\"top\":[", topk_dim_names[dim],
+		 topk_metric_names[metric], (uint64_t)ti->start,
+		 topk_interval_secs, ti->records, ti->bytes, ti->packets);
+
+  for (i = 0; i < shown; i++) {
+    topk_key_name(name, sizeof(name), dim, sorted[i]->key);
+    len += snprintf(record + len, TOPK_RECORD_MAX - len,
+		    "%s[\"%s\",%lu,%lu,%lu]", (i == 0) ? "" : ",", name,
+		    sorted[i]->count, sorted[i]->other, sorted[i]->error);
+  }
+
+  len += snprintf(record + len, TOPK_RECORD_MAX - len, "]}\n");
+
+  return len;
+}
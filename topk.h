@@ -0,0 +1,92 @@
+#ifndef TOPK_H
+#define TOPK_H 1
+
+#include <stdint.h>
+#include <time.h>
+
+#include "flowtree.h"
+
+
+/* ===
+ * Streaming heavy hitters
+ *
+ * With -K <secs> every record that makes it to flow_callback() is
+ * counted for the top source addresses, destination addresses,
+ * source/destination pairs and destination protocol/ports, each ranked
+ * once by bytes and once by packets.
+ *
+ * Each of those has a Count-Min sketch (TOPK_CM_DEPTH rows of
+ * TOPK_CM_WIDTH byte and packet counters) in front of a Space-Saving
+ * style table of TOPK_SLOTS counters with a min-heap on the count and a
+ * small chained hash on the key.  Keys already in the table are counted
+ * exactly from then on.  A new key only gets in when its Count-Min
+ * estimate beats the smallest counter, which it then replaces, so the
+ * long tail of one-off keys costs a few counter bumps and a hash probe
+ * instead of an eviction each.  A key's error is how much of its count
+ * came from the estimate, so a reported count is at most error too high.
+ * Nothing is ever allocated on the way.
+ *
+ * The receive thread is the only writer.  When a record lands past the
+ * end of the interval the finished set is handed to the janitor, which
+ * sends the top TOPK_REPORT of each as one JSON summary record per
+ * sketch down the JSON export stream, and a fresh set is started.
+ *
+ * -B topk measures what the update costs per record.
+ * ===
+ */
+#define TOPK_SLOTS 128   /* counters per sketch */
+#define TOPK_BUCKETS 256 /* hash chains per sketch, power of two */
+#define TOPK_REPORT 10   /* how many of each go in the summary */
+#define TOPK_CM_DEPTH 2
+#define TOPK_CM_WIDTH 1024 /* power of two */
+
+#define TOPK_SRC_ADDR 0
+#define TOPK_DST_ADDR 1
+#define TOPK_PAIR 2
+#define TOPK_DST_PORT 3
+#define TOPK_DIMS 4
+
+#define TOPK_BYTES 0
+#define TOPK_PACKETS 1
+#define TOPK_METRICS 2
+
+struct topk_counter {
+  uint64_t key;
+  uint64_t count; /* what the sketch ranks by */
+  uint64_t other; /* packets when ranked by bytes and the other way round */
+  uint64_t error;
+  int next;       /* hash chain */
+};
+
+struct topk_sketch {
+  int used;
+  int heap[TOPK_SLOTS];     /* counter indexes, smallest count first */
+  int heap_pos[TOPK_SLOTS]; /* where each counter is in heap */
+  int buckets[TOPK_BUCKETS];
+  struct topk_counter counters[TOPK_SLOTS];
+};
+
+struct topk_interval {
+  time_t start;
+  uint64_t records;
+  uint64_t bytes;
+  uint64_t packets;
+  struct topk_sketch sketches[TOPK_DIMS][TOPK_METRICS];
+  uint64_t cm[TOPK_DIMS][TOPK_CM_DEPTH][TOPK_CM_WIDTH][TOPK_METRICS];
+};
+
+extern int topk_interval_secs; /* -K, 0 is off */
+extern uint64_t topk_summaries;
+
+
+/* ===
+ * Topk function prototypes
+ * ===
+ */
+void topk_reset(struct topk_interval *, const time_t);
+void topk_add(struct topk_interval *, const struct unified_flow *);
+void topk_record(const struct unified_flow *);
+void topk_export(void);
+void topk_shutdown(void);
+
+#endif /* topk.h */